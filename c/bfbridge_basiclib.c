@@ -7,6 +7,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #ifdef WIN32
 #include <windows.h>
@@ -14,10 +19,17 @@
 #define BFBRIDGE_PATH_SEPARATOR '\\'
 #else
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #define BFBRIDGE_JNI_PATH_SEPARATOR_STR ":"
 #define BFBRIDGE_PATH_SEPARATOR '/'
 #endif
 
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/eventfd.h>
+#endif
+
 // Define BFENVA - BF ENV Access
 // In the single-header mode of operation, we need to be able to
 // call JNI in its both modes
@@ -38,8 +50,21 @@
     ((*(env_ptr))->method_name((env_ptr)))
 #endif
 
+static char out_of_memory_description[] = "out of memory";
+static bfbridge_error_t out_of_memory_error = {
+    BFBRIDGE_OUT_OF_MEMORY_ERROR, out_of_memory_description};
+
+bfbridge_error_t *bfbridge_out_of_memory_error(void)
+{
+    return &out_of_memory_error;
+}
+
 void bfbridge_free_error(bfbridge_error_t *error)
 {
+    if (error == &out_of_memory_error)
+    {
+        return;
+    }
     free(error->description);
     free(error);
 }
@@ -105,9 +130,270 @@ static bfbridge_error_t *make_error(
     return error;
 }
 
+// Statistics
+// Defined before the methods, whose calls they time
+
+// Slots: each jmethodID of bfbridge_thread_t from BFSetCommunicationBuffer on,
+// in the same order, then the C functions below
+#define BFBRIDGE_STATS_SLOT(method)                                  \
+    ((int)((offsetof(bfbridge_thread_t, method) -                     \
+            offsetof(bfbridge_thread_t, BFSetCommunicationBuffer)) / \
+           sizeof(jmethodID)))
+#define BFBRIDGE_STATS_JAVA_SLOT_COUNT                                  \
+    ((int)((sizeof(bfbridge_thread_t) -                                 \
+            offsetof(bfbridge_thread_t, BFSetCommunicationBuffer)) / \
+           sizeof(jmethodID)))
+
+enum
+{
+    BFBRIDGE_STATS_OPEN_BYTES_CACHED = BFBRIDGE_STATS_JAVA_SLOT_COUNT,
+    BFBRIDGE_STATS_OPEN_DEEPZOOM_TILE,
+    BFBRIDGE_STATS_OPEN_IIIF_REGION,
+    BFBRIDGE_STATS_SLOT_COUNT
+};
+
+#define BFBRIDGE_STATS_BUCKET_COUNT 40
+
+typedef struct bfbridge_stats_counters
+{
+    unsigned long long calls;
+    unsigned long long errors;
+    unsigned long long bytes;
+    unsigned long long total_ns;
+    unsigned long long latency_buckets[BFBRIDGE_STATS_BUCKET_COUNT];
+} bfbridge_stats_counters_t;
+
+// Counters of a thread. Only the thread that owns a block writes to it,
+// with relaxed atomics so that bfbridge_get_stats can read without locking
+// it. Blocks are kept in a list for the summing and, when their
+// thread exits, given to the next thread that needs one.
+typedef struct bfbridge_stats_block
+{
+    struct bfbridge_stats_block *next;
+    int in_use;
+    bfbridge_stats_counters_t slots[BFBRIDGE_STATS_SLOT_COUNT];
+} bfbridge_stats_block_t;
+
+static int stats_enabled = 0;
+// Names of the Java slots, set in bfbridge_make_thread
+static const char *stats_java_names[BFBRIDGE_STATS_JAVA_SLOT_COUNT];
+static const char *const stats_c_names[] = {
+    "bf_open_bytes_cached", "bf_open_deepzoom_tile", "bf_open_iiif_region"};
+static bfbridge_stats_block_t *stats_blocks = NULL;
+static pthread_mutex_t stats_blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+static void stats_release_block(void *block)
+{
+    __atomic_store_n(&((bfbridge_stats_block_t *)block)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void stats_make_key(void)
+{
+    pthread_key_create(&stats_key, stats_release_block);
+}
+
+// The block of the current thread, or NULL if out of memory
+static bfbridge_stats_block_t *stats_get_block(void)
+{
+    pthread_once(&stats_key_once, stats_make_key);
+    bfbridge_stats_block_t *block = (bfbridge_stats_block_t *)pthread_getspecific(stats_key);
+    if (block)
+    {
+        return block;
+    }
+
+    pthread_mutex_lock(&stats_blocks_lock);
+    for (block = stats_blocks; block; block = block->next)
+    {
+        if (!__atomic_load_n(&block->in_use, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+    }
+    if (!block)
+    {
+        block = (bfbridge_stats_block_t *)calloc(1, sizeof(bfbridge_stats_block_t));
+        if (block)
+        {
+            block->next = stats_blocks;
+            stats_blocks = block;
+        }
+    }
+    if (block)
+    {
+        block->in_use = 1;
+        pthread_setspecific(stats_key, block);
+    }
+    pthread_mutex_unlock(&stats_blocks_lock);
+    return block;
+}
+
+static unsigned long long stats_now_ns(void)
+{
+#ifdef WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (unsigned long long)(counter.QuadPart * (1e9 / frequency.QuadPart));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// Single writer: a load and a store, not a locked add
+#define stats_add(counter, value) \
+    __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (value), __ATOMIC_RELAXED)
+
+static void stats_record(int slot, unsigned long long start, int error, unsigned long long bytes)
+{
+    unsigned long long ns = stats_now_ns() - start;
+    bfbridge_stats_block_t *block = stats_get_block();
+    if (!block)
+    {
+        return;
+    }
+    int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+    if (bucket >= BFBRIDGE_STATS_BUCKET_COUNT)
+    {
+        bucket = BFBRIDGE_STATS_BUCKET_COUNT - 1;
+    }
+    bfbridge_stats_counters_t *c = &block->slots[slot];
+    stats_add(c->calls, 1);
+    stats_add(c->errors, error ? 1 : 0);
+    stats_add(c->bytes, bytes);
+    stats_add(c->total_ns, ns);
+    stats_add(c->latency_buckets[bucket], 1);
+}
+
+// The start time, or 0 when disabled
+static inline unsigned long long stats_start(void)
+{
+    if (!__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    return stats_now_ns();
+}
+
+// Records a call that started at start (if not 0) and returns its result.
+// Negative results are errors; with counts_bytes, positive ones are bytes
+static inline int stats_end_Int(int slot, int counts_bytes, unsigned long long start, int result)
+{
+    if (start)
+    {
+        stats_record(slot, start, result < 0,
+                     counts_bytes && result > 0 ? (unsigned long long)result : 0);
+    }
+    return result;
+}
+
+static inline double stats_end_Double(int slot, int counts_bytes, unsigned long long start, double result)
+{
+    // Doubles are not bytes; the parameter is there for BFFUNCSTATS
+    (void)counts_bytes;
+    if (start)
+    {
+        stats_record(slot, start, 0, 0);
+    }
+    return result;
+}
+
+void bfbridge_set_stats_enabled(int enabled)
+{
+    __atomic_store_n(&stats_enabled, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+int bfbridge_get_stats_enabled(void)
+{
+    return __atomic_load_n(&stats_enabled, __ATOMIC_RELAXED);
+}
+
+int bfbridge_get_stats(bfbridge_call_stats_t *dest, int max)
+{
+    int count = 0;
+    pthread_mutex_lock(&stats_blocks_lock);
+    for (int slot = 0; slot < BFBRIDGE_STATS_SLOT_COUNT; slot++)
+    {
+        const char *name = slot < BFBRIDGE_STATS_JAVA_SLOT_COUNT
+                               ? __atomic_load_n(&stats_java_names[slot], __ATOMIC_RELAXED)
+                               : stats_c_names[slot - BFBRIDGE_STATS_JAVA_SLOT_COUNT];
+        bfbridge_call_stats_t sum;
+        memset(&sum, 0, sizeof(sum));
+        sum.name = name;
+        for (bfbridge_stats_block_t *block = stats_blocks; block; block = block->next)
+        {
+            bfbridge_stats_counters_t *c = &block->slots[slot];
+            sum.calls += __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+            sum.errors += __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+            sum.bytes += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+            sum.total_ns += __atomic_load_n(&c->total_ns, __ATOMIC_RELAXED);
+            for (int i = 0; i < BFBRIDGE_STATS_BUCKET_COUNT; i++)
+            {
+                sum.latency_buckets[i] += __atomic_load_n(&c->latency_buckets[i], __ATOMIC_RELAXED);
+            }
+        }
+        if (sum.calls == 0 || !name)
+        {
+            continue;
+        }
+        if (count < max)
+        {
+            dest[count] = sum;
+        }
+        count++;
+    }
+    pthread_mutex_unlock(&stats_blocks_lock);
+    return count;
+}
+
+void bfbridge_reset_stats(void)
+{
+    pthread_mutex_lock(&stats_blocks_lock);
+    for (bfbridge_stats_block_t *block = stats_blocks; block; block = block->next)
+    {
+        for (int slot = 0; slot < BFBRIDGE_STATS_SLOT_COUNT; slot++)
+        {
+            bfbridge_stats_counters_t *c = &block->slots[slot];
+            __atomic_store_n(&c->calls, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&c->errors, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&c->bytes, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&c->total_ns, 0, __ATOMIC_RELAXED);
+            for (int i = 0; i < BFBRIDGE_STATS_BUCKET_COUNT; i++)
+            {
+                __atomic_store_n(&c->latency_buckets[i], 0, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats_blocks_lock);
+}
+
 bfbridge_error_t *bfbridge_make_vm(bfbridge_vm_t *dest,
     char *cpdir,
     char *cachedir)
+{
+    return bfbridge_make_vm_with_options(dest, cpdir, cachedir, NULL);
+}
+
+// Options field if set, otherwise the environment variable, NULL if empty
+static const char *vm_option_or_env(const char *option, const char *env)
+{
+    const char *value = option ? option : getenv(env);
+    return value && value[0] != '\0' ? value : NULL;
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+bfbridge_error_t *bfbridge_make_vm_with_options(bfbridge_vm_t *dest,
+    char *cpdir,
+    char *cachedir,
+    const bfbridge_vm_options_t *vm_options)
 {
     // Ease of freeing
     dest->jvm = NULL;
@@ -117,6 +403,15 @@ bfbridge_error_t *bfbridge_make_vm(bfbridge_vm_t *dest,
         return make_error(BFBRIDGE_INVALID_CLASSPATH, "bfbridge_make_thread: no classpath supplied", NULL);
     }
 
+    const char *cds_archive = vm_option_or_env(vm_options ? vm_options->cds_archive : NULL, "BFBRIDGE_CDS_ARCHIVE");
+    int warm_up = vm_options && vm_options->warm_up;
+    if (!warm_up)
+    {
+        const char *warm_up_env = getenv("BFBRIDGE_WARM_UP");
+        warm_up = warm_up_env && strtoll(warm_up_env, NULL, 10) != 0;
+    }
+    const char *warm_up_file = vm_option_or_env(vm_options ? vm_options->warm_up_file : NULL, "BFBRIDGE_WARM_UP_FILE");
+
     // Plus one if needed for the purpose below, and one for nullchar
     int cp_len = strlen(cpdir);
     char cp[cp_len + 1 + 1];
@@ -132,12 +427,15 @@ bfbridge_error_t *bfbridge_make_vm(bfbridge_vm_t *dest,
     // Should be freed: path_arg
     bfbridge_basiclib_string_t *path_arg = allocate_string("-Djava.class.path=");
 
-    append_to_string(path_arg, cp);
+    if (!cds_archive)
+    {
+        append_to_string(path_arg, cp);
 
-    // Also add .../*, ending with asterisk, just in case
-    append_to_string(path_arg, BFBRIDGE_JNI_PATH_SEPARATOR_STR);
-    append_to_string(path_arg, cp);
-    append_to_string(path_arg, "*");
+        // Also add .../*, ending with asterisk, just in case
+        append_to_string(path_arg, BFBRIDGE_JNI_PATH_SEPARATOR_STR);
+        append_to_string(path_arg, cp);
+        append_to_string(path_arg, "*");
+    }
 
 // But for some reason unlike the -cp arg, .../* does not work
 // so we need to list every jar file
@@ -151,18 +449,115 @@ bfbridge_error_t *bfbridge_make_vm(bfbridge_vm_t *dest,
         free_string(path_arg);
         return make_error(BFBRIDGE_INVALID_CLASSPATH, "bfbridge_make_thread: a single classpath folder containing jars was expected but got ", cp);
     }
+    // A CDS archive is valid only for the classpath it was created with,
+    // so list jars in a fixed order
+    char **jars = NULL;
+    int jar_count = 0;
+    int jar_alloc = 0;
+    int out_of_memory = 0;
     struct dirent *cp_dirent;
     // BUG: one of the cp_dirent is "..", the parent folder
     while ((cp_dirent = readdir(cp_dir)) != NULL)
     {
-        append_to_string(path_arg, BFBRIDGE_JNI_PATH_SEPARATOR_STR);
-        append_to_string(path_arg, cp);
-        append_to_string(path_arg, cp_dirent->d_name);
+        if (!cds_archive)
+        {
+            append_to_string(path_arg, BFBRIDGE_JNI_PATH_SEPARATOR_STR);
+            append_to_string(path_arg, cp);
+            append_to_string(path_arg, cp_dirent->d_name);
+            continue;
+        }
+        int name_len = strlen(cp_dirent->d_name);
+        if (name_len < 5 || strcmp(cp_dirent->d_name + name_len - 4, ".jar") != 0)
+        {
+            continue;
+        }
+        if (jar_count == jar_alloc)
+        {
+            int new_alloc = jar_alloc ? jar_alloc * 2 : 64;
+            char **new_jars = (char **)realloc(jars, new_alloc * sizeof(char *));
+            if (!new_jars)
+            {
+                out_of_memory = 1;
+                break;
+            }
+            jars = new_jars;
+            jar_alloc = new_alloc;
+        }
+        char *jar = strdup(cp_dirent->d_name);
+        if (!jar)
+        {
+            out_of_memory = 1;
+            break;
+        }
+        jars[jar_count++] = jar;
     }
     closedir(cp_dir);
+    if (out_of_memory)
+    {
+        for (int i = 0; i < jar_count; i++)
+        {
+            free(jars[i]);
+        }
+        free(jars);
+        free_string(path_arg);
+        return make_error(BFBRIDGE_OUT_OF_MEMORY_ERROR, "bfbridge_make_vm: out of memory listing the classpath", NULL);
+    }
+    if (jar_count > 0)
+    {
+        qsort(jars, jar_count, sizeof(char *), compare_strings);
+    }
+    for (int i = 0; i < jar_count; i++)
+    {
+        if (i > 0)
+        {
+            append_to_string(path_arg, BFBRIDGE_JNI_PATH_SEPARATOR_STR);
+        }
+        append_to_string(path_arg, cp);
+        append_to_string(path_arg, jars[i]);
+        free(jars[i]);
+    }
+    free(jars);
 #endif
 
-    JavaVMOption options[3];
+    // Should be freed: path_arg, env_opts
+    // BFBRIDGE_JVM_OPTS split in place at spaces
+    char *env_opts = NULL;
+    int env_opt_count = 0;
+    const char *env_opts_value = getenv("BFBRIDGE_JVM_OPTS");
+    if (env_opts_value)
+    {
+        env_opts = strdup(env_opts_value);
+        if (!env_opts)
+        {
+            free_string(path_arg);
+            return make_error(BFBRIDGE_OUT_OF_MEMORY_ERROR, "bfbridge_make_vm: out of memory reading BFBRIDGE_JVM_OPTS", NULL);
+        }
+        int in_option = 0;
+        for (char *c = env_opts; *c; c++)
+        {
+            if (*c == ' ' || *c == '\t' || *c == '\n')
+            {
+                *c = 0;
+                in_option = 0;
+            }
+            else if (!in_option)
+            {
+                in_option = 1;
+                env_opt_count++;
+            }
+        }
+    }
+    int extra_count = vm_options && vm_options->jvm_options ? vm_options->jvm_option_count : 0;
+
+    // Should be freed: path_arg, env_opts, options
+    // Class path, GC, cache, two for CDS
+    JavaVMOption *options = (JavaVMOption *)calloc(5 + env_opt_count + extra_count, sizeof(JavaVMOption));
+    if (!options)
+    {
+        free_string(path_arg);
+        free(env_opts);
+        return make_error(BFBRIDGE_OUT_OF_MEMORY_ERROR, "bfbridge_make_vm: out of memory for the JVM options", NULL);
+    }
 
     //fprintf(stderr, "Java classpath (BFBRIDGE_CLASSPATH): %s\n", path_arg->str);
     // https://docs.oracle.com/en/java/javase/20/docs/specs/man/java.html#performance-tuning-examples
@@ -170,17 +565,14 @@ bfbridge_error_t *bfbridge_make_vm(bfbridge_vm_t *dest,
     // char optimize2[] = "-XX:+UseLargePages"; Not compatible with our linux distro
     options[0].optionString = path_arg->str;
     options[1].optionString = optimize1;
-    // Note: please make sure to update the array size above and nOptions below
-    // to uncomment these
-    // options[2].optionString = "-verbose:jni";
-    // options[3].optionString = "-Xcheck:jni";
+    // For JNI debugging, set BFBRIDGE_JVM_OPTS to "-verbose:jni -Xcheck:jni"
     JavaVMInitArgs vm_args;
     vm_args.version = JNI_VERSION_20;
     vm_args.nOptions = 2;
     vm_args.options = options;
     vm_args.ignoreUnrecognized = 0;
 
-    // Should be freed: path_arg, cache_arg
+    // Should be freed: path_arg, env_opts, options, cache_arg, cds_arg
     bfbridge_basiclib_string_t *cache_arg = allocate_string("-Dbfbridge.cachedir=");
 
     if (cachedir && cachedir[0] != '\0')
@@ -190,6 +582,31 @@ bfbridge_error_t *bfbridge_make_vm(bfbridge_vm_t *dest,
         options[vm_args.nOptions++].optionString = cache_arg->str;
     }
 
+    // https://docs.oracle.com/en/java/javase/20/docs/specs/man/java.html#application-class-data-sharing
+    bfbridge_basiclib_string_t *cds_arg = allocate_string("-XX:SharedArchiveFile=");
+    char auto_create_archive[] = "-XX:+AutoCreateSharedArchive";
+    if (cds_archive)
+    {
+        append_to_string(cds_arg, cds_archive);
+        options[vm_args.nOptions++].optionString = cds_arg->str;
+        options[vm_args.nOptions++].optionString = auto_create_archive;
+    }
+
+    char *env_opt = env_opts;
+    for (int i = 0; i < env_opt_count; i++)
+    {
+        while (*env_opt == 0)
+        {
+            env_opt++;
+        }
+        options[vm_args.nOptions++].optionString = env_opt;
+        env_opt += strlen(env_opt);
+    }
+    for (int i = 0; i < extra_count; i++)
+    {
+        options[vm_args.nOptions++].optionString = (char *)vm_options->jvm_options[i];
+    }
+
     // Check if JVM already exists
     /*{
     JavaVM* vmbuf[3];
@@ -205,6 +622,9 @@ bfbridge_error_t *bfbridge_make_vm(bfbridge_vm_t *dest,
     int code = JNI_CreateJavaVM(&jvm, (void **)&env, &vm_args);
 
     free_string(cache_arg);
+    free_string(cds_arg);
+    free(options);
+    free(env_opts);
 
     if (code < 0)
     {
@@ -234,6 +654,10 @@ bfbridge_error_t *bfbridge_make_vm(bfbridge_vm_t *dest,
     {
         bfbridge_basiclib_string_t *error = allocate_string("FindClass failed because org.camicroscope.BFBridge (or a dependency of it) could not be found. Are the jars in: ");
         append_to_string(error, path_arg->str);
+        if (cds_archive)
+        {
+            append_to_string(error, " With a CDS archive, classes must be in jar files.");
+        }
 
         if (BFENVAV(env, ExceptionCheck) == 1)
         {
@@ -250,6 +674,37 @@ bfbridge_error_t *bfbridge_make_vm(bfbridge_vm_t *dest,
     }
 
     free_string(path_arg);
+
+    if (warm_up)
+    {
+        jmethodID warm_up_method = BFENVA(env, GetStaticMethodID, bfbridge_base, "BFWarmUp", "(Ljava/lang/String;)I");
+        jstring warm_up_file_string = NULL;
+        if (warm_up_method && warm_up_file)
+        {
+            warm_up_file_string = BFENVA(env, NewStringUTF, warm_up_file);
+        }
+        if (warm_up_method)
+        {
+            // Errors are printed by Java
+            BFENVA(env, CallStaticIntMethod, bfbridge_base, warm_up_method, warm_up_file_string);
+        }
+        if (BFENVAV(env, ExceptionCheck) == 1)
+        {
+            BFENVAV(env, ExceptionDescribe);
+        }
+        if (warm_up_file_string)
+        {
+            BFENVA(env, DeleteLocalRef, warm_up_file_string);
+        }
+    }
+
+    // The Java side reads it too
+    char *stats = getenv("BFBRIDGE_STATS");
+    if (stats && strtoll(stats, NULL, 10) != 0)
+    {
+        bfbridge_set_stats_enabled(1);
+    }
+
     dest->jvm = jvm;
     return NULL;
 }
@@ -283,6 +738,7 @@ bfbridge_error_t *bfbridge_make_thread(
     }
 
     dest->vm = vm;
+    dest->stats_start = 0;
     JNIEnv *env;
     jint code = BFENVA(vm->jvm, AttachCurrentThread, (void **)&env, NULL);
 
@@ -331,7 +787,9 @@ bfbridge_error_t *bfbridge_make_thread(
     {                                                                       \
         method_cannot_be_found = #name;                                     \
         goto prepare_method_error;                                          \
-    }
+    }                                                                       \
+    __atomic_store_n(&stats_java_names[BFBRIDGE_STATS_SLOT(name)], #name,   \
+                     __ATOMIC_RELAXED);
 
     if (0) {
     prepare_method_error:
@@ -385,11 +843,20 @@ bfbridge_error_t *bfbridge_make_thread(
     prepare_method_id(BFGet8BitLookupTable, "()I");
     prepare_method_id(BFGet16BitLookupTable, "()I");
     prepare_method_id(BFOpenBytes, "(IIIII)I");
+    prepare_method_id(BFOpenBytesStack, "(IIIIIIIIIII)I");
+    prepare_method_id(BFOpenBytesBatch, "(I)I");
+    prepare_method_id(BFGetPixelPoolStats, "()I");
     prepare_method_id(BFOpenThumbBytes, "(III)I");
+    prepare_method_id(BFOpenBytesEncoded, "(IIIIIII)I");
+    prepare_method_id(BFOpenCompressedTile, "(IIIII)I");
     prepare_method_id(BFGetMPPX, "(I)D");
     prepare_method_id(BFGetMPPY, "(I)D");
     prepare_method_id(BFGetMPPZ, "(I)D");
     prepare_method_id(BFDumpOMEXMLMetadata, "()I");
+    prepare_method_id(BFGetImageInfo, "()I");
+    prepare_method_id(BFGetPyramidLayout, "()I");
+    prepare_method_id(BFGetJavaStats, "()I");
+    prepare_method_id(BFGetRequiredBufferSize, "()I");
 
     // Ease of freeing: keep null until we can return without error
     dest->env = env;
@@ -422,48 +889,13 @@ void bfbridge_free_thread(bfbridge_thread_t *dest)
     }
 }
 
-bfbridge_error_t *bfbridge_make_instance(
-    bfbridge_instance_t *dest,
-    bfbridge_thread_t *thread,
-    char *communication_buffer,
-    int communication_buffer_len)
+// Gives the bfbridge object a direct ByteBuffer over buffer
+static bfbridge_error_t *instance_set_java_buffer(
+    bfbridge_thread_t *thread, jobject bfbridge,
+    char *communication_buffer, int communication_buffer_len)
 {
-    // Ease of freeing
-    dest->bfbridge = NULL;
-    dest->communication_buffer = communication_buffer;
-#ifndef BFBRIDGE_KNOW_BUFFER_LEN
-    dest->communication_buffer_len = communication_buffer_len;
-#endif
-    if (!thread->env)
-    {
-        return make_error(
-            BFBRIDGE_LIBRARY_UNINITIALIZED,
-            "a bfbridge_thread_t must have been initialized before bfbridge_make_instance",
-            NULL);
-    }
-
-    if (communication_buffer == NULL || communication_buffer_len < 0)
-    {
-        return make_error(
-            BFBRIDGE_INVALID_COMMUNICATON_BUFFER,
-            "communication_buffer NULL or has negative length",
-            NULL);
-    }
-
-    /* Check if its out thread:
-    printf("env pointer for this thread oming\n");
-
-    // verify attached
-    BFENVA(thread->vm->jvm, GetEnv, (void**)&env2, 20);*/
-
     JNIEnv *env = thread->env;
-    jobject bfbridge_local =
-        BFENVA(env, NewObject, thread->bfbridge_base, thread->constructor);
-    // Should be freed: bfbridge
-    jobject bfbridge = (jobject)BFENVA(env, NewGlobalRef, bfbridge_local);
-    BFENVA(env, DeleteLocalRef, bfbridge_local);
-
-    // Should be freed: bfbridge, buffer (the jobject only)
+    // Should be freed: buffer (the jobject only)
     jobject buffer =
         BFENVA(env,
                NewDirectByteBuffer,
@@ -475,7 +907,6 @@ bfbridge_error_t *bfbridge_make_instance(
         {
             // As of JDK 20, NewDirectByteBuffer only raises OutOfMemoryError
             BFENVAV(env, ExceptionDescribe);
-            BFENVA(env, DeleteGlobalRef, bfbridge);
 
             return make_error(
                 BFBRIDGE_OUT_OF_MEMORY_ERROR,
@@ -484,7 +915,6 @@ bfbridge_error_t *bfbridge_make_instance(
         }
         else
         {
-            BFENVA(env, DeleteGlobalRef, bfbridge);
             return make_error(
                 BFBRIDGE_JVM_LACKS_BYTE_BUFFERS,
                 "Used JVM implementation does not support direct byte buffers"
@@ -517,41 +947,111 @@ bfbridge_error_t *bfbridge_make_instance(
         thread->BFSetCommunicationBuffer, buffer);
 
     BFENVA(env, DeleteLocalRef, buffer);
-
-    // Ease of freeing: keep null until we can return without error
-    dest->bfbridge = bfbridge;
     return NULL;
 }
 
-void bfbridge_move_instance(bfbridge_instance_t *dest, bfbridge_instance_t *thread)
+bfbridge_error_t *bfbridge_make_instance(
+    bfbridge_instance_t *dest,
+    bfbridge_thread_t *thread,
+    char *communication_buffer,
+    int communication_buffer_len)
 {
     // Ease of freeing
-    if (thread->bfbridge)
-    {
-        *dest = *thread;
-        thread->bfbridge = NULL;
-        thread->communication_buffer = NULL;
-    }
-    else
+    dest->bfbridge = NULL;
+    dest->communication_buffer = communication_buffer;
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    dest->communication_buffer_len = communication_buffer_len;
+    dest->communication_buffer_max_len = 0;
+    dest->communication_buffer_required = 0;
+    dest->communication_buffer_high_water = 0;
+    dest->last_result = 0;
+#endif
+    if (!thread->env)
     {
-        dest->bfbridge = NULL;
-        dest->communication_buffer = NULL;
+        return make_error(
+            BFBRIDGE_LIBRARY_UNINITIALIZED,
+            "a bfbridge_thread_t must have been initialized before bfbridge_make_instance",
+            NULL);
     }
-}
 
-void bfbridge_free_instance(
-    bfbridge_instance_t *instance, bfbridge_thread_t *thread)
-{
-    // Ease of freeing
-    if (instance->bfbridge && thread->env && thread->vm->jvm)
+    if (communication_buffer == NULL || communication_buffer_len < 0)
     {
-        BFENVA(thread->env, DeleteGlobalRef, instance->bfbridge);
-        instance->bfbridge = NULL;
+        return make_error(
+            BFBRIDGE_INVALID_COMMUNICATON_BUFFER,
+            "communication_buffer NULL or has negative length",
+            NULL);
     }
-}
 
-char *bfbridge_instance_get_communication_buffer(
-    bfbridge_instance_t *instance, int *len)
+    /* Check if its out thread:
+    printf("env pointer for this thread oming\n");
+
+    // verify attached
+    BFENVA(thread->vm->jvm, GetEnv, (void**)&env2, 20);*/
+
+    JNIEnv *env = thread->env;
+    jobject bfbridge_local =
+        BFENVA(env, NewObject, thread->bfbridge_base, thread->constructor);
+    // Should be freed: bfbridge
+    jobject bfbridge = (jobject)BFENVA(env, NewGlobalRef, bfbridge_local);
+    BFENVA(env, DeleteLocalRef, bfbridge_local);
+
+    bfbridge_error_t *err = instance_set_java_buffer(
+        thread, bfbridge, communication_buffer, communication_buffer_len);
+    if (err)
+    {
+        BFENVA(env, DeleteGlobalRef, bfbridge);
+        return err;
+    }
+
+    // Ease of freeing: keep null until we can return without error
+    dest->bfbridge = bfbridge;
+    return NULL;
+}
+
+void bfbridge_move_instance(bfbridge_instance_t *dest, bfbridge_instance_t *thread)
+{
+    // Ease of freeing
+    if (thread->bfbridge)
+    {
+        *dest = *thread;
+        thread->bfbridge = NULL;
+        thread->communication_buffer = NULL;
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+        thread->communication_buffer_max_len = 0;
+#endif
+    }
+    else
+    {
+        dest->bfbridge = NULL;
+        dest->communication_buffer = NULL;
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+        dest->communication_buffer_max_len = 0;
+#endif
+    }
+}
+
+void bfbridge_free_instance(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread)
+{
+    // Ease of freeing
+    if (instance->bfbridge && thread->env && thread->vm->jvm)
+    {
+        BFENVA(thread->env, DeleteGlobalRef, instance->bfbridge);
+        instance->bfbridge = NULL;
+    }
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    // Owned by the library
+    if (instance->communication_buffer_max_len > 0)
+    {
+        free(instance->communication_buffer);
+        instance->communication_buffer = NULL;
+        instance->communication_buffer_max_len = 0;
+    }
+#endif
+}
+
+char *bfbridge_instance_get_communication_buffer(
+    bfbridge_instance_t *instance, int *len)
 {
 #ifndef BFBRIDGE_KNOW_BUFFER_LEN
     if (len)
@@ -562,6 +1062,183 @@ char *bfbridge_instance_get_communication_buffer(
     return instance->communication_buffer;
 }
 
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+// Moves a library owned buffer to a new allocation of len bytes,
+// keeping the contents that fit
+// returns: 1 on success, 0 on failure, keeping the previous buffer
+static int instance_move_buffer(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread, int len)
+{
+    char *buffer = (char *)malloc(len > 0 ? len : 1);
+    if (!buffer)
+    {
+        return 0;
+    }
+    int keep = len < instance->communication_buffer_len ? len : instance->communication_buffer_len;
+    memcpy(buffer, instance->communication_buffer, keep);
+    bfbridge_error_t *err = instance_set_java_buffer(thread, instance->bfbridge, buffer, len);
+    if (err)
+    {
+        bfbridge_free_error(err);
+        free(buffer);
+        return 0;
+    }
+    free(instance->communication_buffer);
+    instance->communication_buffer = buffer;
+    instance->communication_buffer_len = len;
+    return 1;
+}
+
+// Grows a library owned buffer to at least needed bytes
+// returns: 1 if it grew, 0 if it can't: owned by the caller,
+// needed over the maximum, or out of memory
+static int instance_grow_buffer(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread, long long needed)
+{
+    int len = instance->communication_buffer_len;
+    int max_len = instance->communication_buffer_max_len;
+    if (max_len == 0 || needed <= len || needed > max_len)
+    {
+        return 0;
+    }
+    // Geometric, so that slowly increasing sizes don't copy every time
+    long long new_len = len + (long long)len / 2;
+    if (new_len < needed)
+    {
+        new_len = needed;
+    }
+    if (new_len > max_len)
+    {
+        new_len = max_len;
+    }
+    return instance_move_buffer(instance, thread, (int)new_len);
+}
+#endif
+
+bfbridge_error_t *bfbridge_make_growable_instance(
+    bfbridge_instance_t *dest,
+    bfbridge_thread_t *thread,
+    int initial_len,
+    int max_len)
+{
+#ifdef BFBRIDGE_KNOW_BUFFER_LEN
+    (void)thread;
+    (void)initial_len;
+    (void)max_len;
+    // Ease of freeing
+    dest->bfbridge = NULL;
+    dest->communication_buffer = NULL;
+    return make_error(
+        BFBRIDGE_INVALID_COMMUNICATON_BUFFER,
+        "bfbridge_make_growable_instance is not available with BFBRIDGE_KNOW_BUFFER_LEN",
+        NULL);
+#else
+    // Ease of freeing
+    dest->bfbridge = NULL;
+    dest->communication_buffer = NULL;
+    dest->communication_buffer_max_len = 0;
+    if (initial_len <= 0 || max_len < initial_len)
+    {
+        return make_error(
+            BFBRIDGE_INVALID_COMMUNICATON_BUFFER,
+            "bfbridge_make_growable_instance: initial_len must be positive and at most max_len",
+            NULL);
+    }
+    char *buffer = (char *)malloc(initial_len);
+    if (!buffer)
+    {
+        return make_error(
+            BFBRIDGE_OUT_OF_MEMORY_ERROR,
+            "bfbridge_make_growable_instance: could not allocate the communication buffer",
+            NULL);
+    }
+    bfbridge_error_t *err = bfbridge_make_instance(dest, thread, buffer, initial_len);
+    if (err)
+    {
+        free(buffer);
+        dest->communication_buffer = NULL;
+        return err;
+    }
+    // Ease of freeing: owned once made
+    dest->communication_buffer_max_len = max_len;
+    return NULL;
+#endif
+}
+
+bfbridge_error_t *bfbridge_instance_set_communication_buffer(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    char *communication_buffer, int communication_buffer_len)
+{
+    if (communication_buffer == NULL || communication_buffer_len < 0)
+    {
+        return make_error(
+            BFBRIDGE_INVALID_COMMUNICATON_BUFFER,
+            "communication_buffer NULL or has negative length",
+            NULL);
+    }
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    if (instance->communication_buffer_max_len > 0)
+    {
+        return make_error(
+            BFBRIDGE_INVALID_COMMUNICATON_BUFFER,
+            "bfbridge_instance_set_communication_buffer: the buffer of a growable instance is owned by the library",
+            NULL);
+    }
+#endif
+    bfbridge_error_t *err = instance_set_java_buffer(
+        thread, instance->bfbridge, communication_buffer, communication_buffer_len);
+    if (err)
+    {
+        return err;
+    }
+    instance->communication_buffer = communication_buffer;
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    instance->communication_buffer_len = communication_buffer_len;
+#endif
+    return NULL;
+}
+
+int bfbridge_instance_get_required_len(bfbridge_instance_t *instance)
+{
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    return instance->communication_buffer_required;
+#else
+    (void)instance;
+    return 0;
+#endif
+}
+
+int bfbridge_instance_get_high_water(bfbridge_instance_t *instance)
+{
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    return instance->communication_buffer_high_water;
+#else
+    (void)instance;
+    return 0;
+#endif
+}
+
+int bfbridge_instance_shrink(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread, int len)
+{
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    if (instance->communication_buffer_max_len == 0 || len <= 0)
+    {
+        return -1;
+    }
+    if (len >= instance->communication_buffer_len)
+    {
+        return 0;
+    }
+    return instance_move_buffer(instance, thread, len) ? 0 : -1;
+#else
+    (void)instance;
+    (void)thread;
+    (void)len;
+    return -1;
+#endif
+}
+
 // Shorthand for JavaENV:
 #define BFENV (thread->env)
 // Instance class:
@@ -580,12 +1257,59 @@ char *bfbridge_instance_get_communication_buffer(
  //   BFENVA(BFENV, Call##type##Method, BFINSTC, thread->method)
 
 // Super easily, super fast:
-#define BFFUNC(method, type, ...) \
+#define BFFUNCNOSTATS(method, type, ...) \
     BFENVA(BFENV, CallNonvirtual##type##Method, BFINSTC, thread->bfbridge_base, thread->method, __VA_ARGS__)
 // Use the second one, void one, for no args as __VA_ARGS__ requires at least one
-#define BFFUNCV(method, type) \
+#define BFFUNCVNOSTATS(method, type) \
     BFENVA(BFENV, CallNonvirtual##type##Method, BFINSTC, thread->bfbridge_base, thread->method)
 
+// Timed for statistics. The start time goes to thread->stats_start
+// as the comma operator orders it before the call, unlike arguments.
+#define BFFUNCSTATS(method, type, counts_bytes, call)                            \
+    (thread->stats_start = stats_start(),                                       \
+     stats_end_##type(BFBRIDGE_STATS_SLOT(method), counts_bytes, thread->stats_start, call))
+#define BFFUNC(method, type, ...) \
+    BFFUNCSTATS(method, type, 0, BFFUNCNOSTATS(method, type, __VA_ARGS__))
+#define BFFUNCV(method, type) \
+    BFFUNCSTATS(method, type, 0, BFFUNCVNOSTATS(method, type))
+
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+// For methods that write to the buffer: records the result. If it is -2,
+// records the length needed and grows a library owned buffer to it
+// returns: 1 if the call should be retried
+static int instance_check_result(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread, int result)
+{
+    instance->last_result = result;
+    int needed = result;
+    instance->communication_buffer_required = 0;
+    if (result == -2)
+    {
+        needed = BFFUNCVNOSTATS(BFGetRequiredBufferSize, Int);
+        instance->communication_buffer_required = needed;
+    }
+    if (needed > instance->communication_buffer_high_water)
+    {
+        instance->communication_buffer_high_water = needed;
+    }
+    return result == -2 && instance_grow_buffer(instance, thread, needed);
+}
+
+// Retries once, which is enough unless the length needed was a guess
+#define BFFUNCGROW(call)                                     \
+    ((void)(instance_check_result(instance, thread, (call)) && \
+            instance_check_result(instance, thread, (call))),  \
+     instance->last_result)
+#else
+#define BFFUNCGROW(call) (call)
+#endif
+
+// For methods that return the number of bytes written
+#define BFFUNCB(method, type, ...) \
+    BFFUNCSTATS(method, type, 1, BFFUNCGROW(BFFUNCNOSTATS(method, type, __VA_ARGS__)))
+#define BFFUNCVB(method, type) \
+    BFFUNCSTATS(method, type, 1, BFFUNCGROW(BFFUNCVNOSTATS(method, type)))
+
 // Methods
 // Please keep in order with bfbridge_thread_t members
 
@@ -630,7 +1354,7 @@ int bf_open(
 int bf_get_format(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread)
 {
-    return BFFUNCV(BFGetFormat, Int);
+    return BFFUNCVB(BFGetFormat, Int);
 }
 
 int bf_is_single_file(
@@ -644,7 +1368,7 @@ int bf_is_single_file(
 int bf_get_current_file(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread)
 {
-    return BFFUNCV(BFGetCurrentFile, Int);
+    return BFFUNCVB(BFGetCurrentFile, Int);
 }
 
 // Lists null-separated filenames/filepaths for the currently open file.
@@ -652,7 +1376,7 @@ int bf_get_current_file(
 int bf_get_used_files(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread)
 {
-    return BFFUNCV(BFGetUsedFiles, Int);
+    return BFFUNCVB(BFGetUsedFiles, Int);
 }
 
 int bf_close(
@@ -732,7 +1456,7 @@ int bf_get_image_count(
 int bf_get_dimension_order(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread)
 {
-    return BFFUNCV(BFGetDimensionOrder, Int);
+    return BFFUNCVB(BFGetDimensionOrder, Int);
 }
 
 int bf_is_order_certain(
@@ -810,27 +1534,81 @@ int bf_is_false_color(
 int bf_get_8_bit_lookup_table(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread)
 {
-    return BFFUNCV(BFGet8BitLookupTable, Int);
+    return BFFUNCVB(BFGet8BitLookupTable, Int);
 }
 
 int bf_get_16_bit_lookup_table(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread)
 {
-    return BFFUNCV(BFGet16BitLookupTable, Int);
+    return BFFUNCVB(BFGet16BitLookupTable, Int);
 }
 
 int bf_open_bytes(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread,
     int plane, int x, int y, int w, int h)
 {
-    return BFFUNC(BFOpenBytes, Int, plane, x, y, w, h);
+    return BFFUNCB(BFOpenBytes, Int, plane, x, y, w, h);
+}
+
+int bf_open_bytes_stack(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int x, int y, int w, int h, int z, int z_count,
+    int c, int c_count, int t, int t_count, int order)
+{
+    return BFFUNCB(BFOpenBytesStack, Int, x, y, w, h, z, z_count, c, c_count, t, t_count, order);
+}
+
+int bf_open_bytes_batch(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_tile_request_t *requests, int count)
+{
+    if (count < 0)
+    {
+        return -1;
+    }
+    // Java checks the length only after the requests are copied
+    long long needed = (long long)count * sizeof(bfbridge_tile_request_t);
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    if (needed > instance->communication_buffer_len &&
+        !instance_grow_buffer(instance, thread, needed))
+    {
+        instance->communication_buffer_required = needed > INT_MAX ? INT_MAX : (int)needed;
+        instance->last_result = -2;
+        return -2;
+    }
+#endif
+    if (count > 0)
+    {
+        memcpy(instance->communication_buffer, requests, needed);
+    }
+    return BFFUNCB(BFOpenBytesBatch, Int, count);
+}
+
+int bf_get_pixel_pool_stats(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread)
+{
+    return BFFUNCVB(BFGetPixelPoolStats, Int);
 }
 
 int bf_open_thumb_bytes(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread,
     int plane, int w, int h)
 {
-    return BFFUNC(BFOpenThumbBytes, Int, plane, w, h);
+    return BFFUNCB(BFOpenThumbBytes, Int, plane, w, h);
+}
+
+int bf_open_bytes_encoded(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int format, int quality, int plane, int x, int y, int w, int h)
+{
+    return BFFUNCB(BFOpenBytesEncoded, Int, format, quality, plane, x, y, w, h);
+}
+
+int bf_open_compressed_tile(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int plane, int x, int y, int w, int h)
+{
+    return BFFUNCB(BFOpenCompressedTile, Int, plane, x, y, w, h);
 }
 
 double bf_get_mpp_x(
@@ -857,7 +1635,3062 @@ double bf_get_mpp_z(
 int bf_dump_ome_xml_metadata(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread)
 {
-    return BFFUNCV(BFDumpOMEXMLMetadata, Int);
+    return BFFUNCVB(BFDumpOMEXMLMetadata, Int);
+}
+
+int bf_get_image_info(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_image_info_t *dest)
+{
+    int len = BFFUNCVB(BFGetImageInfo, Int);
+    if (len >= 0 && dest)
+    {
+        memcpy(dest, instance->communication_buffer, sizeof(bfbridge_image_info_t));
+    }
+    return len;
+}
+
+int bf_get_pyramid_layout(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread)
+{
+    return BFFUNCVB(BFGetPyramidLayout, Int);
+}
+
+int bf_get_java_stats(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_java_stats_t *dest)
+{
+    int len = BFFUNCVB(BFGetJavaStats, Int);
+    if (len >= 0 && dest)
+    {
+        memcpy(dest, instance->communication_buffer, sizeof(bfbridge_java_stats_t));
+    }
+    return len;
+}
+
+// Tile cache
+
+typedef struct bfbridge_tile_cache_entry
+{
+    bfbridge_tile_key_t key;
+    unsigned long long hash;
+    char *data;
+    int len;
+    // CLOCK: set on access, cleared when the hand passes
+    int referenced;
+    struct bfbridge_tile_cache_entry *bucket_next;
+    // Circular list that the hand walks
+    struct bfbridge_tile_cache_entry *clock_prev;
+    struct bfbridge_tile_cache_entry *clock_next;
+} bfbridge_tile_cache_entry_t;
+
+typedef struct bfbridge_tile_cache_shard
+{
+    pthread_mutex_t lock;
+    bfbridge_tile_cache_entry_t **buckets;
+    // Power of two
+    int bucket_count;
+    bfbridge_tile_cache_entry_t *hand;
+    long long max_bytes;
+    bfbridge_tile_cache_stats_t stats;
+} bfbridge_tile_cache_shard_t;
+
+struct bfbridge_tile_cache_internal
+{
+    int shard_count;
+    bfbridge_tile_cache_shard_t *shards;
+};
+
+// FNV-1a
+static unsigned long long tile_cache_hash_bytes(
+    unsigned long long hash, const void *bytes, size_t len)
+{
+    const unsigned char *b = (const unsigned char *)bytes;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= b[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static unsigned long long tile_cache_hash_key(const bfbridge_tile_key_t *key)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    hash = tile_cache_hash_bytes(hash, &key->file_id, sizeof(key->file_id));
+    int fields[7] = {key->series, key->resolution, key->plane,
+                     key->x, key->y, key->w, key->h};
+    return tile_cache_hash_bytes(hash, fields, sizeof(fields));
+}
+
+static int tile_cache_key_equals(
+    const bfbridge_tile_key_t *a, const bfbridge_tile_key_t *b)
+{
+    return a->file_id == b->file_id && a->series == b->series &&
+           a->resolution == b->resolution && a->plane == b->plane &&
+           a->x == b->x && a->y == b->y && a->w == b->w && a->h == b->h;
+}
+
+static bfbridge_tile_cache_shard_t *tile_cache_shard(
+    struct bfbridge_tile_cache_internal *cache, unsigned long long hash)
+{
+    // High bits for the shard, low bits for the bucket
+    return &cache->shards[(hash >> 40) % cache->shard_count];
+}
+
+// Caller holds the shard lock
+static bfbridge_tile_cache_entry_t **tile_cache_find(
+    bfbridge_tile_cache_shard_t *shard, const bfbridge_tile_key_t *key,
+    unsigned long long hash)
+{
+    bfbridge_tile_cache_entry_t **e =
+        &shard->buckets[hash & (shard->bucket_count - 1)];
+    while (*e && !((*e)->hash == hash && tile_cache_key_equals(&(*e)->key, key)))
+    {
+        e = &(*e)->bucket_next;
+    }
+    return e;
+}
+
+// Caller holds the shard lock. Unlinks and frees
+static void tile_cache_remove(
+    bfbridge_tile_cache_shard_t *shard, bfbridge_tile_cache_entry_t *entry)
+{
+    bfbridge_tile_cache_entry_t **e = tile_cache_find(shard, &entry->key, entry->hash);
+    *e = entry->bucket_next;
+    if (entry->clock_next == entry)
+    {
+        shard->hand = NULL;
+    }
+    else
+    {
+        entry->clock_prev->clock_next = entry->clock_next;
+        entry->clock_next->clock_prev = entry->clock_prev;
+        if (shard->hand == entry)
+        {
+            shard->hand = entry->clock_next;
+        }
+    }
+    shard->stats.bytes -= entry->len;
+    shard->stats.entries--;
+    free(entry->data);
+    free(entry);
+}
+
+// Caller holds the shard lock. Returns 0 if out of memory
+static int tile_cache_grow(bfbridge_tile_cache_shard_t *shard)
+{
+    int bucket_count = shard->bucket_count * 2;
+    bfbridge_tile_cache_entry_t **buckets = (bfbridge_tile_cache_entry_t **)
+        calloc(bucket_count, sizeof(bfbridge_tile_cache_entry_t *));
+    if (!buckets)
+    {
+        return 0;
+    }
+    for (int i = 0; i < shard->bucket_count; i++)
+    {
+        bfbridge_tile_cache_entry_t *e = shard->buckets[i];
+        while (e)
+        {
+            bfbridge_tile_cache_entry_t *next = e->bucket_next;
+            bfbridge_tile_cache_entry_t **bucket = &buckets[e->hash & (bucket_count - 1)];
+            e->bucket_next = *bucket;
+            *bucket = e;
+            e = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = bucket_count;
+    return 1;
+}
+
+bfbridge_error_t *bfbridge_make_tile_cache(
+    bfbridge_tile_cache_t *dest, long long max_bytes, int shard_count)
+{
+    // Ease of freeing
+    dest->internal = NULL;
+
+    if (max_bytes <= 0 || shard_count <= 0)
+    {
+        return make_error(BFBRIDGE_INVALID_TILE_CACHE_SIZE, "bfbridge_make_tile_cache: max_bytes and shard_count must be positive", NULL);
+    }
+
+    struct bfbridge_tile_cache_internal *cache = (struct bfbridge_tile_cache_internal *)
+        malloc(sizeof(struct bfbridge_tile_cache_internal));
+    bfbridge_tile_cache_shard_t *shards = (bfbridge_tile_cache_shard_t *)
+        calloc(shard_count, sizeof(bfbridge_tile_cache_shard_t));
+    int initialized = 0;
+    for (; cache && shards && initialized < shard_count; initialized++)
+    {
+        bfbridge_tile_cache_shard_t *shard = &shards[initialized];
+        shard->bucket_count = 64;
+        shard->buckets = (bfbridge_tile_cache_entry_t **)
+            calloc(shard->bucket_count, sizeof(bfbridge_tile_cache_entry_t *));
+        if (!shard->buckets)
+        {
+            break;
+        }
+        shard->max_bytes = max_bytes / shard_count;
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    if (!cache || !shards || initialized < shard_count)
+    {
+        for (int i = 0; i < initialized; i++)
+        {
+            free(shards[i].buckets);
+            pthread_mutex_destroy(&shards[i].lock);
+        }
+        free(shards);
+        free(cache);
+        return make_error(BFBRIDGE_OUT_OF_MEMORY_ERROR, "bfbridge_make_tile_cache: out of memory", NULL);
+    }
+    cache->shard_count = shard_count;
+    cache->shards = shards;
+    dest->internal = cache;
+    return NULL;
+}
+
+void bfbridge_free_tile_cache(bfbridge_tile_cache_t *cache)
+{
+    // Ease of freeing
+    if (!cache->internal)
+    {
+        return;
+    }
+    struct bfbridge_tile_cache_internal *c = cache->internal;
+    for (int i = 0; i < c->shard_count; i++)
+    {
+        bfbridge_tile_cache_shard_t *shard = &c->shards[i];
+        while (shard->hand)
+        {
+            tile_cache_remove(shard, shard->hand);
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(c->shards);
+    free(c);
+    cache->internal = NULL;
+}
+
+long long bfbridge_tile_cache_file_id(const char *filepath, int filepath_len)
+{
+    return (long long)tile_cache_hash_bytes(
+        14695981039346656037ULL, filepath, filepath_len);
+}
+
+int bfbridge_tile_cache_get(
+    bfbridge_tile_cache_t *cache, const bfbridge_tile_key_t *key,
+    char *dest, int dest_len)
+{
+    unsigned long long hash = tile_cache_hash_key(key);
+    bfbridge_tile_cache_shard_t *shard = tile_cache_shard(cache->internal, hash);
+    int len = -1;
+    pthread_mutex_lock(&shard->lock);
+    bfbridge_tile_cache_entry_t *entry = *tile_cache_find(shard, key, hash);
+    if (entry)
+    {
+        shard->stats.hits++;
+        entry->referenced = 1;
+        len = entry->len;
+        if (len > dest_len)
+        {
+            len = -2;
+        }
+        else
+        {
+            memcpy(dest, entry->data, len);
+        }
+    }
+    else
+    {
+        shard->stats.misses++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return len;
+}
+
+// Without counting a hit or a miss
+static int tile_cache_contains(
+    bfbridge_tile_cache_t *cache, const bfbridge_tile_key_t *key)
+{
+    unsigned long long hash = tile_cache_hash_key(key);
+    bfbridge_tile_cache_shard_t *shard = tile_cache_shard(cache->internal, hash);
+    pthread_mutex_lock(&shard->lock);
+    int found = *tile_cache_find(shard, key, hash) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+void bfbridge_tile_cache_put(
+    bfbridge_tile_cache_t *cache, const bfbridge_tile_key_t *key,
+    const char *tile, int len)
+{
+    unsigned long long hash = tile_cache_hash_key(key);
+    bfbridge_tile_cache_shard_t *shard = tile_cache_shard(cache->internal, hash);
+    if (len < 0 || len > shard->max_bytes)
+    {
+        return;
+    }
+    // Copy outside the lock
+    bfbridge_tile_cache_entry_t *entry = (bfbridge_tile_cache_entry_t *)
+        malloc(sizeof(bfbridge_tile_cache_entry_t));
+    char *data = (char *)malloc(len > 0 ? len : 1);
+    if (!entry || !data)
+    {
+        free(entry);
+        free(data);
+        return;
+    }
+    memcpy(data, tile, len);
+    entry->key = *key;
+    entry->hash = hash;
+    entry->data = data;
+    entry->len = len;
+    entry->referenced = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    bfbridge_tile_cache_entry_t *existing = *tile_cache_find(shard, key, hash);
+    if (existing)
+    {
+        tile_cache_remove(shard, existing);
+    }
+    // CLOCK: give referenced entries a second chance
+    while (shard->hand && shard->stats.bytes + len > shard->max_bytes)
+    {
+        bfbridge_tile_cache_entry_t *hand = shard->hand;
+        if (hand->referenced)
+        {
+            hand->referenced = 0;
+            shard->hand = hand->clock_next;
+        }
+        else
+        {
+            tile_cache_remove(shard, hand);
+            shard->stats.evictions++;
+        }
+    }
+    if (shard->stats.entries >= shard->bucket_count)
+    {
+        // On failure, keep using longer chains
+        tile_cache_grow(shard);
+    }
+    bfbridge_tile_cache_entry_t **bucket = &shard->buckets[hash & (shard->bucket_count - 1)];
+    entry->bucket_next = *bucket;
+    *bucket = entry;
+    // Insert just behind the hand, so it is visited last
+    if (shard->hand)
+    {
+        entry->clock_next = shard->hand;
+        entry->clock_prev = shard->hand->clock_prev;
+        shard->hand->clock_prev->clock_next = entry;
+        shard->hand->clock_prev = entry;
+    }
+    else
+    {
+        entry->clock_next = entry;
+        entry->clock_prev = entry;
+        shard->hand = entry;
+    }
+    shard->stats.bytes += len;
+    shard->stats.entries++;
+    shard->stats.insertions++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void bfbridge_tile_cache_invalidate_file(
+    bfbridge_tile_cache_t *cache, long long file_id)
+{
+    struct bfbridge_tile_cache_internal *c = cache->internal;
+    for (int i = 0; i < c->shard_count; i++)
+    {
+        bfbridge_tile_cache_shard_t *shard = &c->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (int b = 0; b < shard->bucket_count; b++)
+        {
+            bfbridge_tile_cache_entry_t *e = shard->buckets[b];
+            while (e)
+            {
+                bfbridge_tile_cache_entry_t *next = e->bucket_next;
+                if (e->key.file_id == file_id)
+                {
+                    tile_cache_remove(shard, e);
+                    shard->stats.invalidations++;
+                }
+                e = next;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void bfbridge_tile_cache_get_stats(
+    bfbridge_tile_cache_t *cache, bfbridge_tile_cache_stats_t *dest)
+{
+    struct bfbridge_tile_cache_internal *c = cache->internal;
+    memset(dest, 0, sizeof(bfbridge_tile_cache_stats_t));
+    for (int i = 0; i < c->shard_count; i++)
+    {
+        bfbridge_tile_cache_shard_t *shard = &c->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        dest->hits += shard->stats.hits;
+        dest->misses += shard->stats.misses;
+        dest->insertions += shard->stats.insertions;
+        dest->evictions += shard->stats.evictions;
+        dest->invalidations += shard->stats.invalidations;
+        dest->bytes += shard->stats.bytes;
+        dest->entries += shard->stats.entries;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+int bf_open_bytes_cached(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_tile_cache_t *cache, const bfbridge_tile_key_t *key)
+{
+    unsigned long long start = stats_start();
+    int len;
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    len = bfbridge_tile_cache_get(
+        cache, key, instance->communication_buffer, instance->communication_buffer_len);
+    if (len >= 0)
+    {
+        return stats_end_Int(BFBRIDGE_STATS_OPEN_BYTES_CACHED, 1, start, len);
+    }
+#else
+    // A tile that another instance cached may not fit this buffer
+#endif
+    len = bf_open_bytes(instance, thread, key->plane, key->x, key->y, key->w, key->h);
+    if (len >= 0)
+    {
+        bfbridge_tile_cache_put(cache, key, instance->communication_buffer, len);
+    }
+    return stats_end_Int(BFBRIDGE_STATS_OPEN_BYTES_CACHED, 1, start, len);
+}
+
+// Tiler
+
+bfbridge_error_t *bfbridge_make_tiler(
+    bfbridge_tiler_t *tiler, bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int series, int tile_size, int overlap)
+{
+    tiler->resolution_sizes = NULL;
+    if (tile_size <= 0 || overlap < 0 || series < 0)
+    {
+        return make_error(BFBRIDGE_INVALID_TILER_PARAMETERS, "bfbridge_make_tiler: tile_size must be positive and overlap and series nonnegative", NULL);
+    }
+    if (bf_set_current_series(instance, thread, series) < 0)
+    {
+        return make_error(BFBRIDGE_TILER_LAYOUT_FAILED, "bfbridge_make_tiler: could not set the series: ", bf_get_error_convenience(instance, thread));
+    }
+    int is_interleaved = bf_is_interleaved(instance, thread);
+    int is_little_endian = bf_is_little_endian(instance, thread);
+    int len = bf_get_pyramid_layout(instance, thread);
+    if (is_interleaved < 0 || is_little_endian < 0 || len < 0)
+    {
+        return make_error(BFBRIDGE_TILER_LAYOUT_FAILED, "bfbridge_make_tiler: could not read the pyramid: ", bf_get_error_convenience(instance, thread));
+    }
+    bfbridge_pyramid_level_t *levels = (bfbridge_pyramid_level_t *)instance->communication_buffer;
+    int level_count = len / (int)sizeof(bfbridge_pyramid_level_t);
+    int first = -1;
+    int count = 0;
+    for (int i = 0; i < level_count; i++)
+    {
+        if (levels[i].series == series)
+        {
+            first = first < 0 ? i : first;
+            count++;
+        }
+    }
+    if (count == 0)
+    {
+        return make_error(BFBRIDGE_TILER_LAYOUT_FAILED, "bfbridge_make_tiler: the series has no resolutions", NULL);
+    }
+    int *sizes = (int *)malloc(sizeof(int) * 2 * count);
+    if (!sizes)
+    {
+        return make_error(BFBRIDGE_OUT_OF_MEMORY_ERROR, "bfbridge_make_tiler: out of memory", NULL);
+    }
+    for (int r = 0; r < count; r++)
+    {
+        sizes[2 * r] = levels[first + r].size_x;
+        sizes[2 * r + 1] = levels[first + r].size_y;
+    }
+    tiler->series = series;
+    tiler->tile_size = tile_size;
+    tiler->overlap = overlap;
+    tiler->size_x = sizes[0];
+    tiler->size_y = sizes[1];
+    tiler->pixel_type = levels[first].pixel_type;
+    tiler->rgb_channel_count = levels[first].rgb_channel_count;
+    // https://github.com/ome/bioformats/blob/9cb6cfaaa5361bc/components/formats-api/src/loci/formats/FormatTools.java#L98
+    static const int bytes_per_sample[] = {1, 1, 2, 2, 4, 4, 4, 8, 1};
+    tiler->bytes_per_sample = tiler->pixel_type >= 0 && tiler->pixel_type <= 8
+                                  ? bytes_per_sample[tiler->pixel_type]
+                                  : 1;
+    tiler->is_interleaved = is_interleaved;
+    tiler->is_little_endian = is_little_endian;
+    tiler->resolution_count = count;
+    tiler->resolution_sizes = sizes;
+    tiler->current_resolution = 0;
+    int largest = tiler->size_x > tiler->size_y ? tiler->size_x : tiler->size_y;
+    tiler->level_count = 1;
+    while (largest > 1)
+    {
+        largest = (largest + 1) / 2;
+        tiler->level_count++;
+    }
+    return NULL;
+}
+
+void bfbridge_free_tiler(bfbridge_tiler_t *tiler)
+{
+    free(tiler->resolution_sizes);
+    tiler->resolution_sizes = NULL;
+}
+
+int bfbridge_tiler_get_level_size(
+    const bfbridge_tiler_t *tiler, int level,
+    int *w, int *h, int *columns, int *rows)
+{
+    if (level < 0 || level >= tiler->level_count)
+    {
+        return -1;
+    }
+    int shift = tiler->level_count - 1 - level;
+    long long factor = 1ll << shift;
+    *w = (int)((tiler->size_x + factor - 1) >> shift);
+    *h = (int)((tiler->size_y + factor - 1) >> shift);
+    *columns = (*w + tiler->tile_size - 1) / tiler->tile_size;
+    *rows = (*h + tiler->tile_size - 1) / tiler->tile_size;
+    return 0;
+}
+
+int bfbridge_tiler_get_tile_rect(
+    const bfbridge_tiler_t *tiler, int level, int column, int row,
+    int *x, int *y, int *w, int *h)
+{
+    int level_w, level_h, columns, rows;
+    if (bfbridge_tiler_get_level_size(tiler, level, &level_w, &level_h, &columns, &rows) < 0 ||
+        column < 0 || row < 0 || column >= columns || row >= rows)
+    {
+        return -1;
+    }
+    int t = tiler->tile_size;
+    int left = column > 0 ? tiler->overlap : 0;
+    int top = row > 0 ? tiler->overlap : 0;
+    int right = column < columns - 1 ? tiler->overlap : 0;
+    int bottom = row < rows - 1 ? tiler->overlap : 0;
+    *x = column * t - left;
+    *y = row * t - top;
+    *w = (level_w - column * t < t ? level_w - column * t : t) + left + right;
+    *h = (level_h - row * t < t ? level_h - row * t : t) + top + bottom;
+    return 0;
+}
+
+// Near integer ratios are made integers so that a pyramid whose
+// sizes were rounded still copies or box-filters exactly
+static double tiler_snap(double ratio)
+{
+    double rounded = (double)(long long)(ratio + 0.5);
+    if (rounded >= 1 && (ratio - rounded < 0.01 * ratio && rounded - ratio < 0.01 * ratio))
+    {
+        return rounded;
+    }
+    return ratio;
+}
+
+// The source pixels of each output pixel along an axis:
+// first[o] to first[o] + count[o] - 1 with weights[o * stride + i],
+// summing to weight_sum[o]
+typedef struct bfbridge_tiler_axis
+{
+    int *first;
+    int *count;
+    double *weights;
+    double *weight_sum;
+    int stride;
+    // Source pixels needed
+    int start;
+    int end;
+} bfbridge_tiler_axis_t;
+
+// Output pixel o covers [origin + o * ratio, origin + (o + 1) * ratio)
+// of the source, clipped to limit and to the source length
+static int tiler_make_axis(
+    bfbridge_tiler_axis_t *axis, double origin, double ratio, int out_len,
+    double limit, int source_len)
+{
+    axis->stride = (int)ratio + 3;
+    axis->first = (int *)malloc(sizeof(int) * 2 * out_len);
+    axis->weights = (double *)malloc(sizeof(double) * ((size_t)out_len * axis->stride + out_len));
+    if (!axis->first || !axis->weights)
+    {
+        free(axis->first);
+        free(axis->weights);
+        axis->first = NULL;
+        axis->weights = NULL;
+        return -1;
+    }
+    axis->count = axis->first + out_len;
+    axis->weight_sum = axis->weights + (size_t)out_len * axis->stride;
+    if (limit > source_len)
+    {
+        limit = source_len;
+    }
+    axis->start = source_len;
+    axis->end = 0;
+    for (int o = 0; o < out_len; o++)
+    {
+        double a = origin + o * ratio;
+        double b = a + ratio;
+        a = a > 0 ? a : 0;
+        b = b < limit ? b : limit;
+        if (b <= a)
+        {
+            // Past the edge of a rounded down resolution: repeat the edge
+            int edge = (int)a < source_len ? (int)a : source_len - 1;
+            a = edge;
+            b = edge + 1;
+        }
+        int i0 = (int)a;
+        int i1 = (int)b;
+        i1 += i1 < b;
+        axis->first[o] = i0;
+        axis->count[o] = i1 - i0;
+        double sum = 0;
+        for (int i = i0; i < i1; i++)
+        {
+            double w = (i + 1 < b ? i + 1 : b) - (i > a ? i : a);
+            axis->weights[(size_t)o * axis->stride + i - i0] = w;
+            sum += w;
+        }
+        axis->weight_sum[o] = sum;
+        axis->start = i0 < axis->start ? i0 : axis->start;
+        axis->end = i1 > axis->end ? i1 : axis->end;
+    }
+    return 0;
+}
+
+static void tiler_free_axis(bfbridge_tiler_axis_t *axis)
+{
+    free(axis->first);
+    free(axis->weights);
+}
+
+static double tiler_get_sample(const unsigned char *p, int pixel_type, int little_endian)
+{
+    int bytes = pixel_type == 2 || pixel_type == 3 ? 2 : (pixel_type >= 4 && pixel_type <= 6 ? 4 : (pixel_type == 7 ? 8 : 1));
+    unsigned long long bits = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        bits |= (unsigned long long)p[little_endian ? i : bytes - 1 - i] << (8 * i);
+    }
+    switch (pixel_type)
+    {
+    case 0:
+        return (signed char)bits;
+    case 2:
+        return (short)bits;
+    case 4:
+        return (int)(unsigned int)bits;
+    case 6:
+    {
+        unsigned int b32 = (unsigned int)bits;
+        float f;
+        memcpy(&f, &b32, sizeof(f));
+        return f;
+    }
+    case 7:
+    {
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        return d;
+    }
+    default:
+        return (double)bits;
+    }
+}
+
+// Rounds and clamps to the range of integer types
+static void tiler_put_sample(unsigned char *p, int pixel_type, int little_endian, double value)
+{
+    static const double min[] = {-128, 0, -32768, 0, -2147483648.0, 0};
+    static const double max[] = {127, 255, 32767, 65535, 2147483647.0, 4294967295.0};
+    int bytes = pixel_type == 2 || pixel_type == 3 ? 2 : (pixel_type >= 4 && pixel_type <= 6 ? 4 : (pixel_type == 7 ? 8 : 1));
+    unsigned long long bits;
+    if (pixel_type == 6)
+    {
+        float f = (float)value;
+        unsigned int b32;
+        memcpy(&b32, &f, sizeof(b32));
+        bits = b32;
+    }
+    else if (pixel_type == 7)
+    {
+        memcpy(&bits, &value, sizeof(bits));
+    }
+    else
+    {
+        int t = pixel_type == 8 ? 1 : pixel_type;
+        value = value > min[t] ? value : min[t];
+        value = value < max[t] ? value : max[t];
+        long long rounded = value >= 0 ? (long long)(value + 0.5) : -(long long)(-value + 0.5);
+        bits = (unsigned long long)rounded;
+    }
+    for (int i = 0; i < bytes; i++)
+    {
+        p[little_endian ? i : bytes - 1 - i] = (unsigned char)(bits >> (8 * i));
+    }
+}
+
+// Writes out_w x out_h pixels, pixel (ox, oy) covering
+// [x0 + ox * scale_x, x0 + (ox + 1) * scale_x) horizontally (and the same
+// vertically) of the largest resolution, clipped to the image
+static int tiler_read_scaled(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_tiler_t *tiler, int plane, double x0, double y0,
+    double scale_x, double scale_y, int out_w, int out_h)
+{
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    long long buffer_len = instance->communication_buffer_len;
+#else
+    // Java checks every read, and the output is checked against them below
+    long long buffer_len = 0x7fffffff;
+    long long read_len = 0;
+#endif
+    int channels = tiler->rgb_channel_count;
+    int bytes = tiler->bytes_per_sample;
+    long long pixel_bytes = (long long)channels * bytes;
+    long long out_bytes = (long long)out_w * out_h * pixel_bytes;
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    if (out_bytes > buffer_len && instance_grow_buffer(instance, thread, out_bytes))
+    {
+        buffer_len = instance->communication_buffer_len;
+    }
+    if (out_bytes > buffer_len)
+    {
+        instance->communication_buffer_required =
+            out_bytes > 0x7fffffff ? 0x7fffffff : (int)out_bytes;
+        return -2;
+    }
+#else
+    if (out_bytes > buffer_len)
+    {
+        return -2;
+    }
+#endif
+
+    // The smallest resolution at least as detailed, within rounding
+    int resolution = 0;
+    for (int r = 1; r < tiler->resolution_count; r++)
+    {
+        double downsample_x = (double)tiler->size_x / tiler->resolution_sizes[2 * r];
+        double downsample_y = (double)tiler->size_y / tiler->resolution_sizes[2 * r + 1];
+        if (downsample_x <= scale_x * 1.01 && downsample_y <= scale_y * 1.01 &&
+            tiler->resolution_sizes[2 * r] < tiler->resolution_sizes[2 * resolution])
+        {
+            resolution = r;
+        }
+    }
+    int res_w = tiler->resolution_sizes[2 * resolution];
+    int res_h = tiler->resolution_sizes[2 * resolution + 1];
+    int code = bf_set_current_series(instance, thread, tiler->series);
+    if (code >= 0)
+    {
+        code = bf_set_current_resolution(instance, thread, resolution);
+    }
+    if (code < 0)
+    {
+        return code;
+    }
+    tiler->current_resolution = resolution;
+
+    // Source pixels per output pixel
+    double ratio_x = tiler_snap(scale_x * res_w / tiler->size_x);
+    double ratio_y = tiler_snap(scale_y * res_h / tiler->size_y);
+    // Largest resolution pixels per source pixel
+    double downsample_x = scale_x / ratio_x;
+    double downsample_y = scale_y / ratio_y;
+    double origin_x = x0 / downsample_x;
+    double origin_y = y0 / downsample_y;
+
+    if (ratio_x == 1 && ratio_y == 1 && origin_x == (int)origin_x && origin_y == (int)origin_y &&
+        origin_x + out_w <= res_w && origin_y + out_h <= res_h)
+    {
+        return bf_open_bytes(instance, thread, plane, (int)origin_x, (int)origin_y, out_w, out_h);
+    }
+
+    bfbridge_tiler_axis_t ax = {0};
+    bfbridge_tiler_axis_t ay = {0};
+    double *sums = (double *)calloc((size_t)out_w * out_h * channels, sizeof(double));
+    double *row_sums = (double *)malloc(sizeof(double) * out_w * channels);
+    if (!sums || !row_sums ||
+        tiler_make_axis(&ax, origin_x, ratio_x, out_w, tiler->size_x / downsample_x, res_w) < 0 ||
+        tiler_make_axis(&ay, origin_y, ratio_y, out_h, tiler->size_y / downsample_y, res_h) < 0)
+    {
+        free(sums);
+        free(row_sums);
+        tiler_free_axis(&ax);
+        tiler_free_axis(&ay);
+        return -3;
+    }
+
+    // Read in strips of rows that fit the buffer
+    int region_w = ax.end - ax.start;
+    long long row_bytes = region_w * pixel_bytes;
+    int strip_h = (int)(buffer_len / row_bytes);
+    code = strip_h > 0 ? 0 : -2;
+    int first_out_row = 0;
+    for (int strip_y = ay.start; code >= 0 && strip_y < ay.end; strip_y += strip_h)
+    {
+        int h = ay.end - strip_y < strip_h ? ay.end - strip_y : strip_h;
+        code = bf_open_bytes(instance, thread, plane, ax.start, strip_y, region_w, h);
+        if (code < 0)
+        {
+            break;
+        }
+#ifdef BFBRIDGE_KNOW_BUFFER_LEN
+        read_len = code > read_len ? code : read_len;
+#endif
+        const unsigned char *strip = (const unsigned char *)instance->communication_buffer;
+        for (int y = 0; y < h; y++)
+        {
+            int source_y = strip_y + y;
+            // Horizontal pass of this row
+            for (int ox = 0; ox < out_w; ox++)
+            {
+                for (int c = 0; c < channels; c++)
+                {
+                    double sum = 0;
+                    for (int i = 0; i < ax.count[ox]; i++)
+                    {
+                        int x = ax.first[ox] + i - ax.start;
+                        size_t sample = tiler->is_interleaved
+                                            ? ((size_t)y * region_w + x) * channels + c
+                                            : ((size_t)c * h + y) * region_w + x;
+                        sum += ax.weights[(size_t)ox * ax.stride + i] *
+                               tiler_get_sample(strip + sample * bytes, tiler->pixel_type, tiler->is_little_endian);
+                    }
+                    row_sums[ox * channels + c] = sum;
+                }
+            }
+            // Added to the output rows covering it
+            while (first_out_row < out_h && ay.first[first_out_row] + ay.count[first_out_row] <= source_y)
+            {
+                first_out_row++;
+            }
+            for (int oy = first_out_row; oy < out_h && ay.first[oy] <= source_y; oy++)
+            {
+                if (source_y >= ay.first[oy] + ay.count[oy])
+                {
+                    continue;
+                }
+                double w = ay.weights[(size_t)oy * ay.stride + source_y - ay.first[oy]];
+                double *out = sums + (size_t)oy * out_w * channels;
+                for (int i = 0; i < out_w * channels; i++)
+                {
+                    out[i] += w * row_sums[i];
+                }
+            }
+        }
+    }
+#ifdef BFBRIDGE_KNOW_BUFFER_LEN
+    // The buffer is known to hold only what Java wrote to it, which an
+    // upscaled output can exceed
+    if (code >= 0 && out_bytes > read_len)
+    {
+        code = -2;
+    }
+#endif
+
+    if (code >= 0)
+    {
+        // Same layout and byte order as bf_open_bytes
+        unsigned char *dest = (unsigned char *)instance->communication_buffer;
+        for (int oy = 0; oy < out_h; oy++)
+        {
+            for (int ox = 0; ox < out_w; ox++)
+            {
+                double weight = ax.weight_sum[ox] * ay.weight_sum[oy];
+                size_t pixel = (size_t)oy * out_w + ox;
+                for (int c = 0; c < channels; c++)
+                {
+                    size_t sample = tiler->is_interleaved ? pixel * channels + c
+                                                          : (size_t)c * out_w * out_h + pixel;
+                    tiler_put_sample(dest + sample * bytes, tiler->pixel_type, tiler->is_little_endian,
+                                     sums[pixel * channels + c] / weight);
+                }
+            }
+        }
+        code = (int)((long long)out_w * out_h * pixel_bytes);
+    }
+    free(sums);
+    free(row_sums);
+    tiler_free_axis(&ax);
+    tiler_free_axis(&ay);
+    return code;
+}
+
+int bf_open_deepzoom_tile(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_tiler_t *tiler, int plane, int level, int column, int row)
+{
+    unsigned long long start = stats_start();
+    int x, y, w, h;
+    if (bfbridge_tiler_get_tile_rect(tiler, level, column, row, &x, &y, &w, &h) < 0)
+    {
+        return stats_end_Int(BFBRIDGE_STATS_OPEN_DEEPZOOM_TILE, 1, start, -3);
+    }
+    double scale = (double)(1ll << (tiler->level_count - 1 - level));
+    return stats_end_Int(BFBRIDGE_STATS_OPEN_DEEPZOOM_TILE, 1, start,
+                         tiler_read_scaled(instance, thread, tiler, plane,
+                                           x * scale, y * scale, scale, scale, w, h));
+}
+
+int bf_open_iiif_region(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_tiler_t *tiler, int plane, int x, int y, int w, int h,
+    int out_w, int out_h)
+{
+    unsigned long long start = stats_start();
+    if (x < 0 || y < 0 || x >= tiler->size_x || y >= tiler->size_y ||
+        w <= 0 || h <= 0 || out_w <= 0 || out_h <= 0)
+    {
+        return stats_end_Int(BFBRIDGE_STATS_OPEN_IIIF_REGION, 1, start, -3);
+    }
+    w = w < tiler->size_x - x ? w : tiler->size_x - x;
+    h = h < tiler->size_y - y ? h : tiler->size_y - y;
+    return stats_end_Int(BFBRIDGE_STATS_OPEN_IIIF_REGION, 1, start,
+                         tiler_read_scaled(instance, thread, tiler, plane, x, y,
+                                           (double)w / out_w, (double)h / out_h, out_w, out_h));
+}
+
+// Streaming reads
+
+// How a region is split into strips of a row of tiles, and strips into
+// parts of part_w columns aligned to multiples of part_w
+typedef struct region_stream_layout
+{
+    int x;
+    int y;
+    int w;
+    int h;
+    int tile_h;
+    int part_w;
+    int samples;
+    int sample_bytes;
+    int is_interleaved;
+    int pixel_bytes;
+    int strip_count;
+    // Of the tallest strip
+    int strip_len;
+} region_stream_layout_t;
+
+// The index-th piece of start to start + len - 1 cut at multiples of step
+static void region_stream_span(
+    int start, int len, int step, int index, int *piece_start, int *piece_len)
+{
+    long long begin = (long long)(start / step + index) * step;
+    long long end = begin + step;
+    begin = begin > start ? begin : start;
+    end = end < (long long)start + len ? end : (long long)start + len;
+    *piece_start = (int)begin;
+    *piece_len = (int)(end - begin);
+}
+
+static int region_stream_span_count(int start, int len, int step)
+{
+    return (int)(((long long)start + len - 1) / step - start / step + 1);
+}
+
+// Parts are as wide as fits capacity bytes, but split a strip into at
+// least min_parts when it has enough tiles, for reading them in parallel
+// returns: 0, -2 if a tile does not fit capacity, or -3 if the region
+// is out of the image or a strip is over 2 GB
+static int region_stream_plan(
+    region_stream_layout_t *layout, int size_x, int size_y,
+    int x, int y, int w, int h, int tile_w, int tile_h,
+    int samples, int sample_bytes, int is_interleaved,
+    long long capacity, int min_parts)
+{
+    if (x < 0 || y < 0 || w <= 0 || h <= 0 ||
+        (long long)x + w > size_x || (long long)y + h > size_y)
+    {
+        return -3;
+    }
+    tile_w = tile_w > 0 ? tile_w : w;
+    tile_h = tile_h > 0 ? tile_h : h;
+    long long pixel_bytes = (long long)samples * sample_bytes;
+    int strip_h = tile_h < h ? tile_h : h;
+    long long tile_len = (long long)tile_w * strip_h * pixel_bytes;
+    long long strip_len = (long long)w * strip_h * pixel_bytes;
+    if (tile_len > capacity)
+    {
+        return -2;
+    }
+    if (pixel_bytes <= 0 || strip_len > INT_MAX)
+    {
+        return -3;
+    }
+    long long columns = capacity / tile_len;
+    int strip_columns = region_stream_span_count(x, w, tile_w);
+    if (min_parts > 1)
+    {
+        int spread = (strip_columns + min_parts - 1) / min_parts;
+        columns = columns < spread ? columns : spread;
+    }
+    columns = columns < strip_columns ? columns : strip_columns;
+    layout->x = x;
+    layout->y = y;
+    layout->w = w;
+    layout->h = h;
+    layout->tile_h = tile_h;
+    layout->part_w = (int)columns * tile_w;
+    layout->samples = samples;
+    layout->sample_bytes = sample_bytes;
+    layout->is_interleaved = is_interleaved;
+    layout->pixel_bytes = (int)pixel_bytes;
+    layout->strip_count = region_stream_span_count(y, h, tile_h);
+    layout->strip_len = (int)strip_len;
+    return 0;
+}
+
+// Copies a part, as bf_open_bytes returns it, to its place in the strip
+static void region_stream_copy_part(
+    const region_stream_layout_t *layout, char *strip, int strip_h,
+    const char *part, int offset_x, int part_w)
+{
+    // Non interleaved images have a plane of each sample after another
+    int planes = layout->is_interleaved ? 1 : layout->samples;
+    size_t pixel = layout->is_interleaved ? (size_t)layout->pixel_bytes
+                                          : (size_t)layout->sample_bytes;
+    for (int p = 0; p < planes; p++)
+    {
+        for (int row = 0; row < strip_h; row++)
+        {
+            memcpy(strip + (((size_t)p * strip_h + row) * layout->w + offset_x) * pixel,
+                   part + ((size_t)p * strip_h + row) * part_w * pixel,
+                   part_w * pixel);
+        }
+    }
+}
+
+static void region_stream_describe_strip(
+    const region_stream_layout_t *layout, int index, char *data,
+    bfbridge_region_strip_t *strip)
+{
+    strip->x = layout->x;
+    strip->w = layout->w;
+    region_stream_span(layout->y, layout->h, layout->tile_h, index, &strip->y, &strip->h);
+    strip->index = index;
+    strip->count = layout->strip_count;
+    strip->data = data;
+    strip->len = layout->w * strip->h * layout->pixel_bytes;
+}
+
+#ifdef BFBRIDGE_KNOW_BUFFER_LEN
+int bf_read_region_stream(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int plane, int x, int y, int w, int h,
+    bfbridge_region_sink_t sink, void *user_data)
+{
+    // Parts can't be planned without the buffer length
+    (void)instance;
+    (void)thread;
+    (void)plane;
+    (void)x;
+    (void)y;
+    (void)w;
+    (void)h;
+    (void)sink;
+    (void)user_data;
+    return -3;
+}
+#else
+// Hands strips to the sink on its own thread. Strip i is in strips[i % 2]
+typedef struct region_stream_sink_thread
+{
+    pthread_mutex_t lock;
+    // Signaled when a strip is given or done, or when finished
+    pthread_cond_t cond;
+    bfbridge_region_strip_t strips[2];
+    int given;
+    int done;
+    // No strips will be given anymore
+    int finished;
+    // The sink returned nonzero. Strips given after are skipped
+    int stopped;
+    // Strips the sink was called with
+    int sunk;
+    bfbridge_region_sink_t sink;
+    void *user_data;
+} region_stream_sink_thread_t;
+
+static void *region_stream_sink_main(void *arg)
+{
+    region_stream_sink_thread_t *t = (region_stream_sink_thread_t *)arg;
+    pthread_mutex_lock(&t->lock);
+    while (1)
+    {
+        while (t->done == t->given && !t->finished)
+        {
+            pthread_cond_wait(&t->cond, &t->lock);
+        }
+        if (t->done == t->given)
+        {
+            break;
+        }
+        bfbridge_region_strip_t *strip = &t->strips[t->done % 2];
+        int stopped = t->stopped;
+        pthread_mutex_unlock(&t->lock);
+        int stop = stopped || t->sink(strip, t->user_data);
+        pthread_mutex_lock(&t->lock);
+        t->sunk += !stopped;
+        t->stopped = stop;
+        t->done++;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+// returns: 0 or the negative result of bf_open_bytes
+static int region_stream_read_strip(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    const region_stream_layout_t *layout, int plane, int index,
+    char *data, bfbridge_region_strip_t *strip)
+{
+    region_stream_describe_strip(layout, index, data, strip);
+    int part_count = region_stream_span_count(layout->x, layout->w, layout->part_w);
+    for (int j = 0; j < part_count; j++)
+    {
+        int part_x, part_w;
+        region_stream_span(layout->x, layout->w, layout->part_w, j, &part_x, &part_w);
+        int len = bf_open_bytes(instance, thread, plane, part_x, strip->y, part_w, strip->h);
+        if (len < 0)
+        {
+            return len;
+        }
+        if (len < part_w * strip->h * layout->pixel_bytes)
+        {
+            return -1;
+        }
+        // After the call, as the buffer may have grown
+        region_stream_copy_part(layout, data, strip->h, instance->communication_buffer,
+                                part_x - layout->x, part_w);
+    }
+    return 0;
+}
+
+int bf_read_region_stream(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int plane, int x, int y, int w, int h,
+    bfbridge_region_sink_t sink, void *user_data)
+{
+    int size_x = bf_get_size_x(instance, thread);
+    int size_y = bf_get_size_y(instance, thread);
+    int tile_w = bf_get_optimal_tile_width(instance, thread);
+    int tile_h = bf_get_optimal_tile_height(instance, thread);
+    int samples = bf_get_rgb_channel_count(instance, thread);
+    int sample_bytes = bf_get_bytes_per_pixel(instance, thread);
+    int is_interleaved = bf_is_interleaved(instance, thread);
+    if (size_x < 0 || size_y < 0 || tile_w < 0 || tile_h < 0 ||
+        samples < 0 || sample_bytes < 0 || is_interleaved < 0)
+    {
+        return -1;
+    }
+    long long capacity = instance->communication_buffer_max_len > 0
+                             ? instance->communication_buffer_max_len
+                             : instance->communication_buffer_len;
+    region_stream_layout_t layout;
+    int planned = region_stream_plan(&layout, size_x, size_y, x, y, w, h, tile_w, tile_h,
+                                     samples, sample_bytes, is_interleaved, capacity, 1);
+    if (planned < 0)
+    {
+        return planned;
+    }
+
+    char *buffers[2];
+    buffers[0] = (char *)malloc(layout.strip_len);
+    buffers[1] = (char *)malloc(layout.strip_len);
+    region_stream_sink_thread_t t;
+    memset(&t, 0, sizeof(t));
+    t.sink = sink;
+    t.user_data = user_data;
+    pthread_t sink_thread;
+    if (!buffers[0] || !buffers[1])
+    {
+        free(buffers[0]);
+        free(buffers[1]);
+        return -3;
+    }
+    pthread_mutex_init(&t.lock, NULL);
+    pthread_cond_init(&t.cond, NULL);
+    if (pthread_create(&sink_thread, NULL, region_stream_sink_main, &t) != 0)
+    {
+        pthread_cond_destroy(&t.cond);
+        pthread_mutex_destroy(&t.lock);
+        free(buffers[0]);
+        free(buffers[1]);
+        return -3;
+    }
+
+    int result = 0;
+    for (int i = 0; i < layout.strip_count; i++)
+    {
+        // Until the strip that used this buffer is done
+        pthread_mutex_lock(&t.lock);
+        while (t.given - t.done >= 2 && !t.stopped)
+        {
+            pthread_cond_wait(&t.cond, &t.lock);
+        }
+        int stopped = t.stopped;
+        pthread_mutex_unlock(&t.lock);
+        if (stopped)
+        {
+            break;
+        }
+        result = region_stream_read_strip(instance, thread, &layout, plane, i,
+                                          buffers[i % 2], &t.strips[i % 2]);
+        if (result < 0)
+        {
+            break;
+        }
+        pthread_mutex_lock(&t.lock);
+        t.given++;
+        pthread_cond_broadcast(&t.cond);
+        pthread_mutex_unlock(&t.lock);
+    }
+
+    pthread_mutex_lock(&t.lock);
+    t.finished = 1;
+    pthread_cond_broadcast(&t.cond);
+    pthread_mutex_unlock(&t.lock);
+    pthread_join(sink_thread, NULL);
+    pthread_cond_destroy(&t.cond);
+    pthread_mutex_destroy(&t.lock);
+    free(buffers[0]);
+    free(buffers[1]);
+    return result < 0 ? result : t.sunk;
+}
+#endif
+
+// Reader pool
+
+typedef struct bfbridge_pool_deque
+{
+    pthread_mutex_t lock;
+    // Ring buffer of len items out of cap, beginning from head
+    bfbridge_pool_request_t **items;
+    int head;
+    int len;
+    int cap;
+} bfbridge_pool_deque_t;
+
+typedef struct bfbridge_pool_worker
+{
+    struct bfbridge_pool_internal *pool;
+    int index;
+    pthread_t pthread;
+    // The owner takes from the back, others steal from the front
+    bfbridge_pool_deque_t queue;
+} bfbridge_pool_worker_t;
+
+// Initial and idle communication buffer length of workers
+#define POOL_IDLE_BUFFER_LEN (1 << 20)
+// Idle time after which a worker shrinks its buffer back to that
+#define POOL_IDLE_SHRINK_SECONDS 1
+
+// Viewers, as file, series and plane, whose requests are followed
+#define POOL_PREFETCH_STREAMS 16
+// Files and series whose resolution sizes are kept
+#define POOL_PREFETCH_LAYOUTS 16
+// Prefetched tiles followed for hit and waste counts, per max_queued
+#define POOL_PREFETCH_TRACKED_PER_QUEUED 8
+// The readahead depth is adapted after this many prefetched tiles
+// were requested or forgotten
+#define POOL_PREFETCH_ADAPT_EVERY 32
+// Requests of a viewer whose surroundings predictions must be in to
+// stay queued, for the tiles of a viewport
+#define POOL_PREFETCH_RECENT 16
+// Bounds of bfbridge_prefetch_config_t
+#define POOL_PREFETCH_MAX_RINGS 3
+#define POOL_PREFETCH_MAX_READAHEAD 16
+// Tiles of the next resolution under a tile, as with 4x steps
+#define POOL_PREFETCH_MAX_ZOOM_TILES 16
+#define POOL_PREFETCH_MAX_CANDIDATES                                          \
+    ((2 * POOL_PREFETCH_MAX_RINGS + 1) * (2 * POOL_PREFETCH_MAX_RINGS + 1) + \
+     3 * POOL_PREFETCH_MAX_READAHEAD + POOL_PREFETCH_MAX_ZOOM_TILES)
+
+typedef struct bfbridge_pool_prefetch_stream
+{
+    // Owned. NULL if unused
+    char *filepath;
+    int filepath_len;
+    long long file_id;
+    int series;
+    int plane;
+    // Of the last request
+    int resolution;
+    // Of requests not clipped at the right or bottom edge; 0 if none yet
+    int tile_w;
+    int tile_h;
+    // Smoothed center of requests at resolution, and its velocity
+    // per request, in pixels
+    double center_x;
+    double center_y;
+    double velocity_x;
+    double velocity_y;
+    // Positions of the latest requests at resolution, a ring buffer
+    int recent_x[POOL_PREFETCH_RECENT];
+    int recent_y[POOL_PREFETCH_RECENT];
+    int recent_len;
+    int recent_next;
+    unsigned long long last_used;
+} bfbridge_pool_prefetch_stream_t;
+
+typedef struct bfbridge_pool_prefetch_layout
+{
+    long long file_id;
+    int series;
+    int resolution_count;
+    // Width then height of each resolution, owned. NULL if unused
+    int *sizes;
+    unsigned long long last_used;
+} bfbridge_pool_prefetch_layout_t;
+
+typedef struct bfbridge_pool_prefetch_item
+{
+    bfbridge_tile_key_t key;
+    // Index in streams, whose filepath it is
+    int stream;
+} bfbridge_pool_prefetch_item_t;
+
+typedef struct bfbridge_pool_prefetch_tracked
+{
+    bfbridge_tile_key_t key;
+    unsigned long long hash;
+    // Requested since prefetched
+    int resolved;
+} bfbridge_pool_prefetch_tracked_t;
+
+// Protected by the pool lock
+struct bfbridge_pool_prefetch
+{
+    int enabled;
+    bfbridge_prefetch_config_t config;
+    // Taken from the end, where the latest predictions are, in order
+    bfbridge_pool_prefetch_item_t *queue;
+    int queue_len;
+    int queue_cap;
+    // Workers decoding a prediction
+    int running;
+    // Ring buffer of the latest prefetched tiles, oldest at tracked_head
+    bfbridge_pool_prefetch_tracked_t *tracked;
+    int tracked_head;
+    int tracked_len;
+    int tracked_cap;
+    bfbridge_pool_prefetch_stream_t streams[POOL_PREFETCH_STREAMS];
+    bfbridge_pool_prefetch_layout_t layouts[POOL_PREFETCH_LAYOUTS];
+    unsigned long long use_counter;
+    int adapt_hits;
+    int adapt_count;
+    bfbridge_prefetch_stats_t stats;
+};
+
+struct bfbridge_pool_internal
+{
+    bfbridge_vm_t *vm;
+    int communication_buffer_len;
+    int worker_count;
+    bfbridge_pool_worker_t *workers;
+
+    // Protects the fields below and the done field of requests
+    pthread_mutex_t lock;
+    // Signaled when requests are queued or when stopping
+    pthread_cond_t work_cond;
+    // Signaled when a request is done or a worker has started
+    pthread_cond_t done_cond;
+    // Requests in queues not yet taken by a worker
+    int queued;
+    // Threads in bfbridge_pool_wait
+    int waiters;
+    int started;
+    int stopping;
+    // The first worker initialization error
+    bfbridge_error_t *start_error;
+    // Round robin submission
+    unsigned int next_worker;
+    bfbridge_tile_cache_t *tile_cache;
+    // Completed asynchronous requests without a callback, oldest first
+    bfbridge_pool_request_t *completed_head;
+    bfbridge_pool_request_t *completed_tail;
+    // -1 until bfbridge_pool_get_completion_fd. The same fd with eventfd
+    int completion_read_fd;
+    int completion_write_fd;
+    // NULL until bfbridge_pool_set_prefetch, then kept until the pool is freed
+    struct bfbridge_pool_prefetch *prefetch;
+};
+
+// Caller holds q->lock. Returns 0 if out of memory
+static int pool_deque_push(
+    bfbridge_pool_deque_t *q, bfbridge_pool_request_t *request)
+{
+    if (q->len == q->cap)
+    {
+        int new_cap = q->cap ? q->cap * 2 : 64;
+        bfbridge_pool_request_t **items = (bfbridge_pool_request_t **)
+            malloc(new_cap * sizeof(bfbridge_pool_request_t *));
+        if (!items)
+        {
+            return 0;
+        }
+        for (int i = 0; i < q->len; i++)
+        {
+            items[i] = q->items[(q->head + i) % q->cap];
+        }
+        free(q->items);
+        q->items = items;
+        q->head = 0;
+        q->cap = new_cap;
+    }
+    q->items[(q->head + q->len) % q->cap] = request;
+    q->len++;
+    return 1;
+}
+
+static bfbridge_pool_request_t *pool_deque_take(
+    bfbridge_pool_deque_t *q, int from_front)
+{
+    bfbridge_pool_request_t *request = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->len > 0)
+    {
+        if (from_front)
+        {
+            request = q->items[q->head];
+            q->head = (q->head + 1) % q->cap;
+        }
+        else
+        {
+            request = q->items[(q->head + q->len - 1) % q->cap];
+        }
+        q->len--;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return request;
+}
+
+// Own queue first, then steal
+// Sets *tile_cache to the cache to use for the request,
+// and *prefetch to whether prefetching is enabled
+static bfbridge_pool_request_t *pool_take(
+    struct bfbridge_pool_internal *pool, int index,
+    bfbridge_tile_cache_t **tile_cache, int *prefetch)
+{
+    bfbridge_pool_request_t *request =
+        pool_deque_take(&pool->workers[index].queue, 0);
+    for (int i = 1; !request && i < pool->worker_count; i++)
+    {
+        request = pool_deque_take(
+            &pool->workers[(index + i) % pool->worker_count].queue, 1);
+    }
+    if (request)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        *tile_cache = pool->tile_cache;
+        *prefetch = pool->prefetch && pool->prefetch->enabled;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return request;
+}
+
+// What a worker's instance currently has open
+typedef struct bfbridge_pool_worker_state
+{
+    bfbridge_thread_t thread;
+    bfbridge_instance_t instance;
+    char *filepath;
+    int filepath_len;
+    int series;
+    int resolution;
+} bfbridge_pool_worker_state_t;
+
+// Opens the file and sets the series and resolution, unless the
+// worker's instance already has them
+static int pool_prepare_file(
+    bfbridge_pool_worker_state_t *state, char *filepath, int filepath_len,
+    int series, int resolution)
+{
+    bfbridge_instance_t *instance = &state->instance;
+    bfbridge_thread_t *thread = &state->thread;
+    int code;
+    if (!state->filepath || state->filepath_len != filepath_len ||
+        memcmp(state->filepath, filepath, filepath_len) != 0)
+    {
+        free(state->filepath);
+        state->filepath = NULL;
+        code = bf_open(instance, thread, filepath, filepath_len);
+        if (code < 0)
+        {
+            return code;
+        }
+        state->filepath = (char *)malloc(filepath_len);
+        if (state->filepath)
+        {
+            memcpy(state->filepath, filepath, filepath_len);
+        }
+        state->filepath_len = filepath_len;
+        state->series = -1;
+    }
+    if (state->series != series)
+    {
+        // Setting the series resets the resolution
+        state->resolution = -1;
+        code = bf_set_current_series(instance, thread, series);
+        if (code < 0)
+        {
+            state->series = -1;
+            return code;
+        }
+        state->series = series;
+    }
+    if (state->resolution != resolution)
+    {
+        code = bf_set_current_resolution(instance, thread, resolution);
+        if (code < 0)
+        {
+            state->resolution = -1;
+            return code;
+        }
+        state->resolution = resolution;
+    }
+    return 1;
+}
+
+// Prefetching
+
+// Caller holds the pool lock. Counts a prefetched tile requested (found
+// in the cache or not) or forgotten, and adapts the readahead depth
+static void pool_prefetch_outcome(struct bfbridge_pool_prefetch *prefetch, int hit)
+{
+    if (hit)
+    {
+        prefetch->stats.hits++;
+        prefetch->adapt_hits++;
+    }
+    else
+    {
+        prefetch->stats.wasted++;
+    }
+    if (++prefetch->adapt_count < POOL_PREFETCH_ADAPT_EVERY)
+    {
+        return;
+    }
+    if (prefetch->adapt_hits * 2 > prefetch->adapt_count &&
+        prefetch->stats.readahead < prefetch->config.max_readahead)
+    {
+        prefetch->stats.readahead++;
+    }
+    else if (prefetch->adapt_hits * 4 < prefetch->adapt_count &&
+             prefetch->stats.readahead > 1)
+    {
+        prefetch->stats.readahead--;
+    }
+    prefetch->adapt_hits = 0;
+    prefetch->adapt_count = 0;
+}
+
+// Caller holds the pool lock
+static void pool_prefetch_track(
+    struct bfbridge_pool_prefetch *prefetch, const bfbridge_tile_key_t *key)
+{
+    if (prefetch->tracked_cap == 0)
+    {
+        return;
+    }
+    if (prefetch->tracked_len == prefetch->tracked_cap)
+    {
+        if (!prefetch->tracked[prefetch->tracked_head].resolved)
+        {
+            pool_prefetch_outcome(prefetch, 0);
+        }
+        prefetch->tracked_head = (prefetch->tracked_head + 1) % prefetch->tracked_cap;
+        prefetch->tracked_len--;
+    }
+    bfbridge_pool_prefetch_tracked_t *t =
+        &prefetch->tracked[(prefetch->tracked_head + prefetch->tracked_len) % prefetch->tracked_cap];
+    t->key = *key;
+    t->hash = tile_cache_hash_key(key);
+    t->resolved = 0;
+    prefetch->tracked_len++;
+}
+
+// For a tile request, with whether the cache had the tile
+static void pool_prefetch_note_request(
+    struct bfbridge_pool_internal *pool, const bfbridge_tile_key_t *key, int hit)
+{
+    unsigned long long hash = tile_cache_hash_key(key);
+    pthread_mutex_lock(&pool->lock);
+    struct bfbridge_pool_prefetch *prefetch = pool->prefetch;
+    if (prefetch && prefetch->enabled)
+    {
+        prefetch->stats.requests++;
+        for (int i = 0; i < prefetch->tracked_len; i++)
+        {
+            bfbridge_pool_prefetch_tracked_t *t =
+                &prefetch->tracked[(prefetch->tracked_head + i) % prefetch->tracked_cap];
+            if (!t->resolved && t->hash == hash && tile_cache_key_equals(&t->key, key))
+            {
+                t->resolved = 1;
+                // Not in the cache: evicted before it was requested
+                pool_prefetch_outcome(prefetch, hit);
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Caller holds the pool lock. NULL if unknown
+static bfbridge_pool_prefetch_layout_t *pool_prefetch_layout(
+    struct bfbridge_pool_prefetch *prefetch, long long file_id, int series)
+{
+    for (int i = 0; i < POOL_PREFETCH_LAYOUTS; i++)
+    {
+        bfbridge_pool_prefetch_layout_t *l = &prefetch->layouts[i];
+        if (l->sizes && l->file_id == file_id && l->series == series)
+        {
+            l->last_used = ++prefetch->use_counter;
+            return l;
+        }
+    }
+    return NULL;
+}
+
+// Caller holds the pool lock. Whether a queued prediction is no longer
+// near what its viewer requests: at another resolution than the latest
+// request and the next more detailed one, or away from the latest
+// requests, comparing zoom-in predictions at the latest resolution.
+// Any prediction if stream_reused
+static int pool_prefetch_stale(
+    struct bfbridge_pool_prefetch *prefetch, const bfbridge_pool_prefetch_item_t *item,
+    int stream_reused)
+{
+    const bfbridge_pool_prefetch_stream_t *stream = &prefetch->streams[item->stream];
+    if (stream_reused)
+    {
+        return 1;
+    }
+    if (stream->tile_w <= 0 || stream->tile_h <= 0)
+    {
+        return 1;
+    }
+    int x = item->key.x;
+    int y = item->key.y;
+    int r = stream->resolution;
+    if (item->key.resolution == r - 1)
+    {
+        // Zoom-in predictions, at their position in resolution r
+        const bfbridge_pool_prefetch_layout_t *layout =
+            pool_prefetch_layout(prefetch, stream->file_id, stream->series);
+        if (!layout || r >= layout->resolution_count)
+        {
+            return 0;
+        }
+        x = (int)((double)x * layout->sizes[2 * r] / layout->sizes[2 * (r - 1)]);
+        y = (int)((double)y * layout->sizes[2 * r + 1] / layout->sizes[2 * (r - 1) + 1]);
+    }
+    else if (item->key.resolution != r)
+    {
+        return 1;
+    }
+    int reach = prefetch->config.neighbor_rings + prefetch->stats.readahead + 1;
+    for (int i = 0; i < stream->recent_len; i++)
+    {
+        int dx = (x - stream->recent_x[i]) / stream->tile_w;
+        int dy = (y - stream->recent_y[i]) / stream->tile_h;
+        if (dx <= reach && dx >= -reach && dy <= reach && dy >= -reach)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Caller holds the pool lock. Removes the stale queued predictions of a
+// stream, marking those in candidates (count of them) as queued (w = 0)
+static void pool_prefetch_reconcile(
+    struct bfbridge_pool_prefetch *prefetch, int stream,
+    bfbridge_tile_key_t *candidates, int count, int stream_reused)
+{
+    int kept = 0;
+    for (int i = 0; i < prefetch->queue_len; i++)
+    {
+        bfbridge_pool_prefetch_item_t *item = &prefetch->queue[i];
+        if (item->stream == stream)
+        {
+            int predicted = 0;
+            for (int j = 0; !stream_reused && j < count; j++)
+            {
+                if (candidates[j].w != 0 && tile_cache_key_equals(&candidates[j], &item->key))
+                {
+                    candidates[j].w = 0;
+                    predicted = 1;
+                    break;
+                }
+            }
+            if (!predicted && pool_prefetch_stale(prefetch, item, stream_reused))
+            {
+                prefetch->stats.cancelled++;
+                continue;
+            }
+        }
+        prefetch->queue[kept++] = *item;
+    }
+    prefetch->queue_len = kept;
+}
+
+// Caller holds the pool lock. A stream of the request's file,
+// series and plane, replacing the least recently used
+static int pool_prefetch_stream(
+    struct bfbridge_pool_prefetch *prefetch, const bfbridge_pool_request_t *request,
+    const bfbridge_tile_key_t *key)
+{
+    int victim = 0;
+    for (int i = 0; i < POOL_PREFETCH_STREAMS; i++)
+    {
+        bfbridge_pool_prefetch_stream_t *s = &prefetch->streams[i];
+        if (s->filepath && s->file_id == key->file_id && s->series == key->series &&
+            s->plane == key->plane && s->filepath_len == request->filepath_len &&
+            memcmp(s->filepath, request->filepath, request->filepath_len) == 0)
+        {
+            s->last_used = ++prefetch->use_counter;
+            return i;
+        }
+        if (!s->filepath ||
+            (prefetch->streams[victim].filepath && s->last_used < prefetch->streams[victim].last_used))
+        {
+            victim = i;
+        }
+    }
+    char *filepath = (char *)malloc(request->filepath_len > 0 ? request->filepath_len : 1);
+    if (!filepath)
+    {
+        return -1;
+    }
+    bfbridge_pool_prefetch_stream_t *s = &prefetch->streams[victim];
+    // Its predictions refer to its filepath
+    pool_prefetch_reconcile(prefetch, victim, NULL, 0, 1);
+    free(s->filepath);
+    memset(s, 0, sizeof(*s));
+    memcpy(filepath, request->filepath, request->filepath_len);
+    s->filepath = filepath;
+    s->filepath_len = request->filepath_len;
+    s->file_id = key->file_id;
+    s->series = key->series;
+    s->plane = key->plane;
+    s->resolution = -1;
+    s->last_used = ++prefetch->use_counter;
+    return victim;
+}
+
+// Reads the resolution sizes of the series of the request with the
+// worker's instance. Returns 0 if they could not be read
+static int pool_prefetch_load_layout(
+    struct bfbridge_pool_internal *pool, bfbridge_pool_worker_state_t *state,
+    const bfbridge_pool_request_t *request, long long file_id)
+{
+    if (pool_prepare_file(state, request->filepath, request->filepath_len,
+                          request->series, request->resolution) < 0)
+    {
+        return 0;
+    }
+    int len = bf_get_pyramid_layout(&state->instance, &state->thread);
+    if (len < 0)
+    {
+        return 0;
+    }
+    int level_count = len / sizeof(bfbridge_pyramid_level_t);
+    bfbridge_pyramid_level_t *levels =
+        (bfbridge_pyramid_level_t *)state->instance.communication_buffer;
+    int resolution_count = 0;
+    for (int i = 0; i < level_count; i++)
+    {
+        if (levels[i].series == request->series && levels[i].resolution >= resolution_count)
+        {
+            resolution_count = levels[i].resolution + 1;
+        }
+    }
+    if (resolution_count == 0)
+    {
+        return 0;
+    }
+    int *sizes = (int *)calloc(2 * resolution_count, sizeof(int));
+    if (!sizes)
+    {
+        return 0;
+    }
+    for (int i = 0; i < level_count; i++)
+    {
+        if (levels[i].series == request->series)
+        {
+            sizes[2 * levels[i].resolution] = levels[i].size_x;
+            sizes[2 * levels[i].resolution + 1] = levels[i].size_y;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    struct bfbridge_pool_prefetch *prefetch = pool->prefetch;
+    int victim = 0;
+    for (int i = 1; i < POOL_PREFETCH_LAYOUTS; i++)
+    {
+        bfbridge_pool_prefetch_layout_t *l = &prefetch->layouts[i];
+        if (prefetch->layouts[victim].sizes &&
+            (!l->sizes || l->last_used < prefetch->layouts[victim].last_used))
+        {
+            victim = i;
+        }
+    }
+    bfbridge_pool_prefetch_layout_t *l = &prefetch->layouts[victim];
+    free(l->sizes);
+    l->file_id = file_id;
+    l->series = request->series;
+    l->resolution_count = resolution_count;
+    l->sizes = sizes;
+    l->last_used = ++prefetch->use_counter;
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+// Adds the tile at column and row offsets from (x, y) at resolution,
+// clipped at the edges as a viewer would request it
+static int pool_prefetch_add(
+    bfbridge_tile_key_t *candidates, int count, const bfbridge_tile_key_t *key,
+    const bfbridge_pool_prefetch_layout_t *layout, int resolution,
+    int x, int y, int tile_w, int tile_h)
+{
+    if (resolution < 0 || resolution >= layout->resolution_count ||
+        count >= POOL_PREFETCH_MAX_CANDIDATES)
+    {
+        return count;
+    }
+    int size_x = layout->sizes[2 * resolution];
+    int size_y = layout->sizes[2 * resolution + 1];
+    if (x < 0 || y < 0 || x >= size_x || y >= size_y)
+    {
+        return count;
+    }
+    bfbridge_tile_key_t *c = &candidates[count];
+    *c = *key;
+    c->resolution = resolution;
+    c->x = x;
+    c->y = y;
+    c->w = size_x - x < tile_w ? size_x - x : tile_w;
+    c->h = size_y - y < tile_h ? size_y - y : tile_h;
+    for (int i = 0; i < count; i++)
+    {
+        if (tile_cache_key_equals(&candidates[i], c))
+        {
+            return count;
+        }
+    }
+    return count + 1;
+}
+
+// The tiles at a distance of ring tiles around the key's tile
+static int pool_prefetch_add_ring(
+    bfbridge_tile_key_t *candidates, int count, const bfbridge_tile_key_t *key,
+    const bfbridge_pool_prefetch_layout_t *layout, int ring, int tile_w, int tile_h)
+{
+    for (int j = -ring; j <= ring; j++)
+    {
+        for (int i = -ring; i <= ring; i++)
+        {
+            if (i == -ring || i == ring || j == -ring || j == ring)
+            {
+                count = pool_prefetch_add(candidates, count, key, layout, key->resolution,
+                    key->x + i * tile_w, key->y + j * tile_h, tile_w, tile_h);
+            }
+        }
+    }
+    return count;
+}
+
+// Predicts the next tiles of the request's viewer and queues
+// the ones not cached, cancelling its other queued predictions
+static void pool_prefetch_predict(
+    struct bfbridge_pool_internal *pool, bfbridge_pool_worker_state_t *state,
+    const bfbridge_pool_request_t *request, const bfbridge_tile_key_t *key,
+    bfbridge_tile_cache_t *tile_cache)
+{
+    if (key->w <= 0 || key->h <= 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    int known = pool_prefetch_layout(pool->prefetch, key->file_id, key->series) != NULL;
+    pthread_mutex_unlock(&pool->lock);
+    if (!known && !pool_prefetch_load_layout(pool, state, request, key->file_id))
+    {
+        return;
+    }
+
+    bfbridge_tile_key_t candidates[POOL_PREFETCH_MAX_CANDIDATES];
+    int count = 0;
+    pthread_mutex_lock(&pool->lock);
+    struct bfbridge_pool_prefetch *prefetch = pool->prefetch;
+    bfbridge_pool_prefetch_layout_t *layout =
+        pool_prefetch_layout(prefetch, key->file_id, key->series);
+    int stream_index = prefetch->enabled && layout && key->resolution < layout->resolution_count
+                           ? pool_prefetch_stream(prefetch, request, key)
+                           : -1;
+    if (stream_index < 0)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return;
+    }
+    bfbridge_prefetch_config_t *config = &prefetch->config;
+    bfbridge_pool_prefetch_stream_t *stream = &prefetch->streams[stream_index];
+    int r = key->resolution;
+    int size_x = layout->sizes[2 * r];
+    int size_y = layout->sizes[2 * r + 1];
+    if (key->x + key->w < size_x || stream->tile_w == 0)
+    {
+        stream->tile_w = key->w;
+    }
+    if (key->y + key->h < size_y || stream->tile_h == 0)
+    {
+        stream->tile_h = key->h;
+    }
+    int tile_w = stream->tile_w;
+    int tile_h = stream->tile_h;
+
+    // Pan direction
+    double center_x = key->x + key->w / 2.0;
+    double center_y = key->y + key->h / 2.0;
+    if (stream->resolution != r)
+    {
+        stream->resolution = r;
+        stream->center_x = center_x;
+        stream->center_y = center_y;
+        stream->velocity_x = 0;
+        stream->velocity_y = 0;
+        stream->recent_len = 0;
+    }
+    else
+    {
+        double previous_x = stream->center_x;
+        double previous_y = stream->center_y;
+        stream->center_x += 0.3 * (center_x - stream->center_x);
+        stream->center_y += 0.3 * (center_y - stream->center_y);
+        stream->velocity_x = 0.7 * stream->velocity_x + 0.3 * (stream->center_x - previous_x);
+        stream->velocity_y = 0.7 * stream->velocity_y + 0.3 * (stream->center_y - previous_y);
+    }
+    stream->recent_x[stream->recent_next] = key->x;
+    stream->recent_y[stream->recent_next] = key->y;
+    stream->recent_next = (stream->recent_next + 1) % POOL_PREFETCH_RECENT;
+    if (stream->recent_len < POOL_PREFETCH_RECENT)
+    {
+        stream->recent_len++;
+    }
+    int dx = stream->velocity_x > tile_w / 4.0 ? 1 : stream->velocity_x < -tile_w / 4.0 ? -1 : 0;
+    int dy = stream->velocity_y > tile_h / 4.0 ? 1 : stream->velocity_y < -tile_h / 4.0 ? -1 : 0;
+
+    // In order of priority: adjacent tiles, tiles ahead,
+    // the next resolution, then the outer rings
+    if (config->neighbor_rings > 0)
+    {
+        count = pool_prefetch_add_ring(candidates, count, key, layout, 1, tile_w, tile_h);
+    }
+    for (int step = 1; (dx || dy) && step <= prefetch->stats.readahead; step++)
+    {
+        int ahead = (config->neighbor_rings > 0 ? 1 : 0) + step;
+        // Across the direction, a tile to either side
+        for (int side = -1; side <= 1; side++)
+        {
+            count = pool_prefetch_add(candidates, count, key, layout, r,
+                key->x + (ahead * dx - side * dy) * tile_w,
+                key->y + (ahead * dy + side * dx) * tile_h, tile_w, tile_h);
+        }
+    }
+    if (config->zoom_in && r > 0)
+    {
+        double scale_x = (double)layout->sizes[2 * (r - 1)] / size_x;
+        double scale_y = (double)layout->sizes[2 * (r - 1) + 1] / size_y;
+        int first_column = (int)(key->x * scale_x) / tile_w;
+        int last_column = ((int)((key->x + key->w) * scale_x + 0.5) - 1) / tile_w;
+        int first_row = (int)(key->y * scale_y) / tile_h;
+        int last_row = ((int)((key->y + key->h) * scale_y + 0.5) - 1) / tile_h;
+        int added = 0;
+        for (int row = first_row; row <= last_row; row++)
+        {
+            for (int column = first_column; column <= last_column; column++)
+            {
+                if (added++ < POOL_PREFETCH_MAX_ZOOM_TILES)
+                {
+                    count = pool_prefetch_add(candidates, count, key, layout, r - 1,
+                        column * tile_w, row * tile_h, tile_w, tile_h);
+                }
+            }
+        }
+    }
+    for (int ring = 2; ring <= config->neighbor_rings; ring++)
+    {
+        count = pool_prefetch_add_ring(candidates, count, key, layout, ring, tile_w, tile_h);
+    }
+
+    // Cached ones are not predicted again
+    for (int i = 0; i < count; i++)
+    {
+        if (tile_cache_contains(tile_cache, &candidates[i]))
+        {
+            candidates[i].w = 0;
+        }
+    }
+    pool_prefetch_reconcile(prefetch, stream_index, candidates, count, 0);
+
+    // Lowest priority first, so that workers take the highest first
+    int added = 0;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        if (candidates[i].w == 0)
+        {
+            continue;
+        }
+        if (prefetch->queue_len == prefetch->queue_cap)
+        {
+            // Drop the oldest
+            memmove(prefetch->queue, prefetch->queue + 1,
+                    (prefetch->queue_len - 1) * sizeof(bfbridge_pool_prefetch_item_t));
+            prefetch->queue_len--;
+            prefetch->stats.cancelled++;
+        }
+        bfbridge_pool_prefetch_item_t *item = &prefetch->queue[prefetch->queue_len++];
+        item->key = candidates[i];
+        item->stream = stream_index;
+        prefetch->stats.predicted++;
+        added++;
+    }
+    if (added)
+    {
+        pthread_cond_broadcast(&pool->work_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Caller holds the pool lock. Whether an idle worker may take a prediction.
+// Not when stopping, which shouldn't wait for the queued predictions
+static int pool_prefetch_available(struct bfbridge_pool_internal *pool)
+{
+    struct bfbridge_pool_prefetch *prefetch = pool->prefetch;
+    return !pool->stopping && prefetch && prefetch->enabled && prefetch->queue_len > 0 &&
+           prefetch->running < prefetch->config.max_workers && pool->tile_cache;
+}
+
+// Caller holds the pool lock. Takes the latest prediction, copying
+// its filepath to *filepath (reallocated, of *filepath_cap bytes)
+// returns: 0 if there is none or if out of memory
+static int pool_prefetch_take(
+    struct bfbridge_pool_internal *pool, bfbridge_pool_request_t *request,
+    char **filepath, int *filepath_cap)
+{
+    if (!pool_prefetch_available(pool))
+    {
+        return 0;
+    }
+    struct bfbridge_pool_prefetch *prefetch = pool->prefetch;
+    bfbridge_pool_prefetch_item_t item = prefetch->queue[--prefetch->queue_len];
+    bfbridge_pool_prefetch_stream_t *stream = &prefetch->streams[item.stream];
+    if (*filepath_cap < stream->filepath_len || !*filepath)
+    {
+        char *grown = (char *)realloc(*filepath, stream->filepath_len > 0 ? stream->filepath_len : 1);
+        if (!grown)
+        {
+            prefetch->stats.cancelled++;
+            return 0;
+        }
+        *filepath = grown;
+        *filepath_cap = stream->filepath_len;
+    }
+    memcpy(*filepath, stream->filepath, stream->filepath_len);
+    memset(request, 0, sizeof(*request));
+    request->filepath = *filepath;
+    request->filepath_len = stream->filepath_len;
+    request->series = item.key.series;
+    request->resolution = item.key.resolution;
+    request->plane = item.key.plane;
+    request->x = item.key.x;
+    request->y = item.key.y;
+    request->w = item.key.w;
+    request->h = item.key.h;
+    prefetch->running++;
+    return 1;
+}
+
+// Decodes a prediction taken with pool_prefetch_take into the cache
+static void pool_prefetch_run(
+    struct bfbridge_pool_internal *pool, bfbridge_pool_worker_state_t *state,
+    bfbridge_pool_request_t *request, bfbridge_tile_cache_t *tile_cache)
+{
+    bfbridge_tile_key_t key;
+    key.file_id = bfbridge_tile_cache_file_id(request->filepath, request->filepath_len);
+    key.series = request->series;
+    key.resolution = request->resolution;
+    key.plane = request->plane;
+    key.x = request->x;
+    key.y = request->y;
+    key.w = request->w;
+    key.h = request->h;
+
+    // Such as requested meanwhile
+    int cached = tile_cache_contains(tile_cache, &key);
+    int len = -1;
+    if (!cached && pool_prepare_file(state, request->filepath, request->filepath_len,
+                                     request->series, request->resolution) >= 0)
+    {
+        len = bf_open_bytes(&state->instance, &state->thread, request->plane,
+                            request->x, request->y, request->w, request->h);
+        if (len >= 0)
+        {
+            bfbridge_tile_cache_put(tile_cache, &key, state->instance.communication_buffer, len);
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    struct bfbridge_pool_prefetch *prefetch = pool->prefetch;
+    prefetch->running--;
+    if (cached)
+    {
+        prefetch->stats.cancelled++;
+    }
+    else if (len < 0)
+    {
+        prefetch->stats.failed++;
+    }
+    else
+    {
+        prefetch->stats.decoded++;
+        pool_prefetch_track(prefetch, &key);
+    }
+    if (pool_prefetch_available(pool))
+    {
+        pthread_cond_broadcast(&pool->work_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static int pool_read_request(
+    struct bfbridge_pool_internal *pool, bfbridge_pool_worker_state_t *state,
+    bfbridge_pool_request_t *request, bfbridge_tile_cache_t *tile_cache,
+    int prefetch)
+{
+    bfbridge_instance_t *instance = &state->instance;
+    bfbridge_thread_t *thread = &state->thread;
+    int code;
+    bfbridge_tile_key_t key;
+    // The key has no room for thumbnail sizes; uncached reads are one-off
+    if (request->thumbnail || request->info || request->uncached)
+    {
+        tile_cache = NULL;
+    }
+    if (!tile_cache)
+    {
+        prefetch = 0;
+    }
+    if (tile_cache)
+    {
+        key.file_id = bfbridge_tile_cache_file_id(request->filepath, request->filepath_len);
+        key.series = request->series;
+        key.resolution = request->resolution;
+        key.plane = request->plane;
+        key.x = request->x;
+        key.y = request->y;
+        key.w = request->w;
+        key.h = request->h;
+        code = bfbridge_tile_cache_get(tile_cache, &key, request->dest, request->dest_len);
+        if (prefetch)
+        {
+            pool_prefetch_note_request(pool, &key, code != -1);
+        }
+        if (code != -1)
+        {
+            if (prefetch)
+            {
+                pool_prefetch_predict(pool, state, request, &key, tile_cache);
+            }
+            return code;
+        }
+    }
+    code = pool_prepare_file(state, request->filepath, request->filepath_len,
+                             request->series, request->resolution);
+    if (code < 0)
+    {
+        return code;
+    }
+    if (prefetch)
+    {
+        // Before decoding, so that idle workers start on the predictions
+        pool_prefetch_predict(pool, state, request, &key, tile_cache);
+        code = pool_prepare_file(state, request->filepath, request->filepath_len,
+                                 request->series, request->resolution);
+        if (code < 0)
+        {
+            return code;
+        }
+    }
+    int len;
+    if (request->info)
+    {
+        len = bf_get_image_info(instance, thread, NULL);
+    }
+    else if (request->thumbnail)
+    {
+        len = bf_open_thumb_bytes(instance, thread, request->plane,
+                                  request->w, request->h);
+    }
+    else
+    {
+        len = bf_open_bytes(instance, thread, request->plane,
+                            request->x, request->y, request->w, request->h);
+    }
+    if (len < 0)
+    {
+        return len;
+    }
+    if (tile_cache)
+    {
+        bfbridge_tile_cache_put(tile_cache, &key, instance->communication_buffer, len);
+    }
+    if (len > request->dest_len)
+    {
+        return -2;
+    }
+    memcpy(request->dest, instance->communication_buffer, len);
+    return len;
+}
+
+// Caller holds pool->lock
+static void pool_signal_completion(struct bfbridge_pool_internal *pool)
+{
+    if (pool->completion_write_fd < 0)
+    {
+        return;
+    }
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t written = write(pool->completion_write_fd, &one, sizeof(one));
+#elif !defined(WIN32)
+    char one = 1;
+    ssize_t written = write(pool->completion_write_fd, &one, 1);
+#endif
+    // Nonblocking; if full, it's readable anyway
+    (void)written;
+}
+
+// Caller holds pool->lock
+static void pool_drain_completion_fd(struct bfbridge_pool_internal *pool)
+{
+    if (pool->completion_read_fd < 0)
+    {
+        return;
+    }
+#ifdef __linux__
+    uint64_t count;
+    ssize_t got = read(pool->completion_read_fd, &count, sizeof(count));
+    (void)got;
+#elif !defined(WIN32)
+    char drain[64];
+    while (read(pool->completion_read_fd, drain, sizeof(drain)) > 0)
+    {
+    }
+#endif
+}
+
+// Marks the request done and, if asynchronous, calls its callback
+// or adds it to the completion queue
+static void pool_finish_request(
+    struct bfbridge_pool_internal *pool, bfbridge_pool_request_t *request,
+    int result)
+{
+    bfbridge_pool_callback_t callback = NULL;
+    void *user_data = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    request->result = result;
+    request->done = 1;
+    if (request->async && request->callback)
+    {
+        callback = request->callback;
+        user_data = request->user_data;
+    }
+    else if (request->async)
+    {
+        request->next_completed = NULL;
+        if (pool->completed_tail)
+        {
+            pool->completed_tail->next_completed = request;
+        }
+        else
+        {
+            pool->completed_head = request;
+            pool_signal_completion(pool);
+        }
+        pool->completed_tail = request;
+    }
+    if (pool->waiters)
+    {
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    // The callback may free the request
+    if (callback)
+    {
+        callback(request, user_data);
+    }
+}
+
+static void *pool_worker_main(void *arg)
+{
+    bfbridge_pool_worker_t *worker = (bfbridge_pool_worker_t *)arg;
+    struct bfbridge_pool_internal *pool = worker->pool;
+    bfbridge_pool_worker_state_t state;
+    state.filepath = NULL;
+    state.filepath_len = 0;
+    state.series = -1;
+    state.resolution = -1;
+
+    bfbridge_error_t *err = NULL;
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+    // Grown on demand, so that idle workers don't hold the maximum
+    char *buffer = NULL;
+    int idle_len = pool->communication_buffer_len < POOL_IDLE_BUFFER_LEN
+                       ? pool->communication_buffer_len
+                       : POOL_IDLE_BUFFER_LEN;
+    if (idle_len <= 0)
+    {
+        idle_len = 1;
+    }
+    err = bfbridge_make_thread(&state.thread, pool->vm);
+    if (!err)
+    {
+        err = bfbridge_make_growable_instance(&state.instance, &state.thread,
+            idle_len, idle_len > pool->communication_buffer_len ? idle_len : pool->communication_buffer_len);
+        if (err)
+        {
+            bfbridge_free_thread(&state.thread);
+        }
+    }
+#else
+    char *buffer = (char *)malloc(pool->communication_buffer_len);
+    if (!buffer)
+    {
+        err = make_error(BFBRIDGE_OUT_OF_MEMORY_ERROR,
+            "bfbridge_make_pool: could not allocate a communication buffer", NULL);
+    }
+    else
+    {
+        err = bfbridge_make_thread(&state.thread, pool->vm);
+        if (!err)
+        {
+            err = bfbridge_make_instance(&state.instance, &state.thread,
+                buffer, pool->communication_buffer_len);
+            if (err)
+            {
+                bfbridge_free_thread(&state.thread);
+            }
+        }
+    }
+#endif
+
+    int failed = err != NULL;
+    pthread_mutex_lock(&pool->lock);
+    pool->started++;
+    if (err && !pool->start_error)
+    {
+        // bfbridge_make_pool will return it
+        pool->start_error = err;
+        err = NULL;
+    }
+    pthread_cond_broadcast(&pool->done_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (failed)
+    {
+        if (err)
+        {
+            bfbridge_free_error(err);
+        }
+        free(buffer);
+        return NULL;
+    }
+
+    // Predictions to decode when idle, with their filepath
+    bfbridge_pool_request_t prefetch_request;
+    char *prefetch_filepath = NULL;
+    int prefetch_filepath_cap = 0;
+
+    for (;;)
+    {
+        bfbridge_tile_cache_t *tile_cache = NULL;
+        int prefetch = 0;
+        bfbridge_pool_request_t *request = pool_take(pool, worker->index, &tile_cache, &prefetch);
+        if (!request)
+        {
+            pthread_mutex_lock(&pool->lock);
+            int prefetching = pool_prefetch_take(pool, &prefetch_request,
+                &prefetch_filepath, &prefetch_filepath_cap);
+            tile_cache = pool->tile_cache;
+            pthread_mutex_unlock(&pool->lock);
+            if (prefetching)
+            {
+                pool_prefetch_run(pool, &state, &prefetch_request, tile_cache);
+                continue;
+            }
+            pthread_mutex_lock(&pool->lock);
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+            // Shrinks only after a pause, not between the requests of
+            // a busy pool, which would regrow the buffer each time
+            struct timespec shrink_at;
+            clock_gettime(CLOCK_REALTIME, &shrink_at);
+            shrink_at.tv_sec += POOL_IDLE_SHRINK_SECONDS;
+            int shrunk = 0;
+#endif
+            while (pool->queued == 0 && !pool->stopping && !pool_prefetch_available(pool))
+            {
+#ifndef BFBRIDGE_KNOW_BUFFER_LEN
+                if (!shrunk)
+                {
+                    if (pthread_cond_timedwait(&pool->work_cond, &pool->lock, &shrink_at) == ETIMEDOUT)
+                    {
+                        pthread_mutex_unlock(&pool->lock);
+                        bfbridge_instance_shrink(&state.instance, &state.thread, idle_len);
+                        pthread_mutex_lock(&pool->lock);
+                        shrunk = 1;
+                    }
+                    continue;
+                }
+#endif
+                pthread_cond_wait(&pool->work_cond, &pool->lock);
+            }
+            int stop = pool->queued == 0 && pool->stopping;
+            pthread_mutex_unlock(&pool->lock);
+            if (stop)
+            {
+                break;
+            }
+            continue;
+        }
+
+        int result = pool_read_request(pool, &state, request, tile_cache, prefetch);
+        pool_finish_request(pool, request, result);
+    }
+
+    free(prefetch_filepath);
+    bf_close(&state.instance, &state.thread);
+    bfbridge_free_instance(&state.instance, &state.thread);
+    bfbridge_free_thread(&state.thread);
+    free(state.filepath);
+    free(buffer);
+    return NULL;
+}
+
+static void pool_stop(struct bfbridge_pool_internal *pool, int created)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < created; i++)
+    {
+        pthread_join(pool->workers[i].pthread, NULL);
+    }
+    for (int i = 0; i < pool->worker_count; i++)
+    {
+        free(pool->workers[i].queue.items);
+        pthread_mutex_destroy(&pool->workers[i].queue.lock);
+    }
+#ifndef WIN32
+    if (pool->completion_read_fd >= 0)
+    {
+        close(pool->completion_read_fd);
+    }
+    if (pool->completion_write_fd >= 0 &&
+        pool->completion_write_fd != pool->completion_read_fd)
+    {
+        close(pool->completion_write_fd);
+    }
+#endif
+    if (pool->prefetch)
+    {
+        for (int i = 0; i < POOL_PREFETCH_STREAMS; i++)
+        {
+            free(pool->prefetch->streams[i].filepath);
+        }
+        for (int i = 0; i < POOL_PREFETCH_LAYOUTS; i++)
+        {
+            free(pool->prefetch->layouts[i].sizes);
+        }
+        free(pool->prefetch->queue);
+        free(pool->prefetch->tracked);
+        free(pool->prefetch);
+    }
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+bfbridge_error_t *bfbridge_make_pool(
+    bfbridge_pool_t *dest,
+    bfbridge_vm_t *vm,
+    int thread_count,
+    int communication_buffer_len)
+{
+    // Ease of freeing
+    dest->internal = NULL;
+
+    if (!vm->jvm)
+    {
+        return make_error(BFBRIDGE_LIBRARY_UNINITIALIZED, "bfbridge_make_pool requires successful bfbridge_make_vm", NULL);
+    }
+    if (thread_count <= 0)
+    {
+        return make_error(BFBRIDGE_INVALID_THREAD_COUNT, "bfbridge_make_pool: thread_count must be positive", NULL);
+    }
+    if (communication_buffer_len < 0)
+    {
+        return make_error(BFBRIDGE_INVALID_COMMUNICATON_BUFFER, "bfbridge_make_pool: communication_buffer_len is negative", NULL);
+    }
+
+    struct bfbridge_pool_internal *pool = (struct bfbridge_pool_internal *)
+        calloc(1, sizeof(struct bfbridge_pool_internal));
+    bfbridge_pool_worker_t *workers = (bfbridge_pool_worker_t *)
+        calloc(thread_count, sizeof(bfbridge_pool_worker_t));
+    if (!pool || !workers)
+    {
+        free(pool);
+        free(workers);
+        return make_error(BFBRIDGE_OUT_OF_MEMORY_ERROR, "bfbridge_make_pool: out of memory", NULL);
+    }
+    pool->vm = vm;
+    pool->communication_buffer_len = communication_buffer_len;
+    pool->worker_count = thread_count;
+    pool->workers = workers;
+    pool->completion_read_fd = -1;
+    pool->completion_write_fd = -1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    for (int i = 0; i < thread_count; i++)
+    {
+        workers[i].pool = pool;
+        workers[i].index = i;
+        pthread_mutex_init(&workers[i].queue.lock, NULL);
+    }
+
+    int created = 0;
+    bfbridge_error_t *err = NULL;
+    for (; created < thread_count; created++)
+    {
+        if (pthread_create(&workers[created].pthread, NULL,
+                           pool_worker_main, &workers[created]) != 0)
+        {
+            err = make_error(BFBRIDGE_THREAD_CREATION_FAILED, "bfbridge_make_pool: pthread_create failed", NULL);
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->started < created)
+    {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    if (!err)
+    {
+        err = pool->start_error;
+        pool->start_error = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (err)
+    {
+        if (pool->start_error)
+        {
+            bfbridge_free_error(pool->start_error);
+        }
+        pool_stop(pool, created);
+        return err;
+    }
+
+    dest->internal = pool;
+    return NULL;
+}
+
+static void pool_submit(
+    struct bfbridge_pool_internal *p, bfbridge_pool_request_t *requests,
+    int count, int async)
+{
+    pthread_mutex_lock(&p->lock);
+    unsigned int next_worker = p->next_worker;
+    p->next_worker += count;
+    pthread_mutex_unlock(&p->lock);
+
+    int queued = 0;
+    for (int i = 0; i < count; i++)
+    {
+        bfbridge_pool_request_t *request = &requests[i];
+        request->result = 0;
+        request->done = 0;
+        request->async = async;
+        bfbridge_pool_deque_t *q =
+            &p->workers[(next_worker + i) % p->worker_count].queue;
+        pthread_mutex_lock(&q->lock);
+        int pushed = pool_deque_push(q, request);
+        pthread_mutex_unlock(&q->lock);
+        if (pushed)
+        {
+            queued++;
+        }
+        else
+        {
+            pool_finish_request(p, request, -1);
+        }
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->queued += queued;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void bfbridge_pool_submit(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *requests, int count)
+{
+    pool_submit(pool->internal, requests, count, 0);
+}
+
+void bfbridge_pool_wait(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *requests, int count)
+{
+    struct bfbridge_pool_internal *p = pool->internal;
+    pthread_mutex_lock(&p->lock);
+    p->waiters++;
+    for (int i = 0; i < count; i++)
+    {
+        while (!requests[i].done)
+        {
+            pthread_cond_wait(&p->done_cond, &p->lock);
+        }
+    }
+    p->waiters--;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void bfbridge_pool_set_tile_cache(
+    bfbridge_pool_t *pool, bfbridge_tile_cache_t *cache)
+{
+    struct bfbridge_pool_internal *p = pool->internal;
+    pthread_mutex_lock(&p->lock);
+    p->tile_cache = cache;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void bfbridge_pool_set_prefetch(
+    bfbridge_pool_t *pool, const bfbridge_prefetch_config_t *config)
+{
+    struct bfbridge_pool_internal *p = pool->internal;
+    bfbridge_prefetch_config_t c;
+    bfbridge_pool_prefetch_item_t *queue = NULL;
+    bfbridge_pool_prefetch_tracked_t *tracked = NULL;
+    if (config)
+    {
+        c = *config;
+        c.neighbor_rings = c.neighbor_rings < 0 ? 0 : c.neighbor_rings > POOL_PREFETCH_MAX_RINGS ? POOL_PREFETCH_MAX_RINGS : c.neighbor_rings;
+        c.max_readahead = c.max_readahead < 0 ? 0 : c.max_readahead > POOL_PREFETCH_MAX_READAHEAD ? POOL_PREFETCH_MAX_READAHEAD : c.max_readahead;
+        c.max_queued = c.max_queued < 1 ? 1 : c.max_queued;
+        c.max_workers = c.max_workers < 1 ? 1 : c.max_workers;
+        queue = (bfbridge_pool_prefetch_item_t *)malloc(c.max_queued * sizeof(bfbridge_pool_prefetch_item_t));
+        tracked = (bfbridge_pool_prefetch_tracked_t *)malloc(
+            (size_t)c.max_queued * POOL_PREFETCH_TRACKED_PER_QUEUED * sizeof(bfbridge_pool_prefetch_tracked_t));
+        if (!queue || !tracked)
+        {
+            // Prefetching is an optimization; stay disabled
+            free(queue);
+            free(tracked);
+            queue = NULL;
+            tracked = NULL;
+            config = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (!p->prefetch && config)
+    {
+        p->prefetch = (struct bfbridge_pool_prefetch *)calloc(1, sizeof(struct bfbridge_pool_prefetch));
+    }
+    struct bfbridge_pool_prefetch *prefetch = p->prefetch;
+    if (prefetch)
+    {
+        // Workers running a prediction don't refer to these
+        prefetch->stats.cancelled += prefetch->queue_len;
+        free(prefetch->queue);
+        free(prefetch->tracked);
+        prefetch->queue = NULL;
+        prefetch->queue_len = 0;
+        prefetch->queue_cap = 0;
+        prefetch->tracked = NULL;
+        prefetch->tracked_head = 0;
+        prefetch->tracked_len = 0;
+        prefetch->tracked_cap = 0;
+        prefetch->enabled = config != NULL;
+    }
+    if (prefetch && config)
+    {
+        prefetch->config = c;
+        prefetch->queue = queue;
+        prefetch->queue_cap = c.max_queued;
+        prefetch->tracked = tracked;
+        prefetch->tracked_cap = c.max_queued * POOL_PREFETCH_TRACKED_PER_QUEUED;
+        prefetch->stats.readahead = c.max_readahead < 1 ? c.max_readahead : 1;
+        prefetch->adapt_hits = 0;
+        prefetch->adapt_count = 0;
+    }
+    else
+    {
+        free(queue);
+        free(tracked);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void bfbridge_pool_get_prefetch_stats(
+    bfbridge_pool_t *pool, bfbridge_prefetch_stats_t *dest)
+{
+    struct bfbridge_pool_internal *p = pool->internal;
+    pthread_mutex_lock(&p->lock);
+    if (p->prefetch)
+    {
+        *dest = p->prefetch->stats;
+        dest->queue_length = p->prefetch->queue_len;
+    }
+    else
+    {
+        memset(dest, 0, sizeof(*dest));
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void bfbridge_pool_read(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *requests, int count)
+{
+    bfbridge_pool_submit(pool, requests, count);
+    bfbridge_pool_wait(pool, requests, count);
+}
+
+void bfbridge_pool_open_bytes_async(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *request,
+    bfbridge_pool_callback_t callback, void *user_data)
+{
+    request->callback = callback;
+    request->user_data = user_data;
+    pool_submit(pool->internal, request, 1, 1);
+}
+
+void bfbridge_pool_open_thumb_bytes_async(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *request,
+    bfbridge_pool_callback_t callback, void *user_data)
+{
+    request->thumbnail = 1;
+    bfbridge_pool_open_bytes_async(pool, request, callback, user_data);
+}
+
+void bfbridge_pool_get_image_info_async(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *request,
+    bfbridge_pool_callback_t callback, void *user_data)
+{
+    request->info = 1;
+    bfbridge_pool_open_bytes_async(pool, request, callback, user_data);
+}
+
+int bfbridge_pool_get_completion_fd(bfbridge_pool_t *pool)
+{
+    struct bfbridge_pool_internal *p = pool->internal;
+    pthread_mutex_lock(&p->lock);
+#ifdef __linux__
+    if (p->completion_read_fd < 0)
+    {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        p->completion_read_fd = fd;
+        p->completion_write_fd = fd;
+        if (p->completed_head)
+        {
+            pool_signal_completion(p);
+        }
+    }
+#elif !defined(WIN32)
+    if (p->completion_read_fd < 0)
+    {
+        int fds[2];
+        if (pipe(fds) == 0)
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+                fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+            }
+            p->completion_read_fd = fds[0];
+            p->completion_write_fd = fds[1];
+            if (p->completed_head)
+            {
+                pool_signal_completion(p);
+            }
+        }
+    }
+#endif
+    int fd = p->completion_read_fd;
+    pthread_mutex_unlock(&p->lock);
+    return fd;
+}
+
+int bfbridge_pool_take_completed(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t **dest, int max)
+{
+    struct bfbridge_pool_internal *p = pool->internal;
+    int count = 0;
+    pthread_mutex_lock(&p->lock);
+    while (count < max && p->completed_head)
+    {
+        dest[count++] = p->completed_head;
+        p->completed_head = p->completed_head->next_completed;
+    }
+    if (!p->completed_head)
+    {
+        p->completed_tail = NULL;
+        pool_drain_completion_fd(p);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return count;
+}
+
+void bfbridge_free_pool(bfbridge_pool_t *pool)
+{
+    // Ease of freeing
+    if (pool->internal)
+    {
+        pool_stop(pool->internal, pool->internal->worker_count);
+        pool->internal = NULL;
+    }
+}
+
+// Streaming reads with a pool
+
+struct bfbridge_region_stream_internal
+{
+    bfbridge_pool_t *pool;
+    char *filepath;
+    int filepath_len;
+    int series;
+    int resolution;
+    int plane;
+    region_stream_layout_t layout;
+    // Strip i is read into slot i % 2, its parts one after another
+    bfbridge_pool_request_t *requests[2];
+    int request_count[2];
+    char *parts[2];
+    // Submitted and not yet waited for
+    int pending[2];
+    // Where strips of more than one part are assembled
+    char *strip;
+    int next;
+    int failed;
+};
+
+static void region_stream_submit(struct bfbridge_region_stream_internal *s, int index)
+{
+    int slot = index % 2;
+    const region_stream_layout_t *layout = &s->layout;
+    int strip_y, strip_h;
+    region_stream_span(layout->y, layout->h, layout->tile_h, index, &strip_y, &strip_h);
+    int count = region_stream_span_count(layout->x, layout->w, layout->part_w);
+    char *dest = s->parts[slot];
+    for (int j = 0; j < count; j++)
+    {
+        bfbridge_pool_request_t *request = &s->requests[slot][j];
+        memset(request, 0, sizeof(*request));
+        request->filepath = s->filepath;
+        request->filepath_len = s->filepath_len;
+        request->series = s->series;
+        request->resolution = s->resolution;
+        request->plane = s->plane;
+        region_stream_span(layout->x, layout->w, layout->part_w, j, &request->x, &request->w);
+        request->y = strip_y;
+        request->h = strip_h;
+        request->dest = dest;
+        request->dest_len = request->w * strip_h * layout->pixel_bytes;
+        // Parts would evict viewer tiles and predict more parts
+        request->uncached = 1;
+        dest += request->dest_len;
+    }
+    s->request_count[slot] = count;
+    s->pending[slot] = 1;
+    bfbridge_pool_submit(s->pool, s->requests[slot], count);
+}
+
+static void region_stream_wait(struct bfbridge_region_stream_internal *s, int slot)
+{
+    if (s->pending[slot])
+    {
+        bfbridge_pool_wait(s->pool, s->requests[slot], s->request_count[slot]);
+        s->pending[slot] = 0;
+    }
+}
+
+bfbridge_error_t *bfbridge_make_region_stream(
+    bfbridge_region_stream_t *dest, bfbridge_pool_t *pool,
+    const char *filepath, int filepath_len, int series, int resolution,
+    int plane, int x, int y, int w, int h)
+{
+    // Ease of freeing
+    dest->internal = NULL;
+    struct bfbridge_region_stream_internal *s = (struct bfbridge_region_stream_internal *)
+        calloc(1, sizeof(struct bfbridge_region_stream_internal));
+    char *filepath_copy = (char *)malloc(filepath_len + 1);
+    if (!s || !filepath_copy)
+    {
+        free(s);
+        free(filepath_copy);
+        return make_error(BFBRIDGE_OUT_OF_MEMORY_ERROR, "bfbridge_make_region_stream: out of memory", NULL);
+    }
+    memcpy(filepath_copy, filepath, filepath_len);
+    filepath_copy[filepath_len] = 0;
+    s->pool = pool;
+    s->filepath = filepath_copy;
+    s->filepath_len = filepath_len;
+    s->series = series;
+    s->resolution = resolution;
+    s->plane = plane;
+
+    bfbridge_image_info_t info;
+    bfbridge_pool_request_t request;
+    memset(&request, 0, sizeof(request));
+    request.filepath = filepath_copy;
+    request.filepath_len = filepath_len;
+    request.series = series;
+    request.resolution = resolution;
+    request.info = 1;
+    request.dest = (char *)&info;
+    request.dest_len = sizeof(info);
+    bfbridge_pool_read(pool, &request, 1);
+    if (request.result < 0)
+    {
+        free(filepath_copy);
+        free(s);
+        return make_error(BFBRIDGE_REGION_INFO_FAILED, "bfbridge_make_region_stream: could not open the file or read its image info", NULL);
+    }
+
+    int planned = region_stream_plan(
+        &s->layout, info.size_x, info.size_y, x, y, w, h,
+        info.optimal_tile_width, info.optimal_tile_height, info.rgb_channel_count,
+        info.bytes_per_pixel, info.is_interleaved,
+        pool->internal->communication_buffer_len, pool->internal->worker_count);
+    if (planned < 0)
+    {
+        free(filepath_copy);
+        free(s);
+        const char *problem = planned == -2
+                                  ? "bfbridge_make_region_stream: a tile does not fit the communication buffers of the pool"
+                                  : "bfbridge_make_region_stream: the region is out of the image or too wide";
+        return make_error(BFBRIDGE_INVALID_REGION, problem, NULL);
+    }
+
+    int part_count = region_stream_span_count(x, w, s->layout.part_w);
+    int allocated = 1;
+    for (int slot = 0; slot < 2; slot++)
+    {
+        s->requests[slot] = (bfbridge_pool_request_t *)malloc(part_count * sizeof(bfbridge_pool_request_t));
+        s->parts[slot] = (char *)malloc(s->layout.strip_len);
+        allocated = allocated && s->requests[slot] && s->parts[slot];
+    }
+    if (part_count > 1)
+    {
+        s->strip = (char *)malloc(s->layout.strip_len);
+        allocated = allocated && s->strip;
+    }
+    if (!allocated)
+    {
+        dest->internal = s;
+        bfbridge_free_region_stream(dest);
+        return make_error(BFBRIDGE_OUT_OF_MEMORY_ERROR, "bfbridge_make_region_stream: could not allocate the strips", NULL);
+    }
+    region_stream_submit(s, 0);
+    dest->internal = s;
+    return NULL;
+}
+
+int bfbridge_region_stream_next(
+    bfbridge_region_stream_t *stream, bfbridge_region_strip_t *strip)
+{
+    struct bfbridge_region_stream_internal *s = stream->internal;
+    if (s->failed || s->next >= s->layout.strip_count)
+    {
+        return 0;
+    }
+    int index = s->next++;
+    int slot = index % 2;
+    region_stream_wait(s, slot);
+    // The caller is done with the strip before, which used the other slot.
+    // Submitted only now: workers take their own queue newest first, so
+    // earlier the next strip's parts would be read before this strip's
+    if (index + 1 < s->layout.strip_count)
+    {
+        region_stream_submit(s, index + 1);
+    }
+
+    int count = s->request_count[slot];
+    char *data = count == 1 ? s->parts[slot] : s->strip;
+    region_stream_describe_strip(&s->layout, index, data, strip);
+    for (int j = 0; j < count; j++)
+    {
+        bfbridge_pool_request_t *request = &s->requests[slot][j];
+        if (request->result < request->dest_len)
+        {
+            s->failed = 1;
+            return request->result < 0 ? request->result : -1;
+        }
+        if (count > 1)
+        {
+            region_stream_copy_part(&s->layout, s->strip, strip->h, request->dest,
+                                    request->x - s->layout.x, request->w);
+        }
+    }
+    return 1;
+}
+
+void bfbridge_free_region_stream(bfbridge_region_stream_t *stream)
+{
+    // Ease of freeing
+    struct bfbridge_region_stream_internal *s = stream->internal;
+    if (!s)
+    {
+        return;
+    }
+    for (int slot = 0; slot < 2; slot++)
+    {
+        region_stream_wait(s, slot);
+        free(s->requests[slot]);
+        free(s->parts[slot]);
+    }
+    free(s->strip);
+    free(s->filepath);
+    free(s);
+    stream->internal = NULL;
 }
 
 #undef BFENVA
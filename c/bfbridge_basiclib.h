@@ -58,6 +58,26 @@ typedef enum bfbridge_error_code
     BFBRIDGE_OUT_OF_MEMORY_ERROR,
     BFBRIDGE_JVM_LACKS_BYTE_BUFFERS,
     BFBRIDGE_LIBRARY_UNINITIALIZED, // previous step wasn't successfully completed
+
+    // Explicit values from here on, distinct from all of the above
+
+    // Pool initialization:
+    BFBRIDGE_INVALID_THREAD_COUNT = -100,
+    BFBRIDGE_THREAD_CREATION_FAILED = -101,
+
+    // Tile cache initialization:
+    BFBRIDGE_INVALID_TILE_CACHE_SIZE = -110,
+
+    // Tiler initialization:
+    BFBRIDGE_INVALID_TILER_PARAMETERS = -120,
+    BFBRIDGE_TILER_LAYOUT_FAILED = -121,
+
+    // Shared memory server initialization:
+    BFBRIDGE_SHM_SERVER_FAILED = -130,
+
+    // Region stream initialization:
+    BFBRIDGE_INVALID_REGION = -140,
+    BFBRIDGE_REGION_INFO_FAILED = -141,
 } bfbridge_error_code_t;
 
 typedef struct bfbridge_error
@@ -68,6 +88,10 @@ typedef struct bfbridge_error
 
 BFBRIDGE_INLINE_ME void bfbridge_free_error(bfbridge_error_t *);
 
+// A static BFBRIDGE_OUT_OF_MEMORY_ERROR, for when an error can't be
+// allocated. bfbridge_free_error does nothing to it
+BFBRIDGE_INLINE_ME bfbridge_error_t *bfbridge_out_of_memory_error(void);
+
 typedef struct bfbridge_vm {
     JavaVM *jvm;
 } bfbridge_vm_t;
@@ -75,10 +99,46 @@ typedef struct bfbridge_vm {
 // A process can call bfbridge_make_vm at most once
 // cpdir: a string to a single directory containing jar files (and maybe classes)
 // cachedir: NULL or the directory path to store file caches for faster opening
+// Also reads BFBRIDGE_JVM_OPTS and the other environment variables of
+// bfbridge_vm_options_t
 BFBRIDGE_INLINE_ME_EXTRA bfbridge_error_t *bfbridge_make_vm(bfbridge_vm_t *dest,
     char *cpdir,
     char *cachedir);
 
+// For bfbridge_make_vm_with_options. Zero fields are the defaults, which
+// the environment variables named below can set instead, as they do
+// for bfbridge_make_vm
+typedef struct bfbridge_vm_options
+{
+    // NULL or options for JNI_CreateJavaVM such as "-Xmx8g" or
+    // "-XX:+UseG1GC", after ours and those of the BFBRIDGE_JVM_OPTS
+    // environment variable (separated by spaces) so that they take
+    // precedence over both. Must be valid during the call only
+    const char **jvm_options;
+    int jvm_option_count;
+    // NULL or a Class Data Sharing archive file (BFBRIDGE_CDS_ARCHIVE),
+    // which the JVM creates when bfbridge_free_vm is called if it is
+    // missing or was made by another JVM or classpath, and otherwise maps
+    // to skip loading and verifying the classes it has. Sets the
+    // classpath to the jar files of cpdir only, as classes in directories
+    // cannot be archived
+    const char *cds_archive;
+    // Nonzero (BFBRIDGE_WARM_UP=1) to load every BioFormats reader and
+    // read a few generated images before returning, so that the first
+    // tiles of the process are faster and a cds_archive created later
+    // has these classes. Warm-up errors are printed and otherwise ignored
+    int warm_up;
+    // With warm_up, NULL or a file to read as well (BFBRIDGE_WARM_UP_FILE),
+    // ideally of the format to be served
+    const char *warm_up_file;
+} bfbridge_vm_options_t;
+
+// As bfbridge_make_vm, with options NULL or as above
+BFBRIDGE_INLINE_ME_EXTRA bfbridge_error_t *bfbridge_make_vm_with_options(bfbridge_vm_t *dest,
+    char *cpdir,
+    char *cachedir,
+    const bfbridge_vm_options_t *options);
+
 // Copies while making the freeing of the previous a noop.
 // Do not use for moving from one thread/process to another
 BFBRIDGE_INLINE_ME void bfbridge_move_vm(bfbridge_vm_t *dest, bfbridge_vm_t *from);
@@ -98,6 +158,9 @@ typedef struct bfbridge_thread
 
     jmethodID constructor;
 
+    // Start time of the Java call in progress, for statistics
+    unsigned long long stats_start;
+
     // Please keep this list in order with javap output
     // See the comment "To print descriptors (encoded function types) ..."
     // for the javap command.
@@ -143,11 +206,20 @@ typedef struct bfbridge_thread
     jmethodID BFGet8BitLookupTable;
     jmethodID BFGet16BitLookupTable;
     jmethodID BFOpenBytes;
+    jmethodID BFOpenBytesStack;
+    jmethodID BFOpenBytesBatch;
+    jmethodID BFGetPixelPoolStats;
     jmethodID BFOpenThumbBytes;
+    jmethodID BFOpenBytesEncoded;
+    jmethodID BFOpenCompressedTile;
     jmethodID BFGetMPPX;
     jmethodID BFGetMPPY;
     jmethodID BFGetMPPZ;
     jmethodID BFDumpOMEXMLMetadata;
+    jmethodID BFGetImageInfo;
+    jmethodID BFGetPyramidLayout;
+    jmethodID BFGetJavaStats;
+    jmethodID BFGetRequiredBufferSize;
 } bfbridge_thread_t;
 
 // bfbridge_make_thread attaches the current thread to the JVM
@@ -182,6 +254,15 @@ typedef struct bfbridge_instance
     char *communication_buffer;
 #ifndef BFBRIDGE_KNOW_BUFFER_LEN
     int communication_buffer_len;
+    // For buffers owned by the library, see bfbridge_make_growable_instance,
+    // the length it can grow to. 0 if the caller owns the buffer
+    int communication_buffer_max_len;
+    // See bfbridge_instance_get_required_len
+    int communication_buffer_required;
+    // See bfbridge_instance_get_high_water
+    int communication_buffer_high_water;
+    // Internal, for retrying calls after growing the buffer
+    int last_result;
 #endif
 } bfbridge_instance_t;
 
@@ -227,6 +308,48 @@ BFBRIDGE_INLINE_ME void bfbridge_free_instance(
 BFBRIDGE_INLINE_ME char *bfbridge_instance_get_communication_buffer(
     bfbridge_instance_t *, int *len);
 
+// Growable communication buffers:
+// Not available if you define BFBRIDGE_KNOW_BUFFER_LEN.
+// When the output of a call does not fit the buffer, the call returns -2
+// and bfbridge_instance_get_required_len tells the length needed. The
+// library can do this for you: an instance made with
+// bfbridge_make_growable_instance owns its buffer, which starts small
+// and, when a call returns -2, grows (up to max_len) and the call is
+// retried. The buffer then moves, so get it with
+// bfbridge_instance_get_communication_buffer after every call that grows it
+// and don't keep pointers into it.
+
+// Like bfbridge_make_instance, allocating a buffer of initial_len bytes
+// that bfbridge_free_instance frees. On failure, bfbridge_free_instance is a noop
+BFBRIDGE_INLINE_ME_EXTRA bfbridge_error_t *bfbridge_make_growable_instance(
+    bfbridge_instance_t *dest,
+    bfbridge_thread_t *thread,
+    int initial_len,
+    int max_len);
+
+// Replaces the buffer of an instance whose caller owns the buffer,
+// for example with a larger one after a call returned -2.
+// The previous buffer can be freed after this returns NULL.
+// On failure, returns error and the previous buffer is kept
+BFBRIDGE_INLINE_ME_EXTRA bfbridge_error_t *bfbridge_instance_set_communication_buffer(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    char *communication_buffer, int communication_buffer_len);
+
+// After a call returned -2: the buffer length the call needs, at least
+// (an encoded tile, for example, can't know its length before encoding).
+// 0 if unknown or if the last call didn't return -2
+BFBRIDGE_INLINE_ME int bfbridge_instance_get_required_len(bfbridge_instance_t *instance);
+
+// The largest number of bytes that a call wrote to, or needed in,
+// the buffer since the instance was made, to size buffers
+BFBRIDGE_INLINE_ME int bfbridge_instance_get_high_water(bfbridge_instance_t *instance);
+
+// Shrinks the buffer of a growable instance to len bytes if longer,
+// for example after it has been idle. Keeps the first len bytes
+// returns: 0, or -1 if the instance isn't growable or on failure
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_instance_shrink(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread, int len);
+
 // Return a C string with the last error
 // This should only be called when the last bf_* method returned an error code
 // May otherwise return undisplayable characters
@@ -360,14 +483,130 @@ BFBRIDGE_INLINE_ME int bf_get_8_bit_lookup_table(
 BFBRIDGE_INLINE_ME int bf_get_16_bit_lookup_table(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread);
 
+// plane: the image index, from 0 to bf_get_image_count() - 1
+// For slides, usually 0
 BFBRIDGE_INLINE_ME int bf_open_bytes(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread,
     int plane, int x, int y, int w, int h);
 
+// Output orders of bf_open_bytes_stack, as BioFormats dimension orders:
+// the first of Z, C and T varies fastest
+typedef enum bfbridge_stack_order
+{
+    BFBRIDGE_ORDER_XYZCT = 0,
+    BFBRIDGE_ORDER_XYZTC = 1,
+    BFBRIDGE_ORDER_XYCZT = 2,
+    BFBRIDGE_ORDER_XYCTZ = 3,
+    BFBRIDGE_ORDER_XYTCZ = 4,
+    BFBRIDGE_ORDER_XYTZC = 5,
+} bfbridge_stack_order_t;
+
+// Reads a region of z_count * c_count * t_count planes, from
+// (z, c, t), in one call. Writes the planes one after another,
+// each as bf_open_bytes would, in the bfbridge_stack_order_t order.
+// c is from 0 to bf_get_effective_size_c() - 1
+// returns: the number of bytes written, or -2 if the buffer is too small
+BFBRIDGE_INLINE_ME int bf_open_bytes_stack(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int x, int y, int w, int h, int z, int z_count,
+    int c, int c_count, int t, int t_count, int order);
+
+// A tile to read with bf_open_bytes_batch
+typedef struct bfbridge_tile_request
+{
+    int plane;
+    int x;
+    int y;
+    int w;
+    int h;
+} bfbridge_tile_request_t;
+
+// The table bf_open_bytes_batch writes to the
+// beginning of the communication buffer, one for each tile
+typedef struct bfbridge_tile_result
+{
+    // from the beginning of the communication buffer
+    int offset;
+    // bytes to read, as bf_open_bytes would return
+    int length;
+    // 1: success, -1: could not be read, -2: did not fit into the buffer
+    int status;
+} bfbridge_tile_result_t;
+
+// Reads count tiles with a single call to Java
+// Copies requests to the communication buffer, so please
+// do not pass a pointer inside the communication buffer.
+// Returns -2 without calling Java if count * sizeof(bfbridge_tile_request_t)
+// bytes don't fit (growable instances grow first). If you define
+// BFBRIDGE_KNOW_BUFFER_LEN, please make sure that they fit
+// After the call, the communication buffer starts with count
+// bfbridge_tile_result_t and the tiles follow it
+// (each starting at an 8 byte aligned offset)
+// Tiles failing individually do not set an error message
+// returns: the number of bytes written, or negative on error
+// Little endian hosts only, like bf_get_16_bit_lookup_table
+BFBRIDGE_INLINE_ME int bf_open_bytes_batch(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_tile_request_t *requests, int count);
+
+// Writes two little endian 64 bit integers, hits and misses
+// of the Java array pool that bf_open_bytes reads pixels into
+// returns: the number of bytes written (16)
+BFBRIDGE_INLINE_ME int bf_get_pixel_pool_stats(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread);
+
+// Writes a w x h thumbnail of the plane in the current series, in the
+// pixel format of bf_open_bytes, area-downsampled from the smallest
+// resolution at least as large. Keeps the current resolution
+// returns: the number of bytes written, or -2 if the buffer is too small
 BFBRIDGE_INLINE_ME int bf_open_thumb_bytes(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread,
     int plane, int w, int h);
 
+typedef enum bfbridge_encoded_format
+{
+    BFBRIDGE_ENCODED_JPEG = 0,
+    BFBRIDGE_ENCODED_PNG = 1,
+} bfbridge_encoded_format_t;
+
+// Reads a region like bf_open_bytes and writes it encoded as a
+// bfbridge_encoded_format_t instead of raw pixels, converted to 8 bit:
+// grayscale, RGB, or RGBA for 4 channel PNG.
+// quality: 1 to 100 for JPEG, ignored for PNG
+// returns: the number of bytes written, or -2 if the buffer is too small
+BFBRIDGE_INLINE_ME int bf_open_bytes_encoded(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int format, int quality, int plane, int x, int y, int w, int h);
+
+typedef enum bfbridge_compressed_format
+{
+    // Decoded pixels, as bf_open_bytes returns them
+    BFBRIDGE_COMPRESSED_NONE = 0,
+    BFBRIDGE_COMPRESSED_JPEG = 1,
+    BFBRIDGE_COMPRESSED_JPEG2000 = 2,
+} bfbridge_compressed_format_t;
+
+// Written by bf_open_compressed_tile before the data
+typedef struct bfbridge_compressed_tile_header
+{
+    // bfbridge_compressed_format_t
+    int format;
+    // Bytes of data following this header
+    int length;
+} bfbridge_compressed_tile_header_t;
+
+// If the region is exactly a stored tile (not an edge tile) of a JPEG or
+// JPEG 2000 compressed file whose reader supports it, writes a header
+// then that tile as stored in the file, without decoding it.
+// Otherwise writes a header with BFBRIDGE_COMPRESSED_NONE then what
+// bf_open_bytes would. JPEG tiles can be abbreviated streams whose
+// tables are stored once in the file, depending on the reader.
+// returns: the number of bytes written including the header,
+// or -2 if the buffer is too small
+BFBRIDGE_INLINE_ME int bf_open_compressed_tile(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int plane, int x, int y, int w, int h);
+
 BFBRIDGE_INLINE_ME double bf_get_mpp_x(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread,
     int series);
@@ -383,6 +622,553 @@ BFBRIDGE_INLINE_ME double bf_get_mpp_z(
 BFBRIDGE_INLINE_ME int bf_dump_ome_xml_metadata(
     bfbridge_instance_t *instance, bfbridge_thread_t *thread);
 
+// The current series and resolution as returned by the
+// bf_get_* functions of the same names, in one call.
+// Booleans are 1 or 0.
+typedef struct bfbridge_image_info
+{
+    // For the current series, 0 if not defined
+    double mpp_x;
+    double mpp_y;
+    double mpp_z;
+    int series_count;
+    int current_series;
+    int resolution_count;
+    int current_resolution;
+    int size_x;
+    int size_y;
+    int size_c;
+    int size_z;
+    // As bf_get_size_t; not named size_t, which is a type
+    int size_time;
+    int effective_size_c;
+    int image_count;
+    int is_order_certain;
+    int optimal_tile_width;
+    int optimal_tile_height;
+    int pixel_type;
+    int bits_per_pixel;
+    int bytes_per_pixel;
+    int rgb_channel_count;
+    int is_rgb;
+    int is_interleaved;
+    int is_little_endian;
+    int is_indexed_color;
+    int is_false_color;
+    int padding;
+} bfbridge_image_info_t;
+
+// Fills *dest (if not NULL) and the beginning of the communication buffer
+// returns: the number of bytes written, sizeof(bfbridge_image_info_t),
+// or negative on error, in which case *dest is not modified
+// Little endian hosts only, like bf_get_16_bit_lookup_table
+BFBRIDGE_INLINE_ME int bf_get_image_info(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_image_info_t *dest);
+
+// A resolution of a series, as written by bf_get_pyramid_layout
+typedef struct bfbridge_pyramid_level
+{
+    // Micrometers per pixel at this resolution (scaled from
+    // the largest resolution of the series), 0 if not defined
+    double mpp_x;
+    double mpp_y;
+    int series;
+    int resolution;
+    int size_x;
+    int size_y;
+    int optimal_tile_width;
+    int optimal_tile_height;
+    int pixel_type;
+    int rgb_channel_count;
+} bfbridge_pyramid_level_t;
+
+// Writes a bfbridge_pyramid_level_t for every resolution of every series
+// to the communication buffer, ordered by series then resolution,
+// without changing the current series and resolution
+// returns: the number of bytes written, which is the level count
+// times sizeof(bfbridge_pyramid_level_t)
+// Little endian hosts only, like bf_get_16_bit_lookup_table
+BFBRIDGE_INLINE_ME int bf_get_pyramid_layout(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread);
+
+// Java side timing, as written by bf_get_java_stats
+typedef struct bfbridge_java_stats
+{
+    // reader.openBytes
+    long long open_bytes_calls;
+    long long open_bytes_ns;
+    // reader.setId, when opening files
+    long long set_id_calls;
+    long long set_id_ns;
+    // Copies of pixels to the communication buffer
+    long long copy_calls;
+    long long copy_ns;
+    long long copy_bytes;
+} bfbridge_java_stats_t;
+
+// Fills *dest (if not NULL) and the beginning of the communication buffer
+// with the counters of this instance. All zero unless the BFBRIDGE_STATS
+// environment variable was set before bfbridge_make_vm
+// returns: the number of bytes written, sizeof(bfbridge_java_stats_t),
+// or negative on error, in which case *dest is not modified
+// Little endian hosts only, like bf_get_16_bit_lookup_table
+BFBRIDGE_INLINE_ME int bf_get_java_stats(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_java_stats_t *dest);
+
+// Statistics
+// Counts calls, errors (negative results), bytes written and a latency
+// histogram for bf_* functions, per function and summed over threads.
+// Each thread updates its own counters without locking.
+// Disabled by default: then a call costs one branch. Enabled by
+// bfbridge_set_stats_enabled or by setting the BFBRIDGE_STATS
+// environment variable to a nonzero value before bfbridge_make_vm.
+// With BFBRIDGE_INLINE, each compilation unit has its own counters.
+
+typedef struct bfbridge_call_stats
+{
+    // Such as "BFOpenBytes" or "bf_open_bytes_cached". Not to be freed
+    const char *name;
+    unsigned long long calls;
+    unsigned long long errors;
+    // Sum of positive results of functions that return a byte count
+    unsigned long long bytes;
+    unsigned long long total_ns;
+    // latency_buckets[i] counts calls that took 2^i to 2^(i+1) - 1
+    // nanoseconds; bucket 0 also has those under 1 ns
+    unsigned long long latency_buckets[40];
+} bfbridge_call_stats_t;
+
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_set_stats_enabled(int enabled);
+
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_get_stats_enabled(void);
+
+// Fills dest with up to max functions that were called at least once
+// returns: the number of such functions, which may be more than max
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_get_stats(bfbridge_call_stats_t *dest, int max);
+
+// Zeroes the counters. Calls in progress in other threads may still be counted
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_reset_stats(void);
+
+// Tile cache
+// Decoded tiles shared between instances and threads, with a byte budget.
+// Split into shards, each with its own lock and CLOCK eviction.
+// bf_open_bytes_cached and bfbridge_pool_t (with bfbridge_pool_set_tile_cache)
+// serve hits from it without calling Java.
+
+typedef struct bfbridge_tile_key
+{
+    // Such as from bfbridge_tile_cache_file_id
+    long long file_id;
+    int series;
+    int resolution;
+    int plane;
+    int x;
+    int y;
+    int w;
+    int h;
+} bfbridge_tile_key_t;
+
+typedef struct bfbridge_tile_cache_stats
+{
+    long long hits;
+    long long misses;
+    long long insertions;
+    long long evictions;
+    long long invalidations;
+    long long bytes;
+    long long entries;
+} bfbridge_tile_cache_stats_t;
+
+typedef struct bfbridge_tile_cache
+{
+    struct bfbridge_tile_cache_internal *internal;
+} bfbridge_tile_cache_t;
+
+// max_bytes: budget for tile bytes, divided equally between shards
+// shard_count: for example the number of threads using the cache
+// On success, returns NULL and fills *dest
+// On failure, returns error, and bfbridge_free_tile_cache is a noop
+BFBRIDGE_INLINE_ME_EXTRA bfbridge_error_t *bfbridge_make_tile_cache(
+    bfbridge_tile_cache_t *dest, long long max_bytes, int shard_count);
+
+// Must not be in use by other threads or by a pool
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_free_tile_cache(bfbridge_tile_cache_t *cache);
+
+// A file id for tile keys: a hash of the filepath
+BFBRIDGE_INLINE_ME long long bfbridge_tile_cache_file_id(
+    const char *filepath, int filepath_len);
+
+// Copies the tile to dest if cached and if it fits dest_len
+// returns: the tile length, or -1 if not cached, or -2 if dest_len is too small
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_tile_cache_get(
+    bfbridge_tile_cache_t *cache, const bfbridge_tile_key_t *key,
+    char *dest, int dest_len);
+
+// Copies len bytes of tile to the cache, evicting as needed.
+// Tiles larger than the budget of a shard are not cached.
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_tile_cache_put(
+    bfbridge_tile_cache_t *cache, const bfbridge_tile_key_t *key,
+    const char *tile, int len);
+
+// Removes the tiles of a file, such as when it changed on disk
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_tile_cache_invalidate_file(
+    bfbridge_tile_cache_t *cache, long long file_id);
+
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_tile_cache_get_stats(
+    bfbridge_tile_cache_t *cache, bfbridge_tile_cache_stats_t *dest);
+
+// bf_open_bytes through the cache. key->series and key->resolution must be
+// the current series and resolution of the file key->file_id open in the instance
+// Like bf_open_bytes, writes to the communication buffer and
+// returns the number of bytes written
+// If you define BFBRIDGE_KNOW_BUFFER_LEN, tiles are added to the cache
+// but never read from it, as a cached tile may not fit this buffer
+BFBRIDGE_INLINE_ME int bf_open_bytes_cached(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_tile_cache_t *cache, const bfbridge_tile_key_t *key);
+
+// Tiler
+// Serves DeepZoom and IIIF tiles of a series in a single call. A tile is
+// read from the smallest resolution at least as detailed as asked and,
+// if the pyramid has no resolution of that scale (e.g. DeepZoom's 2x steps
+// over a pyramid of 4x steps), area-downsampled in C. Tiles are written
+// to the communication buffer in the pixel format of bf_open_bytes.
+// The tiler describes the file open when it was made; it doesn't change.
+
+typedef struct bfbridge_tiler
+{
+    int series;
+    int tile_size;
+    int overlap;
+    // Of the largest resolution
+    int size_x;
+    int size_y;
+    // DeepZoom levels: level_count - 1 is the largest resolution,
+    // each level below is half the size, rounded up, down to 1x1
+    int level_count;
+    int pixel_type;
+    int rgb_channel_count;
+    int bytes_per_sample;
+    int is_interleaved;
+    int is_little_endian;
+    int resolution_count;
+    // Width then height of each resolution. NULL if not made
+    int *resolution_sizes;
+    // The resolution the last tile was read from, now the current one
+    int current_resolution;
+} bfbridge_tiler_t;
+
+// Describes the given series of the open file, and sets it as the current one.
+// tile_size: of DeepZoom tiles, e.g. 254; overlap: pixels added to each
+// side of a DeepZoom tile that has a neighbor there, e.g. 1
+// On success, returns NULL and fills *tiler
+BFBRIDGE_INLINE_ME_EXTRA bfbridge_error_t *bfbridge_make_tiler(
+    bfbridge_tiler_t *tiler, bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int series, int tile_size, int overlap);
+
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_free_tiler(bfbridge_tiler_t *tiler);
+
+// Sets the size of a DeepZoom level and its number of tile columns and rows
+// returns: 0, or -1 if there is no such level
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_tiler_get_level_size(
+    const bfbridge_tiler_t *tiler, int level,
+    int *w, int *h, int *columns, int *rows);
+
+// Sets the rectangle that a DeepZoom tile covers in its level, overlap included
+// returns: 0, or -1 if there is no such tile
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_tiler_get_tile_rect(
+    const bfbridge_tiler_t *tiler, int level, int column, int row,
+    int *x, int *y, int *w, int *h);
+
+// Writes the DeepZoom tile, of the size that bfbridge_tiler_get_tile_rect
+// gives. Sets the current series and resolution
+// returns: the number of bytes written, -1 on a BioFormats error,
+// -2 if the buffer is too small, or -3 if there is no such tile
+// or memory could not be allocated
+BFBRIDGE_INLINE_ME int bf_open_deepzoom_tile(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_tiler_t *tiler, int plane, int level, int column, int row);
+
+// Writes the region x, y, w, h of the largest resolution scaled to
+// out_w x out_h, as a IIIF Image API request of that region and size.
+// The region is clipped to the image. Otherwise as bf_open_deepzoom_tile
+// If you define BFBRIDGE_KNOW_BUFFER_LEN, returns -2 when the output is
+// larger than the pixels read for it, as when upscaling
+BFBRIDGE_INLINE_ME int bf_open_iiif_region(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    bfbridge_tiler_t *tiler, int plane, int x, int y, int w, int h,
+    int out_w, int out_h);
+
+// Streaming reads
+// Reads regions too large for the communication buffer, such as a whole
+// slide for export, in strips of one row of tiles, aligned to the
+// optimal tile size. A strip too large for the communication buffer is
+// read in tile-aligned parts and assembled in C. Peak memory is two
+// strips, whatever the size of the region.
+
+// Rows y to y + h - 1 of the region, in the resolution's coordinates
+typedef struct bfbridge_region_strip
+{
+    int x;
+    int y;
+    int w;
+    int h;
+    // From 0 to count - 1
+    int index;
+    int count;
+    // len bytes, as bf_open_bytes would return for x, y, w, h
+    char *data;
+    int len;
+} bfbridge_region_strip_t;
+
+// Returns 0 to continue, or nonzero to stop reading.
+// strip->data is reused after it returns
+typedef int (*bfbridge_region_sink_t)(
+    const bfbridge_region_strip_t *strip, void *user_data);
+
+// Reads the region of plane in the current series and resolution
+// strip by strip and calls sink with each, in order. sink is called
+// from another thread while this one reads the next strip.
+// returns: the number of strips given to sink, or -1 on a BioFormats
+// error, -2 if a tile does not fit the communication buffer, or -3 if
+// the region is out of the image or memory could not be allocated
+// If you define BFBRIDGE_KNOW_BUFFER_LEN, always returns -3, as strips
+// can't be planned without the buffer length; bfbridge_make_region_stream
+// is available
+BFBRIDGE_INLINE_ME_EXTRA int bf_read_region_stream(
+    bfbridge_instance_t *instance, bfbridge_thread_t *thread,
+    int plane, int x, int y, int w, int h,
+    bfbridge_region_sink_t sink, void *user_data);
+
+// Reader pool
+// A bfbridge_instance_t can be used only from the thread of its
+// bfbridge_thread_t. bfbridge_pool_t owns worker threads, each attached
+// to the JVM with its own bfbridge_thread_t, bfbridge_instance_t and
+// communication buffer, and reads regions into caller memory.
+// Requests are distributed among the workers' queues and idle
+// workers steal from the others.
+
+struct bfbridge_pool_request;
+
+// Called from a worker thread when an asynchronous request is done.
+// Must not call bfbridge_free_pool
+typedef void (*bfbridge_pool_callback_t)(
+    struct bfbridge_pool_request *request, void *user_data);
+
+// A region to read with a bfbridge_pool_t
+typedef struct bfbridge_pool_request
+{
+    // Input:
+    // The file is opened (and the series and resolution set)
+    // only if the worker doesn't already have it open
+    char *filepath;
+    int filepath_len;
+    int series;
+    int resolution;
+    int plane;
+    int x;
+    int y;
+    int w;
+    int h;
+    // If nonzero, reads a w x h thumbnail of plane as
+    // bf_open_thumb_bytes does; x and y are ignored
+    int thumbnail;
+    // If nonzero, writes the bfbridge_image_info_t of the series and
+    // resolution as bf_get_image_info does; plane to h are ignored
+    int info;
+    // If nonzero, the read bypasses the tile cache and prefetching, for
+    // large one-off regions such as the parts of bfbridge_make_region_stream
+    int uncached;
+    // Caller memory that receives the bytes bf_open_bytes would return
+    char *dest;
+    int dest_len;
+
+    // Output:
+    // The number of bytes written to dest, or negative:
+    // as returned by bf_open, bf_set_current_series,
+    // bf_set_current_resolution, bf_open_bytes, bf_open_thumb_bytes
+    // or bf_get_image_info, or -2 if dest_len is too small
+    int result;
+
+    // Internal
+    int done;
+    int async;
+    bfbridge_pool_callback_t callback;
+    void *user_data;
+    struct bfbridge_pool_request *next_completed;
+} bfbridge_pool_request_t;
+
+typedef struct bfbridge_pool
+{
+    struct bfbridge_pool_internal *internal;
+} bfbridge_pool_t;
+
+// Starts thread_count worker threads, each with a communication
+// buffer of up to communication_buffer_len bytes. The buffers start
+// at 1 MB, grow as needed and shrink back when their worker has been
+// idle for a second.
+// Can be called from any thread after bfbridge_make_vm.
+// On success, returns NULL and fills *dest
+// On failure, returns error, and bfbridge_free_pool is a noop
+BFBRIDGE_INLINE_ME_EXTRA bfbridge_error_t *bfbridge_make_pool(
+    bfbridge_pool_t *dest,
+    bfbridge_vm_t *vm,
+    int thread_count,
+    int communication_buffer_len);
+
+// Queues requests and returns without waiting. The requests,
+// their filepaths and dest must stay valid until bfbridge_pool_wait
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_pool_submit(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *requests, int count);
+
+// Waits until the given submitted requests are done.
+// Multiple threads can submit and wait on the same pool
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_pool_wait(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *requests, int count);
+
+// Workers serve requests from the cache when possible and add
+// what they read to it. NULL to stop using a cache.
+// Call when no requests are pending
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_pool_set_tile_cache(
+    bfbridge_pool_t *pool, bfbridge_tile_cache_t *cache);
+
+// bfbridge_pool_submit then bfbridge_pool_wait
+BFBRIDGE_INLINE_ME void bfbridge_pool_read(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *requests, int count);
+
+// Asynchronous requests, for event loops:
+// Queues a request and returns without waiting. The request, its
+// filepath and dest must stay valid until it completes. On completion
+// a worker thread calls callback(request, user_data), or if callback
+// is NULL, the request is added to the completion queue,
+// see bfbridge_pool_take_completed
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_pool_open_bytes_async(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *request,
+    bfbridge_pool_callback_t callback, void *user_data);
+
+// Same, setting request->thumbnail
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_pool_open_thumb_bytes_async(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *request,
+    bfbridge_pool_callback_t callback, void *user_data);
+
+// Same, setting request->info
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_pool_get_image_info_async(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t *request,
+    bfbridge_pool_callback_t callback, void *user_data);
+
+// A file descriptor that is readable while the completion queue is not
+// empty, for poll, epoll or an event loop. Owned by the pool: don't read
+// or close it. An eventfd on Linux, otherwise a pipe.
+// Returns -1 if it could not be created
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_pool_get_completion_fd(bfbridge_pool_t *pool);
+
+// Moves up to max completed requests from the completion queue
+// to dest, in completion order, and returns how many
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_pool_take_completed(
+    bfbridge_pool_t *pool, bfbridge_pool_request_t **dest, int max);
+
+// Prefetching
+// Predicts the tiles a viewer will request next from the tile requests
+// the pool serves, and decodes them into the pool's tile cache on idle
+// workers: the tiles around each requested tile, tiles ahead in the
+// direction the requests move, and the tiles of the next more detailed
+// resolution under it. Requests of a file, series and plane are taken
+// as one viewer, with tiles of one size that are clipped at the image
+// edges. A viewer's predictions not started yet are cancelled when its
+// requests move away from them or to another resolution.
+// Requests always come first.
+
+typedef struct bfbridge_prefetch_config
+{
+    // Rings of tiles around each requested tile: 1 for the 8 adjacent
+    // tiles, 2 for 24, at most 3. 0 for none
+    int neighbor_rings;
+    // Most tiles to read ahead in the direction of panning, at most 16.
+    // The depth adapts between 1 and this to how many prefetched tiles
+    // are requested. 0 for none
+    int max_readahead;
+    // Nonzero to prefetch the tiles under a requested tile
+    // in the next more detailed resolution
+    int zoom_in;
+    // Predictions waiting for a worker; the oldest are dropped beyond this
+    int max_queued;
+    // Workers that may prefetch at once, so that the others are free
+    // for requests
+    int max_workers;
+} bfbridge_prefetch_config_t;
+
+typedef struct bfbridge_prefetch_stats
+{
+    // Tile requests served by the pool while prefetching
+    long long requests;
+    // Predictions queued
+    long long predicted;
+    // Predictions dropped before decoding: stale, cached meanwhile,
+    // or beyond max_queued
+    long long cancelled;
+    // Predictions decoded into the tile cache
+    long long decoded;
+    // Predictions that could not be read
+    long long failed;
+    // Prefetched tiles later requested and served from the cache.
+    // Hit ratio: hits / decoded. Requests served: hits / requests
+    long long hits;
+    // Prefetched tiles evicted before being requested or not requested
+    // until 8 * max_queued later ones were prefetched.
+    // Waste ratio: wasted / decoded
+    long long wasted;
+    // Current readahead depth
+    int readahead;
+    int queue_length;
+} bfbridge_prefetch_stats_t;
+
+// Enables prefetching with config, or disables it if NULL. Requires
+// a tile cache, see bfbridge_pool_set_tile_cache.
+// Drops the queued predictions. Call when no requests are pending
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_pool_set_prefetch(
+    bfbridge_pool_t *pool, const bfbridge_prefetch_config_t *config);
+
+// Counters since the pool was made. Zero if prefetching was never enabled
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_pool_get_prefetch_stats(
+    bfbridge_pool_t *pool, bfbridge_prefetch_stats_t *dest);
+
+// Streaming reads with a pool
+// Reads a region strip by strip like bf_read_region_stream, with the
+// parts of a strip spread over the workers. While the caller handles
+// a strip, the workers read the next one. Peak memory is three strips.
+
+typedef struct bfbridge_region_stream
+{
+    struct bfbridge_region_stream_internal *internal;
+} bfbridge_region_stream_t;
+
+// Reads the image info of the file, then queues the first strip.
+// The pool must outlive the stream
+// On success, returns NULL and fills *dest
+// On failure, returns error, and bfbridge_free_region_stream is a noop
+BFBRIDGE_INLINE_ME_EXTRA bfbridge_error_t *bfbridge_make_region_stream(
+    bfbridge_region_stream_t *dest, bfbridge_pool_t *pool,
+    const char *filepath, int filepath_len, int series, int resolution,
+    int plane, int x, int y, int w, int h);
+
+// Waits for the next strip and queues the one after it
+// returns: 1 and fills *strip, whose data is valid until the next call,
+// 0 after the last strip, or the negative result of a failed part
+// (see bfbridge_pool_request_t), after which it returns 0
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_region_stream_next(
+    bfbridge_region_stream_t *stream, bfbridge_region_strip_t *strip);
+
+// Waits for the queued parts and frees the buffers.
+// Does not free the stream struct but its contents
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_free_region_stream(
+    bfbridge_region_stream_t *stream);
+
+// Waits for the queued requests, stops the workers and frees their
+// instances and buffers. Does not free the pool struct but its contents.
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_free_pool(bfbridge_pool_t *pool);
+
 // -----CFFI HEADER END-----
 // The marker above is for our Python CFFI compiler
 
@@ -0,0 +1,766 @@
+// bfbridge_convert.c
+
+// If inlining but erroneously still compiling .c, make it empty
+#if !(defined(BFBRIDGE_INLINE) && !defined(BFBRIDGE_CONVERT_HEADER))
+
+#include "bfbridge_convert.h"
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BFBRIDGE_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+// Planar sources are converted this many pixels of a channel
+// at once and then interleaved from the stack
+#define BFBRIDGE_CONVERT_CHUNK 1024
+
+typedef struct bfbridge_convert_state
+{
+    int pixel_type;
+    int little_endian;
+    int simd_level;
+    // If nonzero, out = (value - low) * scale, rounded and clamped:
+    // the window, or the normalization of float types
+    int scaled;
+    double low;
+    double scale;
+    // 8 bit, 16 bit and float types compute in float, like the SIMD code
+    float low_f;
+    float scale_f;
+} bfbridge_convert_state_t;
+
+static const int bfbridge_convert_bytes_per_sample[] = {1, 1, 2, 2, 4, 4, 4, 8, 1};
+
+static unsigned int convert_load16(const unsigned char *p, int little_endian)
+{
+    return little_endian ? p[0] | (p[1] << 8) : (p[0] << 8) | p[1];
+}
+
+static unsigned int convert_load32(const unsigned char *p, int little_endian)
+{
+    return little_endian
+        ? p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24)
+        : ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static double convert_load_float(const unsigned char *p, int pixel_type, int little_endian)
+{
+    if (pixel_type == BFBRIDGE_PIXEL_FLOAT)
+    {
+        unsigned int bits = convert_load32(p, little_endian);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return f;
+    }
+    unsigned long long bits = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        bits |= (unsigned long long)p[little_endian ? i : 7 - i] << (8 * i);
+    }
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+// Clamps to 0 to 255 then rounds half to even, as the SIMD code does.
+// NaN gives 0. Without branches, as pixel data is unpredictable:
+// adding 2^52 leaves no fraction bits so the default rounding mode
+// rounds half to even (don't compile with -ffast-math)
+static unsigned char convert_round(double x)
+{
+    x = x > 0 ? x : 0;
+    x = x < 255 ? x : 255;
+    return (unsigned char)((x + 4503599627370496.0) - 4503599627370496.0);
+}
+
+// Same with 2^23 for float
+static unsigned char convert_roundf(float x)
+{
+    x = x > 0 ? x : 0;
+    x = x < 255 ? x : 255;
+    return (unsigned char)((x + 8388608.0f) - 8388608.0f);
+}
+
+// The highest 8 bits of v, rounded half to even, at most 255
+static unsigned char convert_shift(unsigned int v, int shift)
+{
+    unsigned long long half = 1ull << (shift - 1);
+    unsigned int high = (unsigned int)((v + (half - 1) + ((v >> shift) & 1)) >> shift);
+    return high > 255 ? 255 : (unsigned char)high;
+}
+
+static void convert_run_scalar(
+    const unsigned char *src, unsigned char *dest, int count,
+    const bfbridge_convert_state_t *s)
+{
+    int is_signed = s->pixel_type == BFBRIDGE_PIXEL_INT8 ||
+                    s->pixel_type == BFBRIDGE_PIXEL_INT16 ||
+                    s->pixel_type == BFBRIDGE_PIXEL_INT32;
+    switch (s->pixel_type)
+    {
+    case BFBRIDGE_PIXEL_INT8:
+    case BFBRIDGE_PIXEL_UINT8:
+        if (s->scaled)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                int v = is_signed ? (int)(src[i] ^ 0x80) - 128 : src[i];
+                dest[i] = convert_roundf(((float)v - s->low_f) * s->scale_f);
+            }
+        }
+        else if (is_signed)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                dest[i] = src[i] ^ 0x80;
+            }
+        }
+        else
+        {
+            memcpy(dest, src, count);
+        }
+        break;
+    case BFBRIDGE_PIXEL_INT16:
+    case BFBRIDGE_PIXEL_UINT16:
+        for (int i = 0; i < count; i++)
+        {
+            unsigned int v = convert_load16(src + 2 * i, s->little_endian);
+            if (s->scaled)
+            {
+                int value = is_signed ? (int)(v ^ 0x8000) - 32768 : (int)v;
+                dest[i] = convert_roundf(((float)value - s->low_f) * s->scale_f);
+            }
+            else
+            {
+                dest[i] = convert_shift(is_signed ? v ^ 0x8000 : v, 8);
+            }
+        }
+        break;
+    case BFBRIDGE_PIXEL_INT32:
+    case BFBRIDGE_PIXEL_UINT32:
+        for (int i = 0; i < count; i++)
+        {
+            unsigned int v = convert_load32(src + 4 * i, s->little_endian);
+            if (s->scaled)
+            {
+                double value = is_signed && v >= 0x80000000u ? (double)v - 4294967296.0 : (double)v;
+                dest[i] = convert_round((value - s->low) * s->scale);
+            }
+            else
+            {
+                dest[i] = convert_shift(is_signed ? v ^ 0x80000000u : v, 24);
+            }
+        }
+        break;
+    case BFBRIDGE_PIXEL_FLOAT:
+        for (int i = 0; i < count; i++)
+        {
+            float value = (float)convert_load_float(src + 4 * i, s->pixel_type, s->little_endian);
+            dest[i] = convert_roundf((value - s->low_f) * s->scale_f);
+        }
+        break;
+    case BFBRIDGE_PIXEL_DOUBLE:
+        for (int i = 0; i < count; i++)
+        {
+            double value = convert_load_float(src + 8 * i, s->pixel_type, s->little_endian);
+            dest[i] = convert_round((value - s->low) * s->scale);
+        }
+        break;
+    case BFBRIDGE_PIXEL_BIT:
+        for (int i = 0; i < count; i++)
+        {
+            dest[i] = src[i] ? 255 : 0;
+        }
+        break;
+    }
+}
+
+#ifdef BFBRIDGE_CONVERT_X86
+
+// Returns how many samples were converted, a multiple of 8, 16 or 32.
+// The caller converts the rest
+
+// Stores 16 values of two vectors of int32 as 8 bit, saturating
+__attribute__((target("avx2")))
+static inline void convert_store16_avx2(unsigned char *dest, __m256i a, __m256i b)
+{
+    // packs works within 128 bit lanes
+    __m256i packed16 = _mm256_permute4x64_epi64(
+        _mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+    __m128i packed8 = _mm_packus_epi16(
+        _mm256_castsi256_si128(packed16), _mm256_extracti128_si256(packed16, 1));
+    _mm_storeu_si128((__m128i *)dest, packed8);
+}
+
+__attribute__((target("avx2")))
+static int convert_run16_avx2(
+    const unsigned char *src, unsigned char *dest, int count,
+    const bfbridge_convert_state_t *s)
+{
+    const __m256i swap = _mm256_setr_epi8(
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+        1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    int is_signed = s->pixel_type == BFBRIDGE_PIXEL_INT16;
+    int i = 0;
+    if (!s->scaled)
+    {
+        const __m256i sign = _mm256_set1_epi16((short)0x8000);
+        const __m256i low_byte = _mm256_set1_epi16(0xff);
+        const __m256i half = _mm256_set1_epi16(128);
+        const __m256i one = _mm256_set1_epi16(1);
+        for (; i + 32 <= count; i += 32)
+        {
+            __m256i v[2];
+            v[0] = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+            v[1] = _mm256_loadu_si256((const __m256i *)(src + 2 * i + 32));
+            for (int k = 0; k < 2; k++)
+            {
+                if (!s->little_endian)
+                {
+                    v[k] = _mm256_shuffle_epi8(v[k], swap);
+                }
+                if (is_signed)
+                {
+                    v[k] = _mm256_xor_si256(v[k], sign);
+                }
+                // As convert_shift: round half to even; 256 saturates below
+                __m256i high = _mm256_srli_epi16(v[k], 8);
+                __m256i rest = _mm256_and_si256(v[k], low_byte);
+                __m256i up = _mm256_or_si256(
+                    _mm256_cmpgt_epi16(rest, half),
+                    _mm256_and_si256(_mm256_cmpeq_epi16(rest, half),
+                                     _mm256_cmpeq_epi16(_mm256_and_si256(high, one), one)));
+                v[k] = _mm256_add_epi16(high, _mm256_and_si256(up, one));
+            }
+            // packus works within 128 bit lanes
+            __m256i packed = _mm256_permute4x64_epi64(
+                _mm256_packus_epi16(v[0], v[1]), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm256_storeu_si256((__m256i *)(dest + i), packed);
+        }
+    }
+    else
+    {
+        const __m256 low = _mm256_set1_ps(s->low_f);
+        const __m256 scale = _mm256_set1_ps(s->scale_f);
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 max = _mm256_set1_ps(255);
+        for (; i + 16 <= count; i += 16)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+            if (!s->little_endian)
+            {
+                v = _mm256_shuffle_epi8(v, swap);
+            }
+            __m256i r[2];
+            for (int k = 0; k < 2; k++)
+            {
+                __m128i half_v = k ? _mm256_extracti128_si256(v, 1) : _mm256_castsi256_si128(v);
+                __m256i wide = is_signed ? _mm256_cvtepi16_epi32(half_v) : _mm256_cvtepu16_epi32(half_v);
+                __m256 x = _mm256_mul_ps(_mm256_sub_ps(_mm256_cvtepi32_ps(wide), low), scale);
+                // As convert_roundf: clamp (NaN to 0) then round half to even
+                x = _mm256_min_ps(_mm256_max_ps(x, zero), max);
+                r[k] = _mm256_cvtps_epi32(x);
+            }
+            convert_store16_avx2(dest + i, r[0], r[1]);
+        }
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int convert_run_float_avx2(
+    const unsigned char *src, unsigned char *dest, int count,
+    const bfbridge_convert_state_t *s)
+{
+    const __m256i swap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256 low = _mm256_set1_ps(s->low_f);
+    const __m256 scale = _mm256_set1_ps(s->scale_f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 max = _mm256_set1_ps(255);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i r[2];
+        for (int k = 0; k < 2; k++)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(src + 4 * (i + 8 * k)));
+            if (!s->little_endian)
+            {
+                v = _mm256_shuffle_epi8(v, swap);
+            }
+            __m256 x = _mm256_mul_ps(_mm256_sub_ps(_mm256_castsi256_ps(v), low), scale);
+            x = _mm256_min_ps(_mm256_max_ps(x, zero), max);
+            r[k] = _mm256_cvtps_epi32(x);
+        }
+        convert_store16_avx2(dest + i, r[0], r[1]);
+    }
+    return i;
+}
+
+// Updates *min and *max, skipping NaN
+__attribute__((target("avx2")))
+static int convert_min_max_float_avx2(
+    const unsigned char *src, int count, int little_endian, float *min, float *max)
+{
+    const __m256i swap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256 low = _mm256_set1_ps(*min);
+    __m256 high = _mm256_set1_ps(*max);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+        if (!little_endian)
+        {
+            v = _mm256_shuffle_epi8(v, swap);
+        }
+        // Returns the second operand if the first is NaN
+        low = _mm256_min_ps(_mm256_castsi256_ps(v), low);
+        high = _mm256_max_ps(_mm256_castsi256_ps(v), high);
+    }
+    float lows[8];
+    float highs[8];
+    _mm256_storeu_ps(lows, low);
+    _mm256_storeu_ps(highs, high);
+    for (int k = 0; k < 8; k++)
+    {
+        *min = lows[k] < *min ? lows[k] : *min;
+        *max = highs[k] > *max ? highs[k] : *max;
+    }
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+static int convert_run16_sse41(
+    const unsigned char *src, unsigned char *dest, int count,
+    const bfbridge_convert_state_t *s)
+{
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    int is_signed = s->pixel_type == BFBRIDGE_PIXEL_INT16;
+    int i = 0;
+    if (!s->scaled)
+    {
+        const __m128i sign = _mm_set1_epi16((short)0x8000);
+        const __m128i low_byte = _mm_set1_epi16(0xff);
+        const __m128i half = _mm_set1_epi16(128);
+        const __m128i one = _mm_set1_epi16(1);
+        for (; i + 16 <= count; i += 16)
+        {
+            __m128i v[2];
+            v[0] = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+            v[1] = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+            for (int k = 0; k < 2; k++)
+            {
+                if (!s->little_endian)
+                {
+                    v[k] = _mm_shuffle_epi8(v[k], swap);
+                }
+                if (is_signed)
+                {
+                    v[k] = _mm_xor_si128(v[k], sign);
+                }
+                __m128i high = _mm_srli_epi16(v[k], 8);
+                __m128i rest = _mm_and_si128(v[k], low_byte);
+                __m128i up = _mm_or_si128(
+                    _mm_cmpgt_epi16(rest, half),
+                    _mm_and_si128(_mm_cmpeq_epi16(rest, half),
+                                  _mm_cmpeq_epi16(_mm_and_si128(high, one), one)));
+                v[k] = _mm_add_epi16(high, _mm_and_si128(up, one));
+            }
+            _mm_storeu_si128((__m128i *)(dest + i), _mm_packus_epi16(v[0], v[1]));
+        }
+    }
+    else
+    {
+        const __m128 low = _mm_set1_ps(s->low_f);
+        const __m128 scale = _mm_set1_ps(s->scale_f);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 max = _mm_set1_ps(255);
+        for (; i + 8 <= count; i += 8)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+            if (!s->little_endian)
+            {
+                v = _mm_shuffle_epi8(v, swap);
+            }
+            __m128i r[2];
+            for (int k = 0; k < 2; k++)
+            {
+                __m128i half_v = k ? _mm_srli_si128(v, 8) : v;
+                __m128i wide = is_signed ? _mm_cvtepi16_epi32(half_v) : _mm_cvtepu16_epi32(half_v);
+                __m128 x = _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(wide), low), scale);
+                x = _mm_min_ps(_mm_max_ps(x, zero), max);
+                r[k] = _mm_cvtps_epi32(x);
+            }
+            __m128i packed16 = _mm_packs_epi32(r[0], r[1]);
+            _mm_storel_epi64((__m128i *)(dest + i), _mm_packus_epi16(packed16, packed16));
+        }
+    }
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+static int convert_run_float_sse41(
+    const unsigned char *src, unsigned char *dest, int count,
+    const bfbridge_convert_state_t *s)
+{
+    const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m128 low = _mm_set1_ps(s->low_f);
+    const __m128 scale = _mm_set1_ps(s->scale_f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 max = _mm_set1_ps(255);
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i r[2];
+        for (int k = 0; k < 2; k++)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + 4 * (i + 4 * k)));
+            if (!s->little_endian)
+            {
+                v = _mm_shuffle_epi8(v, swap);
+            }
+            __m128 x = _mm_mul_ps(_mm_sub_ps(_mm_castsi128_ps(v), low), scale);
+            x = _mm_min_ps(_mm_max_ps(x, zero), max);
+            r[k] = _mm_cvtps_epi32(x);
+        }
+        __m128i packed16 = _mm_packs_epi32(r[0], r[1]);
+        _mm_storel_epi64((__m128i *)(dest + i), _mm_packus_epi16(packed16, packed16));
+    }
+    return i;
+}
+
+__attribute__((target("sse4.1")))
+static int convert_min_max_float_sse41(
+    const unsigned char *src, int count, int little_endian, float *min, float *max)
+{
+    const __m128i swap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m128 low = _mm_set1_ps(*min);
+    __m128 high = _mm_set1_ps(*max);
+    int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + 4 * i));
+        if (!little_endian)
+        {
+            v = _mm_shuffle_epi8(v, swap);
+        }
+        low = _mm_min_ps(_mm_castsi128_ps(v), low);
+        high = _mm_max_ps(_mm_castsi128_ps(v), high);
+    }
+    float lows[4];
+    float highs[4];
+    _mm_storeu_ps(lows, low);
+    _mm_storeu_ps(highs, high);
+    for (int k = 0; k < 4; k++)
+    {
+        *min = lows[k] < *min ? lows[k] : *min;
+        *max = highs[k] > *max ? highs[k] : *max;
+    }
+    return i;
+}
+
+#endif // BFBRIDGE_CONVERT_X86
+
+// Of float and double types, skipping NaN.
+// If there are only NaN, *min > *max
+static void convert_min_max(
+    const unsigned char *src, int count, const bfbridge_convert_state_t *s,
+    double *min, double *max)
+{
+    int done = 0;
+    *min = DBL_MAX;
+    *max = -DBL_MAX;
+#ifdef BFBRIDGE_CONVERT_X86
+    if (s->pixel_type == BFBRIDGE_PIXEL_FLOAT && s->simd_level)
+    {
+        float min_f = FLT_MAX;
+        float max_f = -FLT_MAX;
+        if (s->simd_level >= 2)
+        {
+            done = convert_min_max_float_avx2(src, count, s->little_endian, &min_f, &max_f);
+        }
+        else
+        {
+            done = convert_min_max_float_sse41(src, count, s->little_endian, &min_f, &max_f);
+        }
+        *min = min_f;
+        *max = max_f;
+    }
+#endif
+    int bytes = bfbridge_convert_bytes_per_sample[s->pixel_type];
+    for (int i = done; i < count; i++)
+    {
+        double value = convert_load_float(src + (size_t)i * bytes, s->pixel_type, s->little_endian);
+        // False for NaN
+        if (value < *min)
+        {
+            *min = value;
+        }
+        if (value > *max)
+        {
+            *max = value;
+        }
+    }
+}
+
+static void convert_run(
+    const unsigned char *src, unsigned char *dest, int count,
+    const bfbridge_convert_state_t *s)
+{
+    int done = 0;
+#ifdef BFBRIDGE_CONVERT_X86
+    if (s->pixel_type == BFBRIDGE_PIXEL_INT16 || s->pixel_type == BFBRIDGE_PIXEL_UINT16)
+    {
+        if (s->simd_level >= 2)
+        {
+            done = convert_run16_avx2(src, dest, count, s);
+        }
+        else if (s->simd_level == 1)
+        {
+            done = convert_run16_sse41(src, dest, count, s);
+        }
+    }
+    else if (s->pixel_type == BFBRIDGE_PIXEL_FLOAT)
+    {
+        if (s->simd_level >= 2)
+        {
+            done = convert_run_float_avx2(src, dest, count, s);
+        }
+        else if (s->simd_level == 1)
+        {
+            done = convert_run_float_sse41(src, dest, count, s);
+        }
+    }
+#endif
+    int bytes = bfbridge_convert_bytes_per_sample[s->pixel_type];
+    convert_run_scalar(src + (size_t)done * bytes, dest + done, count - done, s);
+}
+
+int bfbridge_convert_get_simd_level(void)
+{
+#ifdef BFBRIDGE_CONVERT_X86
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return 2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+int bfbridge_convert_to_8bit(
+    const char *src, int src_len, unsigned char *dest, int pixel_count,
+    const bfbridge_convert_options_t *options)
+{
+    int pixel_type = options->pixel_type;
+    int channels = options->channels;
+    if (pixel_type < BFBRIDGE_PIXEL_INT8 || pixel_type > BFBRIDGE_PIXEL_BIT ||
+        channels <= 0 || pixel_count < 0)
+    {
+        return -1;
+    }
+    int bytes = bfbridge_convert_bytes_per_sample[pixel_type];
+    if ((long long)pixel_count * channels * bytes != src_len)
+    {
+        return -1;
+    }
+    const unsigned char *source = (const unsigned char *)src;
+    int samples = pixel_count * channels;
+
+    bfbridge_convert_state_t s;
+    s.pixel_type = pixel_type;
+    s.little_endian = options->is_little_endian;
+    s.simd_level = options->disable_simd ? 0 : bfbridge_convert_get_simd_level();
+    s.scaled = 0;
+    s.low = 0;
+    s.scale = 1;
+    if (options->window_width > 0 && pixel_type != BFBRIDGE_PIXEL_BIT)
+    {
+        s.scaled = 1;
+        s.low = options->window_center - options->window_width / 2;
+        s.scale = 255 / options->window_width;
+    }
+    else if (pixel_type == BFBRIDGE_PIXEL_FLOAT || pixel_type == BFBRIDGE_PIXEL_DOUBLE)
+    {
+        // Needs a pass of its own
+        double min;
+        double max;
+        convert_min_max(source, samples, &s, &min, &max);
+        s.scaled = 1;
+        // Already normalized unless out of 0 to 1
+        s.scale = 255.4999;
+        if (min <= max && (min < 0 || max > 1))
+        {
+            s.low = min;
+            s.scale = max > min ? 255.4999 / (max - min) : 0;
+        }
+    }
+    s.low_f = (float)s.low;
+    s.scale_f = (float)s.scale;
+
+    if (options->is_interleaved || channels == 1)
+    {
+        convert_run(source, dest, samples, &s);
+        return 0;
+    }
+
+    unsigned char chunk[BFBRIDGE_CONVERT_CHUNK];
+    for (int p = 0; p < pixel_count; p += BFBRIDGE_CONVERT_CHUNK)
+    {
+        int n = pixel_count - p < BFBRIDGE_CONVERT_CHUNK ? pixel_count - p : BFBRIDGE_CONVERT_CHUNK;
+        for (int c = 0; c < channels; c++)
+        {
+            convert_run(source + ((size_t)c * pixel_count + p) * bytes, chunk, n, &s);
+            unsigned char *out = dest + (size_t)p * channels + c;
+            for (int j = 0; j < n; j++)
+            {
+                out[(size_t)j * channels] = chunk[j];
+            }
+        }
+    }
+    return 0;
+}
+
+int bfbridge_make_lut(
+    bfbridge_lut_t *lut, const char *table, int table_len, int bits)
+{
+    lut->entries = NULL;
+    if (bits != 8 && bits != 16)
+    {
+        return -1;
+    }
+    int entry_count = bits == 8 ? 256 : 65536;
+    int row_bytes = entry_count * (bits / 8);
+    if (table_len <= 0 || table_len % row_bytes != 0 || table_len / row_bytes > 4)
+    {
+        return -1;
+    }
+    int channels = table_len / row_bytes;
+    unsigned int *entries = (unsigned int *)calloc(entry_count, sizeof(unsigned int));
+    if (!entries)
+    {
+        return -1;
+    }
+    const unsigned char *t = (const unsigned char *)table;
+    for (int c = 0; c < channels; c++)
+    {
+        for (int i = 0; i < entry_count; i++)
+        {
+            unsigned int v = bits == 8
+                ? t[c * entry_count + i]
+                : convert_shift(convert_load16(t + 2 * (c * entry_count + i), 1), 8);
+            entries[i] |= v << (8 * c);
+        }
+    }
+    lut->entries = entries;
+    lut->entry_count = entry_count;
+    lut->channels = channels;
+    return 0;
+}
+
+void bfbridge_free_lut(bfbridge_lut_t *lut)
+{
+    free(lut->entries);
+    lut->entries = NULL;
+}
+
+#ifdef BFBRIDGE_CONVERT_X86
+
+// Returns how many pixels were expanded, the caller expands the rest
+__attribute__((target("avx2")))
+static int lut_apply_avx2(
+    const bfbridge_lut_t *lut, const unsigned char *src, unsigned char *dest,
+    int count, int wide, int little_endian)
+{
+    int channels = lut->channels;
+    // Packs the lowest channels bytes of the 4 entries of a lane
+    // to the start of the lane
+    char mask[16];
+    for (int k = 0; k < 16; k++)
+    {
+        mask[k] = k < 4 * channels ? (char)(k / channels * 4 + k % channels) : (char)0x80;
+    }
+    const __m256i pack = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)mask));
+    const __m128i swap = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    const int *base = (const int *)lut->entries;
+    int i = 0;
+    // The store of the second lane writes 16 - 4 * channels bytes
+    // past the 8 pixels, overwritten by the next iteration
+    for (; i + 8 <= count && (long long)channels * (i + 4) + 16 <= (long long)channels * count; i += 8)
+    {
+        __m256i index;
+        if (wide)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+            if (!little_endian)
+            {
+                v = _mm_shuffle_epi8(v, swap);
+            }
+            index = _mm256_cvtepu16_epi32(v);
+        }
+        else
+        {
+            index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+        }
+        __m256i e = _mm256_i32gather_epi32(base, index, 4);
+        if (channels == 4)
+        {
+            _mm256_storeu_si256((__m256i *)(dest + 4 * i), e);
+            continue;
+        }
+        e = _mm256_shuffle_epi8(e, pack);
+        _mm_storeu_si128((__m128i *)(dest + channels * i), _mm256_castsi256_si128(e));
+        _mm_storeu_si128((__m128i *)(dest + channels * (i + 4)), _mm256_extracti128_si256(e, 1));
+    }
+    return i;
+}
+
+#endif // BFBRIDGE_CONVERT_X86
+
+int bfbridge_lut_apply(
+    const bfbridge_lut_t *lut, const char *src, int src_len, unsigned char *dest,
+    int pixel_count, int pixel_type, int is_little_endian, int disable_simd)
+{
+    int wide = pixel_type == BFBRIDGE_PIXEL_INT16 || pixel_type == BFBRIDGE_PIXEL_UINT16;
+    if (!lut->entries || pixel_count < 0 ||
+        (!wide && pixel_type != BFBRIDGE_PIXEL_INT8 && pixel_type != BFBRIDGE_PIXEL_UINT8) ||
+        (wide && lut->entry_count != 65536) ||
+        (long long)pixel_count * (wide ? 2 : 1) != src_len)
+    {
+        return -1;
+    }
+    const unsigned char *source = (const unsigned char *)src;
+    int channels = lut->channels;
+    int done = 0;
+#ifdef BFBRIDGE_CONVERT_X86
+    if (!disable_simd && bfbridge_convert_get_simd_level() >= 2)
+    {
+        done = lut_apply_avx2(lut, source, dest, pixel_count, wide, is_little_endian);
+    }
+#else
+    (void)disable_simd;
+#endif
+    for (int i = done; i < pixel_count; i++)
+    {
+        unsigned int index = wide ? convert_load16(source + 2 * i, is_little_endian) : source[i];
+        unsigned int e = lut->entries[index];
+        unsigned char *out = dest + (size_t)i * channels;
+        for (int c = 0; c < channels; c++)
+        {
+            out[c] = (unsigned char)(e >> (8 * c));
+        }
+    }
+    return 0;
+}
+
+#endif // !(defined(BFBRIDGE_INLINE) && !defined(BFBRIDGE_CONVERT_HEADER))
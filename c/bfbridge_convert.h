@@ -0,0 +1,119 @@
+// bfbridge_convert.h
+
+// Converts pixels as bf_open_bytes returns them to 8 bit interleaved
+// samples for display, in one pass: planar to interleaved, byte order,
+// signed to unsigned and bit depth reduction, with an optional window,
+// or through the lookup table of an indexed color image.
+// Doesn't need the JVM. Uses AVX2 or SSE4.1 when the CPU has them.
+
+// Optionally define: BFBRIDGE_INLINE, as for bfbridge_basiclib.h
+
+#ifndef BFBRIDGE_CONVERT_H
+#define BFBRIDGE_CONVERT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef BFBRIDGE_INLINE
+#define BFBRIDGE_INLINE_ME_EXTRA static
+#else
+#define BFBRIDGE_INLINE_ME_EXTRA
+#endif
+
+// The following marker is for our Python CFFI compiler:
+// -----CFFI HEADER BEGIN-----
+
+// As bf_get_pixel_type returns them
+// https://github.com/ome/bioformats/blob/9cb6cfaaa5361bc/components/formats-api/src/loci/formats/FormatTools.java#L98
+typedef enum bfbridge_pixel_type
+{
+    BFBRIDGE_PIXEL_INT8 = 0,
+    BFBRIDGE_PIXEL_UINT8 = 1,
+    BFBRIDGE_PIXEL_INT16 = 2,
+    BFBRIDGE_PIXEL_UINT16 = 3,
+    BFBRIDGE_PIXEL_INT32 = 4,
+    BFBRIDGE_PIXEL_UINT32 = 5,
+    BFBRIDGE_PIXEL_FLOAT = 6,
+    BFBRIDGE_PIXEL_DOUBLE = 7,
+    BFBRIDGE_PIXEL_BIT = 8,
+} bfbridge_pixel_type_t;
+
+typedef struct bfbridge_convert_options
+{
+    // Of the source, as bf_get_pixel_type, bf_get_rgb_channel_count,
+    // bf_is_interleaved and bf_is_little_endian return them
+    int pixel_type;
+    int channels;
+    int is_interleaved;
+    int is_little_endian;
+
+    // If window_width > 0, sample values (signed for signed types)
+    // from window_center - window_width / 2 to window_center + window_width / 2
+    // are mapped to 0 to 255, and the rest clamped.
+    // Otherwise: signed types are offset to unsigned, integers
+    // keep their highest 8 bits (rounded), floats are scaled
+    // by the minimum and maximum of src unless they are within 0 to 1,
+    // and bit type is 0 or 255
+    double window_center;
+    double window_width;
+
+    // Nonzero to use the scalar code only, for comparison
+    int disable_simd;
+} bfbridge_convert_options_t;
+
+// Converts pixel_count pixels from src to pixel_count * options->channels
+// 8 bit samples in dest, interleaved.
+// src_len: bytes in src, as bf_open_bytes returned
+// returns: 0, or -1 if the options are invalid or src_len doesn't match
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_convert_to_8bit(
+    const char *src, int src_len, unsigned char *dest, int pixel_count,
+    const bfbridge_convert_options_t *options);
+
+// 2 if AVX2 is used, 1 if SSE4.1 is used, 0 if only scalar code
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_convert_get_simd_level(void);
+
+// A lookup table of an indexed color image, prepared for
+// bfbridge_lut_apply. Make it once per series and resolution
+typedef struct bfbridge_lut
+{
+    // Entry i has the 8 bit samples of index i in its lowest bytes,
+    // channel 0 lowest. NULL if not made
+    unsigned int *entries;
+    // 256 or 65536
+    int entry_count;
+    // 1 to 4, usually 3
+    int channels;
+} bfbridge_lut_t;
+
+// table: as bf_get_8_bit_lookup_table (bits 8) or bf_get_16_bit_lookup_table
+// (bits 16) wrote it, a row of 256 or 65536 values per channel.
+// 16 bit values keep their highest 8 bits, rounded, like bfbridge_convert_to_8bit
+// returns: 0, or -1 if the table is invalid or memory could not be allocated
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_make_lut(
+    bfbridge_lut_t *lut, const char *table, int table_len, int bits);
+
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_free_lut(bfbridge_lut_t *lut);
+
+// Expands pixel_count indices in src, as bf_open_bytes returns them for an
+// indexed image (one channel of 8 or 16 bit type), to pixel_count * lut->channels
+// interleaved 8 bit samples in dest. Uses AVX2 gathers when available.
+// returns: 0, or -1 if the pixel type doesn't fit the table or src_len doesn't match
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_lut_apply(
+    const bfbridge_lut_t *lut, const char *src, int src_len, unsigned char *dest,
+    int pixel_count, int pixel_type, int is_little_endian, int disable_simd);
+
+// -----CFFI HEADER END-----
+// The marker above is for our Python CFFI compiler
+
+#ifdef BFBRIDGE_INLINE
+#define BFBRIDGE_CONVERT_HEADER
+#include "bfbridge_convert.c"
+#undef BFBRIDGE_CONVERT_HEADER
+#endif
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // BFBRIDGE_CONVERT_H
@@ -0,0 +1,1040 @@
+// bfbridge_shm.c
+
+// If inlining but erroneously still compiling .c, make it empty
+#if !(defined(BFBRIDGE_INLINE) && !defined(BFBRIDGE_SHM_HEADER))
+
+// ftruncate, shm_open and MSG_NOSIGNAL under -std=c11
+#if !defined(_GNU_SOURCE) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "bfbridge_shm.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+// macOS: SO_NOSIGPIPE is set on the socket instead
+#define MSG_NOSIGNAL 0
+#endif
+
+#define BFBRIDGE_SHM_MAGIC 0x4d534642u
+#define BFBRIDGE_SHM_VERSION 1
+// The ring header and each slot header take a cache line
+#define BFBRIDGE_SHM_LINE 64
+// Longer filepaths end the connection
+#define BFBRIDGE_SHM_MAX_FILEPATH 65536
+// Requests whose slot was reused before the client pinned it are sent again
+#define BFBRIDGE_SHM_ATTEMPTS 3
+
+typedef struct bfbridge_shm_ring_header
+{
+    // Written last by the creator
+    unsigned int magic;
+    int version;
+    int slot_count;
+    int slot_size;
+    // Claims so far: the next claim starts at this modulo slot_count
+    unsigned long long next;
+} bfbridge_shm_ring_header_t;
+
+typedef struct bfbridge_shm_slot_header
+{
+    // Even when free or published, odd while written
+    unsigned long long sequence;
+    unsigned int readers;
+    int length;
+} bfbridge_shm_slot_header_t;
+
+// Wire format: native byte order and layout, as both ends are on this host
+// On connecting, the server sends:
+typedef struct bfbridge_shm_hello
+{
+    unsigned int magic;
+    int version;
+    char shm_name[64];
+} bfbridge_shm_hello_t;
+
+// Then the client sends requests, each followed by filepath_len bytes
+typedef struct bfbridge_shm_wire_request
+{
+    unsigned long long id;
+    int filepath_len;
+    int thumbnail;
+    int series;
+    int resolution;
+    int plane;
+    int x;
+    int y;
+    int w;
+    int h;
+    int padding;
+} bfbridge_shm_wire_request_t;
+
+// And receives, in completion order:
+typedef struct bfbridge_shm_wire_response
+{
+    unsigned long long id;
+    int result;
+    int padding;
+    bfbridge_shm_handle_t handle;
+} bfbridge_shm_wire_response_t;
+
+// Ring
+
+static long long shm_slot_stride(int slot_size)
+{
+    return BFBRIDGE_SHM_LINE +
+           ((long long)slot_size + BFBRIDGE_SHM_LINE - 1) / BFBRIDGE_SHM_LINE * BFBRIDGE_SHM_LINE;
+}
+
+static long long shm_ring_len(int slot_count, int slot_size)
+{
+    return BFBRIDGE_SHM_LINE + slot_count * shm_slot_stride(slot_size);
+}
+
+static bfbridge_shm_slot_header_t *shm_slot(bfbridge_shm_ring_t *ring, int slot)
+{
+    return (bfbridge_shm_slot_header_t *)(ring->base + BFBRIDGE_SHM_LINE +
+                                          slot * shm_slot_stride(ring->slot_size));
+}
+
+static int shm_set_name(bfbridge_shm_ring_t *ring, const char *name)
+{
+    size_t slash = name[0] != '/';
+    if (strlen(name) + slash >= sizeof(ring->name))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    ring->name[0] = '/';
+    strcpy(ring->name + slash, name);
+    return 0;
+}
+
+int bfbridge_shm_ring_create(
+    bfbridge_shm_ring_t *ring, const char *name, int slot_count, int slot_size)
+{
+    // Ease of freeing
+    ring->base = NULL;
+    ring->owner = 0;
+    if (slot_count <= 0 || slot_size <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (shm_set_name(ring, name) < 0)
+    {
+        return -1;
+    }
+    long long len = shm_ring_len(slot_count, slot_size);
+    // Left by a server that didn't exit cleanly
+    shm_unlink(ring->name);
+    int fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    // Zero filled: every slot free with sequence 0
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, len) == 0)
+    {
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    int saved_errno = errno;
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        shm_unlink(ring->name);
+        errno = saved_errno;
+        return -1;
+    }
+    bfbridge_shm_ring_header_t *header = (bfbridge_shm_ring_header_t *)base;
+    header->version = BFBRIDGE_SHM_VERSION;
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    __atomic_store_n(&header->magic, BFBRIDGE_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    ring->base = (char *)base;
+    ring->mapped_len = len;
+    ring->slot_count = slot_count;
+    ring->slot_size = slot_size;
+    ring->owner = 1;
+    return 0;
+}
+
+int bfbridge_shm_ring_open(bfbridge_shm_ring_t *ring, const char *name)
+{
+    // Ease of freeing
+    ring->base = NULL;
+    ring->owner = 0;
+    if (shm_set_name(ring, name) < 0)
+    {
+        return -1;
+    }
+    int fd = shm_open(ring->name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0)
+    {
+        if (st.st_size < BFBRIDGE_SHM_LINE)
+        {
+            errno = EPROTO;
+        }
+        else
+        {
+            base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+    }
+    int saved_errno = errno;
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        errno = saved_errno;
+        return -1;
+    }
+    bfbridge_shm_ring_header_t *header = (bfbridge_shm_ring_header_t *)base;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != BFBRIDGE_SHM_MAGIC ||
+        header->version != BFBRIDGE_SHM_VERSION ||
+        header->slot_count <= 0 || header->slot_size <= 0 ||
+        shm_ring_len(header->slot_count, header->slot_size) != st.st_size)
+    {
+        munmap(base, st.st_size);
+        errno = EPROTO;
+        return -1;
+    }
+    ring->base = (char *)base;
+    ring->mapped_len = st.st_size;
+    ring->slot_count = header->slot_count;
+    ring->slot_size = header->slot_size;
+    return 0;
+}
+
+void bfbridge_shm_ring_close(bfbridge_shm_ring_t *ring)
+{
+    if (!ring->base)
+    {
+        return;
+    }
+    munmap(ring->base, ring->mapped_len);
+    ring->base = NULL;
+    if (ring->owner)
+    {
+        shm_unlink(ring->name);
+        ring->owner = 0;
+    }
+}
+
+char *bfbridge_shm_ring_claim(bfbridge_shm_ring_t *ring, bfbridge_shm_handle_t *handle)
+{
+    bfbridge_shm_ring_header_t *header = (bfbridge_shm_ring_header_t *)ring->base;
+    for (int tries = 0; tries < ring->slot_count; tries++)
+    {
+        int slot = (int)(__atomic_fetch_add(&header->next, 1, __ATOMIC_RELAXED) % ring->slot_count);
+        bfbridge_shm_slot_header_t *s = shm_slot(ring, slot);
+        unsigned long long sequence = __atomic_load_n(&s->sequence, __ATOMIC_RELAXED);
+        if ((sequence & 1) || __atomic_load_n(&s->readers, __ATOMIC_RELAXED) != 0)
+        {
+            continue;
+        }
+        if (!__atomic_compare_exchange_n(&s->sequence, &sequence, sequence + 1, 0,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+        // A reader increments readers before checking the sequence, and we
+        // changed the sequence before checking readers, so either it saw
+        // the change or we see it. Nothing was written yet, so restoring
+        // the sequence keeps its handle valid
+        if (__atomic_load_n(&s->readers, __ATOMIC_SEQ_CST) != 0)
+        {
+            __atomic_store_n(&s->sequence, sequence, __ATOMIC_RELEASE);
+            continue;
+        }
+        handle->slot = slot;
+        handle->padding = 0;
+        handle->sequence = sequence + 2;
+        return (char *)s + BFBRIDGE_SHM_LINE;
+    }
+    return NULL;
+}
+
+void bfbridge_shm_ring_publish(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle, int length)
+{
+    bfbridge_shm_slot_header_t *s = shm_slot(ring, handle->slot);
+    __atomic_store_n(&s->length, length, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->sequence, handle->sequence, __ATOMIC_RELEASE);
+}
+
+void bfbridge_shm_ring_abandon(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle)
+{
+    // Possibly partly overwritten: older handles must not match
+    bfbridge_shm_ring_publish(ring, handle, 0);
+}
+
+const char *bfbridge_shm_ring_pin(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle, int *length)
+{
+    if (handle->slot < 0 || handle->slot >= ring->slot_count)
+    {
+        return NULL;
+    }
+    bfbridge_shm_slot_header_t *s = shm_slot(ring, handle->slot);
+    __atomic_fetch_add(&s->readers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->sequence, __ATOMIC_SEQ_CST) != handle->sequence)
+    {
+        __atomic_fetch_sub(&s->readers, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    int len = __atomic_load_n(&s->length, __ATOMIC_RELAXED);
+    *length = len < 0 ? 0 : len > ring->slot_size ? ring->slot_size : len;
+    return (const char *)s + BFBRIDGE_SHM_LINE;
+}
+
+void bfbridge_shm_ring_unpin(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle)
+{
+    __atomic_fetch_sub(&shm_slot(ring, handle->slot)->readers, 1, __ATOMIC_RELEASE);
+}
+
+// Socket
+
+// returns: 0, or -1
+static int shm_write_all(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *)data;
+    while (len > 0)
+    {
+        ssize_t written = send(fd, p, len, MSG_NOSIGNAL);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// returns: 1, 0 if the connection was closed before any byte, or -1
+static int shm_read_all(int fd, void *data, size_t len)
+{
+    char *p = (char *)data;
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t got = recv(fd, p + done, len - done, 0);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            if (got == 0 && done == 0)
+            {
+                return 0;
+            }
+            return -1;
+        }
+        done += got;
+    }
+    return 1;
+}
+
+static void shm_no_sigpipe(int fd)
+{
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#else
+    (void)fd;
+#endif
+}
+
+static int shm_make_address(struct sockaddr_un *addr, const char *socket_path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return 0;
+}
+
+// Client
+
+int bfbridge_shm_connect(bfbridge_shm_client_t *client, const char *socket_path)
+{
+    // Ease of freeing
+    client->fd = -1;
+    client->next_id = 1;
+    client->ring.base = NULL;
+
+    struct sockaddr_un addr;
+    if (shm_make_address(&addr, socket_path) < 0)
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    shm_no_sigpipe(fd);
+    bfbridge_shm_hello_t hello;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        shm_read_all(fd, &hello, sizeof(hello)) != 1)
+    {
+        int saved_errno = errno ? errno : ECONNRESET;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    hello.shm_name[sizeof(hello.shm_name) - 1] = '\0';
+    if (hello.magic != BFBRIDGE_SHM_MAGIC || hello.version != BFBRIDGE_SHM_VERSION ||
+        bfbridge_shm_ring_open(&client->ring, hello.shm_name) < 0)
+    {
+        int saved_errno = hello.magic != BFBRIDGE_SHM_MAGIC ? EPROTO : errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    client->fd = fd;
+    return 0;
+}
+
+void bfbridge_shm_disconnect(bfbridge_shm_client_t *client)
+{
+    if (client->fd >= 0)
+    {
+        close(client->fd);
+        client->fd = -1;
+    }
+    bfbridge_shm_ring_close(&client->ring);
+}
+
+static int shm_request(
+    bfbridge_shm_client_t *client, const char *filepath, int filepath_len,
+    int thumbnail, int series, int resolution, int plane,
+    int x, int y, int w, int h, bfbridge_shm_tile_t *tile)
+{
+    tile->data = NULL;
+    tile->length = 0;
+    tile->ring = NULL;
+    if (client->fd < 0)
+    {
+        return -4;
+    }
+    if (filepath_len <= 0 || filepath_len > BFBRIDGE_SHM_MAX_FILEPATH)
+    {
+        return -1;
+    }
+    for (int attempt = 0; attempt < BFBRIDGE_SHM_ATTEMPTS; attempt++)
+    {
+        bfbridge_shm_wire_request_t request = {0};
+        request.id = client->next_id++;
+        request.filepath_len = filepath_len;
+        request.thumbnail = thumbnail;
+        request.series = series;
+        request.resolution = resolution;
+        request.plane = plane;
+        request.x = x;
+        request.y = y;
+        request.w = w;
+        request.h = h;
+        bfbridge_shm_wire_response_t response;
+        if (shm_write_all(client->fd, &request, sizeof(request)) < 0 ||
+            shm_write_all(client->fd, filepath, filepath_len) < 0 ||
+            shm_read_all(client->fd, &response, sizeof(response)) != 1 ||
+            response.id != request.id)
+        {
+            // Out of step with the server
+            close(client->fd);
+            client->fd = -1;
+            return -4;
+        }
+        if (response.result < 0)
+        {
+            return response.result;
+        }
+        int length;
+        const char *data = bfbridge_shm_ring_pin(&client->ring, &response.handle, &length);
+        if (data)
+        {
+            tile->data = data;
+            tile->length = length;
+            tile->handle = response.handle;
+            tile->ring = &client->ring;
+            return length;
+        }
+    }
+    return -6;
+}
+
+int bfbridge_shm_read_region(
+    bfbridge_shm_client_t *client, const char *filepath, int filepath_len,
+    int series, int resolution, int plane, int x, int y, int w, int h,
+    bfbridge_shm_tile_t *tile)
+{
+    return shm_request(client, filepath, filepath_len, 0, series, resolution,
+                       plane, x, y, w, h, tile);
+}
+
+int bfbridge_shm_read_thumbnail(
+    bfbridge_shm_client_t *client, const char *filepath, int filepath_len,
+    int series, int plane, int w, int h, bfbridge_shm_tile_t *tile)
+{
+    return shm_request(client, filepath, filepath_len, 1, series, 0,
+                       plane, 0, 0, w, h, tile);
+}
+
+void bfbridge_shm_release(bfbridge_shm_tile_t *tile)
+{
+    if (tile->ring)
+    {
+        bfbridge_shm_ring_unpin(tile->ring, &tile->handle);
+        tile->ring = NULL;
+        tile->data = NULL;
+    }
+}
+
+// Server
+
+typedef struct bfbridge_shm_connection
+{
+    struct bfbridge_shm_server_internal *server;
+    int fd;
+    // Responses are written by pool workers
+    pthread_mutex_t write_lock;
+    // Requests given to the pool and not done, protected by server->lock
+    int outstanding;
+    struct bfbridge_shm_connection *next;
+} bfbridge_shm_connection_t;
+
+typedef struct bfbridge_shm_job
+{
+    bfbridge_pool_request_t request;
+    bfbridge_shm_connection_t *connection;
+    unsigned long long id;
+    bfbridge_shm_handle_t handle;
+    // Followed by the filepath
+} bfbridge_shm_job_t;
+
+struct bfbridge_shm_server_internal
+{
+    bfbridge_pool_t pool;
+    bfbridge_shm_ring_t ring;
+    int listen_fd;
+    // Written to, to stop the accept thread
+    int stop_pipe[2];
+    pthread_t accept_thread;
+    struct sockaddr_un address;
+
+    // Protects the fields below and the outstanding field of connections
+    pthread_mutex_t lock;
+    // Signaled when a request is done or a connection ends
+    pthread_cond_t cond;
+    bfbridge_shm_connection_t *connections;
+    int connection_count;
+    // Set when freeing: connections take no new requests
+    int stopping;
+};
+
+// As make_error of bfbridge_basiclib.c, which is static.
+// Out of memory, returns bfbridge_out_of_memory_error(), never NULL
+static bfbridge_error_t *shm_make_error(
+    bfbridge_error_code_t code, const char *operation, const char *description)
+{
+    bfbridge_error_t *error = (bfbridge_error_t *)malloc(sizeof(bfbridge_error_t));
+    size_t len = strlen(operation) + (description ? strlen(description) : 0);
+    char *text = (char *)malloc(len + 1);
+    if (!error || !text)
+    {
+        free(error);
+        free(text);
+        return bfbridge_out_of_memory_error();
+    }
+    error->code = code;
+    error->description = text;
+    strcpy(error->description, operation);
+    if (description)
+    {
+        strcat(error->description, description);
+    }
+    return error;
+}
+
+static void shm_respond(
+    bfbridge_shm_connection_t *connection, unsigned long long id,
+    int result, const bfbridge_shm_handle_t *handle)
+{
+    bfbridge_shm_wire_response_t response = {0};
+    response.id = id;
+    response.result = result;
+    if (handle)
+    {
+        response.handle = *handle;
+    }
+    pthread_mutex_lock(&connection->write_lock);
+    // On failure the client is gone and the reading thread will notice
+    shm_write_all(connection->fd, &response, sizeof(response));
+    pthread_mutex_unlock(&connection->write_lock);
+}
+
+// Pool callback, on a worker thread
+static void shm_job_done(bfbridge_pool_request_t *request, void *user_data)
+{
+    bfbridge_shm_job_t *job = (bfbridge_shm_job_t *)user_data;
+    bfbridge_shm_connection_t *connection = job->connection;
+    struct bfbridge_shm_server_internal *server = connection->server;
+    if (request->result >= 0)
+    {
+        bfbridge_shm_ring_publish(&server->ring, &job->handle, request->result);
+    }
+    else
+    {
+        bfbridge_shm_ring_abandon(&server->ring, &job->handle);
+    }
+    shm_respond(connection, job->id, request->result, &job->handle);
+    free(job);
+
+    pthread_mutex_lock(&server->lock);
+    connection->outstanding--;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+}
+
+static void *shm_connection_main(void *arg)
+{
+    bfbridge_shm_connection_t *connection = (bfbridge_shm_connection_t *)arg;
+    struct bfbridge_shm_server_internal *server = connection->server;
+
+    // Requests are given to the pool as they arrive, so
+    // a client can have many in flight
+    for (;;)
+    {
+        bfbridge_shm_wire_request_t wire;
+        if (shm_read_all(connection->fd, &wire, sizeof(wire)) != 1 ||
+            wire.filepath_len <= 0 || wire.filepath_len > BFBRIDGE_SHM_MAX_FILEPATH)
+        {
+            break;
+        }
+        bfbridge_shm_job_t *job = (bfbridge_shm_job_t *)
+            malloc(sizeof(bfbridge_shm_job_t) + wire.filepath_len + 1);
+        if (!job)
+        {
+            break;
+        }
+        char *filepath = (char *)(job + 1);
+        if (shm_read_all(connection->fd, filepath, wire.filepath_len) != 1)
+        {
+            free(job);
+            break;
+        }
+        filepath[wire.filepath_len] = '\0';
+
+        // No new requests once the server is being freed
+        pthread_mutex_lock(&server->lock);
+        int stopping = server->stopping;
+        pthread_mutex_unlock(&server->lock);
+        if (stopping)
+        {
+            free(job);
+            break;
+        }
+
+        char *dest = bfbridge_shm_ring_claim(&server->ring, &job->handle);
+        if (!dest)
+        {
+            shm_respond(connection, wire.id, -5, NULL);
+            free(job);
+            continue;
+        }
+        memset(&job->request, 0, sizeof(job->request));
+        job->request.filepath = filepath;
+        job->request.filepath_len = wire.filepath_len;
+        job->request.series = wire.series;
+        job->request.resolution = wire.resolution;
+        job->request.plane = wire.plane;
+        job->request.x = wire.x;
+        job->request.y = wire.y;
+        job->request.w = wire.w;
+        job->request.h = wire.h;
+        job->request.dest = dest;
+        job->request.dest_len = server->ring.slot_size;
+        job->connection = connection;
+        job->id = wire.id;
+
+        pthread_mutex_lock(&server->lock);
+        connection->outstanding++;
+        pthread_mutex_unlock(&server->lock);
+        if (wire.thumbnail)
+        {
+            bfbridge_pool_open_thumb_bytes_async(&server->pool, &job->request, shm_job_done, job);
+        }
+        else
+        {
+            bfbridge_pool_open_bytes_async(&server->pool, &job->request, shm_job_done, job);
+        }
+    }
+
+    pthread_mutex_lock(&server->lock);
+    while (connection->outstanding > 0)
+    {
+        pthread_cond_wait(&server->cond, &server->lock);
+    }
+    bfbridge_shm_connection_t **link = &server->connections;
+    while (*link != connection)
+    {
+        link = &(*link)->next;
+    }
+    *link = connection->next;
+    server->connection_count--;
+    pthread_cond_broadcast(&server->cond);
+    pthread_mutex_unlock(&server->lock);
+
+    close(connection->fd);
+    pthread_mutex_destroy(&connection->write_lock);
+    free(connection);
+    return NULL;
+}
+
+static void shm_accept_connection(struct bfbridge_shm_server_internal *server, int fd)
+{
+    shm_no_sigpipe(fd);
+    bfbridge_shm_hello_t hello = {0};
+    hello.magic = BFBRIDGE_SHM_MAGIC;
+    hello.version = BFBRIDGE_SHM_VERSION;
+    strcpy(hello.shm_name, server->ring.name);
+    bfbridge_shm_connection_t *connection = (bfbridge_shm_connection_t *)
+        calloc(1, sizeof(bfbridge_shm_connection_t));
+    if (!connection || shm_write_all(fd, &hello, sizeof(hello)) < 0)
+    {
+        free(connection);
+        close(fd);
+        return;
+    }
+    connection->server = server;
+    connection->fd = fd;
+    pthread_mutex_init(&connection->write_lock, NULL);
+
+    // Listed before starting, as the thread unlists itself when done
+    pthread_mutex_lock(&server->lock);
+    connection->next = server->connections;
+    server->connections = connection;
+    server->connection_count++;
+    pthread_mutex_unlock(&server->lock);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t pthread;
+    int created = pthread_create(&pthread, &attr, shm_connection_main, connection) == 0;
+    pthread_attr_destroy(&attr);
+    if (!created)
+    {
+        pthread_mutex_lock(&server->lock);
+        bfbridge_shm_connection_t **link = &server->connections;
+        while (*link != connection)
+        {
+            link = &(*link)->next;
+        }
+        *link = connection->next;
+        server->connection_count--;
+        pthread_mutex_unlock(&server->lock);
+        close(fd);
+        pthread_mutex_destroy(&connection->write_lock);
+        free(connection);
+    }
+}
+
+static void *shm_accept_main(void *arg)
+{
+    struct bfbridge_shm_server_internal *server = (struct bfbridge_shm_server_internal *)arg;
+    struct pollfd fds[2];
+    fds[0].fd = server->listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = server->stop_pipe[0];
+    fds[1].events = POLLIN;
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents)
+        {
+            break;
+        }
+        if (!(fds[0].revents & POLLIN))
+        {
+            continue;
+        }
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd >= 0)
+        {
+            shm_accept_connection(server, fd);
+        }
+    }
+    return NULL;
+}
+
+static void shm_server_free_internal(struct bfbridge_shm_server_internal *server)
+{
+    if (server->listen_fd >= 0)
+    {
+        close(server->listen_fd);
+        unlink(server->address.sun_path);
+    }
+    if (server->stop_pipe[0] >= 0)
+    {
+        close(server->stop_pipe[0]);
+        close(server->stop_pipe[1]);
+    }
+    bfbridge_free_pool(&server->pool);
+    bfbridge_shm_ring_close(&server->ring);
+    pthread_cond_destroy(&server->cond);
+    pthread_mutex_destroy(&server->lock);
+    free(server);
+}
+
+bfbridge_error_t *bfbridge_make_shm_server(
+    bfbridge_shm_server_t *dest, bfbridge_vm_t *vm,
+    const char *socket_path, const char *shm_name,
+    int slot_count, int slot_size, int thread_count)
+{
+    // Ease of freeing
+    dest->internal = NULL;
+
+    struct bfbridge_shm_server_internal *server = (struct bfbridge_shm_server_internal *)
+        calloc(1, sizeof(struct bfbridge_shm_server_internal));
+    if (!server)
+    {
+        return shm_make_error(BFBRIDGE_OUT_OF_MEMORY_ERROR, "bfbridge_make_shm_server: out of memory", NULL);
+    }
+    server->listen_fd = -1;
+    server->stop_pipe[0] = server->stop_pipe[1] = -1;
+    pthread_mutex_init(&server->lock, NULL);
+    pthread_cond_init(&server->cond, NULL);
+
+    if (shm_make_address(&server->address, socket_path) < 0)
+    {
+        shm_server_free_internal(server);
+        return shm_make_error(BFBRIDGE_SHM_SERVER_FAILED, "bfbridge_make_shm_server: socket path too long: ", socket_path);
+    }
+    if (bfbridge_shm_ring_create(&server->ring, shm_name, slot_count, slot_size) < 0)
+    {
+        bfbridge_error_t *err = shm_make_error(BFBRIDGE_SHM_SERVER_FAILED,
+            "bfbridge_make_shm_server: could not create the shared memory ring: ", strerror(errno));
+        shm_server_free_internal(server);
+        return err;
+    }
+    // Worker buffers grow up to a slot
+    bfbridge_error_t *err = bfbridge_make_pool(&server->pool, vm, thread_count, slot_size);
+    if (err)
+    {
+        shm_server_free_internal(server);
+        return err;
+    }
+
+    const char *failed = NULL;
+    server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->listen_fd < 0)
+    {
+        failed = "bfbridge_make_shm_server: socket: ";
+    }
+    else
+    {
+        // A socket file left by a server that didn't exit cleanly
+        unlink(socket_path);
+        if (bind(server->listen_fd, (struct sockaddr *)&server->address, sizeof(server->address)) < 0)
+        {
+            failed = "bfbridge_make_shm_server: bind: ";
+            // Not ours to unlink
+            close(server->listen_fd);
+            server->listen_fd = -1;
+        }
+        else if (listen(server->listen_fd, SOMAXCONN) < 0)
+        {
+            failed = "bfbridge_make_shm_server: listen: ";
+        }
+        else if (pipe(server->stop_pipe) < 0)
+        {
+            failed = "bfbridge_make_shm_server: pipe: ";
+            server->stop_pipe[0] = server->stop_pipe[1] = -1;
+        }
+        else if (pthread_create(&server->accept_thread, NULL, shm_accept_main, server) != 0)
+        {
+            failed = "bfbridge_make_shm_server: could not start the accept thread: ";
+        }
+    }
+    if (failed)
+    {
+        err = shm_make_error(BFBRIDGE_SHM_SERVER_FAILED, failed, strerror(errno));
+        shm_server_free_internal(server);
+        return err;
+    }
+
+    dest->internal = server;
+    return NULL;
+}
+
+void bfbridge_free_shm_server(bfbridge_shm_server_t *dest)
+{
+    struct bfbridge_shm_server_internal *server = dest->internal;
+    if (!server)
+    {
+        return;
+    }
+    char stop = 1;
+    while (write(server->stop_pipe[1], &stop, 1) < 0 && errno == EINTR)
+    {
+    }
+    pthread_join(server->accept_thread, NULL);
+
+    // Connection threads see the end of their connection, wait
+    // for their requests, and unlist themselves
+    pthread_mutex_lock(&server->lock);
+    server->stopping = 1;
+    for (bfbridge_shm_connection_t *c = server->connections; c; c = c->next)
+    {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    while (server->connection_count > 0)
+    {
+        pthread_cond_wait(&server->cond, &server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    shm_server_free_internal(server);
+    dest->internal = NULL;
+}
+
+#else // WIN32
+
+// POSIX shared memory and Unix domain sockets only
+
+int bfbridge_shm_ring_create(
+    bfbridge_shm_ring_t *ring, const char *name, int slot_count, int slot_size)
+{
+    ring->base = NULL;
+    errno = ENOSYS;
+    return -1;
+}
+
+int bfbridge_shm_ring_open(bfbridge_shm_ring_t *ring, const char *name)
+{
+    ring->base = NULL;
+    errno = ENOSYS;
+    return -1;
+}
+
+void bfbridge_shm_ring_close(bfbridge_shm_ring_t *ring)
+{
+}
+
+char *bfbridge_shm_ring_claim(bfbridge_shm_ring_t *ring, bfbridge_shm_handle_t *handle)
+{
+    return NULL;
+}
+
+void bfbridge_shm_ring_publish(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle, int length)
+{
+}
+
+void bfbridge_shm_ring_abandon(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle)
+{
+}
+
+const char *bfbridge_shm_ring_pin(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle, int *length)
+{
+    return NULL;
+}
+
+void bfbridge_shm_ring_unpin(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle)
+{
+}
+
+int bfbridge_shm_connect(bfbridge_shm_client_t *client, const char *socket_path)
+{
+    client->fd = -1;
+    client->ring.base = NULL;
+    errno = ENOSYS;
+    return -1;
+}
+
+void bfbridge_shm_disconnect(bfbridge_shm_client_t *client)
+{
+}
+
+int bfbridge_shm_read_region(
+    bfbridge_shm_client_t *client, const char *filepath, int filepath_len,
+    int series, int resolution, int plane, int x, int y, int w, int h,
+    bfbridge_shm_tile_t *tile)
+{
+    tile->ring = NULL;
+    return -4;
+}
+
+int bfbridge_shm_read_thumbnail(
+    bfbridge_shm_client_t *client, const char *filepath, int filepath_len,
+    int series, int plane, int w, int h, bfbridge_shm_tile_t *tile)
+{
+    tile->ring = NULL;
+    return -4;
+}
+
+void bfbridge_shm_release(bfbridge_shm_tile_t *tile)
+{
+}
+
+bfbridge_error_t *bfbridge_make_shm_server(
+    bfbridge_shm_server_t *dest, bfbridge_vm_t *vm,
+    const char *socket_path, const char *shm_name,
+    int slot_count, int slot_size, int thread_count)
+{
+    dest->internal = NULL;
+    bfbridge_error_t *error = (bfbridge_error_t *)malloc(sizeof(bfbridge_error_t));
+    error->code = BFBRIDGE_SHM_SERVER_FAILED;
+    error->description = strdup("bfbridge_make_shm_server: not supported on Windows");
+    return error;
+}
+
+void bfbridge_free_shm_server(bfbridge_shm_server_t *server)
+{
+}
+
+#endif // WIN32
+
+#endif // !(defined(BFBRIDGE_INLINE) && !defined(BFBRIDGE_SHM_HEADER))
@@ -0,0 +1,177 @@
+// bfbridge_shm.h
+
+// Serves tiles to other processes through shared memory, so that many
+// processes (web server workers, data loaders) share one JVM.
+// A server process reads regions with a bfbridge_pool_t straight into a
+// POSIX shared memory ring of fixed size slots and answers requests made
+// over a Unix domain socket with slot handles. Clients map the ring and
+// read tiles without copying.
+// The ring and the client don't need the JVM. POSIX only.
+
+// Optionally define: BFBRIDGE_INLINE, as for bfbridge_basiclib.h
+
+#ifndef BFBRIDGE_SHM_H
+#define BFBRIDGE_SHM_H
+
+#include "bfbridge_basiclib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The following marker is for our Python CFFI compiler:
+// -----CFFI HEADER BEGIN-----
+
+// Ring
+// Slots are claimed by writers in turn with an atomic counter and are
+// reused unless a reader pinned them. Each slot has a sequence number,
+// odd while written, that handles carry, so that a reader can tell
+// when a slot it was handed has since been reused.
+
+typedef struct bfbridge_shm_ring
+{
+    // Start of the mapping, NULL if not open
+    char *base;
+    long long mapped_len;
+    int slot_count;
+    int slot_size;
+    // Nonzero for the creator, which unlinks the name when closing
+    int owner;
+    // As given to shm_open, starting with '/'
+    char name[64];
+} bfbridge_shm_ring_t;
+
+// A published tile: which slot and which write of it
+typedef struct bfbridge_shm_handle
+{
+    int slot;
+    int padding;
+    unsigned long long sequence;
+} bfbridge_shm_handle_t;
+
+// Creates and maps a ring of slot_count slots of slot_size bytes,
+// replacing any ring of the same name. name: at most 62 characters,
+// with or without the leading '/'
+// returns: 0, or -1 with errno set
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_shm_ring_create(
+    bfbridge_shm_ring_t *ring, const char *name, int slot_count, int slot_size);
+
+// Maps an existing ring
+// returns: 0, or -1 with errno set (EPROTO if it is not a ring)
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_shm_ring_open(
+    bfbridge_shm_ring_t *ring, const char *name);
+
+// Unmaps, and unlinks the name if this process created it.
+// A noop if not open
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_shm_ring_close(bfbridge_shm_ring_t *ring);
+
+// Writers (any thread, lock-free):
+// Claims a slot to write at most slot_size bytes to, then
+// bfbridge_shm_ring_publish or bfbridge_shm_ring_abandon it
+// returns: the slot memory, or NULL if every slot is being
+// written or pinned
+BFBRIDGE_INLINE_ME_EXTRA char *bfbridge_shm_ring_claim(
+    bfbridge_shm_ring_t *ring, bfbridge_shm_handle_t *handle);
+
+// Makes length bytes of a claimed slot readable with the handle
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_shm_ring_publish(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle, int length);
+
+// Returns a claimed slot without publishing it
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_shm_ring_abandon(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle);
+
+// Readers (any process that mapped the ring):
+// Keeps the slot of a published handle from being reused until
+// bfbridge_shm_ring_unpin. A process that exits while pinning
+// makes the slot unusable until the ring is recreated
+// returns: the tile and its length in *length, or NULL if the slot
+// was reused since the handle was published
+BFBRIDGE_INLINE_ME_EXTRA const char *bfbridge_shm_ring_pin(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle, int *length);
+
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_shm_ring_unpin(
+    bfbridge_shm_ring_t *ring, const bfbridge_shm_handle_t *handle);
+
+// Client
+// Each request is a round trip; use one client per thread
+
+typedef struct bfbridge_shm_client
+{
+    int fd;
+    unsigned long long next_id;
+    bfbridge_shm_ring_t ring;
+} bfbridge_shm_client_t;
+
+// A pinned tile, valid until bfbridge_shm_release
+typedef struct bfbridge_shm_tile
+{
+    const char *data;
+    int length;
+    bfbridge_shm_handle_t handle;
+    // NULL once released
+    bfbridge_shm_ring_t *ring;
+} bfbridge_shm_tile_t;
+
+// Connects to the server at socket_path and maps its ring
+// returns: 0, or -1 with errno set
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_shm_connect(
+    bfbridge_shm_client_t *client, const char *socket_path);
+
+// A noop if not connected. Tiles must have been released
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_shm_disconnect(bfbridge_shm_client_t *client);
+
+// Reads a region as bf_open_bytes would, opening the file and setting
+// the series and resolution as needed, and pins it in *tile
+// returns: the length, or as bfbridge_pool_request_t.result (-2 if it
+// doesn't fit a slot), or -4 if the connection failed, -5 if no slot
+// was free, -6 if slots were reused before they could be pinned
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_shm_read_region(
+    bfbridge_shm_client_t *client, const char *filepath, int filepath_len,
+    int series, int resolution, int plane, int x, int y, int w, int h,
+    bfbridge_shm_tile_t *tile);
+
+// Same for a w x h thumbnail as bf_open_thumb_bytes would
+BFBRIDGE_INLINE_ME_EXTRA int bfbridge_shm_read_thumbnail(
+    bfbridge_shm_client_t *client, const char *filepath, int filepath_len,
+    int series, int plane, int w, int h, bfbridge_shm_tile_t *tile);
+
+// Lets the slot be reused. A noop if already released
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_shm_release(bfbridge_shm_tile_t *tile);
+
+// Server
+
+typedef struct bfbridge_shm_server
+{
+    struct bfbridge_shm_server_internal *internal;
+} bfbridge_shm_server_t;
+
+// Creates the ring shm_name and a pool of thread_count workers, listens
+// on socket_path (replacing a stale socket file) and serves every client
+// connection from its own thread, with requests read in parallel.
+// Can be called from any thread after bfbridge_make_vm.
+// On success, returns NULL and fills *dest
+// On failure, returns error, and bfbridge_free_shm_server is a noop
+BFBRIDGE_INLINE_ME_EXTRA bfbridge_error_t *bfbridge_make_shm_server(
+    bfbridge_shm_server_t *dest, bfbridge_vm_t *vm,
+    const char *socket_path, const char *shm_name,
+    int slot_count, int slot_size, int thread_count);
+
+// Disconnects clients, stops the pool, and removes the socket
+// file and the ring name
+BFBRIDGE_INLINE_ME_EXTRA void bfbridge_free_shm_server(bfbridge_shm_server_t *server);
+
+// -----CFFI HEADER END-----
+// The marker above is for our Python CFFI compiler
+
+#ifdef BFBRIDGE_INLINE
+#define BFBRIDGE_SHM_HEADER
+#include "bfbridge_shm.c"
+#undef BFBRIDGE_SHM_HEADER
+#endif
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // BFBRIDGE_SHM_H
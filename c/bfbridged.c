@@ -0,0 +1,914 @@
+// bfbridged.c
+
+// Tile server daemon: owns the JVM, a bfbridge_pool_t of worker threads
+// each attached with its own bfbridge_instance_t, a tile cache and a
+// table of open files, and serves them over a Unix domain socket with
+// the protocol of bfbridged.h. Processes on the node then share one warm
+// JVM and one Memoizer cache instead of each starting a JVM.
+// Uses the environment variables BFBRIDGE_CLASSPATH and BFBRIDGE_CACHEDIR
+// like the Python package. POSIX only.
+
+// Build, in this directory, on one line:
+// cc -O2 -o bfbridged bfbridged.c bfbridge_basiclib.c
+//   -I"$JAVA_HOME/include" -I"$JAVA_HOME/include/linux"
+//   -L"$JAVA_HOME/lib/server" -Wl,-rpath,"$JAVA_HOME/lib/server" -ljvm -lpthread
+// Run:
+// BFBRIDGE_CLASSPATH=/path/to/jars ./bfbridged -s /run/bfbridged.sock
+
+#include "bfbridge_basiclib.h"
+#include "bfbridged.h"
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Longer payloads end the connection
+#define BFBRIDGED_MAX_PAYLOAD 65536
+// For regions of a series other than 0, whose pixel format
+// the file table doesn't have, and when the guess was too small
+#define BFBRIDGED_MAX_PIXEL_BYTES 16
+// A connection is not read while this many of its responses are unsent,
+// or while more than max_response_bytes of them are queued
+#define BFBRIDGED_MAX_UNSENT 256
+
+typedef struct bfbridged_file
+{
+    // NULL if unused
+    char *filepath;
+    int filepath_len;
+    // Handles are generation * file_capacity + index, so
+    // that handles of evicted files are not reused soon
+    int generation;
+    unsigned long long last_used;
+    // Of series 0, resolution 0
+    bfbridge_image_info_t info;
+} bfbridged_file_t;
+
+struct bfbridged;
+
+typedef struct bfbridged_queued_response
+{
+    bfbridged_response_t response;
+    // Owned, response.payload_len bytes or NULL
+    char *payload;
+    struct bfbridged_queued_response *next;
+} bfbridged_queued_response_t;
+
+typedef struct bfbridged_connection
+{
+    struct bfbridged *daemon;
+    int fd;
+    // Pool workers queue responses and the writer thread sends them, so
+    // that a client that reads slowly blocks only its own connection
+    pthread_t writer;
+    // Protects the fields below
+    pthread_mutex_t write_lock;
+    // Signaled when a response is queued or sent, or on closing
+    pthread_cond_t write_cond;
+    bfbridged_queued_response_t *queue_head;
+    bfbridged_queued_response_t *queue_tail;
+    long long queued_bytes;
+    // Requests read whose response is not sent yet
+    int unsent;
+    // Set once no more responses will be queued
+    int closing;
+    // Requests given to the pool and not done, protected by daemon->lock
+    int outstanding;
+    struct bfbridged_connection *next;
+} bfbridged_connection_t;
+
+typedef struct bfbridged_job
+{
+    bfbridge_pool_request_t request;
+    bfbridged_connection_t *connection;
+    unsigned long long id;
+    int op;
+    // Nonzero once dest was enlarged after -2
+    int retried;
+    // Followed by the filepath
+} bfbridged_job_t;
+
+typedef struct bfbridged
+{
+    bfbridge_vm_t vm;
+    bfbridge_pool_t pool;
+    bfbridge_tile_cache_t tile_cache;
+    int max_response_bytes;
+    int listen_fd;
+    struct sockaddr_un address;
+
+    // Protects the fields below and the outstanding field of connections
+    pthread_mutex_t lock;
+    // Signaled when a request is done or a connection ends
+    pthread_cond_t cond;
+    bfbridged_connection_t *connections;
+    int connection_count;
+    bfbridged_file_t *files;
+    int file_capacity;
+    unsigned long long file_clock;
+} bfbridged_t;
+
+// Written to by the signal handler
+static int bfbridged_stop_pipe[2] = {-1, -1};
+
+// returns: 0, or -1
+static int bfbridged_write_all(int fd, const void *data, size_t len)
+{
+    const char *p = (const char *)data;
+    while (len > 0)
+    {
+        ssize_t written = write(fd, p, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        p += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// returns: 1, 0 if the connection was closed before any byte, or -1
+static int bfbridged_read_all(int fd, void *data, size_t len)
+{
+    char *p = (char *)data;
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t got = read(fd, p + done, len - done);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return got == 0 && done == 0 ? 0 : -1;
+        }
+        done += got;
+    }
+    return 1;
+}
+
+// Queues a response for the writer thread and takes payload, which
+// it frees once sent, or at once if result is negative
+static void bfbridged_queue_response(
+    bfbridged_connection_t *connection, unsigned long long id,
+    int result, char *payload, int payload_len)
+{
+    bfbridged_queued_response_t *queued = (bfbridged_queued_response_t *)
+        malloc(sizeof(bfbridged_queued_response_t));
+    if (!queued)
+    {
+        // The client would wait for the response forever, so end the connection
+        free(payload);
+        shutdown(connection->fd, SHUT_RDWR);
+        pthread_mutex_lock(&connection->write_lock);
+        connection->unsent--;
+        pthread_cond_broadcast(&connection->write_cond);
+        pthread_mutex_unlock(&connection->write_lock);
+        return;
+    }
+    queued->response.id = id;
+    queued->response.result = result;
+    queued->response.payload_len = result >= 0 ? payload_len : 0;
+    queued->payload = payload;
+    queued->next = NULL;
+    if (queued->response.payload_len == 0)
+    {
+        free(payload);
+        queued->payload = NULL;
+    }
+    pthread_mutex_lock(&connection->write_lock);
+    if (connection->queue_tail)
+    {
+        connection->queue_tail->next = queued;
+    }
+    else
+    {
+        connection->queue_head = queued;
+    }
+    connection->queue_tail = queued;
+    connection->queued_bytes += queued->response.payload_len;
+    pthread_cond_broadcast(&connection->write_cond);
+    pthread_mutex_unlock(&connection->write_lock);
+}
+
+// As bfbridged_queue_response, copying payload
+static void bfbridged_respond(
+    bfbridged_connection_t *connection, unsigned long long id,
+    int result, const void *payload, int payload_len)
+{
+    char *copy = NULL;
+    if (result >= 0 && payload_len > 0)
+    {
+        copy = (char *)malloc(payload_len);
+        if (!copy)
+        {
+            bfbridged_queue_response(connection, id, BFBRIDGED_ERROR_OUT_OF_MEMORY, NULL, 0);
+            return;
+        }
+        memcpy(copy, payload, payload_len);
+    }
+    bfbridged_queue_response(connection, id, result, copy, payload_len);
+}
+
+static void *bfbridged_writer_main(void *arg)
+{
+    bfbridged_connection_t *connection = (bfbridged_connection_t *)arg;
+    int failed = 0;
+    pthread_mutex_lock(&connection->write_lock);
+    for (;;)
+    {
+        while (!connection->queue_head && !connection->closing)
+        {
+            pthread_cond_wait(&connection->write_cond, &connection->write_lock);
+        }
+        bfbridged_queued_response_t *queued = connection->queue_head;
+        if (!queued)
+        {
+            break;
+        }
+        connection->queue_head = queued->next;
+        if (!connection->queue_head)
+        {
+            connection->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&connection->write_lock);
+
+        // After a failure the client is gone: drop the rest
+        if (!failed &&
+            (bfbridged_write_all(connection->fd, &queued->response, sizeof(queued->response)) < 0 ||
+             (queued->response.payload_len > 0 &&
+              bfbridged_write_all(connection->fd, queued->payload, queued->response.payload_len) < 0)))
+        {
+            failed = 1;
+            // So that the reading thread notices too
+            shutdown(connection->fd, SHUT_RDWR);
+        }
+        int sent = queued->response.payload_len;
+        free(queued->payload);
+        free(queued);
+
+        pthread_mutex_lock(&connection->write_lock);
+        connection->queued_bytes -= sent;
+        connection->unsent--;
+        pthread_cond_broadcast(&connection->write_cond);
+    }
+    pthread_mutex_unlock(&connection->write_lock);
+    return NULL;
+}
+
+// Sends what is queued, then ends the writer thread
+static void bfbridged_stop_writer(bfbridged_connection_t *connection)
+{
+    pthread_mutex_lock(&connection->write_lock);
+    connection->closing = 1;
+    pthread_cond_broadcast(&connection->write_cond);
+    pthread_mutex_unlock(&connection->write_lock);
+    pthread_join(connection->writer, NULL);
+}
+
+// File table, caller holds daemon->lock
+
+static bfbridged_file_t *bfbridged_find_handle(bfbridged_t *daemon, int handle)
+{
+    if (handle < 0)
+    {
+        return NULL;
+    }
+    bfbridged_file_t *file = &daemon->files[handle % daemon->file_capacity];
+    if (!file->filepath || file->generation != handle / daemon->file_capacity)
+    {
+        return NULL;
+    }
+    file->last_used = ++daemon->file_clock;
+    return file;
+}
+
+static int bfbridged_file_handle(bfbridged_t *daemon, bfbridged_file_t *file)
+{
+    return file->generation * daemon->file_capacity + (int)(file - daemon->files);
+}
+
+// returns: the handle, or -1 if not in the table
+static int bfbridged_find_path(bfbridged_t *daemon, const char *filepath, int filepath_len)
+{
+    for (int i = 0; i < daemon->file_capacity; i++)
+    {
+        bfbridged_file_t *file = &daemon->files[i];
+        if (file->filepath && file->filepath_len == filepath_len &&
+            memcmp(file->filepath, filepath, filepath_len) == 0)
+        {
+            file->last_used = ++daemon->file_clock;
+            return bfbridged_file_handle(daemon, file);
+        }
+    }
+    return -1;
+}
+
+// Replaces the least recently used file if the table is full
+// returns: the handle, or BFBRIDGED_ERROR_OUT_OF_MEMORY
+static int bfbridged_add_file(
+    bfbridged_t *daemon, const char *filepath, int filepath_len,
+    const bfbridge_image_info_t *info)
+{
+    // Opened by another request meanwhile
+    int handle = bfbridged_find_path(daemon, filepath, filepath_len);
+    if (handle >= 0)
+    {
+        return handle;
+    }
+    bfbridged_file_t *file = &daemon->files[0];
+    for (int i = 0; i < daemon->file_capacity && file->filepath; i++)
+    {
+        if (!daemon->files[i].filepath || daemon->files[i].last_used < file->last_used)
+        {
+            file = &daemon->files[i];
+        }
+    }
+    char *copy = (char *)malloc(filepath_len + 1);
+    if (!copy)
+    {
+        return BFBRIDGED_ERROR_OUT_OF_MEMORY;
+    }
+    memcpy(copy, filepath, filepath_len);
+    copy[filepath_len] = '\0';
+    if (file->filepath)
+    {
+        free(file->filepath);
+        file->generation = (file->generation + 1) % (INT_MAX / daemon->file_capacity);
+    }
+    file->filepath = copy;
+    file->filepath_len = filepath_len;
+    file->last_used = ++daemon->file_clock;
+    file->info = *info;
+    return bfbridged_file_handle(daemon, file);
+}
+
+// Requests
+
+static void bfbridged_job_done(bfbridge_pool_request_t *request, void *user_data);
+
+static void bfbridged_submit(bfbridged_job_t *job)
+{
+    bfbridged_t *daemon = job->connection->daemon;
+    if (job->op == BFBRIDGED_THUMBNAIL)
+    {
+        bfbridge_pool_open_thumb_bytes_async(&daemon->pool, &job->request, bfbridged_job_done, job);
+    }
+    else if (job->op == BFBRIDGED_OPEN || job->op == BFBRIDGED_INFO)
+    {
+        bfbridge_pool_get_image_info_async(&daemon->pool, &job->request, bfbridged_job_done, job);
+    }
+    else
+    {
+        bfbridge_pool_open_bytes_async(&daemon->pool, &job->request, bfbridged_job_done, job);
+    }
+}
+
+// Pool callback, on a worker thread
+static void bfbridged_job_done(bfbridge_pool_request_t *request, void *user_data)
+{
+    bfbridged_job_t *job = (bfbridged_job_t *)user_data;
+    bfbridged_connection_t *connection = job->connection;
+    bfbridged_t *daemon = connection->daemon;
+    int result = request->result;
+
+    // The pixel format was guessed: once more with the largest
+    long long max_len = (long long)request->w * request->h * BFBRIDGED_MAX_PIXEL_BYTES;
+    int len = max_len > daemon->max_response_bytes ? daemon->max_response_bytes : (int)max_len;
+    if (result == -2 && !job->retried && request->dest_len < len &&
+        (job->op == BFBRIDGED_READ_REGION || job->op == BFBRIDGED_THUMBNAIL))
+    {
+        char *dest = (char *)malloc(len);
+        if (dest)
+        {
+            free(request->dest);
+            request->dest = dest;
+            request->dest_len = len;
+            job->retried = 1;
+            bfbridged_submit(job);
+            return;
+        }
+    }
+
+    if (job->op == BFBRIDGED_OPEN && result >= 0)
+    {
+        pthread_mutex_lock(&daemon->lock);
+        result = bfbridged_add_file(daemon, request->filepath, request->filepath_len,
+                                    (bfbridge_image_info_t *)request->dest);
+        pthread_mutex_unlock(&daemon->lock);
+    }
+    // The payload is handed over instead of copied
+    bfbridged_queue_response(connection, job->id, result, request->dest,
+                             job->op == BFBRIDGED_OPEN ? (int)sizeof(bfbridge_image_info_t) : result);
+    free(job);
+
+    pthread_mutex_lock(&daemon->lock);
+    connection->outstanding--;
+    pthread_cond_broadcast(&daemon->cond);
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+// Handles a request other than BFBRIDGED_OPEN, without payload
+static void bfbridged_handle_file_request(
+    bfbridged_connection_t *connection, const bfbridged_request_t *wire)
+{
+    bfbridged_t *daemon = connection->daemon;
+    if (wire->op == BFBRIDGED_PING)
+    {
+        bfbridged_respond(connection, wire->id, BFBRIDGED_VERSION, NULL, 0);
+        return;
+    }
+    if ((wire->op != BFBRIDGED_INFO && wire->op != BFBRIDGED_READ_REGION &&
+         wire->op != BFBRIDGED_THUMBNAIL) ||
+        (wire->op != BFBRIDGED_INFO && (wire->w <= 0 || wire->h <= 0)))
+    {
+        bfbridged_respond(connection, wire->id, BFBRIDGED_ERROR_BAD_REQUEST, NULL, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&daemon->lock);
+    bfbridged_file_t *file = bfbridged_find_handle(daemon, wire->file);
+    bfbridged_job_t *job = NULL;
+    long long dest_len = sizeof(bfbridge_image_info_t);
+    if (file)
+    {
+        if (wire->op != BFBRIDGED_INFO)
+        {
+            // The pixel format of series 0, usually that of the others
+            int pixel_bytes = file->info.rgb_channel_count * file->info.bytes_per_pixel;
+            if (wire->series != 0 || pixel_bytes <= 0)
+            {
+                pixel_bytes = BFBRIDGED_MAX_PIXEL_BYTES;
+            }
+            dest_len = (long long)wire->w * wire->h * pixel_bytes;
+        }
+        if (dest_len <= daemon->max_response_bytes)
+        {
+            job = (bfbridged_job_t *)calloc(1, sizeof(bfbridged_job_t) + file->filepath_len + 1);
+            if (job)
+            {
+                memcpy(job + 1, file->filepath, file->filepath_len);
+                job->request.filepath_len = file->filepath_len;
+            }
+        }
+    }
+    pthread_mutex_unlock(&daemon->lock);
+
+    int error = !file ? BFBRIDGED_ERROR_UNKNOWN_FILE
+                : dest_len > daemon->max_response_bytes ? BFBRIDGED_ERROR_TOO_LARGE
+                : 0;
+    if (!error && job)
+    {
+        job->request.dest = (char *)malloc(dest_len);
+    }
+    if (!error && (!job || !job->request.dest))
+    {
+        free(job);
+        error = BFBRIDGED_ERROR_OUT_OF_MEMORY;
+    }
+    if (error)
+    {
+        bfbridged_respond(connection, wire->id, error, NULL, 0);
+        return;
+    }
+    job->request.filepath = (char *)(job + 1);
+    job->request.dest_len = (int)dest_len;
+    job->request.series = wire->series;
+    job->request.resolution = wire->op == BFBRIDGED_THUMBNAIL ? 0 : wire->resolution;
+    job->request.plane = wire->plane;
+    job->request.x = wire->x;
+    job->request.y = wire->y;
+    job->request.w = wire->w;
+    job->request.h = wire->h;
+    job->connection = connection;
+    job->id = wire->id;
+    job->op = wire->op;
+
+    pthread_mutex_lock(&daemon->lock);
+    connection->outstanding++;
+    pthread_mutex_unlock(&daemon->lock);
+    bfbridged_submit(job);
+}
+
+// Handles BFBRIDGED_OPEN with its filepath
+static void bfbridged_handle_open(
+    bfbridged_connection_t *connection, const bfbridged_request_t *wire,
+    const char *filepath)
+{
+    bfbridged_t *daemon = connection->daemon;
+    bfbridge_image_info_t info;
+    pthread_mutex_lock(&daemon->lock);
+    int handle = bfbridged_find_path(daemon, filepath, wire->payload_len);
+    if (handle >= 0)
+    {
+        info = daemon->files[handle % daemon->file_capacity].info;
+    }
+    pthread_mutex_unlock(&daemon->lock);
+    if (handle >= 0)
+    {
+        bfbridged_respond(connection, wire->id, handle, &info, sizeof(info));
+        return;
+    }
+
+    bfbridged_job_t *job = (bfbridged_job_t *)calloc(1, sizeof(bfbridged_job_t) + wire->payload_len + 1);
+    char *dest = (char *)malloc(sizeof(bfbridge_image_info_t));
+    if (!job || !dest)
+    {
+        free(job);
+        free(dest);
+        bfbridged_respond(connection, wire->id, BFBRIDGED_ERROR_OUT_OF_MEMORY, NULL, 0);
+        return;
+    }
+    memcpy(job + 1, filepath, wire->payload_len);
+    job->request.filepath = (char *)(job + 1);
+    job->request.filepath_len = wire->payload_len;
+    job->request.dest = dest;
+    job->request.dest_len = sizeof(bfbridge_image_info_t);
+    job->connection = connection;
+    job->id = wire->id;
+    job->op = BFBRIDGED_OPEN;
+
+    pthread_mutex_lock(&daemon->lock);
+    connection->outstanding++;
+    pthread_mutex_unlock(&daemon->lock);
+    bfbridged_submit(job);
+}
+
+static void *bfbridged_connection_main(void *arg)
+{
+    bfbridged_connection_t *connection = (bfbridged_connection_t *)arg;
+    bfbridged_t *daemon = connection->daemon;
+    char *payload = (char *)malloc(BFBRIDGED_MAX_PAYLOAD);
+
+    // Requests are given to the pool as they arrive, so
+    // a client can have many in flight
+    for (;;)
+    {
+        bfbridged_request_t wire;
+        if (!payload || bfbridged_read_all(connection->fd, &wire, sizeof(wire)) != 1 ||
+            wire.payload_len < 0 || wire.payload_len > BFBRIDGED_MAX_PAYLOAD ||
+            (wire.payload_len > 0 && bfbridged_read_all(connection->fd, payload, wire.payload_len) != 1))
+        {
+            break;
+        }
+        // A client that doesn't read its responses stops being read
+        pthread_mutex_lock(&connection->write_lock);
+        while (connection->unsent >= BFBRIDGED_MAX_UNSENT ||
+               connection->queued_bytes > daemon->max_response_bytes)
+        {
+            pthread_cond_wait(&connection->write_cond, &connection->write_lock);
+        }
+        connection->unsent++;
+        pthread_mutex_unlock(&connection->write_lock);
+        if (wire.op == BFBRIDGED_OPEN)
+        {
+            if (wire.payload_len == 0)
+            {
+                bfbridged_respond(connection, wire.id, BFBRIDGED_ERROR_BAD_REQUEST, NULL, 0);
+            }
+            else
+            {
+                bfbridged_handle_open(connection, &wire, payload);
+            }
+        }
+        else
+        {
+            bfbridged_handle_file_request(connection, &wire);
+        }
+    }
+    free(payload);
+
+    pthread_mutex_lock(&daemon->lock);
+    while (connection->outstanding > 0)
+    {
+        pthread_cond_wait(&daemon->cond, &daemon->lock);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+    // Still listed, so that shutting down the daemon waits for the
+    // responses and can end a connection whose client doesn't read them
+    bfbridged_stop_writer(connection);
+
+    pthread_mutex_lock(&daemon->lock);
+    bfbridged_connection_t **link = &daemon->connections;
+    while (*link != connection)
+    {
+        link = &(*link)->next;
+    }
+    *link = connection->next;
+    daemon->connection_count--;
+    pthread_cond_broadcast(&daemon->cond);
+    pthread_mutex_unlock(&daemon->lock);
+
+    close(connection->fd);
+    pthread_mutex_destroy(&connection->write_lock);
+    pthread_cond_destroy(&connection->write_cond);
+    free(connection);
+    return NULL;
+}
+
+static void bfbridged_accept(bfbridged_t *daemon, int fd)
+{
+    bfbridged_connection_t *connection = (bfbridged_connection_t *)
+        calloc(1, sizeof(bfbridged_connection_t));
+    if (!connection)
+    {
+        close(fd);
+        return;
+    }
+    connection->daemon = daemon;
+    connection->fd = fd;
+    pthread_mutex_init(&connection->write_lock, NULL);
+    pthread_cond_init(&connection->write_cond, NULL);
+    if (pthread_create(&connection->writer, NULL, bfbridged_writer_main, connection) != 0)
+    {
+        close(fd);
+        pthread_mutex_destroy(&connection->write_lock);
+        pthread_cond_destroy(&connection->write_cond);
+        free(connection);
+        return;
+    }
+
+    // Listed before starting, as the thread unlists itself when done
+    pthread_mutex_lock(&daemon->lock);
+    connection->next = daemon->connections;
+    daemon->connections = connection;
+    daemon->connection_count++;
+    pthread_mutex_unlock(&daemon->lock);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t pthread;
+    int created = pthread_create(&pthread, &attr, bfbridged_connection_main, connection) == 0;
+    pthread_attr_destroy(&attr);
+    if (!created)
+    {
+        pthread_mutex_lock(&daemon->lock);
+        bfbridged_connection_t **link = &daemon->connections;
+        while (*link != connection)
+        {
+            link = &(*link)->next;
+        }
+        *link = connection->next;
+        daemon->connection_count--;
+        pthread_mutex_unlock(&daemon->lock);
+        bfbridged_stop_writer(connection);
+        close(fd);
+        pthread_mutex_destroy(&connection->write_lock);
+        pthread_cond_destroy(&connection->write_cond);
+        free(connection);
+    }
+}
+
+static void bfbridged_on_signal(int sig)
+{
+    (void)sig;
+    char stop = 1;
+    int saved_errno = errno;
+    if (write(bfbridged_stop_pipe[1], &stop, 1) < 0)
+    {
+        // Already stopping
+    }
+    errno = saved_errno;
+}
+
+// Accepts connections until SIGINT or SIGTERM
+static void bfbridged_serve(bfbridged_t *daemon)
+{
+    struct pollfd fds[2];
+    fds[0].fd = daemon->listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = bfbridged_stop_pipe[0];
+    fds[1].events = POLLIN;
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("bfbridged: poll");
+            break;
+        }
+        if (fds[1].revents)
+        {
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            int fd = accept(daemon->listen_fd, NULL, NULL);
+            if (fd >= 0)
+            {
+                bfbridged_accept(daemon, fd);
+            }
+        }
+    }
+
+    // Connection threads see the end of their connection, wait
+    // for their requests, and unlist themselves
+    pthread_mutex_lock(&daemon->lock);
+    for (bfbridged_connection_t *c = daemon->connections; c; c = c->next)
+    {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    while (daemon->connection_count > 0)
+    {
+        pthread_cond_wait(&daemon->cond, &daemon->lock);
+    }
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+static void bfbridged_usage(void)
+{
+    fprintf(stderr,
+            "Usage: bfbridged [-s socket] [-t threads] [-m max_response_bytes]\n"
+            "                 [-c tile_cache_bytes] [-f open_files] [-p]\n"
+            "  -s  Unix domain socket path (default /tmp/bfbridged.sock)\n"
+            "  -t  worker threads, each with a BioFormats instance (default: cores)\n"
+            "  -m  largest response, and worker buffer limit (default 67108864)\n"
+            "  -c  decoded tile cache budget, 0 for none (default 268435456)\n"
+            "  -f  files kept in the open file table (default 1024)\n"
+            "  -p  prefetch the tiles viewers are likely to request next\n"
+            "      into the tile cache on idle workers (not with -c 0)\n"
+            "Environment: BFBRIDGE_CLASSPATH (required), BFBRIDGE_CACHEDIR\n");
+}
+
+static int bfbridged_check_error(bfbridge_error_t *err, const char *what)
+{
+    if (!err)
+    {
+        return 0;
+    }
+    fprintf(stderr, "bfbridged: %s: %s\n", what, err->description);
+    bfbridge_free_error(err);
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *socket_path = "/tmp/bfbridged.sock";
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long long max_response_bytes = 64 << 20;
+    long long tile_cache_bytes = 256 << 20;
+    long long file_capacity = 1024;
+    int prefetch = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:m:c:f:ph")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 't':
+            threads = atol(optarg);
+            break;
+        case 'm':
+            max_response_bytes = atoll(optarg);
+            break;
+        case 'c':
+            tile_cache_bytes = atoll(optarg);
+            break;
+        case 'f':
+            file_capacity = atoll(optarg);
+            break;
+        case 'p':
+            prefetch = 1;
+            break;
+        default:
+            bfbridged_usage();
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (threads <= 0 || max_response_bytes <= 0 || max_response_bytes > INT_MAX ||
+        tile_cache_bytes < 0 || file_capacity <= 0 || file_capacity > 1 << 20)
+    {
+        bfbridged_usage();
+        return 2;
+    }
+    if (prefetch && tile_cache_bytes == 0)
+    {
+        fprintf(stderr, "bfbridged: -p prefetches into the tile cache, so it needs -c above 0\n");
+        return 2;
+    }
+    char *cpdir = getenv("BFBRIDGE_CLASSPATH");
+    char *cachedir = getenv("BFBRIDGE_CACHEDIR");
+    if (!cpdir || !*cpdir)
+    {
+        fprintf(stderr, "bfbridged: please set BFBRIDGE_CLASSPATH to a single dir containing the jar files\n");
+        return 2;
+    }
+
+    static bfbridged_t daemon;
+    daemon.listen_fd = -1;
+    daemon.max_response_bytes = (int)max_response_bytes;
+    daemon.file_capacity = (int)file_capacity;
+    daemon.files = (bfbridged_file_t *)calloc(file_capacity, sizeof(bfbridged_file_t));
+    pthread_mutex_init(&daemon.lock, NULL);
+    pthread_cond_init(&daemon.cond, NULL);
+    memset(&daemon.address, 0, sizeof(daemon.address));
+    daemon.address.sun_family = AF_UNIX;
+    if (!daemon.files || strlen(socket_path) >= sizeof(daemon.address.sun_path))
+    {
+        fprintf(stderr, "bfbridged: socket path too long, or out of memory\n");
+        return 1;
+    }
+    strcpy(daemon.address.sun_path, socket_path);
+
+    if (bfbridged_check_error(bfbridge_make_vm(&daemon.vm, cpdir, cachedir && *cachedir ? cachedir : NULL), "bfbridge_make_vm"))
+    {
+        return 1;
+    }
+    if (bfbridged_check_error(bfbridge_make_pool(&daemon.pool, &daemon.vm, (int)threads, (int)max_response_bytes), "bfbridge_make_pool"))
+    {
+        bfbridge_free_vm(&daemon.vm);
+        return 1;
+    }
+    int have_cache = 0;
+    if (tile_cache_bytes > 0)
+    {
+        if (bfbridged_check_error(bfbridge_make_tile_cache(&daemon.tile_cache, tile_cache_bytes, 16), "bfbridge_make_tile_cache"))
+        {
+            bfbridge_free_pool(&daemon.pool);
+            bfbridge_free_vm(&daemon.vm);
+            return 1;
+        }
+        bfbridge_pool_set_tile_cache(&daemon.pool, &daemon.tile_cache);
+        have_cache = 1;
+        if (prefetch)
+        {
+            // Leave a worker for requests
+            bfbridge_prefetch_config_t config = {1, 4, 1, 64, threads > 1 ? (int)threads - 1 : 1};
+            bfbridge_pool_set_prefetch(&daemon.pool, &config);
+        }
+    }
+
+    // Responses to clients that left fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    int status = 1;
+    daemon.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (daemon.listen_fd < 0 || pipe(bfbridged_stop_pipe) < 0)
+    {
+        perror("bfbridged: socket");
+    }
+    else
+    {
+        // A socket file left by a daemon that didn't exit cleanly
+        unlink(socket_path);
+        if (bind(daemon.listen_fd, (struct sockaddr *)&daemon.address, sizeof(daemon.address)) < 0 ||
+            listen(daemon.listen_fd, SOMAXCONN) < 0)
+        {
+            perror("bfbridged: bind");
+        }
+        else
+        {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = bfbridged_on_signal;
+            sigaction(SIGINT, &action, NULL);
+            sigaction(SIGTERM, &action, NULL);
+            fprintf(stderr, "bfbridged: listening on %s with %ld threads\n", socket_path, threads);
+            bfbridged_serve(&daemon);
+            unlink(socket_path);
+            if (prefetch && have_cache)
+            {
+                bfbridge_prefetch_stats_t stats;
+                bfbridge_pool_get_prefetch_stats(&daemon.pool, &stats);
+                fprintf(stderr, "bfbridged: prefetched %lld tiles, %lld requested later, %lld wasted\n",
+                        stats.decoded, stats.hits, stats.wasted);
+            }
+            status = 0;
+        }
+    }
+
+    if (daemon.listen_fd >= 0)
+    {
+        close(daemon.listen_fd);
+    }
+    bfbridge_free_pool(&daemon.pool);
+    if (have_cache)
+    {
+        bfbridge_free_tile_cache(&daemon.tile_cache);
+    }
+    for (int i = 0; i < daemon.file_capacity; i++)
+    {
+        free(daemon.files[i].filepath);
+    }
+    free(daemon.files);
+    bfbridge_free_vm(&daemon.vm);
+    return status;
+}
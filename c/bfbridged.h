@@ -0,0 +1,82 @@
+// bfbridged.h
+
+// Protocol of bfbridged (bfbridged.c), the tile server daemon, for clients
+// in any language. Over a Unix domain socket, with the byte order and
+// struct layout of the host.
+// A client sends requests, each a bfbridged_request_t followed by
+// payload_len bytes, without having to wait for the responses. The daemon
+// answers each with a bfbridged_response_t with the id of the request,
+// followed by payload_len bytes, in the order they complete.
+// Requests of one or many connections are read in parallel.
+
+#ifndef BFBRIDGED_H
+#define BFBRIDGED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BFBRIDGED_VERSION 1
+
+typedef enum bfbridged_op
+{
+    // result: BFBRIDGED_VERSION. No payloads
+    BFBRIDGED_PING = 1,
+    // payload: the filepath
+    // result: a file handle for the requests below, valid until the
+    // daemon evicts the file from its table (BFBRIDGED_ERROR_UNKNOWN_FILE)
+    // response payload: bfbridge_image_info_t of series 0, resolution 0
+    BFBRIDGED_OPEN = 2,
+    // file, series, resolution
+    // response payload: bfbridge_image_info_t, see bfbridge_basiclib.h
+    BFBRIDGED_INFO = 3,
+    // file, series, resolution, plane, x, y, w, h
+    // response payload: the bytes bf_open_bytes returns
+    BFBRIDGED_READ_REGION = 4,
+    // file, series, plane, w, h
+    // response payload: the bytes bf_open_thumb_bytes returns
+    BFBRIDGED_THUMBNAIL = 5,
+} bfbridged_op_t;
+
+// Negative results, besides those of bf_* functions
+// (-1: error in BioFormats, -2: too large for the daemon's buffers)
+typedef enum bfbridged_error
+{
+    // Open the file again
+    BFBRIDGED_ERROR_UNKNOWN_FILE = -10,
+    // Unknown op, or negative sizes
+    BFBRIDGED_ERROR_BAD_REQUEST = -11,
+    // Over the daemon's limit of bytes per response
+    BFBRIDGED_ERROR_TOO_LARGE = -12,
+    BFBRIDGED_ERROR_OUT_OF_MEMORY = -13,
+} bfbridged_error_t;
+
+typedef struct bfbridged_request
+{
+    // Any value; echoed in the response
+    unsigned long long id;
+    int op;
+    int file;
+    int series;
+    int resolution;
+    int plane;
+    int x;
+    int y;
+    int w;
+    int h;
+    int payload_len;
+} bfbridged_request_t;
+
+typedef struct bfbridged_response
+{
+    unsigned long long id;
+    // Negative on error, with no payload
+    int result;
+    int payload_len;
+} bfbridged_response_t;
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif // BFBRIDGED_H
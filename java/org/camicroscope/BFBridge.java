@@ -1,6 +1,7 @@
 package org.camicroscope;
 
 import loci.common.DebugTools;
+import loci.formats.ICompressedTileReader;
 import loci.formats.IFormatReader;
 // https://downloads.openmicroscopy.org/bio-formats/7.0.0/api/loci/formats/IFormatReader.html etc. for documentation
 import loci.formats.ImageReader;
@@ -10,25 +11,42 @@ import loci.formats.FormatTools;
 // import loci.formats.services.OMEXMLServiceImpl;
 import loci.formats.ome.OMEXMLMetadataImpl;
 import loci.formats.Memoizer;
+import loci.formats.codec.Codec;
+import loci.formats.codec.JPEG2000Codec;
+import loci.formats.codec.JPEGCodec;
 import loci.formats.ome.OMEXMLMetadata;
 import loci.formats.services.JPEGTurboServiceImpl;
 import ome.units.UNITS;
+import ome.units.quantity.Length;
 
 // import loci.formats.tools.ImageConverter;
 
+import java.awt.image.BufferedImage;
+import java.awt.image.DataBufferByte;
 import java.io.BufferedInputStream;
 import java.io.File;
 import java.io.FileInputStream;
+import java.io.IOException;
+import java.io.OutputStream;
 import java.io.PrintWriter;
 import java.io.StringWriter;
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
 import java.nio.charset.Charset;
 import java.nio.file.Files;
+import java.util.ArrayDeque;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.Iterator;
+import java.util.LinkedHashMap;
 
+import javax.imageio.IIOImage;
 import javax.imageio.ImageIO;
+import javax.imageio.ImageWriteParam;
+import javax.imageio.ImageWriter;
 import javax.imageio.stream.ImageInputStream;
 import javax.imageio.stream.MemoryCacheImageInputStream;
+import javax.imageio.stream.MemoryCacheImageOutputStream;
 
 // Useful Docs:
 // https://bio-formats.readthedocs.io/en/v6.14.0/developers/file-reader.html#reading-files
@@ -38,70 +56,304 @@ public class BFBridge {
     // ImageReader is our noncached reader but it doesn't
     // implement ReaderWrapper so make a wrapper to make substitution
     // possible with Memoizer
-    private final class BFReaderWrapper extends ReaderWrapper {
+    private static final class BFReaderWrapper extends ReaderWrapper {
         BFReaderWrapper(IFormatReader r) {
             super(r);
         }
     }
 
-    // BioFormats doesn't give us control over thumbnail sizes
-    // unless we define a wrapper for FormatTools.openThumbBytes
-    // https://github.com/ome/bioformats/blob/9cb6cfaaa5361bcc4ed9f9841f2a4caa29aad6c7/components/formats-api/src/loci/formats/FormatTools.java#L1287
-    private final class BFThumbnailWrapper extends ReaderWrapper {
-        // exact sizes
-        private int thumbX = 256;
-        private int thumbY = 256;
-
-        // For our use
-        void setThumbSizeX(int x) {
-            thumbX = x;
+    // reader.openBytes(no, x, y, w, h) allocates a new array for every call
+    // so keep a few arrays of exact sizes (see the BioFormats issue
+    // mentioned in BFOpenBytes) for the openBytes(no, buf, x, y, w, h) overload.
+    // A few slots are enough as tile servers request a few tile sizes only.
+    // BFBridge instances are used by a single thread so no locking.
+    private final class BFPixelArrayPool {
+        private static final int SLOTS = 8;
+        // Arrays larger than this are allocated for every call
+        private static final long MAX_TOTAL_BYTES = 64L * 1024 * 1024;
+
+        private final int[] widths = new int[SLOTS];
+        private final int[] heights = new int[SLOTS];
+        private final int[] pixelTypes = new int[SLOTS];
+        private final int[] channels = new int[SLOTS];
+        private final byte[][] arrays = new byte[SLOTS][];
+        // Least recently used slot is replaced on a miss
+        private final long[] lastUsed = new long[SLOTS];
+        private long useCounter = 0;
+        private long totalBytes = 0;
+
+        long hits = 0;
+        long misses = 0;
+
+        // size: w * h * bytes per pixel * rgb channel count
+        byte[] get(int w, int h, int pixelType, int rgbChannels, int size) {
+            useCounter++;
+            int victim = 0;
+            for (int i = 0; i < SLOTS; i++) {
+                if (arrays[i] != null && widths[i] == w && heights[i] == h
+                        && pixelTypes[i] == pixelType && channels[i] == rgbChannels) {
+                    hits++;
+                    lastUsed[i] = useCounter;
+                    return arrays[i];
+                }
+                if (lastUsed[i] < lastUsed[victim]) {
+                    victim = i;
+                }
+            }
+            misses++;
+            byte[] array = new byte[size];
+            long oldBytes = arrays[victim] == null ? 0 : arrays[victim].length;
+            if (totalBytes - oldBytes + size > MAX_TOTAL_BYTES) {
+                return array;
+            }
+            totalBytes += size - oldBytes;
+            widths[victim] = w;
+            heights[victim] = h;
+            pixelTypes[victim] = pixelType;
+            channels[victim] = rgbChannels;
+            arrays[victim] = array;
+            lastUsed[victim] = useCounter;
+            return array;
         }
+    }
 
-        void setThumbSizeY(int y) {
-            thumbY = y;
-        }
+    private final BFPixelArrayPool pixelArrayPool = new BFPixelArrayPool();
+
+    // Timing of the Java side of calls, for BFGetJavaStats: how much of a
+    // tile is BioFormats decoding and how much the copy to communicationBuffer
+    private long openBytesCalls = 0;
+    private long openBytesNanos = 0;
+    private long setIdCalls = 0;
+    private long setIdNanos = 0;
+    private long copyCalls = 0;
+    private long copyNanos = 0;
+    private long copyBytes = 0;
+
+    // Encodes tiles for BFOpenBytesEncoded. Writers and the image
+    // are kept between calls as tile servers encode many tiles
+    // of the same size; ImageIO's JPEG writer uses native libjpeg
+    private final class BFTileEncoder {
+        static final int JPEG = 0;
+        static final int PNG = 1;
+
+        private ImageWriter jpegWriter;
+        private ImageWriteParam jpegParam;
+        private ImageWriter pngWriter;
+        private BufferedImage image;
+        private final BufferOutputStream output = new BufferOutputStream();
+
+        // Writes to a ByteBuffer, failing when it's full
+        private final class BufferOutputStream extends OutputStream {
+            ByteBuffer buffer;
+            boolean overflowed;
+
+            @Override
+            public void write(int b) throws IOException {
+                if (!buffer.hasRemaining()) {
+                    overflowed = true;
+                    throw new IOException("Encoded tile does not fit the communication buffer");
+                }
+                buffer.put((byte) b);
+            }
 
-        // For FormatTools.openThumbBytes
-        @Override
-        public int getThumbSizeX() {
-            return thumbX;
+            @Override
+            public void write(byte[] b, int off, int len) throws IOException {
+                if (buffer.remaining() < len) {
+                    overflowed = true;
+                    throw new IOException("Encoded tile does not fit the communication buffer");
+                }
+                buffer.put(b, off, len);
+            }
         }
 
-        @Override
-        public int getThumbSizeY() {
-            return thumbY;
+        // Returns the image to fill, of the given size and type
+        BufferedImage image(int w, int h, int type) {
+            if (image == null || image.getWidth() != w || image.getHeight() != h || image.getType() != type) {
+                image = new BufferedImage(w, h, type);
+            }
+            return image;
         }
 
-        BFThumbnailWrapper(IFormatReader r) {
-            super(r);
+        // Returns the number of bytes written to dest from its position,
+        // or -2 if they don't fit
+        int encode(int format, int quality, ByteBuffer dest) throws IOException {
+            ImageWriter writer;
+            ImageWriteParam param = null;
+            if (format == JPEG) {
+                if (jpegWriter == null) {
+                    jpegWriter = ImageIO.getImageWritersByFormatName("jpeg").next();
+                    jpegParam = jpegWriter.getDefaultWriteParam();
+                    jpegParam.setCompressionMode(ImageWriteParam.MODE_EXPLICIT);
+                }
+                jpegParam.setCompressionQuality(quality / 100f);
+                writer = jpegWriter;
+                param = jpegParam;
+            } else {
+                if (pngWriter == null) {
+                    pngWriter = ImageIO.getImageWritersByFormatName("png").next();
+                }
+                writer = pngWriter;
+            }
+            int start = dest.position();
+            output.buffer = dest;
+            output.overflowed = false;
+            MemoryCacheImageOutputStream stream = new MemoryCacheImageOutputStream(output);
+            try {
+                writer.setOutput(stream);
+                writer.write(null, new IIOImage(image, null, null), param);
+                stream.close();
+            } catch (IOException e) {
+                if (output.overflowed) {
+                    return -2;
+                }
+                throw e;
+            } finally {
+                writer.setOutput(null);
+                output.buffer = null;
+            }
+            return dest.position() - start;
         }
     }
 
-    private final BFThumbnailWrapper readerWithThumbnailSizes;
-    private final ReaderWrapper reader;
+    private final BFTileEncoder tileEncoder = new BFTileEncoder();
+
+    private ReaderWrapper reader;
 
     // Our uncaching internal reader. ImageReader and ReaderWrapper
     // both implement IFormatReader but if you need an ImageReader-only
     // method, access this. (You could also do (inefficiently)
     // .getReader() on "reader" and cast it to ImageReader
     // since that's what we use)
-    private final ImageReader nonCachingReader = new ImageReader();
+    private ImageReader nonCachingReader;
 
     // As a summary, nonCachingReader is the reader
     // which is wrapped by BFReaderWrapper or Memoizer
-    // which is sometimes wrapped by readerWithThumbnailSizes
-    // For performance, this library calls the readerWithThumbnailSizes
-    // wrapper only when it needs thumbnail.
     // Please note that reinstantiating nonCachingReader requires
     // reinstantiating "ReaderWrapper reader" (BFReaderWrapper or Memoizer).
-    // And reinstantiating the latter requires reinstantiating
-    // the readerWithThumbnailSizes
+    // BFReaders keeps them together so that an open file
+    // can be kept in openReaders or sharedReaders and swapped in later.
+
+    private OMEXMLMetadataImpl metadata;
+
+    // Static so that they can be handed between instances, see BFSharedReaders
+    private static final class BFReaders {
+        final ImageReader nonCachingReader = new ImageReader();
+        final ReaderWrapper reader;
+        final OMEXMLMetadataImpl metadata = new OMEXMLMetadataImpl();
+
+        // Flattened as BFGet8BitLookupTable and BFGet16BitLookupTable
+        // write them, by series and resolution (see lookupTableKey).
+        // Cleared when the file is closed
+        final HashMap<Long, byte[]> lookupTables8 = new HashMap<>();
+        final HashMap<Long, short[]> lookupTables16 = new HashMap<>();
+
+        // Of the open file, for openReaders
+        String canonicalPath = null;
+        long lastModified = 0;
+        long estimatedBytes = 0;
+
+        BFReaders() {
+            if (cachedir == null) {
+                reader = new BFReaderWrapper(nonCachingReader);
+            } else {
+                reader = new Memoizer(nonCachingReader, cachedir);
+            }
+
+            // Use the easier resolution API
+            reader.setFlattenedResolutions(false);
+            reader.setMetadataStore(metadata);
+            // Save format-specific metadata as well?
+            // metadata.setOriginalMetadataPopulated(true);
+        }
+    }
+
+    private BFReaders readers;
+
+    private void useReaders(BFReaders r) {
+        readers = r;
+        nonCachingReader = r.nonCachingReader;
+        reader = r.reader;
+        metadata = r.metadata;
+    }
+
+    // Files kept open after BFOpen of another file or BFClose
+    // so that opening them again skips setId.
+    // Least recently used first. Disabled unless readerCacheMaxCount > 0
+    // Readers aren't thread safe so this is per instance.
+    private final LinkedHashMap<String, BFReaders> openReaders = new LinkedHashMap<>(16, 0.75f, true);
+    private long openReadersBytes = 0;
+
+    // Files kept open, when no instance uses them, for every instance
+    // in the JVM. A thread opening a file that another thread opened
+    // gets its readers without setId, which with Memoizer would otherwise
+    // read and deserialize the .bfmemo file again. Memoizer can only load
+    // memo files from disk, so whole readers are shared: one instance
+    // owns a BFReaders at a time and hands it here when done, through
+    // openReaders if enabled. Disabled unless sharedReaderCacheMaxCount > 0
+    private static final class BFSharedReaders {
+        // Least recently released first. Same file can be here
+        // more than once when several threads had it open
+        private final ArrayDeque<BFReaders> idle = new ArrayDeque<>();
+        private long bytes = 0;
+
+        // Returns readers of the file or null. Readers of the file
+        // with another lastModified are added to stale, to be closed
+        synchronized BFReaders take(String canonicalPath, long lastModified, ArrayList<BFReaders> stale) {
+            BFReaders found = null;
+            Iterator<BFReaders> mostRecentlyUsed = idle.descendingIterator();
+            while (mostRecentlyUsed.hasNext()) {
+                BFReaders r = mostRecentlyUsed.next();
+                if (!r.canonicalPath.equals(canonicalPath)) {
+                    continue;
+                }
+                if (found != null && r.lastModified == lastModified) {
+                    continue;
+                }
+                mostRecentlyUsed.remove();
+                bytes -= r.estimatedBytes;
+                if (r.lastModified == lastModified) {
+                    found = r;
+                } else {
+                    stale.add(r);
+                }
+            }
+            return found;
+        }
 
-    private final OMEXMLMetadataImpl metadata = new OMEXMLMetadataImpl();
+        // Readers evicted over the limits are added to evicted, to be closed
+        synchronized void put(BFReaders r, ArrayList<BFReaders> evicted) {
+            idle.addLast(r);
+            bytes += r.estimatedBytes;
+            while (!idle.isEmpty()
+                    && (idle.size() > sharedReaderCacheMaxCount || bytes > sharedReaderCacheMaxBytes)) {
+                BFReaders e = idle.removeFirst();
+                bytes -= e.estimatedBytes;
+                evicted.add(e);
+            }
+        }
+    }
+
+    private static final BFSharedReaders sharedReaders = new BFSharedReaders();
 
     // javac -DBFBridge.cachedir=/tmp/cachedir for faster opening of files
     private static final File cachedir;
 
+    // How many files, and about how much heap, openReaders can keep open
+    // BFBRIDGE_READER_CACHE_COUNT env var or -DBFBridge.readercachecount
+    // BFBRIDGE_READER_CACHE_MB env var or -DBFBridge.readercachemb
+    private static final int readerCacheMaxCount;
+    private static final long readerCacheMaxBytes;
+
+    // Same for sharedReaders, for the whole JVM
+    // BFBRIDGE_SHARED_READER_CACHE_COUNT env var or -DBFBridge.sharedreadercachecount
+    // BFBRIDGE_SHARED_READER_CACHE_MB env var or -DBFBridge.sharedreadercachemb
+    private static final int sharedReaderCacheMaxCount;
+    private static final long sharedReaderCacheMaxBytes;
+
+    // Whether to time calls for BFGetJavaStats
+    // BFBRIDGE_STATS env var (also read by the C library) or -DBFBridge.stats
+    private static final boolean statsEnabled;
+
     static {
         // Set Logging level
         // Available levels: DEBUG TRACE INFO WARN ERROR
@@ -147,23 +399,36 @@ public class BFBridge {
             System.out.println(cacheMessage);
         }
         cachedir = _cachedir;
+
+        readerCacheMaxCount = (int) getLongSetting("BFBridge.readercachecount", "BFBRIDGE_READER_CACHE_COUNT", 0);
+        readerCacheMaxBytes = getLongSetting("BFBridge.readercachemb", "BFBRIDGE_READER_CACHE_MB", 1024) * 1024 * 1024;
+        sharedReaderCacheMaxCount = (int) getLongSetting("BFBridge.sharedreadercachecount",
+                "BFBRIDGE_SHARED_READER_CACHE_COUNT", 0);
+        sharedReaderCacheMaxBytes = getLongSetting("BFBridge.sharedreadercachemb",
+                "BFBRIDGE_SHARED_READER_CACHE_MB", 2048) * 1024 * 1024;
+        statsEnabled = getLongSetting("BFBridge.stats", "BFBRIDGE_STATS", 0) != 0;
     }
 
-    // Initialize our instance reader
-    {
-        if (cachedir == null) {
-            reader = new BFReaderWrapper(nonCachingReader);
-        } else {
-            reader = new Memoizer(nonCachingReader, cachedir);
+    // System property, otherwise environment variable, otherwise defaultValue
+    private static long getLongSetting(String property, String env, long defaultValue) {
+        String value = System.getProperty(property);
+        if (value == null) {
+            value = System.getenv(env);
         }
+        if (value == null || value.equals("")) {
+            return defaultValue;
+        }
+        try {
+            return Long.parseLong(value.trim());
+        } catch (NumberFormatException e) {
+            System.err.println("BFBridge: ignoring invalid " + env + ": " + value);
+            return defaultValue;
+        }
+    }
 
-        // Use the easier resolution API
-        reader.setFlattenedResolutions(false);
-        reader.setMetadataStore(metadata);
-        // Save format-specific metadata as well?
-        // metadata.setOriginalMetadataPopulated(true);
-
-        readerWithThumbnailSizes = new BFThumbnailWrapper(reader);
+    // Initialize our instance reader
+    {
+        useReaders(new BFReaders());
     }
 
     // Use a shared buffer for two-way communication.
@@ -180,6 +445,8 @@ public class BFBridge {
     private static final Charset charset = Charset.forName("UTF-8");
     private ByteBuffer communicationBuffer = null;
     private int lastErrorBytes = 0;
+    // See BFGetRequiredBufferSize
+    private long requiredBufferBytes = 0;
 
     void BFSetCommunicationBuffer(ByteBuffer b) {
         communicationBuffer = b;
@@ -222,12 +489,59 @@ public class BFBridge {
     }
 
     // Input Parameter: first filenameLength bytes of communicationBuffer
+    // With openReaders or sharedReaders enabled, the previous file is kept open
+    // and opening a file kept open only resets the series
     int BFOpen(int filenameLength) {
         try {
             byte[] filename = new byte[filenameLength];
             communicationBuffer.rewind().get(filename);
-            close();
-            reader.setId(new String(filename));
+            String filenameString = new String(filename);
+            if (readerCacheMaxCount <= 0 && sharedReaderCacheMaxCount <= 0) {
+                close();
+                setIdTimed(filenameString);
+                return 1;
+            }
+
+            File file = new File(filenameString);
+            String canonicalPath = file.getCanonicalPath();
+            long lastModified = file.lastModified();
+            if (canonicalPath.equals(readers.canonicalPath) && lastModified == readers.lastModified
+                    && reader.getCurrentFile() != null) {
+                reader.setSeries(0);
+                return 1;
+            }
+
+            keepOpen();
+            BFReaders cached = openReaders.remove(canonicalPath);
+            if (cached != null) {
+                openReadersBytes -= cached.estimatedBytes;
+                if (cached.lastModified == lastModified) {
+                    useReaders(cached);
+                    reader.setSeries(0);
+                    return 1;
+                }
+                retire(cached);
+            }
+            ArrayList<BFReaders> stale = new ArrayList<>();
+            cached = sharedReaders.take(canonicalPath, lastModified, stale);
+            for (BFReaders r : stale) {
+                retire(r);
+            }
+            if (cached != null) {
+                useReaders(cached);
+                reader.setSeries(0);
+                return 1;
+            }
+            useReaders(takeIdleReaders());
+
+            Runtime runtime = Runtime.getRuntime();
+            long usedBefore = runtime.totalMemory() - runtime.freeMemory();
+            setIdTimed(filenameString);
+            long usedAfter = runtime.totalMemory() - runtime.freeMemory();
+            readers.canonicalPath = canonicalPath;
+            readers.lastModified = lastModified;
+            // Rough, as other threads and the GC change it too
+            readers.estimatedBytes = Math.max(usedAfter - usedBefore, 1024 * 1024);
             return 1;
         } catch (Exception e) {
             saveError(getStackTrace(e));
@@ -288,13 +602,16 @@ public class BFBridge {
         try {
             communicationBuffer.rewind();
             String[] files = reader.getUsedFiles();
+            long needed = 0;
+            for (String file : files) {
+                needed += file.getBytes(charset).length + 1;
+            }
+            if (needed > communicationBuffer.capacity()) {
+                return bufferTooSmall("Too long", needed);
+            }
             int charI = 0;
             for (String file : files) {
                 byte[] characters = file.getBytes(charset);
-                if (characters.length + 2 > communicationBuffer.capacity()) {
-                    saveError("Too long");
-                    return -2;
-                }
                 communicationBuffer.put(characters);
                 communicationBuffer.put((byte) 0);
                 charI += characters.length + 1;
@@ -306,9 +623,18 @@ public class BFBridge {
         }
     }
 
+    // With openReaders or sharedReaders enabled, the file is kept open to be
+    // reopened faster, see BFOpen
     int BFClose() {
         try {
-            reader.close();
+            if (readerCacheMaxCount > 0 || sharedReaderCacheMaxCount > 0) {
+                keepOpen();
+                useReaders(takeIdleReaders());
+            } else {
+                reader.close();
+                readers.lookupTables8.clear();
+                readers.lookupTables16.clear();
+            }
             return 1;
         } catch (Exception e) {
             saveError(getStackTrace(e));
@@ -585,21 +911,31 @@ public class BFBridge {
     // Returns number of bytes written
     int BFGet8BitLookupTable() {
         try {
-            byte[][] table = reader.get8BitLookupTable();
-            int len = table.length;
-            int sublen = table[0].length;
-            if (sublen != 256) {
-                saveError("BFGet8BitLookupTable expected 256 rowlength");
-                return -2;
-            }
-            byte[] table1D = new byte[len * sublen];
-            for (int i = 0; i < len; i++) {
-                for (int j = 0; j < sublen; j++) {
-                    table1D[i * sublen + j] = table[i][j];
+            long key = lookupTableKey();
+            byte[] table1D = readers.lookupTables8.get(key);
+            if (table1D == null) {
+                byte[][] table = reader.get8BitLookupTable();
+                if (table == null) {
+                    saveError("BFGet8BitLookupTable: no 8 bit lookup table");
+                    return -1;
+                }
+                int len = table.length;
+                int sublen = table[0].length;
+                if (sublen != 256) {
+                    saveError("BFGet8BitLookupTable expected 256 rowlength");
+                    return -2;
+                }
+                table1D = new byte[len * sublen];
+                for (int i = 0; i < len; i++) {
+                    System.arraycopy(table[i], 0, table1D, i * sublen, sublen);
                 }
+                readers.lookupTables8.put(key, table1D);
+            }
+            if (table1D.length > communicationBuffer.capacity()) {
+                return bufferTooSmall("BFGet8BitLookupTable: communication buffer too small", table1D.length);
             }
             communicationBuffer.rewind().put(table1D);
-            return len * sublen;
+            return table1D.length;
         } catch (Exception e) {
             saveError(getStackTrace(e));
             return -1;
@@ -611,91 +947,450 @@ public class BFBridge {
     // little endian
     int BFGet16BitLookupTable() {
         try {
-            short[][] table = reader.get16BitLookupTable();
-            int len = table.length;
-            int sublen = table[0].length;
-            if (sublen != 65536) {
-                saveError("BFGet16BitLookupTable expected 65536 rowlength");
-                return -2;
-            }
-            short[] table1D = new short[len * sublen];
-            for (int i = 0; i < len; i++) {
-                for (int j = 0; j < sublen; j++) {
-                    table1D[i * sublen + j] = table[i][j];
+            long key = lookupTableKey();
+            short[] table1D = readers.lookupTables16.get(key);
+            if (table1D == null) {
+                short[][] table = reader.get16BitLookupTable();
+                if (table == null) {
+                    saveError("BFGet16BitLookupTable: no 16 bit lookup table");
+                    return -1;
+                }
+                int len = table.length;
+                int sublen = table[0].length;
+                if (sublen != 65536) {
+                    saveError("BFGet16BitLookupTable expected 65536 rowlength");
+                    return -2;
+                }
+                table1D = new short[len * sublen];
+                for (int i = 0; i < len; i++) {
+                    System.arraycopy(table[i], 0, table1D, i * sublen, sublen);
                 }
+                readers.lookupTables16.put(key, table1D);
             }
-            communicationBuffer.rewind();
-            for (int i = 0; i < table1D.length; i++) {
-                communicationBuffer.putShort(table1D[i]);
+            if (2L * table1D.length > communicationBuffer.capacity()) {
+                return bufferTooSmall("BFGet16BitLookupTable: communication buffer too small", 2L * table1D.length);
             }
-            return 2 * len * sublen;
+            // Has the byte order of communicationBuffer
+            communicationBuffer.rewind();
+            communicationBuffer.asShortBuffer().put(table1D);
+            return 2 * table1D.length;
         } catch (Exception e) {
             saveError(getStackTrace(e));
             return -1;
         }
     }
 
-    // plane is 0, default
+    // Readers may build lookup tables on every call (see BFIsFalseColor)
+    // so we cache them for each series and resolution. Where a reader
+    // has a table per plane, the first one read is kept
+    private long lookupTableKey() {
+        return ((long) reader.getSeries() << 32) | reader.getResolution();
+    }
+
+    // plane: image index, from 0 to BFGetImageCount() - 1; 0 for
+    // the first plane, the usual case for brightfield slides
     // writes to communicationBuffer and returns the number of bytes written
     int BFOpenBytes(int plane, int x, int y, int w, int h) {
         try {
-            // https://github.com/ome/bioformats/issues/4058 means that
-            // openBytes wasn't designed to copy to a preallocated byte array
-            // unless it had the exact size and not greater
-            byte[] bytes = reader.openBytes(0, x, y, w, h);
-            communicationBuffer.rewind().put(bytes);
+            long size = getOpenBytesSize(w, h);
+            if (size > communicationBuffer.capacity()) {
+                return bufferTooSmall("Requested tile too big; must be at most " + communicationBuffer.capacity()
+                        + " bytes but wanted " + size, size);
+            }
+            byte[] bytes = openBytesPooled(plane, x, y, w, h, (int) size);
+            communicationBuffer.rewind();
+            putTimed(bytes);
             return bytes.length;
         } catch (Exception e) {
-            // Was it because of exceeding buffer?
-            // https://github.com/ome/bioformats/blob/4a08bfd5334323e99ad57de00e41cd15706164eb/components/formats-api/src/loci/formats/FormatReader.java#L906
-            // https://downloads.openmicroscopy.org/bio-formats/6.13.0/api/loci/formats/ImageReader.html#openBytes-int-byte:A-
-            try {
-                int size = w * h * FormatTools.getBytesPerPixel(reader.getPixelType()) * reader.getRGBChannelCount();
-                if (size > communicationBuffer.capacity()) {
-                    saveError("Requested tile too big; must be at most " + communicationBuffer.capacity()
-                            + " bytes but wanted " + size);
-                    return -2;
+            saveError(getStackTrace(e));
+            return -1;
+        }
+    }
+
+    // format: BFTileEncoder.JPEG or PNG; quality: 1 to 100, for JPEG
+    // Converts to 8 bit as the Python make_pil_image does: signed types
+    // are offset, integers keep their highest 8 bits, floats are
+    // normalized unless within 0 to 1. 1 or 2 channels give grayscale
+    // (of the first), 3 or more RGB, and 4 with PNG RGBA.
+    // writes to communicationBuffer and returns the number of bytes written
+    int BFOpenBytesEncoded(int format, int quality, int plane, int x, int y, int w, int h) {
+        try {
+            if (format != BFTileEncoder.JPEG && format != BFTileEncoder.PNG) {
+                throw new IllegalArgumentException("Unknown encoded format " + format);
+            }
+            if (format == BFTileEncoder.JPEG && (quality < 1 || quality > 100)) {
+                throw new IllegalArgumentException("JPEG quality must be from 1 to 100");
+            }
+            int pixelType = reader.getPixelType();
+            int bytesPerSample = FormatTools.getBytesPerPixel(pixelType);
+            int channels = reader.getRGBChannelCount();
+            boolean interleaved = reader.isInterleaved();
+            byte[] bytes = openBytesPooled(plane, x, y, w, h, (int) getOpenBytesSize(w, h));
+            ByteBuffer pixels = ByteBuffer.wrap(bytes)
+                    .order(reader.isLittleEndian() ? ByteOrder.LITTLE_ENDIAN : ByteOrder.BIG_ENDIAN);
+            int sampleCount = w * h * channels;
+
+            // 8 bit value = (sample + offset) * scale
+            double offset = 0;
+            double scale = 1;
+            switch (pixelType) {
+                case FormatTools.INT8:
+                    offset = 128;
+                    break;
+                case FormatTools.INT16:
+                    offset = 32768;
+                    // fall through
+                case FormatTools.UINT16:
+                    scale = 1.0 / 256;
+                    break;
+                case FormatTools.INT32:
+                    offset = 2147483648.0;
+                    // fall through
+                case FormatTools.UINT32:
+                    scale = 1.0 / 16777216;
+                    break;
+                case FormatTools.BIT:
+                    scale = 255;
+                    break;
+                case FormatTools.FLOAT:
+                case FormatTools.DOUBLE:
+                    double min = Double.POSITIVE_INFINITY;
+                    double max = Double.NEGATIVE_INFINITY;
+                    for (int i = 0; i < sampleCount; i++) {
+                        double v = getSample(pixels, pixelType, i * bytesPerSample);
+                        min = Math.min(min, v);
+                        max = Math.max(max, v);
+                    }
+                    scale = 255;
+                    if ((min < 0 || max > 1) && max > min) {
+                        offset = -min;
+                        scale = 255 / (max - min);
+                    }
+                    break;
+                default:
+                    break;
+            }
+
+            int outChannels = channels < 3 ? 1 : (channels >= 4 && format == BFTileEncoder.PNG ? 4 : 3);
+            int type = outChannels == 1 ? BufferedImage.TYPE_BYTE_GRAY
+                    : (outChannels == 3 ? BufferedImage.TYPE_3BYTE_BGR : BufferedImage.TYPE_4BYTE_ABGR);
+            BufferedImage image = tileEncoder.image(w, h, type);
+            byte[] data = ((DataBufferByte) image.getRaster().getDataBuffer()).getData();
+            for (int pixel = 0; pixel < w * h; pixel++) {
+                for (int c = 0; c < outChannels; c++) {
+                    int sample = interleaved ? pixel * channels + c : c * w * h + pixel;
+                    double v = (getSample(pixels, pixelType, sample * bytesPerSample) + offset) * scale;
+                    // BGR and ABGR are stored reversed
+                    data[pixel * outChannels + (outChannels == 1 ? 0 : outChannels - 1 - c)]
+                            = (byte) clampRound(v, 0, 255);
                 }
-            } catch (Exception e2) {
-            } finally {
-                saveError(getStackTrace(e));
+            }
+
+            communicationBuffer.rewind();
+            int written = tileEncoder.encode(format, quality, communicationBuffer);
+            if (written == -2) {
+                // The encoded size isn't known, but at most about the raw size
+                return bufferTooSmall("Encoded tile does not fit the communication buffer of "
+                        + communicationBuffer.capacity() + " bytes",
+                        Math.max(2L * communicationBuffer.capacity(), (long) w * h * 4 + 65536));
+            }
+            return written;
+        } catch (Exception e) {
+            saveError(getStackTrace(e));
+            return -1;
+        }
+    }
+
+    // Format tags of BFOpenCompressedTile
+    private static final int COMPRESSED_NONE = 0;
+    private static final int COMPRESSED_JPEG = 1;
+    private static final int COMPRESSED_JPEG2000 = 2;
+
+    // Writes two little endian 32 bit integers, a format tag and the length
+    // of the data, then the data from offset 8. If the region is exactly
+    // a stored tile of a JPEG or JPEG 2000 compressed reader
+    // implementing ICompressedTileReader, the data is that tile as stored,
+    // without decoding. Otherwise it is what BFOpenBytes would write,
+    // with tag COMPRESSED_NONE. Edge tiles are padded when stored
+    // so partial ones are decoded too.
+    // Returns the number of bytes written including the 8
+    int BFOpenCompressedTile(int plane, int x, int y, int w, int h) {
+        try {
+            int format = COMPRESSED_NONE;
+            byte[] bytes = null;
+            int tileWidth = reader.getOptimalTileWidth();
+            int tileHeight = reader.getOptimalTileHeight();
+            if (w == tileWidth && h == tileHeight && x % tileWidth == 0 && y % tileHeight == 0
+                    && x + w <= reader.getSizeX() && y + h <= reader.getSizeY()) {
+                IFormatReader core = reader.unwrap();
+                if (core instanceof ICompressedTileReader) {
+                    ICompressedTileReader tiles = (ICompressedTileReader) core;
+                    int column = x / tileWidth;
+                    int row = y / tileHeight;
+                    try {
+                        Codec codec = tiles.getTileCodec(plane);
+                        if (codec instanceof JPEGCodec) {
+                            format = COMPRESSED_JPEG;
+                        } else if (codec instanceof JPEG2000Codec) {
+                            format = COMPRESSED_JPEG2000;
+                        }
+                        if (format != COMPRESSED_NONE && column < tiles.getTileColumns(plane)
+                                && row < tiles.getTileRows(plane)) {
+                            bytes = tiles.openCompressedBytes(plane, column, row);
+                        }
+                    } catch (Exception e) {
+                        // Not supported for this file after all; decode
+                        bytes = null;
+                    }
+                }
+            }
+            if (bytes == null) {
+                format = COMPRESSED_NONE;
+                long size = getOpenBytesSize(w, h);
+                if (size + 8 > communicationBuffer.capacity()) {
+                    return bufferTooSmall("Requested tile too big; must be at most " + (communicationBuffer.capacity() - 8)
+                            + " bytes but wanted " + size, size + 8);
+                }
+                bytes = openBytesPooled(plane, x, y, w, h, (int) size);
+            }
+            if (bytes.length + 8L > communicationBuffer.capacity()) {
+                return bufferTooSmall("Compressed tile of " + bytes.length + " bytes does not fit the communication buffer",
+                        bytes.length + 8L);
+            }
+            communicationBuffer.rewind();
+            communicationBuffer.putInt(format);
+            communicationBuffer.putInt(bytes.length);
+            putTimed(bytes);
+            return bytes.length + 8;
+        } catch (Exception e) {
+            saveError(getStackTrace(e));
+            return -1;
+        }
+    }
+
+    // Orders of BFOpenBytesStack, as BioFormats dimension orders:
+    // the first of Z, C and T varies fastest
+    private static final String[] STACK_ORDERS = {"XYZCT", "XYZTC", "XYCZT", "XYCTZ", "XYTCZ", "XYTZC"};
+
+    // Reads the region of zCount * cCount * tCount planes, from
+    // (z, c, t) = (z0, c0, t0), one after another as BFOpenBytes would
+    // write each, in STACK_ORDERS[order]. c is of BFGetEffectiveSizeC
+    // writes to communicationBuffer and returns the number of bytes written
+    int BFOpenBytesStack(int x, int y, int w, int h, int z0, int zCount,
+            int c0, int cCount, int t0, int tCount, int order) {
+        try {
+            if (order < 0 || order >= STACK_ORDERS.length) {
+                throw new IllegalArgumentException("Unknown order " + order);
+            }
+            if (zCount <= 0 || cCount <= 0 || tCount <= 0 || z0 < 0 || c0 < 0 || t0 < 0
+                    || z0 + zCount > reader.getSizeZ() || c0 + cCount > reader.getEffectiveSizeC()
+                    || t0 + tCount > reader.getSizeT()) {
+                throw new IllegalArgumentException("Z, C or T range out of the image");
+            }
+            int planeCount = zCount * cCount * tCount;
+            long planeSize = getOpenBytesSize(w, h);
+            if (planeSize * planeCount > communicationBuffer.capacity()) {
+                return bufferTooSmall("Requested stack too big; must be at most " + communicationBuffer.capacity()
+                        + " bytes but wanted " + planeSize * planeCount, planeSize * planeCount);
+            }
+            communicationBuffer.rewind();
+            for (int i = 0; i < planeCount; i++) {
+                int[] zct = FormatTools.getZCTCoords(STACK_ORDERS[order], zCount, cCount, tCount, planeCount, i);
+                int plane = reader.getIndex(z0 + zct[0], c0 + zct[1], t0 + zct[2]);
+                putTimed(openBytesPooled(plane, x, y, w, h, (int) planeSize));
+            }
+            return (int) (planeSize * planeCount);
+        } catch (Exception e) {
+            saveError(getStackTrace(e));
+            return -1;
+        }
+    }
+
+    // Input Parameter: count tile descriptors at the beginning of
+    // communicationBuffer, each five little endian 32 bit integers:
+    // plane, x, y, w, h
+    // Writes a table of count entries, each three little endian 32 bit
+    // integers: offset (from the buffer beginning), length, status,
+    // followed by the tiles, each starting at an 8 byte aligned offset.
+    // status is 1 on success, -1 if the tile could not be read
+    // and -2 if it did not fit into the remaining buffer.
+    // A failed tile does not save an error message as that
+    // would overwrite the table; other tiles are still read.
+    // returns the number of bytes written (the end of the last tile)
+    int BFOpenBytesBatch(int count) {
+        try {
+            if (count < 0 || (long) count * 20 > communicationBuffer.capacity()) {
+                saveError("BFOpenBytesBatch: invalid tile count " + count);
                 return -1;
             }
+            int[] descriptors = new int[count * 5];
+            communicationBuffer.rewind();
+            communicationBuffer.asIntBuffer().get(descriptors);
+
+            int offset = alignOffset(count * 12);
+            for (int i = 0; i < count; i++) {
+                int plane = descriptors[i * 5];
+                int x = descriptors[i * 5 + 1];
+                int y = descriptors[i * 5 + 2];
+                int w = descriptors[i * 5 + 3];
+                int h = descriptors[i * 5 + 4];
+                int length = 0;
+                int status;
+                try {
+                    long size = getOpenBytesSize(w, h);
+                    if (offset + size > communicationBuffer.capacity()) {
+                        status = -2;
+                    } else {
+                        byte[] bytes = openBytesPooled(plane, x, y, w, h, (int) size);
+                        communicationBuffer.position(offset);
+                        putTimed(bytes);
+                        length = bytes.length;
+                        status = 1;
+                    }
+                } catch (Exception e) {
+                    status = -1;
+                }
+                communicationBuffer.putInt(i * 12, offset);
+                communicationBuffer.putInt(i * 12 + 4, length);
+                communicationBuffer.putInt(i * 12 + 8, status);
+                if (length > 0) {
+                    offset = alignOffset(offset + length);
+                }
+            }
+            return offset;
+        } catch (Exception e) {
+            saveError(getStackTrace(e));
+            return -1;
+        }
+    }
+
+    // Returns number of bytes written: pixel array pool hits and misses
+    // as two little endian 64 bit integers
+    int BFGetPixelPoolStats() {
+        try {
+            communicationBuffer.rewind();
+            communicationBuffer.putLong(pixelArrayPool.hits);
+            communicationBuffer.putLong(pixelArrayPool.misses);
+            return 16;
+        } catch (Exception e) {
+            saveError(getStackTrace(e));
+            return -1;
         }
     }
 
-   // warning: changes the current resolution level
     // takes exact width and height.
     // the caller should ensure the correct aspect ratio.
     // writes to communicationBuffer and returns the number of bytes written
-    // prepares 3 channel or 4 channel, same sample format
-    // and bitlength (but made unsigned if was int8 or int16 or int32)
+    // Writes a width x height thumbnail of the plane in the current series,
+    // in the pixel format of BFOpenBytes. Reads the smallest resolution
+    // at least as large as the thumbnail (or the largest resolution)
+    // in tiles and downsamples it with an area filter.
+    // The current resolution is kept
     int BFOpenThumbBytes(int plane, int width, int height) {
+        int previousResolution = -1;
         try {
-            /*
-             * float yOverX = reader.getSizeY() / reader.getSizeX();
-             * float xOverY = 1/yToX;
-             * int width = Math.min(maxWidth, maxHeight * xOverY);
-             * int height = Math.min(maxHeight, maxWidth * yOverX);
-             * Also potentially a check so that if width is greater than getSizeX
-             * or likewise for height, use image resolution.
-             */
-
-            readerWithThumbnailSizes.setThumbSizeX(width);
-            readerWithThumbnailSizes.setThumbSizeY(height);
-
-            int resCount = reader.getResolutionCount();
-            reader.setResolution(resCount - 1);
-
-            // Using class's openThumbBytes
-            // instead of FormatTools.openThumbBytes 
-            // might break our custom thumbnail sizes?
-            byte[] bytes = FormatTools.openThumbBytes(readerWithThumbnailSizes, plane);
-            communicationBuffer.rewind().put(bytes);
-            return bytes.length;
+            if (width <= 0 || height <= 0) {
+                throw new IllegalArgumentException("Thumbnail width and height must be positive");
+            }
+            int pixelType = reader.getPixelType();
+            int bytesPerSample = FormatTools.getBytesPerPixel(pixelType);
+            int channels = reader.getRGBChannelCount();
+            if ((long) width * height * bytesPerSample * channels > communicationBuffer.capacity()) {
+                return bufferTooSmall("Thumbnail does not fit the communication buffer",
+                        (long) width * height * bytesPerSample * channels);
+            }
+
+            previousResolution = reader.getResolution();
+            int resolution = 0;
+            long resolutionPixels = Long.MAX_VALUE;
+            for (int i = 0; i < reader.getResolutionCount(); i++) {
+                reader.setResolution(i);
+                long pixels = (long) reader.getSizeX() * reader.getSizeY();
+                if (reader.getSizeX() >= width && reader.getSizeY() >= height && pixels < resolutionPixels) {
+                    resolution = i;
+                    resolutionPixels = pixels;
+                }
+            }
+            reader.setResolution(resolution);
+
+            int levelWidth = reader.getSizeX();
+            int levelHeight = reader.getSizeY();
+            boolean interleaved = reader.isInterleaved();
+            ByteOrder order = reader.isLittleEndian() ? ByteOrder.LITTLE_ENDIAN : ByteOrder.BIG_ENDIAN;
+            // Source pixels per thumbnail pixel
+            double scaleX = (double) levelWidth / width;
+            double scaleY = (double) levelHeight / height;
+
+            // Read at least about a megapixel at once
+            // as some formats have one-row tiles
+            int tileWidth = Math.min(reader.getOptimalTileWidth(), levelWidth);
+            int tileHeight = Math.min(reader.getOptimalTileHeight(), levelHeight);
+            tileHeight = Math.max(tileHeight, Math.min(levelHeight, (1 << 20) / tileWidth));
+
+            double[] sums = new double[width * height * channels];
+            double[] weights = new double[width * height];
+            for (int tileY = 0; tileY < levelHeight; tileY += tileHeight) {
+                int h = Math.min(tileHeight, levelHeight - tileY);
+                for (int tileX = 0; tileX < levelWidth; tileX += tileWidth) {
+                    int w = Math.min(tileWidth, levelWidth - tileX);
+                    byte[] bytes = openBytesPooled(plane, tileX, tileY, w, h, (int) getOpenBytesSize(w, h));
+                    ByteBuffer tile = ByteBuffer.wrap(bytes).order(order);
+                    for (int y = 0; y < h; y++) {
+                        int sourceY = tileY + y;
+                        int firstY = Math.min(height - 1, (int) (sourceY / scaleY));
+                        int lastY = Math.min(height - 1, (int) Math.ceil((sourceY + 1) / scaleY) - 1);
+                        for (int thumbY = firstY; thumbY <= lastY; thumbY++) {
+                            // Overlap of the source and thumbnail pixels
+                            double weightY = Math.min(sourceY + 1, (thumbY + 1) * scaleY)
+                                    - Math.max(sourceY, thumbY * scaleY);
+                            if (weightY <= 0) {
+                                continue;
+                            }
+                            for (int x = 0; x < w; x++) {
+                                int sourceX = tileX + x;
+                                int firstX = Math.min(width - 1, (int) (sourceX / scaleX));
+                                int lastX = Math.min(width - 1, (int) Math.ceil((sourceX + 1) / scaleX) - 1);
+                                for (int thumbX = firstX; thumbX <= lastX; thumbX++) {
+                                    double weight = weightY * (Math.min(sourceX + 1, (thumbX + 1) * scaleX)
+                                            - Math.max(sourceX, thumbX * scaleX));
+                                    if (weight <= 0) {
+                                        continue;
+                                    }
+                                    int thumbPixel = thumbY * width + thumbX;
+                                    weights[thumbPixel] += weight;
+                                    for (int c = 0; c < channels; c++) {
+                                        int sample = interleaved ? (y * w + x) * channels + c : (c * h + y) * w + x;
+                                        sums[thumbPixel * channels + c] +=
+                                                weight * getSample(tile, pixelType, sample * bytesPerSample);
+                                    }
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+
+            // Same layout and byte order as the source
+            ByteBuffer thumbnail = communicationBuffer.duplicate().order(order);
+            for (int pixel = 0; pixel < width * height; pixel++) {
+                for (int c = 0; c < channels; c++) {
+                    int sample = interleaved ? pixel * channels + c : c * width * height + pixel;
+                    putSample(thumbnail, pixelType, sample * bytesPerSample,
+                            sums[pixel * channels + c] / weights[pixel]);
+                }
+            }
+            return width * height * channels * bytesPerSample;
         } catch (Exception e) {
             saveError(getStackTrace(e));
             return -1;
+        } finally {
+            if (previousResolution >= 0) {
+                try {
+                    reader.setResolution(previousResolution);
+                } catch (Exception e) {
+
+                }
+            }
         }
     }
 
@@ -753,8 +1448,8 @@ public class BFBridge {
             String metadataString = metadata.dumpXML();
             byte[] bytes = metadataString.getBytes(charset);
             if (bytes.length > communicationBuffer.capacity()) {
-                saveError("BFDumpOMEXMLMetadata: needed buffer of length at least " + bytes.length + " but current buffer is of length " + communicationBuffer.capacity());
-                return -2;
+                return bufferTooSmall("BFDumpOMEXMLMetadata: needed buffer of length at least " + bytes.length
+                        + " but current buffer is of length " + communicationBuffer.capacity(), bytes.length);
             }
             communicationBuffer.rewind().put(bytes);
             return bytes.length;
@@ -764,21 +1459,425 @@ public class BFBridge {
         }
     }
 
+    // Writes the description of the current series and resolution
+    // in one call, in the layout of bfbridge_image_info_t:
+    // three little endian doubles (as BFGetMPPX, BFGetMPPY, BFGetMPPZ
+    // for the current series) then little endian 32 bit integers
+    // in the order below. Booleans are 1 or 0.
+    // Returns number of bytes written
+    int BFGetImageInfo() {
+        try {
+            int series = reader.getSeries();
+            communicationBuffer.rewind();
+            communicationBuffer.putDouble(micrometersOrZero(metadata.getPixelsPhysicalSizeX(series)));
+            communicationBuffer.putDouble(micrometersOrZero(metadata.getPixelsPhysicalSizeY(series)));
+            communicationBuffer.putDouble(micrometersOrZero(metadata.getPixelsPhysicalSizeZ(series)));
+            communicationBuffer.putInt(reader.getSeriesCount());
+            communicationBuffer.putInt(series);
+            communicationBuffer.putInt(reader.getResolutionCount());
+            communicationBuffer.putInt(reader.getResolution());
+            communicationBuffer.putInt(reader.getSizeX());
+            communicationBuffer.putInt(reader.getSizeY());
+            communicationBuffer.putInt(reader.getSizeC());
+            communicationBuffer.putInt(reader.getSizeZ());
+            // size_time
+            communicationBuffer.putInt(reader.getSizeT());
+            communicationBuffer.putInt(reader.getEffectiveSizeC());
+            communicationBuffer.putInt(reader.getImageCount());
+            communicationBuffer.putInt(reader.isOrderCertain() ? 1 : 0);
+            communicationBuffer.putInt(reader.getOptimalTileWidth());
+            communicationBuffer.putInt(reader.getOptimalTileHeight());
+            communicationBuffer.putInt(reader.getPixelType());
+            communicationBuffer.putInt(reader.getBitsPerPixel());
+            communicationBuffer.putInt(FormatTools.getBytesPerPixel(reader.getPixelType()));
+            communicationBuffer.putInt(reader.getRGBChannelCount());
+            communicationBuffer.putInt(reader.isRGB() ? 1 : 0);
+            communicationBuffer.putInt(reader.isInterleaved() ? 1 : 0);
+            communicationBuffer.putInt(reader.isLittleEndian() ? 1 : 0);
+            communicationBuffer.putInt(reader.isIndexed() ? 1 : 0);
+            communicationBuffer.putInt(reader.isFalseColor() ? 1 : 0);
+            // Padding to keep the size a multiple of 8
+            communicationBuffer.putInt(0);
+            return communicationBuffer.position();
+        } catch (Exception e) {
+            saveError(getStackTrace(e));
+            return -1;
+        }
+    }
+
+    // Describes every resolution of every series in one call
+    // without changing the current series and resolution.
+    // Writes, in the layout of bfbridge_pyramid_level_t, for each level:
+    // two little endian doubles, MPP X and Y (0 if not defined) scaled
+    // from the largest resolution of the series, then little endian
+    // 32 bit integers series, resolution, sizeX, sizeY,
+    // optimal tile width, optimal tile height, pixel type,
+    // RGB channel count.
+    // Returns number of bytes written: 48 times the level count
+    int BFGetPyramidLayout() {
+        int previousSeries = -1;
+        int previousResolution = -1;
+        try {
+            previousSeries = reader.getSeries();
+            previousResolution = reader.getResolution();
+            communicationBuffer.rewind();
+            int seriesCount = reader.getSeriesCount();
+            for (int series = 0; series < seriesCount; series++) {
+                reader.setSeries(series);
+                double mppX = micrometersOrZero(metadata.getPixelsPhysicalSizeX(series));
+                double mppY = micrometersOrZero(metadata.getPixelsPhysicalSizeY(series));
+                int resolutionCount = reader.getResolutionCount();
+                reader.setResolution(0);
+                double fullSizeX = reader.getSizeX();
+                double fullSizeY = reader.getSizeY();
+                for (int resolution = 0; resolution < resolutionCount; resolution++) {
+                    if (communicationBuffer.remaining() < 48) {
+                        return bufferTooSmall("BFGetPyramidLayout: needed a longer buffer than "
+                                + communicationBuffer.capacity(), 2L * communicationBuffer.capacity() + 48);
+                    }
+                    reader.setResolution(resolution);
+                    int sizeX = reader.getSizeX();
+                    int sizeY = reader.getSizeY();
+                    communicationBuffer.putDouble(mppX * fullSizeX / sizeX);
+                    communicationBuffer.putDouble(mppY * fullSizeY / sizeY);
+                    communicationBuffer.putInt(series);
+                    communicationBuffer.putInt(resolution);
+                    communicationBuffer.putInt(sizeX);
+                    communicationBuffer.putInt(sizeY);
+                    communicationBuffer.putInt(reader.getOptimalTileWidth());
+                    communicationBuffer.putInt(reader.getOptimalTileHeight());
+                    communicationBuffer.putInt(reader.getPixelType());
+                    communicationBuffer.putInt(reader.getRGBChannelCount());
+                }
+            }
+            return communicationBuffer.position();
+        } catch (Exception e) {
+            saveError(getStackTrace(e));
+            return -1;
+        } finally {
+            // Restore for the caller
+            try {
+                if (previousSeries >= 0) {
+                    reader.setSeries(previousSeries);
+                    reader.setResolution(previousResolution);
+                }
+            } catch (Exception e) {
+            }
+        }
+    }
+
+    // Writes seven little endian 64 bit integers: openBytes calls and
+    // nanoseconds, setId calls and nanoseconds, copies to
+    // communicationBuffer, their nanoseconds and bytes.
+    // All zero unless BFBRIDGE_STATS is set
+    // Returns number of bytes written: 56
+    int BFGetJavaStats() {
+        try {
+            communicationBuffer.rewind();
+            communicationBuffer.putLong(openBytesCalls);
+            communicationBuffer.putLong(openBytesNanos);
+            communicationBuffer.putLong(setIdCalls);
+            communicationBuffer.putLong(setIdNanos);
+            communicationBuffer.putLong(copyCalls);
+            communicationBuffer.putLong(copyNanos);
+            communicationBuffer.putLong(copyBytes);
+            return 56;
+        } catch (Exception e) {
+            saveError(getStackTrace(e));
+            return -1;
+        }
+    }
+
+    // After a call returned -2 because its output did not fit the
+    // communication buffer: returns the buffer length it needs (at least,
+    // when it could not know before writing), or 0 if the last error was
+    // another. Doesn't use the communication buffer
+    int BFGetRequiredBufferSize() {
+        return (int) Math.min(requiredBufferBytes, Integer.MAX_VALUE);
+    }
+
+    // Images of BioFormats' fake format, which need no file, covering
+    // the usual pixel layouts of slides
+    private static final String[] warmUpImages = {
+            "bfbridge-warmup&sizeX=2048&sizeY=2048&resolutions=4&resolutionScale=2.fake",
+            "bfbridge-warmup&sizeX=1024&sizeY=1024&sizeC=3&rgb=3&interleaved=true.fake",
+            "bfbridge-warmup&sizeX=1024&sizeY=1024&sizeC=3&pixelType=uint16.fake",
+            "bfbridge-warmup&sizeX=512&sizeY=512&pixelType=float.fake",
+    };
+
+    // Called by bfbridge_make_vm when asked to warm up, before any instance.
+    // Constructing an ImageReader loads and initializes every reader class;
+    // reading tiles, thumbnails and image info of warmUpImages, then of file
+    // if not null (a slide like those to be served, to exercise its reader
+    // and Memoizer), runs the code of a first tile once. A CDS archive
+    // created afterwards (see bfbridge_make_vm_with_options) keeps the
+    // loaded classes. Returns the number of images read, or -1 after
+    // printing why to stderr
+    static int BFWarmUp(String file) {
+        BFBridge bridge = new BFBridge();
+        try {
+            bridge.BFSetCommunicationBuffer(ByteBuffer.allocate(16 * 1024 * 1024));
+            int count = 0;
+            for (String image : warmUpImages) {
+                // Memoizer would write memo files for these
+                bridge.nonCachingReader.setId(image);
+                bridge.warmUpCurrentFile();
+                bridge.nonCachingReader.close();
+                count++;
+            }
+            if (file != null) {
+                bridge.setIdTimed(file);
+                bridge.warmUpCurrentFile();
+                count++;
+            }
+            return count;
+        } catch (Exception e) {
+            System.err.println("BFBridge: warm-up failed: " + getStackTrace(e));
+            return -1;
+        } finally {
+            bridge.close();
+        }
+    }
+
+    private void warmUpCurrentFile() throws Exception {
+        int resolutions = reader.getResolutionCount();
+        for (int r = 0; r < resolutions; r++) {
+            warmUpCheck(BFSetCurrentResolution(r));
+            int w = Math.min(reader.getSizeX(), 256);
+            int h = Math.min(reader.getSizeY(), 256);
+            warmUpCheck(BFOpenBytes(0, 0, 0, w, h));
+            warmUpCheck(BFGetImageInfo());
+        }
+        warmUpCheck(BFSetCurrentResolution(0));
+        warmUpCheck(BFOpenThumbBytes(0, 256, 256));
+        warmUpCheck(BFOpenBytesEncoded(BFTileEncoder.JPEG, 80, 0, 0, 0,
+                Math.min(reader.getSizeX(), 256), Math.min(reader.getSizeY(), 256)));
+        warmUpCheck(BFGetPyramidLayout());
+    }
+
+    private void warmUpCheck(int result) {
+        if (result < 0) {
+            byte[] error = new byte[lastErrorBytes];
+            communicationBuffer.rewind().get(error);
+            throw new IllegalStateException(new String(error, charset));
+        }
+    }
+
+    // 0 if not defined
+    private static double micrometersOrZero(Length size) {
+        if (size == null) {
+            return 0d;
+        }
+        return size.value(UNITS.MICROMETER).doubleValue();
+    }
+
     private static String getStackTrace(Throwable t) {
         StringWriter sw = new StringWriter();
         t.printStackTrace(new PrintWriter(sw));
         return t.toString() + "\n" + sw.toString();
     }
 
+    // Size of an openBytes array for the current series and resolution
+    // As in:
+    // https://github.com/ome/bioformats/blob/4a08bfd5334323e99ad57de00e41cd15706164eb/components/formats-api/src/loci/formats/FormatReader.java#L906
+    private long getOpenBytesSize(int w, int h) {
+        return (long) w * h * FormatTools.getBytesPerPixel(reader.getPixelType()) * reader.getRGBChannelCount();
+    }
+
+    // https://github.com/ome/bioformats/issues/4058 means that
+    // openBytes wasn't designed to copy to a preallocated byte array
+    // unless it had the exact size and not greater
+    // so the pool gives us exact-size arrays.
+    // size: from getOpenBytesSize
+    // The returned array is reused by the next call
+    private byte[] openBytesPooled(int plane, int x, int y, int w, int h, int size) throws Exception {
+        byte[] bytes = pixelArrayPool.get(w, h, reader.getPixelType(), reader.getRGBChannelCount(), size);
+        if (!statsEnabled) {
+            reader.openBytes(plane, bytes, x, y, w, h);
+            return bytes;
+        }
+        long start = System.nanoTime();
+        reader.openBytes(plane, bytes, x, y, w, h);
+        openBytesNanos += System.nanoTime() - start;
+        openBytesCalls++;
+        return bytes;
+    }
+
+    private void setIdTimed(String filename) throws Exception {
+        if (!statsEnabled) {
+            reader.setId(filename);
+            return;
+        }
+        long start = System.nanoTime();
+        reader.setId(filename);
+        setIdNanos += System.nanoTime() - start;
+        setIdCalls++;
+    }
+
+    // communicationBuffer.put(bytes) at the current position
+    private void putTimed(byte[] bytes) {
+        if (!statsEnabled) {
+            communicationBuffer.put(bytes);
+            return;
+        }
+        long start = System.nanoTime();
+        communicationBuffer.put(bytes);
+        copyNanos += System.nanoTime() - start;
+        copyCalls++;
+        copyBytes += bytes.length;
+    }
+
+    // index: in bytes
+    private static double getSample(ByteBuffer b, int pixelType, int index) {
+        switch (pixelType) {
+            case FormatTools.INT8:
+                return b.get(index);
+            case FormatTools.UINT8:
+            case FormatTools.BIT:
+                return b.get(index) & 0xff;
+            case FormatTools.INT16:
+                return b.getShort(index);
+            case FormatTools.UINT16:
+                return b.getShort(index) & 0xffff;
+            case FormatTools.INT32:
+                return b.getInt(index);
+            case FormatTools.UINT32:
+                return b.getInt(index) & 0xffffffffL;
+            case FormatTools.FLOAT:
+                return b.getFloat(index);
+            case FormatTools.DOUBLE:
+                return b.getDouble(index);
+            default:
+                throw new IllegalArgumentException("Unknown pixel type " + pixelType);
+        }
+    }
+
+    // Rounds and clamps to the range of integer types
+    private static void putSample(ByteBuffer b, int pixelType, int index, double value) {
+        switch (pixelType) {
+            case FormatTools.INT8:
+                b.put(index, (byte) clampRound(value, Byte.MIN_VALUE, Byte.MAX_VALUE));
+                break;
+            case FormatTools.UINT8:
+            case FormatTools.BIT:
+                b.put(index, (byte) clampRound(value, 0, 255));
+                break;
+            case FormatTools.INT16:
+                b.putShort(index, (short) clampRound(value, Short.MIN_VALUE, Short.MAX_VALUE));
+                break;
+            case FormatTools.UINT16:
+                b.putShort(index, (short) clampRound(value, 0, 65535));
+                break;
+            case FormatTools.INT32:
+                b.putInt(index, (int) clampRound(value, Integer.MIN_VALUE, Integer.MAX_VALUE));
+                break;
+            case FormatTools.UINT32:
+                b.putInt(index, (int) clampRound(value, 0, 0xffffffffL));
+                break;
+            case FormatTools.FLOAT:
+                b.putFloat(index, (float) value);
+                break;
+            case FormatTools.DOUBLE:
+                b.putDouble(index, value);
+                break;
+            default:
+                throw new IllegalArgumentException("Unknown pixel type " + pixelType);
+        }
+    }
+
+    private static long clampRound(double value, long min, long max) {
+        return Math.max(min, Math.min(max, Math.round(value)));
+    }
+
+    private static int alignOffset(int offset) {
+        return (offset + 7) & ~7;
+    }
+
+    // Moves the open file, if any, to openReaders, evicting
+    // the least recently used ones over the limits to sharedReaders.
+    // Without openReaders, moves it to sharedReaders.
+    // Afterwards the current readers must be replaced with useReaders.
+    private void keepOpen() {
+        if (readers.canonicalPath == null || reader.getCurrentFile() == null) {
+            retire(readers);
+            return;
+        }
+        if (readerCacheMaxCount <= 0) {
+            release(readers);
+            return;
+        }
+        BFReaders previous = openReaders.put(readers.canonicalPath, readers);
+        if (previous != null) {
+            openReadersBytes -= previous.estimatedBytes;
+            retire(previous);
+        }
+        openReadersBytes += readers.estimatedBytes;
+
+        Iterator<BFReaders> leastRecentlyUsed = openReaders.values().iterator();
+        while (leastRecentlyUsed.hasNext()
+                && (openReaders.size() > readerCacheMaxCount || openReadersBytes > readerCacheMaxBytes)) {
+            BFReaders evicted = leastRecentlyUsed.next();
+            leastRecentlyUsed.remove();
+            openReadersBytes -= evicted.estimatedBytes;
+            release(evicted);
+        }
+    }
+
+    // Hands an open file to sharedReaders if enabled, otherwise closes it
+    private void release(BFReaders r) {
+        if (sharedReaderCacheMaxCount <= 0) {
+            retire(r);
+            return;
+        }
+        ArrayList<BFReaders> evicted = new ArrayList<>();
+        sharedReaders.put(r, evicted);
+        for (BFReaders e : evicted) {
+            retire(e);
+        }
+    }
+
+    // Closed readers kept to be reused, as constructing
+    // ImageReader constructs every format reader
+    private BFReaders idleReaders = null;
+
+    private void retire(BFReaders r) {
+        try {
+            r.reader.close();
+        } catch (Exception e) {
+
+        }
+        r.canonicalPath = null;
+        r.estimatedBytes = 0;
+        r.lookupTables8.clear();
+        r.lookupTables16.clear();
+        idleReaders = r;
+    }
+
+    private BFReaders takeIdleReaders() {
+        BFReaders r = idleReaders;
+        idleReaders = null;
+        return r != null ? r : new BFReaders();
+    }
+
     private void close() {
         try {
             reader.close();
         } catch (Exception e) {
 
         }
+        readers.lookupTables8.clear();
+        readers.lookupTables16.clear();
+    }
+
+    // Saves the error and the buffer length needed for BFGetRequiredBufferSize
+    private int bufferTooSmall(String s, long requiredBytes) {
+        saveError(s);
+        requiredBufferBytes = requiredBytes;
+        return -2;
     }
 
     private void saveError(String s) {
+        requiredBufferBytes = 0;
         byte[] errorBytes = s.getBytes(charset);
         int bytes_len = errorBytes.length;
         // -1 to account for the null byte for security
@@ -0,0 +1,159 @@
+package org.camicroscope;
+
+import loci.common.DebugTools;
+import loci.common.services.ServiceFactory;
+import loci.formats.FormatTools;
+import loci.formats.MetadataTools;
+import loci.formats.meta.IMetadata;
+import loci.formats.meta.IPyramidStore;
+import loci.formats.out.PyramidOMETiffWriter;
+import loci.formats.out.TiffWriter;
+import loci.formats.services.OMEXMLService;
+import ome.xml.model.primitives.PositiveInteger;
+
+import java.io.File;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+// Writes the pyramidal OME-TIFFs that python/benchmark.py reads, so that
+// benchmark runs on different machines or BioFormats versions read the
+// same pixels. The pixels are a function of the position only.
+// Usage, with the BFBRIDGE_CLASSPATH directory:
+// java -cp "$BFBRIDGE_CLASSPATH:$BFBRIDGE_CLASSPATH/*" org.camicroscope.BFBridgeSyntheticSlides outdir [size] [tilesize]
+// Prints the path of each slide. Existing slides are not rewritten.
+public class BFBridgeSyntheticSlides {
+    private static final class Variant {
+        final String name;
+        final int pixelType;
+        final int channels;
+        // Whether channels are samples of one plane (RGB) or separate planes
+        final boolean rgb;
+        final String compression;
+
+        Variant(String name, int pixelType, int channels, boolean rgb, String compression) {
+            this.name = name;
+            this.pixelType = pixelType;
+            this.channels = channels;
+            this.rgb = rgb;
+            this.compression = compression;
+        }
+    }
+
+    private static final Variant[] VARIANTS = {
+        new Variant("uint8_rgb_uncompressed", FormatTools.UINT8, 3, true, TiffWriter.COMPRESSION_UNCOMPRESSED),
+        new Variant("uint8_rgb_jpeg", FormatTools.UINT8, 3, true, TiffWriter.COMPRESSION_JPEG),
+        new Variant("uint8_rgb_lzw", FormatTools.UINT8, 3, true, TiffWriter.COMPRESSION_LZW),
+        new Variant("uint8_4channel_lzw", FormatTools.UINT8, 4, false, TiffWriter.COMPRESSION_LZW),
+        new Variant("uint16_4channel_uncompressed", FormatTools.UINT16, 4, false, TiffWriter.COMPRESSION_UNCOMPRESSED),
+        new Variant("uint16_4channel_lzw", FormatTools.UINT16, 4, false, TiffWriter.COMPRESSION_LZW),
+    };
+
+    public static void main(String[] args) throws Exception {
+        if (args.length < 1) {
+            System.err.println("Usage: BFBridgeSyntheticSlides outdir [size] [tilesize]");
+            System.exit(2);
+        }
+        DebugTools.setRootLevel("ERROR");
+        File outdir = new File(args[0]);
+        int size = args.length > 1 ? Integer.parseInt(args[1]) : 4096;
+        int tileSize = args.length > 2 ? Integer.parseInt(args[2]) : 256;
+        if (!outdir.isDirectory() && !outdir.mkdirs()) {
+            throw new IllegalArgumentException("Cannot create " + outdir);
+        }
+        for (Variant variant : VARIANTS) {
+            File file = new File(outdir, variant.name + "_" + size + ".ome.tif");
+            if (!file.exists()) {
+                // Renamed when complete so that an interrupted run isn't reused
+                File partial = new File(outdir, variant.name + "_" + size + ".partial.ome.tif");
+                partial.delete();
+                write(partial, variant, size, tileSize);
+                if (!partial.renameTo(file)) {
+                    throw new IllegalStateException("Cannot rename " + partial + " to " + file);
+                }
+            }
+            System.out.println(file.getAbsolutePath());
+        }
+    }
+
+    private static void write(File file, Variant variant, int size, int tileSize) throws Exception {
+        // Halving down to about a tile
+        int resolutionCount = 1;
+        while ((size >> resolutionCount) >= tileSize) {
+            resolutionCount++;
+        }
+
+        ServiceFactory factory = new ServiceFactory();
+        OMEXMLService service = factory.getInstance(OMEXMLService.class);
+        IMetadata metadata = service.createOMEXMLMetadata();
+        MetadataTools.populateMetadata(metadata, 0, variant.name, true, "XYCZT",
+                FormatTools.getPixelTypeString(variant.pixelType), size, size, 1,
+                variant.channels, 1, variant.rgb ? variant.channels : 1);
+        for (int resolution = 1; resolution < resolutionCount; resolution++) {
+            ((IPyramidStore) metadata).setResolutionSizeX(new PositiveInteger(size >> resolution), 0, resolution);
+            ((IPyramidStore) metadata).setResolutionSizeY(new PositiveInteger(size >> resolution), 0, resolution);
+        }
+
+        int bytesPerSample = FormatTools.getBytesPerPixel(variant.pixelType);
+        int samples = variant.rgb ? variant.channels : 1;
+        int planes = variant.rgb ? 1 : variant.channels;
+
+        PyramidOMETiffWriter writer = new PyramidOMETiffWriter();
+        try {
+            writer.setMetadataRetrieve(metadata);
+            writer.setCompression(variant.compression);
+            writer.setInterleaved(true);
+            writer.setBigTiff(true);
+            writer.setWriteSequentially(true);
+            writer.setTileSizeX(tileSize);
+            writer.setTileSizeY(tileSize);
+            writer.setId(file.getAbsolutePath());
+            ByteBuffer tile = ByteBuffer.allocate(tileSize * tileSize * samples * bytesPerSample)
+                    .order(ByteOrder.LITTLE_ENDIAN);
+            for (int resolution = 0; resolution < resolutionCount; resolution++) {
+                writer.setResolution(resolution);
+                int levelSize = size >> resolution;
+                for (int plane = 0; plane < planes; plane++) {
+                    for (int y = 0; y < levelSize; y += tileSize) {
+                        for (int x = 0; x < levelSize; x += tileSize) {
+                            int w = Math.min(tileSize, levelSize - x);
+                            int h = Math.min(tileSize, levelSize - y);
+                            tile.clear();
+                            for (int j = 0; j < h; j++) {
+                                for (int i = 0; i < w; i++) {
+                                    for (int s = 0; s < samples; s++) {
+                                        // Same place in every resolution
+                                        long value = sample((long) (x + i) << resolution,
+                                                (long) (y + j) << resolution, plane + s);
+                                        if (bytesPerSample == 1) {
+                                            tile.put((byte) (value >> 8));
+                                        } else {
+                                            tile.putShort((short) value);
+                                        }
+                                    }
+                                }
+                            }
+                            byte[] bytes = new byte[tile.position()];
+                            tile.flip();
+                            tile.get(bytes);
+                            writer.saveBytes(plane, bytes, x, y, w, h);
+                        }
+                    }
+                }
+            }
+        } finally {
+            writer.close();
+        }
+    }
+
+    // 16 bit sample: smooth gradients, as tissue, plus some noise,
+    // so that compression ratios are realistic
+    private static long sample(long x, long y, int channel) {
+        long h = x * 0x9E3779B97F4A7C15L + y * 0xC2B2AE3D27D4EB4FL + channel * 0x165667B19E3779F9L;
+        h ^= h >>> 29;
+        h *= 0xBF58476D1CE4E5B9L;
+        h ^= h >>> 32;
+        double smooth = 0.5 + 0.25 * Math.sin(x / 97.0 + channel) + 0.2 * Math.cos(y / 131.0 - channel);
+        long value = (long) (smooth * 65535) + (h & 0xFFF) - 0x800;
+        return Math.max(0, Math.min(65535, value));
+    }
+}
@@ -1,13 +1,78 @@
 import os
 import threading
+import weakref
+import numpy as np
+from PIL import Image
 from . import gtm, utils
 ffi, lib = utils.IMPORT_BFBRIDGE()
 
 
+# Converts bytes as open_bytes returns them to a uint8 array of shape
+# (height, width, channels) in one pass in C, see bfbridge_convert.h
+# window_width > 0 maps window_center - window_width / 2 to
+# window_center + window_width / 2 to 0 to 255.
+# Otherwise as utils.make_pil_image converts
+def convert_to_8bit(byte_arr, width, height, channels, interleaved, pixel_type, little_endian, \
+                    window_center=0, window_width=0, disable_simd=False):
+    options = ffi.new("bfbridge_convert_options_t*")
+    options.pixel_type = pixel_type
+    options.channels = channels
+    options.is_interleaved = 1 if interleaved else 0
+    options.is_little_endian = 1 if little_endian else 0
+    options.window_center = window_center
+    options.window_width = window_width
+    options.disable_simd = 1 if disable_simd else 0
+    arr = np.empty((height, width, channels), dtype=np.uint8)
+    src = ffi.from_buffer(byte_arr)
+    if lib.bfbridge_convert_to_8bit(src, len(src), ffi.from_buffer("unsigned char[]", arr, require_writable=True), \
+                                    width * height, options) < 0:
+        raise ValueError("convert_to_8bit: invalid pixel format or number of bytes")
+    return arr
+
+# utils.make_pil_image, converting RGB in C
+def make_pil_image(byte_arr, width, height, channels, interleaved, pixel_type, little_endian):
+    if channels != 3 or pixel_type == 8:
+        return utils.make_pil_image( \
+            byte_arr, width, height, channels, interleaved, pixel_type, little_endian)
+    return Image.fromarray(convert_to_8bit( \
+        byte_arr, width, height, channels, interleaved, pixel_type, little_endian), mode="RGB")
+
+
+# Call statistics of bf_* functions in all threads, see bfbridge_get_stats.
+# Disabled by default, or enabled by the BFBRIDGE_STATS env var
+def set_stats_enabled(enabled):
+    lib.bfbridge_set_stats_enabled(1 if enabled else 0)
+
+def reset_stats():
+    lib.bfbridge_reset_stats()
+
+# returns a dict from function name (such as "BFOpenBytes") to a dict
+# with the fields of bfbridge_call_stats_t, latency_buckets as a list
+def get_stats():
+    count = lib.bfbridge_get_stats(ffi.NULL, 0)
+    stats = ffi.new("bfbridge_call_stats_t[]", max(count, 1))
+    count = min(lib.bfbridge_get_stats(stats, count), count)
+    result = {}
+    for i in range(count):
+        result[ffi.string(stats[i].name).decode()] = { \
+            "calls": stats[i].calls, "errors": stats[i].errors, \
+            "bytes": stats[i].bytes, "total_ns": stats[i].total_ns, \
+            "latency_buckets": list(stats[i].latency_buckets)}
+    return result
+
+
 # Can be created only once during a Python process lifetime.
 # Once it's destroyed it cannot be recreated in the same process
+# jvm_options: list of options such as "-Xmx8g", see bfbridge_vm_options_t
+# in bfbridge_basiclib.h for these and the environment variables
+# (BFBRIDGE_JVM_OPTS, BFBRIDGE_CDS_ARCHIVE, BFBRIDGE_WARM_UP,
+# BFBRIDGE_WARM_UP_FILE) that set them too
+# cds_archive: a Class Data Sharing archive file, created when this
+# object is destroyed if missing, to start faster afterwards
+# warm_up: whether to load the readers and read some images now,
+# and warm_up_file to read too
 class BFBridgeVM:
-    def __init__(self):
+    def __init__(self, jvm_options=None, cds_archive=None, warm_up=False, warm_up_file=None):
         self.bfbridge_vm =  ffi.new("bfbridge_vm_t*")
         cpdir = os.environ.get("BFBRIDGE_CLASSPATH")
         if cpdir is None or cpdir == "":
@@ -19,7 +84,23 @@ class BFBridgeVM:
         if cachedir is not None and cachedir != "":
             cachedir_arg = ffi.new("char[]", cachedir.encode())
 
-        potential_error = lib.bfbridge_make_vm(self.bfbridge_vm, cpdir_arg, cachedir_arg)
+        options = ffi.new("bfbridge_vm_options_t*")
+        # Kept alive until bfbridge_make_vm_with_options returns
+        option_args = [ffi.new("char[]", option.encode()) for option in jvm_options or []]
+        option_array = ffi.new("char*[]", option_args)
+        options.jvm_options = option_array
+        options.jvm_option_count = len(option_args)
+        cds_archive_arg = ffi.NULL
+        if cds_archive:
+            cds_archive_arg = ffi.new("char[]", os.fsencode(cds_archive))
+        options.cds_archive = cds_archive_arg
+        options.warm_up = 1 if warm_up else 0
+        warm_up_file_arg = ffi.NULL
+        if warm_up_file:
+            warm_up_file_arg = ffi.new("char[]", os.fsencode(warm_up_file))
+        options.warm_up_file = warm_up_file_arg
+
+        potential_error = lib.bfbridge_make_vm_with_options(self.bfbridge_vm, cpdir_arg, cachedir_arg, options)
         if potential_error != ffi.NULL:
             err = ffi.string(potential_error[0].description)
             lib.bfbridge_free_error(potential_error)
@@ -73,9 +154,371 @@ class BFBridgeThread:
         if gtm.change_ref_count(self.owner_thread, -1) == 0:
             lib.bfbridge_free_thread(self.bfbridge_thread)
 
+# Worker threads, each with its own BioFormats instance.
+# Can be used from any thread (of the process that created the VM)
+# and by multiple threads at once. CFFI releases the GIL while reading.
+class BFBridgePool:
+    def __init__(self, bfbridge_vm, thread_count, communication_buffer_len=34000000):
+        if bfbridge_vm is None:
+            raise ValueError("BFBridgePool must be initialized with BFBridgeVM")
+        if bfbridge_vm.owner_pid != os.getpid():
+            raise RuntimeError("JVM was created in a different process")
+
+        # Keep the VM alive as long as the pool
+        self.bfbridge_vm = bfbridge_vm
+        self.thread_count = thread_count
+        self.bfbridge_pool = ffi.new("bfbridge_pool_t*")
+        potential_error = lib.bfbridge_make_pool(
+            self.bfbridge_pool, bfbridge_vm.bfbridge_vm, thread_count, communication_buffer_len)
+        if potential_error != ffi.NULL:
+            err = ffi.string(potential_error[0].description)
+            lib.bfbridge_free_error(potential_error)
+            raise RuntimeError(err)
+
+    def __copy__(self):
+        raise RuntimeError("BFBridgePool cannot be copied")
+
+    def __deepcopy__(self):
+        raise RuntimeError("BFBridgePool cannot be copied")
+
+    def __del__(self):
+        if hasattr(self, "async_loop") and not self.async_loop.is_closed():
+            self.async_loop.remove_reader(lib.bfbridge_pool_get_completion_fd(self.bfbridge_pool))
+        if hasattr(self, "bfbridge_pool"):
+            lib.bfbridge_free_pool(self.bfbridge_pool)
+
+    # Serve reads from cache (a BFBridgeTileCache) when possible and add to it,
+    # or stop using a cache if None. Call when no reads are in progress
+    def set_tile_cache(self, cache):
+        # Keep the cache alive as long as it's used
+        self.tile_cache = cache
+        lib.bfbridge_pool_set_tile_cache(self.bfbridge_pool, \
+            cache.bfbridge_tile_cache if cache is not None else ffi.NULL)
+
+    # Prefetch the tiles a viewer will likely request next into the tile
+    # cache on idle workers, see bfbridge_prefetch_config_t, or stop if
+    # enabled is False. Requires a tile cache. Call when no reads are in progress
+    def set_prefetch(self, enabled=True, neighbor_rings=1, max_readahead=4, zoom_in=True, \
+                     max_queued=64, max_workers=None):
+        if not enabled:
+            lib.bfbridge_pool_set_prefetch(self.bfbridge_pool, ffi.NULL)
+            return
+        if getattr(self, "tile_cache", None) is None:
+            raise RuntimeError("prefetching requires a tile cache, see set_tile_cache")
+        config = ffi.new("bfbridge_prefetch_config_t*")
+        config.neighbor_rings = neighbor_rings
+        config.max_readahead = max_readahead
+        config.zoom_in = 1 if zoom_in else 0
+        config.max_queued = max_queued
+        # Leave a worker for requests
+        config.max_workers = max_workers if max_workers is not None else max(1, self.thread_count - 1)
+        lib.bfbridge_pool_set_prefetch(self.bfbridge_pool, config)
+
+    # returns a dict with the fields of bfbridge_prefetch_stats_t,
+    # and hit_ratio and waste_ratio (of decoded predictions, None before any)
+    def get_prefetch_stats(self):
+        stats = ffi.new("bfbridge_prefetch_stats_t*")
+        lib.bfbridge_pool_get_prefetch_stats(self.bfbridge_pool, stats)
+        result = {field: getattr(stats, field) for field, _ in ffi.typeof("bfbridge_prefetch_stats_t").fields}
+        result["hit_ratio"] = stats.hits / stats.decoded if stats.decoded else None
+        result["waste_ratio"] = stats.wasted / stats.decoded if stats.decoded else None
+        return result
+
+    # regions: list of (filepath, series, resolution, plane, x, y, w, h)
+    # max_bytes_per_pixel: bytes per pixel for all channels together,
+    # such as 3 for 8 bit RGB, used to allocate the destinations
+    # returns a list with, for each region, bytes as
+    # BFBridgeInstance.open_bytes would return, or None on error
+    def read_regions(self, regions, max_bytes_per_pixel=8):
+        requests = ffi.new("bfbridge_pool_request_t[]", len(regions))
+        # Keep alive until the read is done
+        filepaths = []
+        dests = []
+        for i, (filepath, series, resolution, plane, x, y, w, h) in enumerate(regions):
+            filepath_arg = ffi.new("char[]", filepath.encode())
+            dest = ffi.new("char[]", w * h * max_bytes_per_pixel)
+            filepaths.append(filepath_arg)
+            dests.append(dest)
+            request = requests[i]
+            request.filepath = filepath_arg
+            request.filepath_len = len(filepath_arg) - 1
+            request.series = series
+            request.resolution = resolution
+            request.plane = plane
+            request.x = x
+            request.y = y
+            request.w = w
+            request.h = h
+            request.dest = dest
+            request.dest_len = len(dest)
+        lib.bfbridge_pool_read(self.bfbridge_pool, requests, len(regions))
+        # ffi.buffer keeps dests alive
+        return [ffi.buffer(dests[i], requests[i].result) \
+            if requests[i].result >= 0 else None for i in range(len(regions))]
+
+    # Reads a region of any size in strips of a row of tiles, with the parts
+    # of a strip spread over the workers, see bfbridge_make_region_stream.
+    # Yields (y, h, data) for each strip, of rows y to y + h - 1, where data
+    # has the bytes read_regions would return for (x, y, w, h) of the strip.
+    # data is valid until the next strip is taken: copy it with bytes(data)
+    # to keep it. While the caller handles a strip, the workers read the next
+    def read_region_stream(self, filepath, series, resolution, plane, x, y, w, h):
+        filepath = filepath.encode()
+        stream = ffi.new("bfbridge_region_stream_t*")
+        potential_error = lib.bfbridge_make_region_stream(stream, self.bfbridge_pool, \
+            filepath, len(filepath), series, resolution, plane, x, y, w, h)
+        if potential_error != ffi.NULL:
+            err = ffi.string(potential_error[0].description)
+            lib.bfbridge_free_error(potential_error)
+            raise RuntimeError(err)
+        strip = ffi.new("bfbridge_region_strip_t*")
+        try:
+            while True:
+                result = lib.bfbridge_region_stream_next(stream, strip)
+                if result == 0:
+                    return
+                if result < 0:
+                    raise RuntimeError("reading a strip failed with " + str(result) + \
+                        ": see bfbridge_pool_request_t in bfbridge_basiclib.h")
+                yield strip.y, strip.h, ffi.buffer(strip.data, strip.len)
+        finally:
+            lib.bfbridge_free_region_stream(stream)
+
+    # For asyncio event loops, on Unix: awaits one region, or a w x h thumbnail
+    # of plane if thumbnail is True, without blocking the loop thread.
+    # Returns bytes as read_regions would for the region, or None on error
+    async def read_region_async(self, filepath, series, resolution, plane, x, y, w, h,
+                                max_bytes_per_pixel=8, thumbnail=False):
+        import asyncio
+        loop = asyncio.get_running_loop()
+        if not hasattr(self, "async_loop"):
+            fd = lib.bfbridge_pool_get_completion_fd(self.bfbridge_pool)
+            if fd < 0:
+                raise RuntimeError("could not create the completion file descriptor")
+            loop.add_reader(fd, self.__on_completion)
+            self.async_loop = loop
+            # address of request -> (future, what to keep alive until done)
+            self.async_pending = {}
+        elif self.async_loop is not loop:
+            raise RuntimeError("BFBridgePool is used with another event loop")
+
+        request = ffi.new("bfbridge_pool_request_t*")
+        filepath_arg = ffi.new("char[]", filepath.encode())
+        dest = ffi.new("char[]", w * h * max_bytes_per_pixel)
+        request.filepath = filepath_arg
+        request.filepath_len = len(filepath_arg) - 1
+        request.series = series
+        request.resolution = resolution
+        request.plane = plane
+        request.x = x
+        request.y = y
+        request.w = w
+        request.h = h
+        request.dest = dest
+        request.dest_len = len(dest)
+        future = loop.create_future()
+        # Even if the caller is cancelled, the worker writes to these until done
+        self.async_pending[int(ffi.cast("uintptr_t", request))] = \
+            (future, request, filepath_arg, dest)
+        if thumbnail:
+            lib.bfbridge_pool_open_thumb_bytes_async(self.bfbridge_pool, request, ffi.NULL, ffi.NULL)
+        else:
+            lib.bfbridge_pool_open_bytes_async(self.bfbridge_pool, request, ffi.NULL, ffi.NULL)
+        return await future
+
+    def __on_completion(self):
+        completed = ffi.new("bfbridge_pool_request_t*[]", 64)
+        while True:
+            count = lib.bfbridge_pool_take_completed(self.bfbridge_pool, completed, 64)
+            for i in range(count):
+                future, _, _, dest = self.async_pending.pop(int(ffi.cast("uintptr_t", completed[i])))
+                result = completed[i].result
+                if not future.cancelled():
+                    future.set_result(ffi.buffer(dest, result) if result >= 0 else None)
+            if count < 64:
+                break
+
+# Serves tiles to BFBridgeSharedMemoryClient in other processes, so
+# that they don't each start a JVM: reads them with a pool of
+# thread_count workers into a shared memory ring named shm_name of
+# slot_count slots of slot_size bytes. See bfbridge_shm.h
+class BFBridgeSharedMemoryServer:
+    def __init__(self, bfbridge_vm, socket_path, shm_name="bfbridge", \
+            slot_count=256, slot_size=4 << 20, thread_count=4):
+        if bfbridge_vm is None:
+            raise ValueError("BFBridgeSharedMemoryServer must be initialized with BFBridgeVM")
+        if bfbridge_vm.owner_pid != os.getpid():
+            raise RuntimeError("JVM was created in a different process")
+
+        # Keep the VM alive as long as the server
+        self.bfbridge_vm = bfbridge_vm
+        self.bfbridge_shm_server = ffi.new("bfbridge_shm_server_t*")
+        potential_error = lib.bfbridge_make_shm_server(self.bfbridge_shm_server, \
+            bfbridge_vm.bfbridge_vm, socket_path.encode(), shm_name.encode(), \
+            slot_count, slot_size, thread_count)
+        if potential_error != ffi.NULL:
+            err = ffi.string(potential_error[0].description)
+            lib.bfbridge_free_error(potential_error)
+            raise RuntimeError(err)
+
+    def __copy__(self):
+        raise RuntimeError("BFBridgeSharedMemoryServer cannot be copied")
+
+    def __deepcopy__(self):
+        raise RuntimeError("BFBridgeSharedMemoryServer cannot be copied")
+
+    def __del__(self):
+        if hasattr(self, "bfbridge_shm_server"):
+            lib.bfbridge_free_shm_server(self.bfbridge_shm_server)
+
+# A tile in shared memory: data is a buffer over it, without copying,
+# valid until release(), which also happens when this is deleted
+class BFBridgeSharedTile:
+    def __init__(self, client, tile):
+        # The mapping must outlive the tile
+        self.client = client
+        self.tile = tile
+        self.data = ffi.buffer(tile.data, tile.length)
+
+    def release(self):
+        if self.tile is not None:
+            self.data = None
+            lib.bfbridge_shm_release(self.tile)
+            self.tile = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.release()
+
+    def __del__(self):
+        self.release()
+
+# Reads tiles from a BFBridgeSharedMemoryServer, possibly in another
+# process. Doesn't need a JVM in this process. Use one per thread
+class BFBridgeSharedMemoryClient:
+    def __init__(self, socket_path):
+        self.bfbridge_shm_client = ffi.new("bfbridge_shm_client_t*")
+        if lib.bfbridge_shm_connect(self.bfbridge_shm_client, socket_path.encode()) < 0:
+            err = ffi.errno
+            raise OSError(err, "BFBridgeSharedMemoryClient could not connect to " + socket_path + ": " + os.strerror(err))
+
+    def __copy__(self):
+        raise RuntimeError("BFBridgeSharedMemoryClient cannot be copied")
+
+    def __deepcopy__(self):
+        raise RuntimeError("BFBridgeSharedMemoryClient cannot be copied")
+
+    def __del__(self):
+        if hasattr(self, "bfbridge_shm_client"):
+            lib.bfbridge_shm_disconnect(self.bfbridge_shm_client)
+
+    def __return_tile(self, tile, length):
+        if length < 0:
+            raise RuntimeError("shared memory read failed with " + str(length) + \
+                ": see bfbridge_shm_read_region in bfbridge_shm.h")
+        return BFBridgeSharedTile(self, tile)
+
+    # Returns a BFBridgeSharedTile with the bytes open_bytes would return
+    def read_region(self, filepath, series, resolution, plane, x, y, w, h):
+        filepath = filepath.encode()
+        tile = ffi.new("bfbridge_shm_tile_t*")
+        length = lib.bfbridge_shm_read_region(self.bfbridge_shm_client, filepath, len(filepath), \
+            series, resolution, plane, x, y, w, h, tile)
+        return self.__return_tile(tile, length)
+
+    # Returns a BFBridgeSharedTile with the bytes open_thumb_bytes would return
+    def read_thumbnail(self, filepath, series, plane, w, h):
+        filepath = filepath.encode()
+        tile = ffi.new("bfbridge_shm_tile_t*")
+        length = lib.bfbridge_shm_read_thumbnail(self.bfbridge_shm_client, filepath, len(filepath), \
+            series, plane, w, h, tile)
+        return self.__return_tile(tile, length)
+
+# Decoded tiles shared between threads, instances and pools, up to max_bytes
+class BFBridgeTileCache:
+    def __init__(self, max_bytes, shard_count=16):
+        self.bfbridge_tile_cache = ffi.new("bfbridge_tile_cache_t*")
+        potential_error = lib.bfbridge_make_tile_cache(self.bfbridge_tile_cache, max_bytes, shard_count)
+        if potential_error != ffi.NULL:
+            err = ffi.string(potential_error[0].description)
+            lib.bfbridge_free_error(potential_error)
+            raise RuntimeError(err)
+
+    def __copy__(self):
+        raise RuntimeError("BFBridgeTileCache cannot be copied")
+
+    def __deepcopy__(self):
+        raise RuntimeError("BFBridgeTileCache cannot be copied")
+
+    def __del__(self):
+        if hasattr(self, "bfbridge_tile_cache"):
+            lib.bfbridge_free_tile_cache(self.bfbridge_tile_cache)
+
+    # Call when the file changed on disk
+    def invalidate_file(self, filepath):
+        filepath = filepath.encode()
+        lib.bfbridge_tile_cache_invalidate_file(self.bfbridge_tile_cache, \
+            lib.bfbridge_tile_cache_file_id(filepath, len(filepath)))
+
+    # returns a dict with the fields of bfbridge_tile_cache_stats_t
+    # (hits, misses, evictions, bytes, ...)
+    def get_stats(self):
+        stats = ffi.new("bfbridge_tile_cache_stats_t*")
+        lib.bfbridge_tile_cache_get_stats(self.bfbridge_tile_cache, stats)
+        return {field: getattr(stats, field) for field, _ in ffi.typeof("bfbridge_tile_cache_stats_t").fields}
+
+# DeepZoom and IIIF tiles of a series of the file open in a BFBridgeInstance,
+# read with its open_deepzoom_tile and open_iiif_region. See bfbridge_tiler_t
+# Make a new one after opening another file
+class BFBridgeTiler:
+    def __init__(self, bfbridge_instance, series=0, tile_size=254, overlap=1):
+        self.bfbridge_tiler = ffi.new("bfbridge_tiler_t*")
+        potential_error = lib.bfbridge_make_tiler( \
+            self.bfbridge_tiler, bfbridge_instance.bfbridge_instance, \
+            bfbridge_instance.bfbridge_thread, series, tile_size, overlap)
+        if potential_error != ffi.NULL:
+            err = ffi.string(potential_error[0].description)
+            lib.bfbridge_free_error(potential_error)
+            raise RuntimeError(err)
+        bfbridge_instance.tile_key.series = series
+        bfbridge_instance.tile_key.resolution = 0
+
+    def __copy__(self):
+        raise RuntimeError("Copying a BFBridgeTiler might not work")
+
+    def __deepcopy__(self):
+        raise RuntimeError("Copying a BFBridgeTiler might not work")
+
+    def __del__(self):
+        if hasattr(self, "bfbridge_tiler"):
+            lib.bfbridge_free_tiler(self.bfbridge_tiler)
+
+    def get_level_count(self):
+        return self.bfbridge_tiler.level_count
+
+    # returns (width, height, columns, rows) of a DeepZoom level
+    def get_level_size(self, level):
+        size = ffi.new("int[4]")
+        if lib.bfbridge_tiler_get_level_size(self.bfbridge_tiler, level, size, size + 1, size + 2, size + 3) < 0:
+            raise ValueError("get_level_size: no such level")
+        return tuple(size)
+
+    # returns (x, y, w, h) that a DeepZoom tile covers in its level
+    def get_tile_rect(self, level, column, row):
+        rect = ffi.new("int[4]")
+        if lib.bfbridge_tiler_get_tile_rect(self.bfbridge_tiler, level, column, row, rect, rect + 1, rect + 2, rect + 3) < 0:
+            raise ValueError("get_tile_rect: no such tile")
+        return tuple(rect)
+
 # An instance can be used with only the thread object it was constructed with
+# communication_buffer_len: initial length of the buffer that results are
+# returned in. It grows up to max_communication_buffer_len when a result
+# doesn't fit; see shrink_communication_buffer
 class BFBridgeInstance:
-    def __init__(self, bfbridge_thread):
+    def __init__(self, bfbridge_thread, communication_buffer_len=1 << 20, \
+            max_communication_buffer_len=0x7fffffff):
         if bfbridge_thread is None:
             raise ValueError("BFBridgeInstance must be initialized with BFBridgeThread")
 
@@ -85,8 +528,12 @@ class BFBridgeInstance:
 
         self.bfbridge_thread = bfbridge_thread.bfbridge_thread
         self.bfbridge_instance = ffi.new("bfbridge_instance_t*")
-        self.communication_buffer = ffi.new("char[34000000]")
-        self.communication_buffer_len = 34000000
+        # Owned here rather than by the library so that results
+        # returned before the buffer grows stay valid
+        self.communication_buffer = ffi.new("char[]", communication_buffer_len)
+        self.communication_buffer_len = communication_buffer_len
+        self.initial_communication_buffer_len = communication_buffer_len
+        self.max_communication_buffer_len = max_communication_buffer_len
         potential_error = lib.bfbridge_make_instance(
             self.bfbridge_instance,
             self.bfbridge_thread,
@@ -96,6 +543,14 @@ class BFBridgeInstance:
             err = ffi.string(potential_error[0].description)
             lib.bfbridge_free_error(potential_error)
             raise RuntimeError(err)
+        # The open file, series and resolution, for open_bytes_cached
+        self.tile_key = ffi.new("bfbridge_tile_key_t*")
+        # The last open_bytes_ndarray(copy=False) result
+        self.buffer_view = None
+        # For open_bytes_indexed_ndarray: bfbridge_lut_t, pixel type,
+        # little endian, and the (file_id, series, resolution) it is of
+        self.lut = None
+        self.lut_key = None
 
     def __copy__(self):
         raise RuntimeError("Copying a BFBridgeInstance might not work")
@@ -117,6 +572,60 @@ class BFBridgeInstance:
         else:
             return ffi.buffer(self.communication_buffer, length)
 
+    # Calls a lib function that writes to the communication buffer and,
+    # if the result didn't fit, grows the buffer and calls it again
+    def __call(self, function, *args):
+        self.__check_no_buffer_view()
+        length = function(self.bfbridge_instance, self.bfbridge_thread, *args)
+        if length == -2 and self.__grow_communication_buffer( \
+                lib.bfbridge_instance_get_required_len(self.bfbridge_instance)):
+            length = function(self.bfbridge_instance, self.bfbridge_thread, *args)
+        return length
+
+    def __grow_communication_buffer(self, needed):
+        if needed <= self.communication_buffer_len or needed > self.max_communication_buffer_len:
+            return False
+        # Geometric, so that slowly increasing sizes don't copy every time
+        length = min(max(needed, self.communication_buffer_len * 3 // 2), self.max_communication_buffer_len)
+        return self.__set_communication_buffer(length)
+
+    # Keeps the contents that fit, which some calls read back
+    def __set_communication_buffer(self, length):
+        try:
+            buffer = ffi.new("char[]", length)
+        except MemoryError:
+            return False
+        ffi.memmove(buffer, self.communication_buffer, min(length, self.communication_buffer_len))
+        potential_error = lib.bfbridge_instance_set_communication_buffer( \
+            self.bfbridge_instance, self.bfbridge_thread, buffer, length)
+        if potential_error != ffi.NULL:
+            lib.bfbridge_free_error(potential_error)
+            return False
+        self.communication_buffer = buffer
+        self.communication_buffer_len = length
+        return True
+
+    # The largest result length so far, including results that didn't fit
+    def get_communication_buffer_high_water(self):
+        return lib.bfbridge_instance_get_high_water(self.bfbridge_instance)
+
+    # Returns memory after large reads, for example when idle. length
+    # defaults to the initial length. Invalidates results like a new read
+    def shrink_communication_buffer(self, length=None):
+        self.__check_no_buffer_view()
+        if length is None:
+            length = self.initial_communication_buffer_len
+        if length < self.communication_buffer_len:
+            if not self.__set_communication_buffer(length):
+                raise MemoryError("shrink_communication_buffer failed")
+
+    # Every call that writes to the communication buffer checks first:
+    # those through __call, and open, is_compatible and get_error_string
+    def __check_no_buffer_view(self):
+        if self.buffer_view is not None and self.buffer_view() is not None:
+            raise RuntimeError("An array from open_bytes_ndarray(copy=False) still views the buffer; " \
+                "delete it and arrays made from it, or use copy=True")
+
     def __boolean(self, integer):
         if integer == 1:
             return True
@@ -128,10 +637,12 @@ class BFBridgeInstance:
 
     # Should be called only just after the last method call returned an error code
     def get_error_string(self):
+        self.__check_no_buffer_view()
         length = lib.bf_get_error_length(self.bfbridge_instance, self.bfbridge_thread)
         return self.__return_from_buffer(length, True)
     
     def is_compatible(self, filepath):
+        self.__check_no_buffer_view()
         filepath = filepath.encode()
         file = ffi.new("char[]", filepath)
         filepathlen = len(file) - 1
@@ -139,15 +650,21 @@ class BFBridgeInstance:
         return self.__boolean(res)
     
     def open(self, filepath):
+        self.__check_no_buffer_view()
         filepath = filepath.encode()
         file = ffi.new("char[]", filepath)
         filepathlen = len(file) - 1
         res = lib.bf_open(self.bfbridge_instance, self.bfbridge_thread, filepath, filepathlen)
         print(self.get_error_string(), flush=True)
+        if res >= 0:
+            # For open_bytes_cached
+            self.tile_key.file_id = lib.bfbridge_tile_cache_file_id(filepath, filepathlen)
+            self.tile_key.series = 0
+            self.tile_key.resolution = 0
         return res
     
     def get_format(self):
-        length = lib.bf_get_format(self.bfbridge_instance, self.bfbridge_thread)
+        length = self.__call(lib.bf_get_format)
         return self.__return_from_buffer(length, True)
 
     def close(self):
@@ -157,13 +674,20 @@ class BFBridgeInstance:
         return lib.bf_get_series_count(self.bfbridge_instance, self.bfbridge_thread)
 
     def set_current_series(self, ser):
-        return lib.bf_set_current_series(self.bfbridge_instance, self.bfbridge_thread, ser)
+        res = lib.bf_set_current_series(self.bfbridge_instance, self.bfbridge_thread, ser)
+        if res >= 0:
+            self.tile_key.series = ser
+            self.tile_key.resolution = 0
+        return res
     
     def get_resolution_count(self):
         return lib.bf_get_resolution_count(self.bfbridge_instance, self.bfbridge_thread)
 
     def set_current_resolution(self, res):
-        return lib.bf_set_current_resolution(self.bfbridge_instance, self.bfbridge_thread, res)
+        code = lib.bf_set_current_resolution(self.bfbridge_instance, self.bfbridge_thread, res)
+        if code >= 0:
+            self.tile_key.resolution = res
+        return code
     
     def get_size_x(self):
         return lib.bf_get_size_x(self.bfbridge_instance, self.bfbridge_thread)
@@ -187,7 +711,7 @@ class BFBridgeInstance:
         return lib.bf_get_image_count(self.bfbridge_instance, self.bfbridge_thread)
 
     def get_dimension_order(self):
-        length = lib.bf_get_dimension_order(self.bfbridge_instance, self.bfbridge_thread)
+        length = self.__call(lib.bf_get_dimension_order)
         return self.__return_from_buffer(length, True)
 
     def is_order_certain(self):
@@ -231,27 +755,221 @@ class BFBridgeInstance:
     
     # TODO return a 2D array, handle sign depending on pixel type
     def get_8_bit_lookup_table(self):
-        return self.__return_from_buffer(lib.bf_get_8_bit_lookup_table(self.bfbridge_instance, self.bfbridge_thread), False)
+        return self.__return_from_buffer(self.__call(lib.bf_get_8_bit_lookup_table), False)
     
     # TODO return a 2D array, handle little endianness, handle sign depending on pixel type
     def get_16_bit_lookup_table(self):
-        return self.__return_from_buffer(lib.bf_get_8_bit_lookup_table(self.bfbridge_instance, self.bfbridge_thread), False)
+        return self.__return_from_buffer(self.__call(lib.bf_get_16_bit_lookup_table), False)
     
-    # plane = 0 in general
+    # plane: image index, 0 in general; see get_image_count
     def open_bytes(self, plane, x, y, w, h):
-        return self.__return_from_buffer(lib.bf_open_bytes(self.bfbridge_instance, self.bfbridge_thread, plane, x, y, w, h), False)
+        return self.__return_from_buffer(self.__call(lib.bf_open_bytes, plane, x, y, w, h), False)
+
+    # Like open_bytes but served from cache (a BFBridgeTileCache) when possible
+    # Please change the file, series and resolution only through this object
+    def open_bytes_cached(self, cache, plane, x, y, w, h):
+        key = self.tile_key
+        key.plane = plane
+        key.x = x
+        key.y = y
+        key.w = w
+        key.h = h
+        return self.__return_from_buffer(self.__call(lib.bf_open_bytes_cached, cache.bfbridge_tile_cache, key), False)
+
+    # tiles: list of (plane, x, y, w, h)
+    # returns a list with, for each tile, bytes as open_bytes would
+    # or None if that tile could not be read
+    # Like open_bytes, the results are valid until the next call
+    def open_bytes_batch(self, tiles):
+        requests = ffi.new("bfbridge_tile_request_t[]", [tuple(tile) for tile in tiles])
+        length = self.__call(lib.bf_open_bytes_batch, requests, len(tiles))
+        self.__return_from_buffer(length, False)
+        results = ffi.cast("bfbridge_tile_result_t*", self.communication_buffer)
+        tile_bytes = []
+        for i in range(len(tiles)):
+            if results[i].status == 1:
+                tile_bytes.append(ffi.buffer(self.communication_buffer + results[i].offset, results[i].length))
+            else:
+                tile_bytes.append(None)
+        return tile_bytes
+
+    # Like open_bytes_batch but returns PIL images (or None)
+    # and asks the pixel format only once for all tiles
+    def open_bytes_batch_pil_images(self, tiles):
+        # Before reading tiles as this overwrites the buffer
+        info = self.get_image_info()
+        byte_arrs = self.open_bytes_batch(tiles)
+        channels = info["rgb_channel_count"]
+        interleaved = info["is_interleaved"] == 1
+        pixel_type = info["pixel_type"]
+        little_endian = info["is_little_endian"] == 1
+        images = []
+        for tile, byte_arr in zip(tiles, byte_arrs):
+            if byte_arr is None:
+                images.append(None)
+                continue
+            images.append(make_pil_image( \
+                byte_arr, tile[3], tile[4], channels, \
+                interleaved, pixel_type, little_endian))
+        return images
+
+    # returns (hits, misses) of the Java pixel array pool used by open_bytes
+    def get_pixel_pool_stats(self):
+        stats = self.__return_from_buffer(self.__call(lib.bf_get_pixel_pool_stats), False)
+        return int.from_bytes(stats[0:8], "little"), int.from_bytes(stats[8:16], "little")
+
+    # Returns a numpy array of shape (h, w, rgb channel count) with the dtype
+    # of the pixel type (uint8 for bit type), interleaved, in native byte order,
+    # converting from the buffer in one pass.
+    # out: an array of that shape to write into instead, converting to its
+    # dtype if needed with numpy same_kind casting rules; it is returned.
+    # copy=False: returns a read-only view of the communication buffer
+    # without copying, in the byte order of the file. Any call of this
+    # instance that writes to the buffer (reading pixels, open, image info,
+    # metadata, error strings) raises RuntimeError until the view and arrays
+    # made from it are deleted, rather than silently changing them
+    def open_bytes_ndarray(self, plane, x, y, w, h, out=None, copy=True):
+        # Before reading pixels as this overwrites the buffer
+        info = self.get_image_info()
+        byte_arr = self.open_bytes(plane, x, y, w, h)
+        view = utils.make_ndarray_view( \
+            byte_arr, w, h, info["rgb_channel_count"], \
+            info["is_interleaved"] == 1, info["pixel_type"], \
+            info["is_little_endian"] == 1)
+        if out is not None:
+            np.copyto(out, view, casting="same_kind")
+            return out
+        if not copy:
+            view.flags.writeable = False
+            # Arrays made from the view keep this one alive
+            base = view
+            while isinstance(base.base, np.ndarray):
+                base = base.base
+            self.buffer_view = weakref.ref(base)
+            return view
+        arr = np.empty(view.shape, dtype=view.dtype.newbyteorder("="))
+        np.copyto(arr, view)
+        return arr
+
+    # For indexed color images: returns a uint8 array of shape
+    # (h, w, lookup table channels), expanded through the lookup table in C.
+    # The table is read once per file, series and resolution so please
+    # change them only through this object, as for open_bytes_cached
+    def open_bytes_indexed_ndarray(self, plane, x, y, w, h):
+        key = (self.tile_key.file_id, self.tile_key.series, self.tile_key.resolution)
+        if self.lut_key != key:
+            pixel_type = self.get_pixel_type()
+            little_endian = self.is_little_endian()
+            if pixel_type < 2:
+                table, bits = self.get_8_bit_lookup_table(), 8
+            else:
+                table, bits = self.get_16_bit_lookup_table(), 16
+            lut = ffi.gc(ffi.new("bfbridge_lut_t*"), lib.bfbridge_free_lut)
+            if lib.bfbridge_make_lut(lut, ffi.from_buffer(table), len(table), bits) < 0:
+                raise ValueError("open_bytes_indexed_ndarray: invalid lookup table")
+            self.lut = (lut, pixel_type, little_endian)
+            self.lut_key = key
+        lut, pixel_type, little_endian = self.lut
+        byte_arr = self.open_bytes(plane, x, y, w, h)
+        arr = np.empty((h, w, lut.channels), dtype=np.uint8)
+        if lib.bfbridge_lut_apply(lut, ffi.from_buffer(byte_arr), len(byte_arr), \
+                ffi.from_buffer("unsigned char[]", arr, require_writable=True), \
+                w * h, pixel_type, 1 if little_endian else 0, 0) < 0:
+            raise ValueError("open_bytes_indexed_ndarray: not an indexed image of 8 or 16 bit type")
+        return arr
+
+    # Returns the region encoded, ready to serve over HTTP
+    # format: "jpeg" or "png"; quality: 1 to 100, for JPEG
+    # Like open_bytes, the result is valid until the next call
+    def open_bytes_encoded(self, plane, x, y, w, h, format="jpeg", quality=85):
+        formats = {"jpeg": lib.BFBRIDGE_ENCODED_JPEG, "jpg": lib.BFBRIDGE_ENCODED_JPEG, "png": lib.BFBRIDGE_ENCODED_PNG}
+        if format.lower() not in formats:
+            raise ValueError("open_bytes_encoded: format must be jpeg or png")
+        return self.__return_from_buffer(self.__call(lib.bf_open_bytes_encoded, \
+            formats[format.lower()], quality, plane, x, y, w, h), False)
+
+    # Returns (format, bytes): ("jpeg" or "jpeg2000", the tile as stored)
+    # if the region is exactly a stored tile that can be passed through,
+    # otherwise (None, bytes as open_bytes returns them)
+    # Like open_bytes, the bytes are valid until the next call
+    def open_compressed_tile(self, plane, x, y, w, h):
+        length = self.__call(lib.bf_open_compressed_tile, plane, x, y, w, h)
+        self.__return_from_buffer(length, False)
+        header = ffi.cast("bfbridge_compressed_tile_header_t*", self.communication_buffer)
+        formats = {lib.BFBRIDGE_COMPRESSED_JPEG: "jpeg", lib.BFBRIDGE_COMPRESSED_JPEG2000: "jpeg2000"}
+        data = ffi.buffer(self.communication_buffer + ffi.sizeof("bfbridge_compressed_tile_header_t"), header.length)
+        return formats.get(header.format), data
+
+    # Returns a DeepZoom tile of a BFBridgeTiler as open_bytes would,
+    # of the size tiler.get_tile_rect gives
+    def open_deepzoom_tile(self, tiler, level, column, row, plane=0):
+        length = self.__call(lib.bf_open_deepzoom_tile, \
+            tiler.bfbridge_tiler, plane, level, column, row)
+        return self.__return_from_tiler(tiler, length)
+
+    # Returns the region x, y, w, h of the largest resolution
+    # scaled to out_w x out_h as open_bytes would
+    def open_iiif_region(self, tiler, x, y, w, h, out_w, out_h, plane=0):
+        length = self.__call(lib.bf_open_iiif_region, \
+            tiler.bfbridge_tiler, plane, x, y, w, h, out_w, out_h)
+        return self.__return_from_tiler(tiler, length)
+
+    def open_deepzoom_tile_pil_image(self, tiler, level, column, row, plane=0):
+        _, _, w, h = tiler.get_tile_rect(level, column, row)
+        byte_arr = self.open_deepzoom_tile(tiler, level, column, row, plane)
+        t = tiler.bfbridge_tiler
+        return make_pil_image(byte_arr, w, h, t.rgb_channel_count, \
+            t.is_interleaved == 1, t.pixel_type, t.is_little_endian == 1)
+
+    def __return_from_tiler(self, tiler, length):
+        if length == -3:
+            raise ValueError("No such tile or region, or out of memory")
+        # The tiler set them
+        self.tile_key.series = tiler.bfbridge_tiler.series
+        self.tile_key.resolution = tiler.bfbridge_tiler.current_resolution
+        return self.__return_from_buffer(length, False)
+
+    # Reads the region of every plane in z, c and t, each a range of
+    # (start, count), in one call. Returns the planes one after another,
+    # each as open_bytes would, in a BioFormats dimension order:
+    # "XYZCT" means Z varies fastest. c is of get_effective_size_c
+    def open_bytes_stack(self, x, y, w, h, z=(0, 1), c=(0, 1), t=(0, 1), order="XYZCT"):
+        orders = ["XYZCT", "XYZTC", "XYCZT", "XYCTZ", "XYTCZ", "XYTZC"]
+        if order not in orders:
+            raise ValueError("open_bytes_stack: order must be one of " + ", ".join(orders))
+        return self.__return_from_buffer(self.__call(lib.bf_open_bytes_stack, \
+            x, y, w, h, \
+            z[0], z[1], c[0], c[1], t[0], t[1], orders.index(order)), False)
+
+    # Like open_bytes_stack but returns a numpy array in native byte order
+    # with the slowest varying dimension first, e.g. for "XYZCT" of shape
+    # (t count, c count, z count, h, w, rgb channel count)
+    def open_bytes_stack_ndarray(self, x, y, w, h, z=(0, 1), c=(0, 1), t=(0, 1), order="XYZCT"):
+        # Before reading pixels as this overwrites the buffer
+        info = self.get_image_info()
+        byte_arr = self.open_bytes_stack(x, y, w, h, z, c, t, order)
+        counts = {"Z": z[1], "C": c[1], "T": t[1]}
+        outer = tuple(counts[d] for d in reversed(order[2:]))
+        channels = info["rgb_channel_count"]
+        dt = utils.bioformats_dtype(info["pixel_type"], info["is_little_endian"] == 1)
+        arr = np.frombuffer(byte_arr, dtype=dt)
+        if info["is_interleaved"] == 1:
+            arr = arr.reshape(outer + (h, w, channels))
+        else:
+            arr = np.moveaxis(arr.reshape(outer + (channels, h, w)), 3, -1)
+        return arr.astype(dt.newbyteorder("="))
 
     def open_bytes_pil_image(self, plane, x, y, w, h):
         byte_arr = self.open_bytes(plane, x, y, w, h)
-        return utils.make_pil_image( \
+        return make_pil_image( \
             byte_arr, w, h, self.get_rgb_channel_count(), \
             self.is_interleaved(), self.get_pixel_type(), \
             self.is_little_endian())
     
     def open_thumb_bytes(self, plane, w, h):
         return self.__return_from_buffer( \
-            lib.bf_open_thumb_bytes( \
-            self.bfbridge_instance, self.bfbridge_thread, plane, w, h), False)
+            self.__call(lib.bf_open_thumb_bytes, \
+            plane, w, h), False)
     
     def open_thumb_bytes_pil_image(self, plane, max_w, max_h):
         img_h = self.get_size_y()
@@ -265,15 +983,10 @@ class BFBridgeInstance:
             w = img_w
         byte_arr = self.open_thumb_bytes(plane, w, h)
 
-        # Thumbnails can't be signed int in BioFormats
-        # https://github.com/ome/bioformats/blob/19d7fb9cbfdc1/components/formats-api/src/loci/formats/FormatTools.java#L1322
-        pixel_type = self.get_pixel_type()
-        if pixel_type == 0 or pixel_type == 2 or pixel_type == 4:
-            pixel_type += 1
-
-        return utils.make_pil_image( \
+        # Thumbnails have the pixel format of open_bytes
+        return make_pil_image( \
             byte_arr, w, h, self.get_rgb_channel_count(), \
-            self.is_interleaved(), pixel_type, \
+            self.is_interleaved(), self.get_pixel_type(), \
             self.is_little_endian())
 
     def get_mpp_x(self, no):
@@ -286,5 +999,33 @@ class BFBridgeInstance:
         return lib.bf_get_mpp_z(self.bfbridge_instance, self.bfbridge_thread, no)
 
     def dump_ome_xml_metadata(self):
-        length = lib.bf_dump_ome_xml_metadata(self.bfbridge_instance, self.bfbridge_thread)
+        length = self.__call(lib.bf_dump_ome_xml_metadata)
         return self.__return_from_buffer(length, True)
+
+    # returns a dict with the fields of bfbridge_image_info_t
+    # (size_x, size_time, pixel_type, is_interleaved, mpp_x, ...)
+    # for the current series and resolution
+    def get_image_info(self):
+        info = ffi.new("bfbridge_image_info_t*")
+        length = self.__call(lib.bf_get_image_info, info)
+        self.__return_from_buffer(length, False)
+        return {field: getattr(info, field) for field, _ in ffi.typeof("bfbridge_image_info_t").fields if field != "padding"}
+
+    # returns a list of dicts with the fields of bfbridge_pyramid_level_t
+    # (series, resolution, size_x, size_y, mpp_x, ...) for every
+    # resolution of every series
+    def get_pyramid_layout(self):
+        length = self.__call(lib.bf_get_pyramid_layout)
+        self.__return_from_buffer(length, False)
+        levels = ffi.cast("bfbridge_pyramid_level_t*", self.communication_buffer)
+        fields = [field for field, _ in ffi.typeof("bfbridge_pyramid_level_t").fields]
+        return [{field: getattr(levels[i], field) for field in fields} \
+            for i in range(length // ffi.sizeof("bfbridge_pyramid_level_t"))]
+
+    # returns a dict with the fields of bfbridge_java_stats_t: time spent
+    # in BioFormats openBytes and setId and in copies to the buffer
+    def get_java_stats(self):
+        stats = ffi.new("bfbridge_java_stats_t*")
+        length = self.__call(lib.bf_get_java_stats, stats)
+        self.__return_from_buffer(length, False)
+        return {field: getattr(stats, field) for field, _ in ffi.typeof("bfbridge_java_stats_t").fields}
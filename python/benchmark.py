@@ -0,0 +1,266 @@
+# Benchmarks reading synthetic pyramidal OME-TIFFs through the C API:
+# open latency with a cold and a warm Memoizer cache, single tile
+# latency percentiles, thumbnail time and pool throughput by thread count.
+# The slides are written by org.camicroscope.BFBridgeSyntheticSlides
+# (compiled in BFBRIDGE_CLASSPATH like BFBridge) with the java of JAVA_HOME.
+# Time to the first tile of a new process is measured in subprocesses,
+# with and without warm-up and a CDS archive (see bfbridge_vm_options_t).
+# Prints JSON, to compare runs for example after upgrading BioFormats:
+# python3 -m BFBridge.python.benchmark --output results.json
+
+import argparse
+import json
+import os
+import platform
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+from . import BFBridgeVM, BFBridgeThread, BFBridgeInstance, BFBridgePool, lib
+
+def log(*args):
+    print(*args, file=sys.stderr, flush=True)
+
+def generate_slides(slide_dir, size, tile_size):
+    cpdir = os.environ["BFBRIDGE_CLASSPATH"]
+    java = "java"
+    if os.environ.get("JAVA_HOME"):
+        java = os.path.join(os.environ["JAVA_HOME"], "bin", "java")
+    classpath = cpdir + os.pathsep + os.path.join(cpdir, "*")
+    output = subprocess.run([java, "-cp", classpath, "org.camicroscope.BFBridgeSyntheticSlides", \
+        slide_dir, str(size), str(tile_size)], check=True, stdout=subprocess.PIPE, text=True).stdout
+    return [line for line in output.splitlines() if line]
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return None
+    return sorted_values[min(len(sorted_values) - 1, int(len(sorted_values) * p / 100))]
+
+def summarize_ms(ns_values):
+    values = sorted(v / 1e6 for v in ns_values)
+    return {"count": len(values), "mean_ms": sum(values) / len(values) if values else None, \
+        "p50_ms": percentile(values, 50), "p99_ms": percentile(values, 99), \
+        "max_ms": values[-1] if values else None}
+
+def memo_count(cache_dir):
+    return sum(1 for _, _, files in os.walk(cache_dir) for f in files if f.endswith(".bfmemo"))
+
+def check(result, instance, what):
+    if result < 0:
+        raise RuntimeError(what + " failed: " + instance.get_error_string())
+    return result
+
+def timed_open(instance, path):
+    filepath = path.encode()
+    start = time.perf_counter_ns()
+    result = lib.bf_open(instance.bfbridge_instance, instance.bfbridge_thread, filepath, len(filepath))
+    elapsed = time.perf_counter_ns() - start
+    check(result, instance, "bf_open " + path)
+    return elapsed
+
+def bench_slide(vm, instance, path, cache_dir, args, rng):
+    result = {"slide": os.path.basename(path)}
+    inst, thread = instance.bfbridge_instance, instance.bfbridge_thread
+
+    # The first open of the file writes the memo file (if parsing took
+    # long enough for Memoizer); later opens read it
+    memos_before = memo_count(cache_dir)
+    result["open_cold_ms"] = timed_open(instance, path) / 1e6
+    result["memo_written"] = memo_count(cache_dir) > memos_before
+    lib.bf_close(inst, thread)
+    warm = []
+    for _ in range(args.opens):
+        warm.append(timed_open(instance, path))
+        lib.bf_close(inst, thread)
+    result["open_warm"] = summarize_ms(warm)
+
+    timed_open(instance, path)
+    size_x = lib.bf_get_size_x(inst, thread)
+    size_y = lib.bf_get_size_y(inst, thread)
+    tile = args.tile_size
+    result["size"] = [size_x, size_y]
+    result["resolution_count"] = lib.bf_get_resolution_count(inst, thread)
+    result["pixel_type"] = lib.bf_get_pixel_type(inst, thread)
+    result["rgb_channel_count"] = lib.bf_get_rgb_channel_count(inst, thread)
+    result["image_count"] = lib.bf_get_image_count(inst, thread)
+
+    # Tile-aligned, full tiles at the largest resolution
+    positions = [(rng.randrange(size_x // tile) * tile, rng.randrange(size_y // tile) * tile) \
+        for _ in range(args.tiles)]
+    tile_ns = []
+    tile_bytes = 0
+    for x, y in positions:
+        start = time.perf_counter_ns()
+        length = lib.bf_open_bytes(inst, thread, 0, x, y, tile, tile)
+        tile_ns.append(time.perf_counter_ns() - start)
+        tile_bytes += check(length, instance, "bf_open_bytes")
+    result["tile"] = summarize_ms(tile_ns)
+    result["tile"]["mb_per_s"] = tile_bytes / 1e6 / (sum(tile_ns) / 1e9)
+
+    thumb_ns = []
+    for _ in range(args.thumbnails):
+        start = time.perf_counter_ns()
+        length = lib.bf_open_thumb_bytes(inst, thread, 0, args.thumbnail_size, args.thumbnail_size)
+        thumb_ns.append(time.perf_counter_ns() - start)
+        check(length, instance, "bf_open_thumb_bytes")
+    result["thumbnail"] = summarize_ms(thumb_ns)
+    lib.bf_close(inst, thread)
+
+    # Each pool worker opens the file once, untimed, then the same tiles
+    # are read by every thread count
+    scaling = []
+    regions = [(path, 0, 0, 0, x, y, tile, tile) for x, y in positions]
+    for thread_count in args.threads:
+        pool = BFBridgePool(vm, thread_count)
+        warmup = [regions[i % len(regions)] for i in range(thread_count * 2)]
+        pool.read_regions(warmup)
+        start = time.perf_counter()
+        tiles = pool.read_regions(regions)
+        elapsed = time.perf_counter() - start
+        if any(t is None for t in tiles):
+            raise RuntimeError("pool read failed for " + path)
+        scaling.append({"threads": thread_count, "tiles_per_s": len(regions) / elapsed})
+        del pool
+    for entry in scaling:
+        entry["speedup"] = entry["tiles_per_s"] / scaling[0]["tiles_per_s"]
+    result["pool"] = scaling
+    return result
+
+# In a new process: creates the VM as configured, opens path and reads
+# its first tile, then prints the timings as JSON
+def first_tile(path, tile, cds_archive, warm_up):
+    start = time.perf_counter_ns()
+    vm = BFBridgeVM(cds_archive=cds_archive, warm_up=warm_up)
+    thread = BFBridgeThread(vm)
+    instance = BFBridgeInstance(thread)
+    vm_ns = time.perf_counter_ns() - start
+    open_ns = timed_open(instance, path)
+    tile_start = time.perf_counter_ns()
+    check(lib.bf_open_bytes(instance.bfbridge_instance, instance.bfbridge_thread, 0, 0, 0, tile, tile), \
+        instance, "bf_open_bytes")
+    tile_ns = time.perf_counter_ns() - tile_start
+    print(json.dumps({"vm_ms": vm_ns / 1e6, "open_ms": open_ns / 1e6, "tile_ms": tile_ns / 1e6, \
+        "first_tile_ms": (time.perf_counter_ns() - start) / 1e6}))
+    # Destroying the VM writes a missing CDS archive
+    del instance, thread, vm
+
+def run_first_tile(path, tile, cds_archive, warm_up):
+    command = [sys.executable, "-m", __spec__.name, "--first-tile", path, "--tile-size", str(tile)]
+    if cds_archive:
+        command += ["--cds-archive", cds_archive]
+    if warm_up:
+        command.append("--warm-up")
+    output = subprocess.run(command, check=True, stdout=subprocess.PIPE, text=True).stdout
+    return json.loads(output.splitlines()[-1])
+
+# Time to the first tile with each VM configuration, in new processes.
+# The CDS archive is created by a first, untimed run with warm-up
+def bench_startup(path, args):
+    archive_dir = tempfile.mkdtemp(prefix="bfbridge_benchmark_cds")
+    archive = os.path.join(archive_dir, "bfbridge.jsa")
+    results = {}
+    try:
+        for name, cds, warm_up in [("default", False, False), ("warm_up", False, True), \
+                ("cds", True, False), ("cds_warm_up", True, True)]:
+            log("Time to first tile: " + name)
+            try:
+                if cds and not os.path.exists(archive):
+                    run_first_tile(path, args.tile_size, archive, True)
+                runs = [run_first_tile(path, args.tile_size, archive if cds else None, warm_up) \
+                    for _ in range(args.startup_runs)]
+            except subprocess.CalledProcessError as e:
+                results[name] = {"error": str(e)}
+                continue
+            results[name] = {key: summarize_ms([run[key] * 1e6 for run in runs]) \
+                for key in ["vm_ms", "open_ms", "tile_ms", "first_tile_ms"]}
+        if os.path.exists(archive):
+            results["cds_archive_bytes"] = os.path.getsize(archive)
+    finally:
+        shutil.rmtree(archive_dir, ignore_errors=True)
+    return results
+
+def main():
+    parser = argparse.ArgumentParser(description="BFBridge benchmark with synthetic pyramidal OME-TIFFs")
+    parser.add_argument("--slide-dir", default=os.path.join(tempfile.gettempdir(), "bfbridge_benchmark_slides"), \
+        help="where slides are generated and reused between runs")
+    parser.add_argument("--size", type=int, default=4096, help="width and height of the largest resolution")
+    parser.add_argument("--tile-size", type=int, default=256)
+    parser.add_argument("--tiles", type=int, default=200, help="tiles read per slide")
+    parser.add_argument("--opens", type=int, default=5, help="warm opens per slide")
+    parser.add_argument("--thumbnails", type=int, default=5)
+    parser.add_argument("--thumbnail-size", type=int, default=256)
+    parser.add_argument("--threads", type=int, nargs="+", default=[1, 2, 4, 8])
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--only", help="benchmark only slides whose name contains this")
+    parser.add_argument("--output", help="JSON file instead of stdout")
+    parser.add_argument("--startup-runs", type=int, default=3, \
+        help="new processes timed to the first tile per VM configuration, 0 to skip")
+    # For the subprocesses of bench_startup
+    parser.add_argument("--first-tile", help=argparse.SUPPRESS)
+    parser.add_argument("--cds-archive", help=argparse.SUPPRESS)
+    parser.add_argument("--warm-up", action="store_true", help=argparse.SUPPRESS)
+    args = parser.parse_args()
+
+    if args.first_tile:
+        first_tile(args.first_tile, args.tile_size, args.cds_archive, args.warm_up)
+        return
+
+    log("Generating slides in " + args.slide_dir)
+    slides = generate_slides(args.slide_dir, args.size, args.tile_size)
+    if args.only:
+        slides = [s for s in slides if args.only in os.path.basename(s)]
+
+    # A fresh Memoizer cache for every run, unless one is set.
+    # Must be set before the JVM starts
+    cache_dir = os.environ.get("BFBRIDGE_CACHEDIR")
+    own_cache_dir = None
+    if not cache_dir:
+        cache_dir = own_cache_dir = tempfile.mkdtemp(prefix="bfbridge_benchmark_memo")
+        os.environ["BFBRIDGE_CACHEDIR"] = cache_dir
+
+    try:
+        start = time.perf_counter()
+        vm = BFBridgeVM()
+        thread = BFBridgeThread(vm)
+        instance = BFBridgeInstance(thread)
+        vm_ms = (time.perf_counter() - start) * 1000
+
+        rng = random.Random(args.seed)
+        results = []
+        for path in slides:
+            log("Benchmarking " + os.path.basename(path))
+            results.append(bench_slide(vm, instance, path, cache_dir, args, rng))
+
+        # Memo files are written by now, so these time the JVM and the
+        # first reads rather than parsing
+        startup = None
+        if args.startup_runs > 0 and slides:
+            startup = bench_startup(slides[0], args)
+    finally:
+        if own_cache_dir:
+            shutil.rmtree(own_cache_dir, ignore_errors=True)
+
+    report = {
+        "environment": {
+            "platform": platform.platform(),
+            "python": platform.python_version(),
+            "cpu_count": os.cpu_count(),
+            "time": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        },
+        "parameters": {key: value for key, value in vars(args).items() \
+            if key not in ["output", "first_tile", "cds_archive", "warm_up"]},
+        "vm_start_ms": vm_ms,
+        "startup": startup,
+        "slides": results,
+    }
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(text + "\n")
+    else:
+        print(text)
+
+if __name__ == "__main__":
+    main()
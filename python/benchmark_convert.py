@@ -0,0 +1,52 @@
+# Compares the C conversion of bfbridge_convert.h with the numpy
+# conversion of utils.make_pil_image. Doesn't need the JVM or files.
+# python3 -m BFBridge.python.benchmark_convert
+
+import time
+import numpy as np
+from PIL import Image
+from . import utils, convert_to_8bit, make_pil_image
+
+# name, pixel type, numpy dtype, interleaved, little endian
+CASES = [
+    ("uint8 interleaved", 1, "<u1", True, True),
+    ("uint8 planar", 1, "<u1", False, True),
+    ("uint16 interleaved little endian", 3, "<u2", True, True),
+    ("uint16 planar big endian", 3, ">u2", False, False),
+    ("int16 interleaved little endian", 2, "<i2", True, True),
+    ("uint32 interleaved little endian", 5, "<u4", True, True),
+    ("float32 planar little endian", 6, "<f4", False, True),
+]
+
+def best_time(f, repeat):
+    best = float("inf")
+    for _ in range(repeat):
+        start = time.perf_counter()
+        f()
+        best = min(best, time.perf_counter() - start)
+    return best
+
+# Both paths make an RGB PIL image
+def main(size=1024, channels=3, repeat=10):
+    rng = np.random.default_rng(0)
+    print("size %dx%d, %d channels, best of %d" % (size, size, channels, repeat))
+    print("%-34s %10s %10s %10s %10s" % ("case", "numpy ms", "C ms", "scalar ms", "speedup"))
+    for name, pixel_type, dtype, interleaved, little_endian in CASES:
+        dt = np.dtype(dtype)
+        if dt.kind == "f":
+            values = rng.random(size * size * channels) * 100 - 20
+        else:
+            info = np.iinfo(dt)
+            values = rng.integers(info.min, info.max, size * size * channels, endpoint=True)
+        byte_arr = values.astype(dt).tobytes()
+        args = (byte_arr, size, size, channels, interleaved, pixel_type, little_endian)
+
+        numpy_time = best_time(lambda: utils.make_pil_image(*args), repeat)
+        c_time = best_time(lambda: make_pil_image(*args), repeat)
+        scalar_time = best_time(lambda: Image.fromarray( \
+            convert_to_8bit(*args, disable_simd=True), mode="RGB"), repeat)
+        print("%-34s %10.2f %10.2f %10.2f %9.1fx" % ( \
+            name, numpy_time * 1000, c_time * 1000, scalar_time * 1000, numpy_time / c_time))
+
+if __name__ == "__main__":
+    main()
@@ -27,23 +27,32 @@ def compile_bfbridge():
         bfbridge_cffi_prefix = Path(cwd + 'bfbridge_cffi_prefix.h').read_text()
         bfbridge_source = Path(c_dir + 'bfbridge_basiclib.c').read_text()
         bfbridge_header = Path(c_dir + 'bfbridge_basiclib.h').read_text()
+        # Pixel conversion, compiled as a separate source
+        bfbridge_convert_header = Path(c_dir + 'bfbridge_convert.h').read_text()
+        # Shared memory tile server and client, compiled as a separate source
+        bfbridge_shm_header = Path(c_dir + 'bfbridge_shm.h').read_text()
     except BaseException as e:
-        raise RuntimeError("bfbridge_basiclib.c and/or bfbridge_basiclib.h and/or bfbridge_cffi_prefix.h could not be found: " + str(e))
+        raise RuntimeError("bfbridge_basiclib.c and/or bfbridge_basiclib.h and/or bfbridge_convert.h and/or bfbridge_shm.h and/or bfbridge_cffi_prefix.h could not be found: " + str(e))
 
     header_begin = "CFFI HEADER BEGIN"
     header_end = "CFFI HEADER END"
 
-    try:
-        header_begin_index = bfbridge_header.index(header_begin)
-        header_end_index = bfbridge_header.index(header_end)
-    except:
-        raise RuntimeError("bfbridge_basiclib.h CFFI markers could not be found")
+    def cffi_section(header, name):
+        try:
+            header_begin_index = header.index(header_begin)
+            header_end_index = header.index(header_end)
+        except:
+            raise RuntimeError(name + " CFFI markers could not be found")
 
-    # Fix header_begin_index: beginning from the middle of a "//"
-    # comment produces an invalid header.
-    header_begin_index = bfbridge_header.index("\n", header_begin_index)
+        # Fix header_begin_index: beginning from the middle of a "//"
+        # comment produces an invalid header.
+        header_begin_index = header.index("\n", header_begin_index)
 
-    bfbridge_header = bfbridge_header[header_begin_index:header_end_index]
+        return header[header_begin_index:header_end_index]
+
+    bfbridge_header = cffi_section(bfbridge_header, "bfbridge_basiclib.h") + \
+        cffi_section(bfbridge_convert_header, "bfbridge_convert.h") + \
+        cffi_section(bfbridge_shm_header, "bfbridge_shm.h")
     bfbridge_header = bfbridge_cffi_prefix + "\n" + bfbridge_header
 
 
@@ -83,8 +92,16 @@ def compile_bfbridge():
         # but somehow fails silently in this script.
         extra_link_args.append("-ljvm")
         extra_link_args.append("-L" + java_link)
+        # bfbridge_pool_t
+        extra_link_args.append("-lpthread")
+        if sys.platform.startswith("linux"):
+            # shm_open before glibc 2.34
+            extra_link_args.append("-lrt")
+
+    bfbridge_source = bfbridge_source + '\n#include "bfbridge_convert.h"\n#include "bfbridge_shm.h"\n'
+    sources = [c_dir + 'bfbridge_convert.c', c_dir + 'bfbridge_shm.c']
 
-    ffibuilder.set_source("_bfbridge", bfbridge_source, extra_link_args=extra_link_args, include_dirs=include_dirs, libraries=["jvm"])
+    ffibuilder.set_source("_bfbridge", bfbridge_source, sources=sources, extra_link_args=extra_link_args, include_dirs=include_dirs, libraries=["jvm"])
 
     ffibuilder.compile(verbose=True)
 
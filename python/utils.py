@@ -50,6 +50,30 @@ def IMPORT_BFBRIDGE():
         print("BFBridge loaded successfully after recompilation.")
         return ffi, lib
 
+# numpy dtype of a BioFormats pixel type, in the given byte order
+# bit type (8) is one byte per pixel
+def bioformats_dtype(bioformats_pixel_type, little_endian):
+    if bioformats_pixel_type > 8 or bioformats_pixel_type < 0:
+        raise ValueError("bioformats_dtype: pixel_type out of range")
+    # https://github.com/ome/bioformats/blob/9cb6cfaaa5361bc/components/formats-api/src/loci/formats/FormatTools.java#L98
+    np_dtype = [np.int8, np.uint8, np.int16, np.uint16, np.int32, \
+        np.uint32, np.float32, np.float64, np.uint8][bioformats_pixel_type]
+    return np.dtype(np_dtype).newbyteorder("<" if little_endian else ">")
+
+# Views byte_arr as an array of shape (height, width, channels)
+# without copying. Planar data gives a non-contiguous view
+# and the dtype has the byte order of the data
+def make_ndarray_view( \
+        byte_arr, width, height, channels, interleaved, bioformats_pixel_type, little_endian):
+    dt = bioformats_dtype(bioformats_pixel_type, little_endian)
+    if len(byte_arr) != width * height * channels * dt.itemsize:
+        raise ValueError("make_ndarray_view: expected " + \
+            str(width * height * channels * dt.itemsize) + " bytes, got " + str(len(byte_arr)))
+    arr = np.frombuffer(byte_arr, dtype=dt)
+    if interleaved:
+        return arr.reshape((height, width, channels))
+    return arr.reshape((channels, height, width)).transpose((1, 2, 0))
+
 # channels = 1 or 3 or 4 supported currently
 # interleaved: Boolean
 # pixel_type: Integer https://github.com/ome/bioformats/blob/9cb6cfa/components/formats-api/src/loci/formats/FormatTools.java#L98
@@ -140,7 +164,7 @@ def make_pil_image( \
     if bioformats_pixel_type < 6 and ((bioformats_pixel_type & 1) == 0):
         # 128 for int8 etc.
         offset = -np.iinfo(arr.dtype).min
-        arr = arr + offset
+        arr = arr.astype(np.int64) + offset
         if bioformats_pixel_type == 0:
             arr = np.uint8(arr)
         elif bioformats_pixel_type == 2: